@@ -0,0 +1,695 @@
+/**
+ * @file bmp2jpeg.c
+ * @brief main file, convert BMP to JPEG image.
+ */
+
+#include <string.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+#include "cjpeg.h"
+#include "rdbmp.h"
+#include "rdimg.h"
+#include "jsimd.h"
+#include "jsegment.h"
+#include "jstats.h"
+#include "jperf.h"
+#include "jdeadline.h"
+#ifndef _WIN32
+#include <strings.h>
+#include "server.h"
+#include "mjpeg.h"
+#include "jcache.h"
+#include "shmring.h"
+#endif
+#ifdef __linux__
+#include "jwatch.h"
+#endif
+
+
+void
+print_help() {
+    printf("compress BMP, PPM/PGM, PAM, Y4M or raw RGB file into JPEG file.\n");
+    printf("Usage:\n");
+    printf("    cjpeg [options] {BMP} {JPEG}    (- for stdin / stdout)\n");
+    printf("    cjpeg --incremental [options] {BMP} {JPEG} [{BMP} {JPEG} ...]\n");
+    printf("    cjpeg --sequence {OUT} [options] {BMP|PATTERN|@LIST} ...\n");
+    printf("    cjpeg --pack {PACK} [options] {BMP|PATTERN|@LIST} ...\n");
+    printf("    cjpeg --segment FIRST,ROWS [options] {BMP} {SEGMENT}\n");
+    printf("    cjpeg --merge {JPEG} {SEGMENT} ...\n");
+    printf("    cjpeg --serve {SOCKET} [-j N]\n");
+    printf("    cjpeg --watch {SPOOL} [--watch-out DIR] [--watch-done DIR|--watch-delete] [-j N]\n");
+    printf("    cjpeg --shm {NAME} [options]\n");
+    printf("    cjpeg --self-test\n");
+    printf("Options:\n");
+    printf("    -q N    quality 1..100 (default 75)\n");
+    printf("    -j N    encoder threads of the server, --watch, --sequence and --pack\n");
+    printf("            (default 4)\n");
+    printf("    --sequence OUT  encode the frames into an MJPEG AVI (OUT ends in\n");
+    printf("                  .avi) or a stream of JPEGs (any other name, - for stdout)\n");
+    printf("    --fps N       frame rate of the AVI (default 25)\n");
+    printf("    --pack PACK   append every JPEG to PACK, indexed in PACK.idx\n");
+    printf("                  (read with bmp2jpeg_unpack)\n");
+    printf("    --pack-sync N entries per fsync of the pack (default 1024)\n");
+    printf("    --shm NAME    encode the frames a producer puts in the shared memory\n");
+    printf("                  ring NAME, until it closes the ring (bmp2jpeg_ring)\n");
+    printf("    --segment FIRST,ROWS  encode only MCU rows FIRST .. FIRST+ROWS-1 into\n");
+    printf("                  a segment file; FIRST must start a restart interval\n");
+    printf("                  (default one interval per MCU row)\n");
+    printf("    --merge JPEG  join the segments of an image into JPEG, the same as\n");
+    printf("                  encoding it in one go with their restart interval\n");
+    printf("    --mcu-stats PREFIX  record the bits and coefficients of every MCU:\n");
+    printf("                  PREFIX.mcu (binary), PREFIX.pgm (heatmap of the bits)\n");
+    printf("                  and a summary with histograms on stderr\n");
+    printf("    --perf        run the stages of every MCU row one at a time and print\n");
+    printf("                  their time, IPC and cache and branch misses per MCU\n");
+    printf("                  (hardware counters on Linux, else time only)\n");
+    printf("    --deadline-ms N  encode an image in N ms: when the MCU rows done so\n");
+    printf("                  far say it would take longer, the rest is coded with the\n");
+    printf("                  high frequencies dropped, or DCs only; still a valid JPEG\n");
+    printf("    --watch SPOOL encode every file written or moved into SPOOL (Linux),\n");
+    printf("                  to SPOOL/NAME.jpg; counters on SIGUSR1 and at the end\n");
+    printf("    --watch-out DIR   write the JPEGs to DIR instead\n");
+    printf("    --watch-done DIR  move the sources to DIR once encoded\n");
+    printf("    --watch-delete    delete the sources once encoded\n");
+    printf("    --crop X,Y,W,H  encode only this region, reading only its rows\n");
+    printf("    --ladder Q,Q,...  encode the image at up to %d qualities at once, the\n", LADDER_MAX + 1);
+    printf("                  color conversion and DCT done once; %%d in {JPEG} is\n");
+    printf("                  replaced by each quality\n");
+    printf("    --rotate N    rotate the (cropped) image N = 90, 180 or 270 degrees\n");
+    printf("                  clockwise while it is read, no extra pass\n");
+    printf("    --flip h|v    mirror it left-right (h) or top-bottom (v), after\n");
+    printf("                  --rotate\n");
+    printf("    --raw FMT:WxH the input is W*H pixels of 3 bytes, FMT rgb or bgr\n");
+    printf("                  (PPM, PAM and Y4M are told by their header; the first\n");
+    printf("                  Y4M frame is encoded)\n");
+    printf("    --cache DIR   reuse the JPEG of identical pixels and options from DIR\n");
+    printf("                  (BMP input)\n");
+    printf("    --cache-limit MB  size limit of the cache, least recently used\n");
+    printf("                  entries go first (default none)\n");
+    printf("    --threads N   threads coding one image, same output (default 1);\n");
+    printf("                  not with --restart or --segment unless --arith or\n");
+    printf("                  --component-scans, --arith needs --restart\n");
+    printf("    --restart N   restart interval of N MCUs (DRI / RSTn)\n");
+    printf("    --arith       arithmetic coding (SOF9) instead of huffman, smaller;\n");
+    printf("                  with --restart N and --threads the intervals are coded\n");
+    printf("                  at once\n");
+    printf("    --component-scans  one scan per component (Y, Cb, Cr) instead of one\n");
+    printf("                  interleaved scan; with --threads the three are huffman\n");
+    printf("                  coded at once\n");
+    printf("    --abbrev      abbreviated images, without DQT and DHT.  a --sequence\n");
+    printf("                  stream starts with a tables-only datastream\n");
+    printf("    --tables FILE abbreviated images, their tables-only datastream\n");
+    printf("                  (SOI DQT DHT EOI) in FILE; bmp2jpeg_unpack -t merges\n");
+    printf("    --incremental encode a sequence of frames, re-encoding only the\n");
+    printf("                  restart intervals that changed (default 16 MCUs)\n");
+    printf("    --simd LEVEL  scalar, sse2, avx2, avx512 or auto (default,\n");
+    printf("                  also from BMP2JPEG_SIMD)\n");
+    printf("    --self-test   check every SIMD level against the scalar code\n");
+    printf("\n");
+    printf("Author: Yu, Le <yeolar@gmail.com>\n");
+    printf("Homework by Haojie Zhang (HuaJuan) 19302010021@fudan.edu.cn");
+}
+
+
+/* --ladder: the path of the JPEG of quality q, pattern has one %d */
+static char *
+ladder_path(const char *pattern, int q) {
+    char *path = (char *) malloc(strlen(pattern) + 16);
+    if (!path)
+        err_exit(BUFFER_ALLOC_ERR);
+    sprintf(path, pattern, q);
+    return path;
+}
+
+/* a pattern with one %d and no other conversion */
+static bool
+is_ladder_pattern(const char *pattern) {
+    const char *p = strchr(pattern, '%');
+    return p && p[1] == 'd' && !strchr(p + 2, '%');
+}
+
+
+/* --raw: the input has no header, its size and byte order are given */
+typedef struct {
+    UINT32 width;   /* 0 when the input is not raw */
+    UINT32 height;
+    int order;
+} raw_spec;
+
+/*
+ * find out what fp holds.  NULL for a BMP, read_bmp() continues after the
+ * signature; otherwise the reader of a PPM, PAM or Y4M stream, or of the
+ * raw pixels of --raw.
+ */
+static image_source *
+open_input(FILE *fp, const raw_spec *raw) {
+    if (raw->width)
+        return open_raw_source(fp, raw->width, raw->height, raw->order);
+    UINT8 magic[2];
+    if (fread(magic, sizeof(UINT8), 2, fp) != 2)
+        err_exit(FILE_READ_ERR);
+    if (magic[0] == 0x42 && magic[1] == 0x4D)
+        return NULL;
+    image_source *src = open_image_source(fp, magic);
+    if (!src)
+        err_exit(FILE_TYPE_ERR);
+    return src;
+}
+
+
+int
+main(int argc, char *argv[]) {
+    encode_options opts;
+    const char *socket_path = NULL;
+    const char *ring_name = NULL;
+    const char *watch_dir = NULL;
+    const char *watch_out = NULL;
+    const char *watch_done = NULL;
+    bool watch_delete = 0;
+    const char *sequence_path = NULL;
+    int fps = 0;
+    const char *pack_path = NULL;
+    const char *tables_path = NULL;
+    const char *merge_path = NULL;
+    const char *stats_prefix = NULL;
+    bool profile = 0;
+    UINT32 pack_sync = 0;
+    const char *cache_dir = NULL;
+    UINT64 cache_limit = 0;
+    int workers = 4;
+    bool incremental = 0;
+    raw_spec raw = {0, 0, RAW_RGB};
+    int rotate = 0, flip = 0;
+    int ladder_q[LADDER_MAX + 1], ladder_n = 0;
+    jpeg_ladder ladder;
+    memset(&ladder, 0, sizeof(ladder));
+    init_encode_options(&opts);
+
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-' && argv[argi][1] != '\0') {
+        if (!strcmp(argv[argi], "-q") && argi + 1 < argc) {
+            opts.scale = quality_to_scale(atoi(argv[argi + 1]));
+            argi += 2;
+        } else if (!strcmp(argv[argi], "-j") && argi + 1 < argc) {
+            workers = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--crop") && argi + 1 < argc) {
+            if (sscanf(argv[argi + 1], "%u,%u,%u,%u", &opts.crop_x, &opts.crop_y,
+                       &opts.crop_w, &opts.crop_h) != 4 || !opts.crop_w) {
+                print_help();
+                exit(1);
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--ladder") && argi + 1 < argc) {
+            const char *p = argv[argi + 1];
+            char *end;
+            for (ladder_n = 0; ladder_n <= LADDER_MAX; ladder_n++) {
+                long q = strtol(p, &end, 10);
+                if (end == p || q < 1 || q > 100) {
+                    ladder_n = 0;
+                    break;
+                }
+                ladder_q[ladder_n] = (int) q;
+                if (*end != ',') {
+                    ladder_n++;
+                    break;
+                }
+                p = end + 1;
+            }
+            if (ladder_n < 2 || *end != '\0') {
+                print_help();
+                exit(1);
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--rotate") && argi + 1 < argc) {
+            int n = atoi(argv[argi + 1]);
+            if (n == 90)
+                rotate = ORIENT_ROT90;
+            else if (n == 180)
+                rotate = ORIENT_ROT180;
+            else if (n == 270)
+                rotate = ORIENT_ROT270;
+            else if (n != 0) {
+                print_help();
+                exit(1);
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--flip") && argi + 1 < argc) {
+            if (!strcmp(argv[argi + 1], "h"))
+                flip ^= ORIENT_FLIP_X;
+            else if (!strcmp(argv[argi + 1], "v"))
+                flip ^= ORIENT_FLIP_Y;
+            else {
+                print_help();
+                exit(1);
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--raw") && argi + 1 < argc) {
+            char fmt[4];
+            if (sscanf(argv[argi + 1], "%3[a-z]:%ux%u", fmt, &raw.width, &raw.height) != 3 ||
+                (strcmp(fmt, "rgb") && strcmp(fmt, "bgr")) || !raw.width || !raw.height) {
+                print_help();
+                exit(1);
+            }
+            raw.order = strcmp(fmt, "bgr") ? RAW_RGB : RAW_BGR;
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--segment") && argi + 1 < argc) {
+            if (sscanf(argv[argi + 1], "%u,%u", &opts.seg_first, &opts.seg_rows) != 2 ||
+                !opts.seg_rows) {
+                print_help();
+                exit(1);
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--merge") && argi + 1 < argc) {
+            merge_path = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--mcu-stats") && argi + 1 < argc) {
+            stats_prefix = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--perf")) {
+            profile = 1;
+            argi++;
+        } else if (!strcmp(argv[argi], "--deadline-ms") && argi + 1 < argc) {
+            double ms = atof(argv[argi + 1]);
+            if (ms <= 0 || ms > 4e6) {
+                print_help();
+                exit(1);
+            }
+            opts.deadline_us = (UINT32) (ms * 1000);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--arith")) {
+            opts.arithmetic = 1;
+            argi++;
+        } else if (!strcmp(argv[argi], "--component-scans")) {
+            opts.component_scans = 1;
+            argi++;
+        } else if (!strcmp(argv[argi], "--abbrev")) {
+            opts.abbreviated = 1;
+            argi++;
+        } else if (!strcmp(argv[argi], "--tables") && argi + 1 < argc) {
+            tables_path = argv[argi + 1];
+            opts.abbreviated = 1;
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--restart") && argi + 1 < argc) {
+            int n = atoi(argv[argi + 1]);
+            if (n < 1 || n > 65535) {
+                print_help();
+                exit(1);
+            }
+            opts.restart = (UINT16) n;
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--threads") && argi + 1 < argc) {
+            int n = atoi(argv[argi + 1]);
+            if (n < 1) {
+                print_help();
+                exit(1);
+            }
+            opts.threads = (UINT32) n;
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--incremental")) {
+            incremental = 1;
+            argi++;
+        } else if (!strcmp(argv[argi], "--simd") && argi + 1 < argc) {
+            if (jsimd_select(argv[argi + 1]) < 0) {
+                print_help();
+                exit(1);
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--self-test")) {
+            exit(jsimd_self_test(stdout) ? 1 : 0);
+        } else if (!strcmp(argv[argi], "--cache") && argi + 1 < argc) {
+            cache_dir = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--cache-limit") && argi + 1 < argc) {
+            cache_limit = (UINT64) strtoull(argv[argi + 1], NULL, 10) << 20;
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--sequence") && argi + 1 < argc) {
+            sequence_path = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--pack") && argi + 1 < argc) {
+            pack_path = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--pack-sync") && argi + 1 < argc) {
+            pack_sync = (UINT32) strtoul(argv[argi + 1], NULL, 10);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--fps") && argi + 1 < argc) {
+            fps = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--serve") && argi + 1 < argc) {
+            socket_path = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--watch") && argi + 1 < argc) {
+            watch_dir = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--watch-out") && argi + 1 < argc) {
+            watch_out = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--watch-done") && argi + 1 < argc) {
+            watch_done = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--watch-delete")) {
+            watch_delete = 1;
+            argi++;
+        } else if (!strcmp(argv[argi], "--shm") && argi + 1 < argc) {
+            ring_name = argv[argi + 1];
+            argi += 2;
+        } else {
+            print_help();
+            exit(1);
+        }
+    }
+
+    /* the flips mirror the rotated image: its x is the y of the region when transposed */
+    opts.orient = rotate ^ flip;
+
+    /* a segment is a part of one image, see jsegment.h */
+    if ((opts.seg_rows || stats_prefix || profile) &&
+        (cache_dir || incremental || sequence_path || pack_path || socket_path || ring_name ||
+         watch_dir)) {
+        fprintf(stderr, "--segment, --mcu-stats and --perf are for a single image\n");
+        exit(1);
+    }
+
+    /* the MCU rows of a segment are rows of the source */
+    if (opts.orient && (opts.seg_rows || merge_path)) {
+        fprintf(stderr, "--rotate and --flip are not with --segment or --merge\n");
+        exit(1);
+    }
+
+    /* the scans are coded from the whole image once it is quantized */
+    if (opts.component_scans && (opts.arithmetic || incremental || opts.seg_rows || merge_path ||
+                                 stats_prefix || profile || opts.deadline_us || ladder_n)) {
+        fprintf(stderr, "--component-scans is not with --arith, --incremental, --segment,\n"
+                        "--merge, --mcu-stats, --perf, --deadline-ms or --ladder\n");
+        exit(1);
+    }
+
+    /* the rungs are coded side by side, by the serial huffman path */
+    if (ladder_n && (opts.arithmetic || opts.seg_rows || merge_path || stats_prefix || profile ||
+                     opts.deadline_us || incremental || cache_dir || sequence_path || pack_path ||
+                     socket_path || ring_name || watch_dir)) {
+        fprintf(stderr, "--ladder is for a single image, not with --arith, --segment, --merge,\n"
+                        "--mcu-stats, --perf, --deadline-ms or --cache\n");
+        exit(1);
+    }
+    if (ladder_n && (argc - argi != 2 || !is_ladder_pattern(argv[argi + 1]))) {
+        fprintf(stderr, "--ladder needs one {JPEG} with %%d for the quality\n");
+        exit(1);
+    }
+    if (ladder_n) {
+        opts.scale = quality_to_scale(ladder_q[0]);
+        ladder.count = ladder_n - 1;
+        for (int i = 1; i < ladder_n; i++)
+            ladder.scale[i - 1] = quality_to_scale(ladder_q[i]);
+        opts.ladder = &ladder;
+    }
+
+    /*
+     * --threads splits the huffman scan by MCU rows, which needs it
+     * unbroken, and the arithmetic one by restart intervals; the other
+     * paths code on one thread
+     */
+    if (opts.threads > 1) {
+#ifdef _WIN32
+        err_exit("--threads needs POSIX threads", 1);
+#endif
+        if (opts.arithmetic ? !opts.restart
+                            : !opts.component_scans && (opts.restart || opts.seg_rows)) {
+            fprintf(stderr, "--threads needs --restart with --arith, and is not with --restart\n"
+                            "or --segment otherwise (except --component-scans)\n");
+            exit(1);
+        }
+        if (profile || opts.deadline_us || ladder_n || incremental) {
+            fprintf(stderr, "--threads is not with --perf, --deadline-ms, --ladder or --incremental\n");
+            exit(1);
+        }
+    }
+
+    if (profile && opts.deadline_us) {
+        fprintf(stderr, "--perf measures the full path, not with --deadline-ms\n");
+        exit(1);
+    }
+
+    /* a timed encode depends on the machine and its load, it is not kept */
+    if (cache_dir && opts.deadline_us) {
+        fprintf(stderr, "--cache is not with --deadline-ms\n");
+        exit(1);
+    }
+
+    /* the arithmetic coder has no tables to leave out, nor per-MCU bits */
+    if (opts.arithmetic && (opts.abbreviated || incremental || opts.seg_rows || merge_path ||
+                            stats_prefix || profile || opts.deadline_us)) {
+        fprintf(stderr, "--arith is not with --abbrev, --tables, --incremental, --segment,\n"
+                        "--merge, --mcu-stats, --perf or --deadline-ms\n");
+        exit(1);
+    }
+
+    if (merge_path) {
+        int count = argc - argi;
+        jpeg_segment *segs = (jpeg_segment *) calloc(count ? count : 1, sizeof(jpeg_segment));
+        if (!segs)
+            err_exit(BUFFER_ALLOC_ERR);
+        for (int i = 0; i < count; i++) {
+            FILE *seg_fp = fopen(argv[argi + i], "rb");
+            if (!seg_fp)
+                err_exit(FILE_OPEN_ERR);
+            if (!read_segment(seg_fp, &segs[i]))
+                err_exit(FILE_TYPE_ERR);
+            fclose(seg_fp);
+        }
+        FILE *jpeg_fp = fopen(merge_path, "wb");
+        if (!jpeg_fp)
+            err_exit(FILE_OPEN_ERR);
+        compress_io cio;
+        init_mem(&cio, NULL, 0, jpeg_fp, MEM_OUT_SIZE);
+        merge_segments(&cio, segs, count);
+        if (!(cio.out->flush_buffer)(&cio))
+            err_exit(BUFFER_WRITE_ERR);
+        free_mem(&cio);
+        if (fclose(jpeg_fp) != 0)
+            err_exit(BUFFER_WRITE_ERR);
+        for (int i = 0; i < count; i++)
+            free_segment(&segs[i]);
+        free(segs);
+        exit(0);
+    }
+
+#ifndef _WIN32
+    jpeg_cache cache;
+    if (cache_dir && open_jpeg_cache(&cache, cache_dir, cache_limit) < 0) {
+        perror(cache_dir);
+        exit(1);
+    }
+#else
+    if (cache_dir)
+        err_exit("--cache needs a POSIX system", 1);
+#endif
+
+    /* the tables the abbreviated images leave out, shared by all of them */
+    if (tables_path) {
+        compress_io cio;
+        FILE *tables_fp = fopen(tables_path, "wb");
+        if (!tables_fp)
+            err_exit(FILE_OPEN_ERR);
+        init_mem(&cio, NULL, 0, NULL, MEM_OUT_SIZE);
+        tables_to_jpeg(&cio, tables_fp, NULL, &opts);
+        free_mem(&cio);
+        if (fclose(tables_fp) != 0)
+            err_exit(BUFFER_WRITE_ERR);
+    }
+
+    if (socket_path) {
+#ifndef _WIN32
+        exit(serve(socket_path, workers, cache_dir ? &cache : NULL));
+#else
+        err_exit("--serve needs Unix domain sockets", 1);
+#endif
+    }
+
+    if (watch_dir) {
+#ifdef __linux__
+        watch_options wopts;
+        wopts.spool = watch_dir;
+        wopts.out_dir = watch_out;
+        wopts.done_dir = watch_done;
+        wopts.remove_source = watch_delete;
+        wopts.workers = workers;
+        exit(watch_folder(&wopts, &opts));
+#else
+        err_exit("--watch needs inotify (Linux)", 1);
+#endif
+    }
+
+    if (ring_name) {
+#ifndef _WIN32
+        exit(encode_ring(ring_name, &opts));
+#else
+        err_exit("--shm needs POSIX shared memory", 1);
+#endif
+    }
+
+    if (sequence_path || pack_path) {
+#ifndef _WIN32
+        seq_options sopts;
+        int count;
+        char **frames = expand_frames(argv + argi, argc - argi, &count);
+        if (!frames || count == 0) {
+            fprintf(stderr, "no frames\n");
+            exit(1);
+        }
+        if (pack_path) {
+            sequence_path = pack_path;
+            sopts.container = SEQ_PACK;
+        } else {
+            size_t n = strlen(sequence_path);
+            sopts.container = n > 4 && !strcasecmp(sequence_path + n - 4, ".avi")
+                              ? SEQ_AVI : SEQ_RAW;
+        }
+        sopts.workers = workers;
+        sopts.fps = fps;
+        sopts.sync_every = pack_sync;
+        sopts.tables_first = opts.abbreviated && !tables_path;
+        if (opts.abbreviated && sopts.container == SEQ_AVI) {
+            fprintf(stderr, "an AVI needs the tables in every frame\n");
+            exit(1);
+        }
+        if (sopts.tables_first && sopts.container == SEQ_PACK) {
+            fprintf(stderr, "abbreviated entries of a pack need --tables\n");
+            exit(1);
+        }
+        int ret = encode_sequence(sequence_path, frames, count, &sopts, &opts);
+        free_frames(frames, count);
+        exit(ret);
+#else
+        err_exit("--sequence and --pack need POSIX threads", 1);
+#endif
+    }
+
+    if (incremental && argc - argi >= 2 && (argc - argi) % 2 == 0) {
+        /* frames of a sequence, each encoded against the one before */
+        incr_cache cache;
+        compress_io cio;
+        init_incr_cache(&cache);
+        opts.incr = &cache;
+        init_mem(&cio, NULL, 0, NULL, MEM_OUT_SIZE);
+        for (; argi < argc; argi += 2) {
+            FILE *bmp_fp = fopen(argv[argi], "rb");
+            if (!bmp_fp)
+                err_exit(FILE_OPEN_ERR);
+            image_source *src = open_input(bmp_fp, &raw);
+            FILE *jpeg_fp = fopen(argv[argi + 1], "wb");
+            if (!jpeg_fp)
+                err_exit(FILE_OPEN_ERR);
+            if (src)
+                image_to_jpeg(&cio, src, jpeg_fp, NULL, &opts);
+            else
+                bmp_to_jpeg(&cio, bmp_fp, jpeg_fp, NULL, &opts);
+            close_image_source(src);
+            fprintf(stderr, "%s: %u of %u restart intervals encoded\n",
+                    argv[argi + 1], cache.dirty, cache.intervals);
+            fclose(bmp_fp);
+            fclose(jpeg_fp);
+        }
+        free_mem(&cio);
+        free_incr_cache(&cache);
+    } else if (argc - argi == 2 && !incremental) {
+        /* open bmp file, "-" reads stdin */
+        bool bmp_std = !strcmp(argv[argi], "-");
+        FILE *bmp_fp = bmp_std ? stdin : fopen(argv[argi], "rb");
+        if (!bmp_fp)
+            err_exit(FILE_OPEN_ERR);
+#ifdef _WIN32
+        if (bmp_std)
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        image_source *src = open_input(bmp_fp, &raw);
+
+        /* open jpeg file, "-" writes stdout as each MCU row is done */
+        bool jpeg_std = !strcmp(argv[argi + 1], "-");
+        char *jpeg_path = ladder_n ? ladder_path(argv[argi + 1], ladder_q[0]) : NULL;
+        FILE *jpeg_fp = jpeg_std ? stdout : fopen(jpeg_path ? jpeg_path : argv[argi + 1], "wb");
+        if (!jpeg_fp)
+            err_exit(FILE_OPEN_ERR);
+#ifdef _WIN32
+        if (jpeg_std)
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        opts.flush_rows = jpeg_std;
+
+        mcu_stats stats;
+        init_mcu_stats(&stats);
+        if (stats_prefix)
+            opts.stats = &stats;
+        deadline_report degraded;
+        if (opts.deadline_us)
+            opts.degraded = &degraded;
+        perf_profile perf;
+        if (profile) {
+            init_perf_profile(&perf);
+            opts.perf = &perf;
+        }
+
+        /* main encode process */
+        compress_io cio;
+        init_mem(&cio, NULL, 0, NULL, MEM_OUT_SIZE);
+        if (src)
+            image_to_jpeg(&cio, src, jpeg_fp, NULL, &opts);
+#ifndef _WIN32
+        else if (cache_dir) {
+            cached_bmp_to_jpeg(&cache, &cio, bmp_fp, jpeg_fp, NULL, &opts);
+            print_cache_stats(&cache, stderr);
+            close_jpeg_cache(&cache);
+        }
+#endif
+        else
+            bmp_to_jpeg(&cio, bmp_fp, jpeg_fp, NULL, &opts);
+
+        if (stats_prefix) {
+            size_t n = strlen(stats_prefix);
+            char *path = (char *) malloc(n + 5);
+            FILE *fp;
+            if (!path)
+                err_exit(BUFFER_ALLOC_ERR);
+            sprintf(path, "%s.mcu", stats_prefix);
+            if (!(fp = fopen(path, "wb")) || !write_mcu_stats(&stats, fp) || fclose(fp) != 0)
+                err_exit(BUFFER_WRITE_ERR);
+            sprintf(path, "%s.pgm", stats_prefix);
+            if (!(fp = fopen(path, "wb")) || !write_mcu_heatmap(&stats, fp) || fclose(fp) != 0)
+                err_exit(BUFFER_WRITE_ERR);
+            print_mcu_summary(&stats, stderr);
+            free(path);
+            free_mcu_stats(&stats);
+        }
+        /* the other rungs of the ladder, in memory until now */
+        for (int i = 0; i < ladder.count; i++) {
+            char *path = ladder_path(argv[argi + 1], ladder_q[i + 1]);
+            FILE *fp = fopen(path, "wb");
+            if (!fp)
+                err_exit(FILE_OPEN_ERR);
+            if (fwrite(ladder.out[i].data, 1, ladder.out[i].len, fp) != ladder.out[i].len ||
+                fclose(fp) != 0)
+                err_exit(BUFFER_WRITE_ERR);
+            free_mem_dest(&ladder.out[i]);
+            free(path);
+        }
+        free(jpeg_path);
+        if (opts.deadline_us)
+            print_deadline_report(&degraded, stderr);
+        if (profile) {
+            print_perf_profile(&perf, stderr);
+            free_perf_profile(&perf);
+        }
+
+        /* free memory, close files */
+        close_image_source(src);
+        free_mem(&cio);
+        if (!bmp_std)
+            fclose(bmp_fp);
+        if (!jpeg_std)
+            fclose(jpeg_fp);
+    } else
+        print_help();
+    exit(0);
+}
@@ -4,6 +4,9 @@
  */
 
 #include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 #include "cjpeg.h"
 #include "cio.h"
 
@@ -35,6 +38,42 @@ flush_cout_buffer(void *cio) {
     return true;
 }
 
+/*
+ * append the output buffer to a mem_dest instead of a file.
+ */
+bool
+flush_cout_mem(void *cio) {
+    mem_mgr *out = ((compress_io *) cio)->out;
+    mem_dest *dest = (mem_dest *) out->user;
+    size_t len = out->pos - out->set;
+    if (dest->len + len > dest->cap) {
+        size_t cap = dest->cap ? dest->cap : (size_t) (out->end - out->set);
+        while (cap < dest->len + len)
+            cap *= 2;
+        UINT8 *data = (UINT8 *) realloc(dest->data, cap);
+        if (!data)
+            return false;
+        dest->data = data;
+        dest->cap = cap;
+    }
+    memcpy(dest->data + dest->len, out->set, len);
+    dest->len += len;
+    out->pos = out->set;
+    return true;
+}
+
+/*
+ * hand the output buffer to the function of an out_sink.
+ */
+bool
+flush_cout_sink(void *cio) {
+    mem_mgr *out = ((compress_io *) cio)->out;
+    out_sink *sink = (out_sink *) out->user;
+    size_t len = out->pos - out->set;
+    out->pos = out->set;
+    return len == 0 || sink->write(sink->ctx, out->set, len);
+}
+
 
 /*
  * init memory manager.
@@ -46,13 +85,14 @@ init_mem(compress_io *cio,
     cio->in = (mem_mgr *) malloc(sizeof(mem_mgr));
     if (!cio->in)
         err_exit(BUFFER_ALLOC_ERR);
-    cio->in->set = (UINT8 *) malloc(sizeof(UINT8) * in_size);
+    cio->in->set = (UINT8 *) malloc(sizeof(UINT8) * (in_size ? in_size : 1));
     if (!cio->in->set)
         err_exit(BUFFER_ALLOC_ERR);
     cio->in->pos = cio->in->set;
     cio->in->end = cio->in->set + in_size;
     cio->in->flush_buffer = flush_cin_buffer;
     cio->in->fp = in_fp;
+    cio->in->user = NULL;
 
     cio->out = (mem_mgr *) malloc(sizeof(mem_mgr));
     if (!cio->out)
@@ -64,6 +104,7 @@ init_mem(compress_io *cio,
     cio->out->end = cio->out->set + out_size;
     cio->out->flush_buffer = flush_cout_buffer;
     cio->out->fp = out_fp;
+    cio->out->user = NULL;
 
     cio->temp_bits.len = 0;
     cio->temp_bits.val = 0;
@@ -71,13 +112,127 @@ init_mem(compress_io *cio,
 
 void
 free_mem(compress_io *cio) {
-    fflush(cio->out->fp);
+    if (cio->out->fp)
+        fflush(cio->out->fp);
     free(cio->in->set);
     free(cio->out->set);
     free(cio->in);
     free(cio->out);
 }
 
+/*
+ * reuse an initialized memory manager for the next image: attach new files,
+ * resize the input buffer to in_size and drop any pending output.
+ * when dest is not NULL the output goes there instead of out_fp.
+ */
+void
+reset_mem(compress_io *cio,
+          FILE *in_fp, int in_size, FILE *out_fp, mem_dest *dest) {
+    mem_mgr *in = cio->in;
+    if (in->end - in->set != in_size) {
+        UINT8 *set = (UINT8 *) realloc(in->set, in_size ? in_size : 1);
+        if (!set)
+            err_exit(BUFFER_ALLOC_ERR);
+        in->set = set;
+        in->end = set + in_size;
+    }
+    in->pos = in->set;
+    in->fp = in_fp;
+
+    cio->out->pos = cio->out->set;
+    cio->out->fp = out_fp;
+    cio->out->flush_buffer = flush_cout_buffer;
+    cio->out->user = NULL;
+    if (dest)
+        use_mem_dest(cio, dest);
+
+    cio->temp_bits.len = 0;
+    cio->temp_bits.val = 0;
+}
+
+/*
+ * send the output to dest instead of the output file.
+ * dest must be zeroed or hold earlier output, which is appended to.
+ */
+void
+use_mem_dest(compress_io *cio, mem_dest *dest) {
+    cio->out->flush_buffer = flush_cout_mem;
+    cio->out->user = dest;
+}
+
+/* send the output to the function of sink, which must stay until the end */
+void
+use_sink(compress_io *cio, out_sink *sink) {
+    cio->out->flush_buffer = flush_cout_sink;
+    cio->out->user = sink;
+}
+
+/*
+ * send the output to dest for a while, e.g. to keep a part of it.  what
+ * was written before goes to the old destination first; restore_output()
+ * switches back.
+ */
+void
+divert_output(compress_io *cio, mem_dest *dest, out_target *saved) {
+    if (!(cio->out->flush_buffer)(cio))
+        err_exit(BUFFER_WRITE_ERR);
+    saved->flush_buffer = cio->out->flush_buffer;
+    saved->user = cio->out->user;
+    use_mem_dest(cio, dest);
+}
+
+void
+restore_output(compress_io *cio, const out_target *saved) {
+    if (!(cio->out->flush_buffer)(cio))
+        err_exit(BUFFER_WRITE_ERR);
+    cio->out->flush_buffer = saved->flush_buffer;
+    cio->out->user = saved->user;
+}
+
+void
+free_mem_dest(mem_dest *dest) {
+    free(dest->data);
+    dest->data = NULL;
+    dest->len = dest->cap = 0;
+}
+
+/*
+ * hand everything written so far to the destination right away,
+ * for streaming to a pipe.
+ */
+void
+flush_output(compress_io *cio) {
+    if (!(cio->out->flush_buffer)(cio))
+        err_exit(BUFFER_WRITE_ERR);
+    if (cio->out->fp && fflush(cio->out->fp) != 0)
+        err_exit(BUFFER_WRITE_ERR);
+}
+
+/*
+ * cache line aligned buffers for the pixel bands.  returns NULL when out
+ * of memory, free with aligned_free().
+ */
+void *
+aligned_malloc(size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size ? size : 1, 64);
+#else
+    void *ptr;
+    if (posix_memalign(&ptr, 64, size ? size : 1) != 0)
+        return NULL;
+    return ptr;
+#endif
+}
+
+void
+aligned_free(void *ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
 
 /*
  * write operations.
@@ -105,6 +260,28 @@ write_marker(compress_io *cio, JPEG_MARKER mark) {
     write_byte(cio, (int) mark);
 }
 
+/*
+ * copy bytes that are ready as they are, e.g. entropy coded data that was
+ * stuffed before.
+ */
+void
+write_bytes(compress_io *cio, const UINT8 *data, size_t len) {
+    mem_mgr *out = cio->out;
+    while (len > 0) {
+        size_t n = (size_t) (out->end - out->pos);
+        if (n > len)
+            n = len;
+        memcpy(out->pos, data, n);
+        out->pos += n;
+        data += n;
+        len -= n;
+        if (out->pos == out->end) {
+            if (!(out->flush_buffer)(cio))
+                err_exit(BUFFER_WRITE_ERR);
+        }
+    }
+}
+
 void
 write_bits(compress_io *cio, BITS bits) {
     // 传进来的bits变量，还有多少长度没有写进去
@@ -150,3 +327,41 @@ write_align_bits(compress_io *cio) {
     }
 }
 
+
+/*
+ * byte stuffing: a 0xFF in entropy coded data is followed by a 0x00, so
+ * it cannot be taken for a marker.  dst must have room for 2 * len bytes.
+ */
+size_t
+stuff_bytes(UINT8 *dst, const UINT8 *src, size_t len) {
+    UINT8 *start = dst;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        *dst++ = src[i];
+        if (src[i] == 0xFF)
+            *dst++ = 0x00;
+    }
+    return dst - start;
+}
+
+/*
+ * write entropy coded bytes, stuffed by one of the kernels of jsimd.h.
+ */
+void
+write_stuffed(compress_io *cio, const UINT8 *data, size_t len,
+              STUFF_METHOD stuff) {
+    mem_mgr *out = cio->out;
+    while (len > 0) {
+        /* stuffing at most doubles the data */
+        size_t n = (size_t) (out->end - out->pos) / 2;
+        if (n > len)
+            n = len;
+        out->pos += stuff(out->pos, data, n);
+        data += n;
+        len -= n;
+        if (out->end - out->pos < 2) {
+            if (!(out->flush_buffer)(cio))
+                err_exit(BUFFER_WRITE_ERR);
+        }
+    }
+}
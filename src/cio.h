@@ -7,6 +7,7 @@
 #define __CIO_H
 
 typedef bool (*CIO_METHOD) (void *);
+typedef size_t (*STUFF_METHOD) (UINT8 *, const UINT8 *, size_t);
 
 typedef struct {
     UINT8 *set;
@@ -14,8 +15,28 @@ typedef struct {
     UINT8 *end;
     CIO_METHOD flush_buffer;
     FILE *fp;
+    void *user;     /* state of a non-FILE destination */
 } mem_mgr;
 
+/* growable in-memory destination, see use_mem_dest() */
+typedef struct {
+    UINT8 *data;
+    size_t len;
+    size_t cap;
+} mem_dest;
+
+/* destination of the output, see divert_output() */
+typedef struct {
+    CIO_METHOD flush_buffer;
+    void *user;
+} out_target;
+
+/* destination that hands the output to a function, see use_sink() */
+typedef struct {
+    bool (*write)(void *ctx, const UINT8 *data, size_t len);   /* 0 on error */
+    void *ctx;
+} out_sink;
+
 typedef struct {
     mem_mgr *in;
     mem_mgr *out;
@@ -26,15 +47,31 @@ typedef struct {
 
 bool flush_cin_buffer(void *cio);
 bool flush_cout_buffer(void *cio);
+bool flush_cout_mem(void *cio);
+bool flush_cout_sink(void *cio);
 
 void init_mem(compress_io *cio,
               FILE *in_fp, int in_size, FILE *out_fp, int out_size);
 void free_mem(compress_io *cio);
+void reset_mem(compress_io *cio,
+               FILE *in_fp, int in_size, FILE *out_fp, mem_dest *dest);
+void use_mem_dest(compress_io *cio, mem_dest *dest);
+void use_sink(compress_io *cio, out_sink *sink);
+void divert_output(compress_io *cio, mem_dest *dest, out_target *saved);
+void restore_output(compress_io *cio, const out_target *saved);
+void free_mem_dest(mem_dest *dest);
+void flush_output(compress_io *cio);
+
+void *aligned_malloc(size_t size);
+void aligned_free(void *ptr);
 
 void write_byte(compress_io *cio, UINT8 val);
 void write_word(compress_io *cio, UINT16 val);
 void write_marker(compress_io *cio, JPEG_MARKER mark);
+void write_bytes(compress_io *cio, const UINT8 *data, size_t len);
 void write_bits(compress_io *cio, BITS bits);
+void write_stuffed(compress_io *cio, const UINT8 *data, size_t len,
+                   STUFF_METHOD stuff);
 void write_align_bits(compress_io *cio);
 
 #endif /* __CIO_H */
@@ -1,426 +1,1792 @@
 /** 
  * @file cjpeg.c
- * @brief main file, convert BMP to JPEG image.
+ * @brief JPEG encoder: color conversion, DCT, quantization, huffman or
+ *        arithmetic coding.
  */
 
+#include <string.h>
+#ifdef JPEG_THREADS
+#include <pthread.h>
+#endif
 #include "cjpeg.h"
 #include "cio.h"
 #include "rdbmp.h"
 #include "cmarker.h"
 #include "huajuan/huajuan_bmp.h"
+#include "jsegment.h"
+#include "jstats.h"
+#include "jperf.h"
+#include "jdeadline.h"
+#include "jarith.h"
+#include "rdimg.h"
 #include "fdctflt.h"
+#include "jsimd.h"
 #include "huajuan/utils.h"
 
-/* YCbCr to RGB transformation */
-
-/*
- * precalculated tables for a faster YCbCr->RGB transformation.
- * use a INT32 table because we'll scale values by 2^16 and
- * work with integers.
- */
 
-ycbcr_tables ycc_tables;
+/* encoder options */
 
 void
-init_ycbcr_tables() {
-    UINT16 i;
-    for (i = 0; i < 256; i++) {
-        ycc_tables.r2y[i] = (INT32) (65536 * 0.299 + 0.5) * i;
-        ycc_tables.r2cb[i] = (INT32) (65536 * -0.16874 + 0.5) * i;
-        ycc_tables.r2cr[i] = (INT32) (32768) * i;
-        ycc_tables.g2y[i] = (INT32) (65536 * 0.587 + 0.5) * i;
-        ycc_tables.g2cb[i] = (INT32) (65536 * -0.33126 + 0.5) * i;
-        ycc_tables.g2cr[i] = (INT32) (65536 * -0.41869 + 0.5) * i;
-        ycc_tables.b2y[i] = (INT32) (65536 * 0.114 + 0.5) * i;
-        ycc_tables.b2cb[i] = (INT32) (32768) * i;
-        ycc_tables.b2cr[i] = (INT32) (65536 * -0.08131 + 0.5) * i;
-    }
+init_encode_options(encode_options *opts) {
+    opts->scale = DEFAULT_SCALE;
+    opts->flush_rows = 0;
+    opts->crop_x = opts->crop_y = 0;
+    opts->crop_w = opts->crop_h = 0;
+    opts->restart = 0;
+    opts->incr = NULL;
+    opts->setup = NULL;
+    opts->threads = 1;
+    opts->abbreviated = 0;
+    opts->seg_first = opts->seg_rows = 0;
+    opts->stats = NULL;
+    opts->perf = NULL;
+    opts->deadline_us = 0;
+    opts->degrade = 0;
+    opts->degraded = NULL;
+    opts->arithmetic = 0;
+    opts->orient = 0;
+    opts->ladder = NULL;
+    opts->component_scans = 0;
 }
 
+/*
+ * map an IJG style quality (1..100) to the scale factor of the standard
+ * quantization tables, in percent.  quality 75 gives the default scale 50.
+ */
+UINT32
+quality_to_scale(int quality) {
+    if (quality < 1)
+        quality = 1;
+    if (quality > 100)
+        quality = 100;
+    if (quality < 50)
+        return 5000 / quality;
+    return 200 - quality * 2;
+}
+
+/* YCbCr to RGB transformation */
+
 /**
  * RGB转换成YCbCr
  * 在这个函数里，已经完成了将YCbCr的结果减去128的操作
  * 因此，这个函数返回的YCbCr的结果，可以直接进行离散余弦变换
+ * 转换的是band里，从第x列开始的8*8的块
  */
 void
-rgb_to_ycbcr(UINT8 *rgb_unit, ycbcr_unit *ycc_unit, int x, int w) {
-    ycbcr_tables *tbl = &ycc_tables;
+rgb_to_ycbcr(const pixel_band *band, int x, ycbcr_unit *ycc_unit) {
+    const ycbcr_tables *tbl = &ycc_tables;
+    const UINT8 *rp = band->plane[0] + x;
+    const UINT8 *gp = band->plane[1] + x;
+    const UINT8 *bp = band->plane[2] + x;
     UINT8 r, g, b;
-    int src_pos = x * 3;
     int dst_pos = 0;
     int i, j;
     for (j = 0; j < DCTSIZE; j++) {
         for (i = 0; i < DCTSIZE; i++) {
-            b = rgb_unit[src_pos];
-            g = rgb_unit[src_pos + 1];
-            r = rgb_unit[src_pos + 2];
+            r = rp[i];
+            g = gp[i];
+            b = bp[i];
             ycc_unit->y[dst_pos] = (INT8) ((UINT8)
                                                    ((tbl->r2y[r] + tbl->g2y[g] + tbl->b2y[b]) >> 16) - 128);
             ycc_unit->cb[dst_pos] = (INT8) ((UINT8)
                     ((tbl->r2cb[r] + tbl->g2cb[g] + tbl->b2cb[b]) >> 16));
             ycc_unit->cr[dst_pos] = (INT8) ((UINT8)
                     ((tbl->r2cr[r] + tbl->g2cr[g] + tbl->b2cr[b]) >> 16));
-            src_pos += 3;
             dst_pos++;
         }
-        src_pos += (w - DCTSIZE) * 3;
+        rp += band->stride;
+        gp += band->stride;
+        bp += band->stride;
     }
 }
 
 
-/* quantization */
+/*
+ * the 8x8 block at column x of a band that holds Y, Cb and Cr already (a
+ * Y4M source): only minus 128, in place of rgb_to_ycbcr().
+ */
+static void
+load_ycbcr(const pixel_band *band, int x, ycbcr_unit *ycc_unit) {
+    const UINT8 *yp = band->plane[0] + x;
+    const UINT8 *cbp = band->plane[1] + x;
+    const UINT8 *crp = band->plane[2] + x;
+    int dst_pos = 0;
+    int i, j;
+    for (j = 0; j < DCTSIZE; j++) {
+        for (i = 0; i < DCTSIZE; i++) {
+            ycc_unit->y[dst_pos] = (float) (yp[i] - 128);
+            ycc_unit->cb[dst_pos] = (float) (cbp[i] - 128);
+            ycc_unit->cr[dst_pos] = (float) (crp[i] - 128);
+            dst_pos++;
+        }
+        yp += band->stride;
+        cbp += band->stride;
+        crp += band->stride;
+    }
+}
 
-quant_tables q_tables;
 
+/* quantization */
+
+// 将离散余弦变换的结果进行量化
 void
-init_quant_tables(UINT32 scale_factor) {
-    quant_tables *tbl = &q_tables;
-    int temp1, temp2;
+jpeg_quant(const ycbcr_unit *ycc_unit, quant_unit *q_unit,
+           const quant_tables *tbl) {
     int i;
     for (i = 0; i < DCTSIZE2; i++) {
-        temp1 = ((UINT32) STD_LU_QTABLE[i] * scale_factor + 50) / 100;
-        if (temp1 < 1)
-            temp1 = 1;
-        if (temp1 > 255)
-            temp1 = 255;
-        tbl->lu[ZIGZAG[i]] = (UINT8) temp1;
-
-        temp2 = ((UINT32) STD_CH_QTABLE[i] * scale_factor + 50) / 100;
-        if (temp2 < 1)
-            temp2 = 1;
-        if (temp2 > 255)
-            temp2 = 255;
-        tbl->ch[ZIGZAG[i]] = (UINT8) temp2;
+        q_unit->y[i] = (INT16) (ycc_unit->y[i] * tbl->lu_recip[i] + 16384.5) - 16384;
+        q_unit->cb[i] = (INT16) (ycc_unit->cb[i] * tbl->ch_recip[i] + 16384.5) - 16384;
+        q_unit->cr[i] = (INT16) (ycc_unit->cr[i] * tbl->ch_recip[i] + 16384.5) - 16384;
     }
 }
 
-// 将离散余弦变换的结果进行量化
+
+/* huffman compression */
+
+/*
+ * the color conversion and huffman tables are const data built with the
+ * program (jtables.c); what is left is picking the SIMD kernels, once per
+ * process.  threaded callers must call this before starting their threads.
+ */
+void
+init_tables_once() {
+    static bool done = 0;
+    if (done)
+        return;
+    jsimd_kernels();
+    done = 1;
+}
+
+#ifdef DEBUG
+void
+print_bits(BITS bits)
+{
+    printf("%hu %hu\t", bits.len, bits.val);
+}
+#endif
+
+/*
+ * compress JPEG
+ * coef: coef[64]，经过离散余弦变换和量化的某个颜色分量
+ * dc: int * dc，指向【上一个相同颜色分量mcu的dc系数】的指针
+ * dc_htable，ac_htable：dc和ac分量对应的哈夫曼表
+ */
 void
-jpeg_quant(ycbcr_unit *ycc_unit, quant_unit *q_unit) {
-    quant_tables *tbl = &q_tables;
-    float q_lu, q_ch;
-    int x, y, i = 0;
-    for (x = 0; x < DCTSIZE; x++) {
-        for (y = 0; y < DCTSIZE; y++) {
-            q_lu = 1.0 / ((double) tbl->lu[ZIGZAG[i]] * \
-                    AAN_SCALE_FACTOR[x] * AAN_SCALE_FACTOR[y] * 8.0);
-            q_ch = 1.0 / ((double) tbl->ch[ZIGZAG[i]] * \
-                    AAN_SCALE_FACTOR[x] * AAN_SCALE_FACTOR[y] * 8.0);
-
-            q_unit->y[i] = (INT16) (ycc_unit->y[i] * q_lu + 16384.5) - 16384;
-            q_unit->cb[i] = (INT16) (ycc_unit->cb[i] * q_ch + 16384.5) - 16384;
-            q_unit->cr[i] = (INT16) (ycc_unit->cr[i] * q_ch + 16384.5) - 16384;
-
-            i++;
+jpeg_huff_block(huff_state *hs, const INT16 *coef, INT16 *dc,
+                const BITS *dc_htable, const BITS *ac_htable) {
+    huff_block blk;
+    int k;
+
+    /* zigzag encode */
+    // zig-zag 编码，同时记下不是0的系数，以及它们的幅值和位数
+    blk.nonzero = 0;
+    for (k = 1; k < DCTSIZE2; k++) {
+        INT16 v = coef[NATURAL[k]];
+        if (v != 0) {
+            blk.nonzero |= (UINT64) 1 << k;
+            blk.nbits[k] = huff_nbits(v >= 0 ? v : -v);
+            // 如果v大于等于0，则幅值的码字是v；如果v小于0，则幅值的码字是v的绝对值的反码
+            blk.val[k] = v >= 0 ? v : v - 1;
         }
     }
+    huff_emit(hs, &blk, coef[0], dc, dc_htable, ac_htable);
+}
+
+/*
+ * move the coded bytes of hs into the output, stuffed.  the bits that do
+ * not fill a byte stay in hs and are mirrored in cio->temp_bits, where
+ * write_align_bits() finds them.
+ */
+static void
+huff_flush(compress_io *cio, huff_state *hs, UINT8 *buf, STUFF_METHOD stuff) {
+    while (hs->len >= 8) {
+        hs->len -= 8;
+        *hs->out++ = (UINT8) (hs->acc >> hs->len);
+    }
+    write_stuffed(cio, buf, hs->out - buf, stuff);
+    hs->out = buf;
+    cio->temp_bits.len = hs->len;
+    cio->temp_bits.val = (UINT16) (hs->acc & ((1u << hs->len) - 1));
 }
 
 
-/* huffman compression */
+// 哈夫曼编码的结果先放在huffBuf里，攒多了再一起做字节填充
+#define HUFF_BUF_SIZE   (16 * HUFF_BLOCK_MAX)
+
+/* pad the bits of hs to a byte with 1s, at the end of an interval */
+static void
+huff_pad(huff_state *hs) {
+    int n = (8 - hs->len % 8) % 8;
+    if (n)
+        huff_put(hs, (1u << n) - 1, n);
+}
+
+/* bits written to hs since (out, len) */
+#define HUFF_BITS_SINCE(hs, out0, len0) \
+    ((UINT16) (((hs)->out - (out0)) * 8 + (hs)->len - (len0)))
+
+/* non-zero coefficients of q, and whether they are DCs only */
+static void
+count_coefs(const quant_unit *q, mcu_stat *st) {
+    int k, nz = 0, ac = 0;
+    for (k = 0; k < DCTSIZE2; k++) {
+        int n = (q->y[k] != 0) + (q->cb[k] != 0) + (q->cr[k] != 0);
+        nz += n;
+        if (k > 0)
+            ac += n;
+    }
+    st->nonzero = (UINT8) nz;
+    st->flags = ac ? 0 : STAT_DC_ONLY;
+}
+
+/*
+ * huffman coding of the quantized MCU q, Y, Cb and Cr.  dc holds the
+ * previous DC of each.  st, when not NULL, gets the bits and coefficients
+ * of the MCU.
+ */
+static void
+code_mcu(const jpeg_kernels *k, const quant_unit *q, huff_state *hs, INT16 *dc,
+         mcu_stat *st) {
+    // jpeg压缩（分别对Y，Cb，Cr三个分量），"上一次的直流分量值"也在里面更新
+    if (!st) {
+        k->huff(hs, q->y, &dc[0], h_tables.lu_dc, h_tables.lu_ac);
+        k->huff(hs, q->cb, &dc[1], h_tables.ch_dc, h_tables.ch_ac);
+        k->huff(hs, q->cr, &dc[2], h_tables.ch_dc, h_tables.ch_ac);
+        return;
+    }
+
+    // 统计模式：每个分量编码前后的位置差就是它用掉的位数
+    UINT8 *out0 = hs->out;
+    int len0 = hs->len;
+    k->huff(hs, q->y, &dc[0], h_tables.lu_dc, h_tables.lu_ac);
+    st->bits[0] = HUFF_BITS_SINCE(hs, out0, len0);
+    out0 = hs->out;
+    len0 = hs->len;
+    k->huff(hs, q->cb, &dc[1], h_tables.ch_dc, h_tables.ch_ac);
+    st->bits[1] = HUFF_BITS_SINCE(hs, out0, len0);
+    out0 = hs->out;
+    len0 = hs->len;
+    k->huff(hs, q->cr, &dc[2], h_tables.ch_dc, h_tables.ch_ac);
+    st->bits[2] = HUFF_BITS_SINCE(hs, out0, len0);
+    count_coefs(q, st);
+}
+
+/*
+ * encode the MCU at column x of band: color conversion, DCT, quantization
+ * and huffman coding of Y, Cb and Cr, see code_mcu().
+ */
+static void
+encode_mcu(const jpeg_kernels *k, const pixel_band *band, UINT32 x,
+           const quant_tables *qtbl, huff_state *hs, INT16 *dc, mcu_stat *st) {
+    // 将RGB数据转换为YCbCr数据，将YCbCr的数据减去128的工作，也在这个函数里面完成了
+    ycbcr_unit ycbcrUnit;
+    k->color(band, x, &ycbcrUnit);
+
+    // 离散余弦变换（对Y，Cb，Cr三个通道都进行离散余弦变换）
+    k->fdct(&ycbcrUnit);
+
+    // 将离散余弦变换的结果进行量化
+    quant_unit quantUnit;
+    k->quant(&ycbcrUnit, &quantUnit, qtbl);
+
+    code_mcu(k, &quantUnit, hs, dc, st);
+}
+
+/*
+ * the DCs of the 8x8 block at column x of band, for DEGRADE_DC.  the DC of
+ * the DCT is the sum of the 64 samples, and the color conversion is linear:
+ * the sums of the planes are converted once, with the factors of the
+ * tables.  the quant tables have the 1/8 scaling.
+ */
+static void
+block_dc(const pixel_band *band, int x, bool ycc, const quant_tables *qtbl,
+         quant_unit *q) {
+    const ycbcr_tables *tbl = &ycc_tables;
+    INT32 sum[COMP_NUM] = {0, 0, 0};
+    float dc[COMP_NUM];
+    int c, i, j;
+    for (c = 0; c < COMP_NUM; c++) {
+        const UINT8 *p = band->plane[c] + x;
+        for (j = 0; j < DCTSIZE; j++, p += band->stride)
+            for (i = 0; i < DCTSIZE; i++)
+                sum[c] += p[i];
+    }
+    if (ycc)
+        for (c = 0; c < COMP_NUM; c++)
+            dc[c] = (float) (sum[c] - DCTSIZE2 * 128);
+    else {
+        dc[0] = (float) ((double) tbl->r2y[1] * sum[0] + (double) tbl->g2y[1] * sum[1] +
+                         (double) tbl->b2y[1] * sum[2]) / 65536 - DCTSIZE2 * 128;
+        dc[1] = (float) ((double) tbl->r2cb[1] * sum[0] + (double) tbl->g2cb[1] * sum[1] +
+                         (double) tbl->b2cb[1] * sum[2]) / 65536;
+        dc[2] = (float) ((double) tbl->r2cr[1] * sum[0] + (double) tbl->g2cr[1] * sum[1] +
+                         (double) tbl->b2cr[1] * sum[2]) / 65536;
+    }
+    memset(q, 0, sizeof(*q));
+    q->y[0] = (INT16) (dc[0] * qtbl->lu_recip[0] + 16384.5) - 16384;
+    q->cb[0] = (INT16) (dc[1] * qtbl->ch_recip[0] + 16384.5) - 16384;
+    q->cr[0] = (INT16) (dc[2] * qtbl->ch_recip[0] + 16384.5) - 16384;
+}
+
+/*
+ * color conversion, DCT and quantization of the MCU at column x of band
+ * into q, on path level of jdeadline.h: the high frequencies dropped after
+ * quantization, or no DCT and only the DCs.
+ */
+static void
+quantize_mcu(const jpeg_kernels *k, const pixel_band *band, UINT32 x,
+             const quant_tables *qtbl, int level, quant_unit *q) {
+    ycbcr_unit ycbcrUnit;
+    int i;
+    if (level == DEGRADE_DC) {
+        block_dc(band, x, k->color == load_ycbcr, qtbl, q);
+        return;
+    }
+    k->color(band, x, &ycbcrUnit);
+    k->fdct(&ycbcrUnit);
+    k->quant(&ycbcrUnit, q, qtbl);
+    if (level == DEGRADE_COARSE)
+        for (i = COARSE_COEFS; i < DCTSIZE2; i++)
+            q->y[NATURAL[i]] = q->cb[NATURAL[i]] = q->cr[NATURAL[i]] = 0;
+}
+
+/* encode_mcu() on a cheaper path of jdeadline.h */
+static void
+degrade_mcu(const jpeg_kernels *k, const pixel_band *band, UINT32 x,
+            const quant_tables *qtbl, huff_state *hs, INT16 *dc, mcu_stat *st,
+            int level) {
+    quant_unit quantUnit;
+    quantize_mcu(k, band, x, qtbl, level, &quantUnit);
+    code_mcu(k, &quantUnit, hs, dc, st);
+}
+
+/*
+ * the same for all MCUs of a band, one stage at a time with the counters
+ * of perf read in between: into perf->q, coded by code_mcu() after.
+ */
+static void
+transform_band(const jpeg_kernels *k, const pixel_band *band, UINT32 width,
+               const quant_tables *qtbl, perf_profile *perf) {
+    UINT32 n = width / DCTSIZE, i;
+    for (i = 0; i < n; i++)
+        k->color(band, i * DCTSIZE, &perf->ycc[i]);
+    perf_stage_done(perf, PERF_COLOR);
+    for (i = 0; i < n; i++)
+        k->fdct(&perf->ycc[i]);
+    perf_stage_done(perf, PERF_FDCT);
+    for (i = 0; i < n; i++)
+        k->quant(&perf->ycc[i], &perf->q[i], qtbl);
+    perf_stage_done(perf, PERF_QUANT);
+}
+
 
-huff_tables h_tables;
+/* per image setup */
 
 void
-set_huff_table(UINT8 *nrcodes, UINT8 *values, BITS *h_table) {
-    // nrcodes：长度位i的哈夫曼码字有nrcides[i]个
-    // values：哈夫曼码字的解码后的值（原始值）
-    // 变量名都是abcdijk，很难读懂到底在写什么。。。。。。
-    // values和value，看着两个变量差不多，其实意思完全不一样。。。。。。
-    int i, j, k;
-    j = 0;
-    // value：哈夫曼码字
-    UINT16 value = 0;
-    for (i = 1; i <= 16; i++) {
-        // i：哈夫曼码字的长度
-        // nrcodes[i]：长度位i的哈夫曼码字有多少个
-        for (k = 0; k < nrcodes[i]; k++) {
-            // j：当前迭代到第几个【原始值】了
-            // 构建【原始值】->【哈夫曼码字】的映射
-            // 设置哈夫曼码字的长度和哈夫曼码字的值
-            h_table[values[j]].len = i;
-            h_table[values[j]].val = value;
-            j++;
-            // 迭代哈夫曼码字。在哈夫曼码字长度不变的情况下，下一个哈夫曼码字就是当前的哈夫曼码字加一
-            value++;
-        }
-        // 迭代哈夫曼码字。如果进入下一个哈夫曼码字长度（哈夫曼码字长度加1）
-        // 则下一个哈夫曼码字就是当前的哈夫曼码字后面填个0，也就是左移1位！
-        value <<= 1;
+init_frame_cache(frame_cache *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+void
+free_frame_cache(frame_cache *cache) {
+    free_mem_dest(&cache->headers);
+    init_frame_cache(cache);
+}
+
+/*
+ * the quant tables for opts: built in for DEFAULT_SCALE, otherwise from
+ * opts->setup when it has them
+ */
+static const quant_tables *
+frame_tables(const encode_options *opts, quant_tables *qtbl) {
+    frame_cache *fc = opts->setup;
+    if (opts->scale == DEFAULT_SCALE)
+        return &std_quant_tables;
+    if (!fc) {
+        init_quant_tables(qtbl, opts->scale);
+        return qtbl;
+    }
+    if (!fc->has_tables || fc->table_scale != opts->scale) {
+        init_quant_tables(&fc->qtbl, opts->scale);
+        fc->table_scale = opts->scale;
+        fc->has_tables = 1;
+    }
+    return &fc->qtbl;
+}
+
+/* offset of the SOF0 or SOF9 segment in the headers h, 0 when there is none */
+static size_t
+find_sof(const UINT8 *h, size_t len) {
+    size_t at = 2;
+    while (at + 4 <= len && h[at] == 0xFF) {
+        if (h[at + 1] == M_SOF0 || h[at + 1] == M_SOF9)
+            return at;
+        at += 2 + ((size_t) h[at + 2] << 8 | h[at + 3]);
+    }
+    return 0;
+}
+
+/*
+ * write SOI, APP0, DQT, SOF0, DHT, DRI and SOS, without DQT and DHT for an
+ * abbreviated image, SOF9 and DAC for arithmetic coding.  with opts->setup
+ * they are serialized once per scale, restart interval and mode; for
+ * another image size only the size in the SOF is patched, and the bytes
+ * are copied in one go.
+ */
+static void
+write_headers(compress_io *cio, bmp_info *frame, const encode_options *opts,
+              UINT16 restart, const quant_tables *qtbl) {
+    frame_cache *fc = opts->setup;
+    bool tables = !opts->abbreviated;
+    if (!fc) {
+        // 这里写入了SOI（Start Of Image）标记和APP0标记
+        write_file_header(cio);
+        // 这里写入了DQT（量化表）标记和SOF（Start Of Frame）标记
+        write_frame_header(cio, frame, tables ? qtbl : NULL, opts->arithmetic);
+        // 这里写入了DHT（Define Huffman Table）标记，DRI标记（如果有restart interval）和SOS（Start of Scan）标记
+        write_scan_header(cio, restart, tables, opts->arithmetic);
+        return;
+    }
+    if (!fc->width || !fc->sof || fc->scale != opts->scale ||
+        fc->restart != restart || fc->abbreviated != opts->abbreviated ||
+        fc->arithmetic != opts->arithmetic) {
+        out_target saved;
+        fc->width = 0;
+        fc->headers.len = 0;
+        divert_output(cio, &fc->headers, &saved);
+        write_file_header(cio);
+        write_frame_header(cio, frame, tables ? qtbl : NULL, opts->arithmetic);
+        write_scan_header(cio, restart, tables, opts->arithmetic);
+        restore_output(cio, &saved);
+        fc->sof = find_sof(fc->headers.data, fc->headers.len);
+        fc->width = frame->width;
+        fc->height = frame->height;
+        fc->scale = opts->scale;
+        fc->restart = restart;
+        fc->abbreviated = opts->abbreviated;
+        fc->arithmetic = opts->arithmetic;
+    } else if (fc->width != frame->width || fc->height != frame->height) {
+        // 只有图像大小变了：改SOF里的高和宽（P之后，各两个字节，大端）
+        UINT8 *sof = fc->headers.data + fc->sof;
+        sof[5] = (UINT8) (frame->height >> 8);
+        sof[6] = (UINT8) frame->height;
+        sof[7] = (UINT8) (frame->width >> 8);
+        sof[8] = (UINT8) frame->width;
+        fc->width = frame->width;
+        fc->height = frame->height;
     }
+    write_bytes(cio, fc->headers.data, fc->headers.len);
 }
 
+
+/* incremental encoding */
+
 void
-init_huff_tables() {
-    huff_tables *tbl = &h_tables;
-    // 设置【原始值】->【哈夫曼码字】的映射，方便jpeg编码的时候用
-    // 亮度，DC哈夫曼表
-    set_huff_table(STD_LU_DC_NRCODES, STD_LU_DC_VALUES, tbl->lu_dc);
-    // 亮度，AC哈夫曼表
-    set_huff_table(STD_LU_AC_NRCODES, STD_LU_AC_VALUES, tbl->lu_ac);
-    // 色度，DC哈夫曼表
-    set_huff_table(STD_CH_DC_NRCODES, STD_CH_DC_VALUES, tbl->ch_dc);
-    // 色度，AC哈夫曼表
-    set_huff_table(STD_CH_AC_NRCODES, STD_CH_AC_VALUES, tbl->ch_ac);
+init_incr_cache(incr_cache *cache) {
+    memset(cache, 0, sizeof(*cache));
 }
 
 void
-set_bits(BITS *bits, INT16 data) {
-    INT16 abs = data >= 0 ? data : -data;
-    INT16 len = 0;
-
-    // 找到从左往右数起来，第一个1所在的位置，就代表了data的绝对值的长度
-    INT16 rightMoveCnt = 15;
-    while (rightMoveCnt >= 0) {
-        UINT16 b = (abs >> rightMoveCnt) & 0x0001;
-        if (b == 1) {
-            len = rightMoveCnt + 1;
-            break;
+free_incr_cache(incr_cache *cache) {
+    free(cache->pixels);
+    free(cache->ends);
+    free(cache->changed);
+    free_mem_dest(&cache->coded);
+    init_incr_cache(cache);
+}
+
+/*
+ * encode a frame of a sequence against the previous one in opts->incr.
+ * the scan is cut into restart intervals; the pixels of each interval are
+ * compared with the previous frame, and only the intervals that changed go
+ * through color conversion, DCT, quantization and huffman coding.  the
+ * others are copied from the cache, which works because every interval
+ * starts its DC predictions from 0 and ends on a byte.  the result is the
+ * same as jpeg_encode() with the same restart interval.
+ */
+static void
+incr_encode(compress_io *cio, struct bmp_complemented *bmpC,
+            const encode_options *opts, const jpeg_kernels *k,
+            const quant_tables *qtbl) {
+    incr_cache *cache = opts->incr;
+    UINT16 restart = opts->restart ? opts->restart : INCR_RESTART;
+    bool ycc = bmpC->src && bmpC->src->format == PIX_YCC;
+
+    bmp_info frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.width = bmpC->realWidth;
+    frame.height = bmpC->realHeight;
+
+    // 整个（补齐以后的）帧按平面存起来，每个平面stride*complementedHeight个字节
+    UINT32 stride = bmpC->complementedWidth;
+    size_t planeSize = (size_t) stride * bmpC->complementedHeight;
+    UINT32 mcusPerRow = stride / DCTSIZE;
+    UINT32 mcus = mcusPerRow * (bmpC->complementedHeight / MCUSIZE);
+    UINT32 intervals = (mcus + restart - 1) / restart;
+
+    // 尺寸和参数都没变，才能用上一帧的结果
+    bool reuse = cache->pixels && cache->width == frame.width &&
+                 cache->height == frame.height && cache->scale == opts->scale &&
+                 cache->restart == restart && cache->ycc == ycc;
+    if (!reuse) {
+        free_incr_cache(cache);
+        cache->pixels = (UINT8 *) malloc(planeSize * COMP_NUM);
+        cache->ends = (size_t *) calloc(intervals, sizeof(size_t));
+        cache->changed = (UINT8 *) malloc(intervals);
+        if (!cache->pixels || !cache->ends || !cache->changed) {
+            free_incr_cache(cache);
+            free_bmp_data(bmpC);
+            err_exit(BUFFER_ALLOC_ERR);
+        }
+        cache->stride = stride;
+        cache->intervals = intervals;
+    }
+    // 中途出错的话，下一帧从头编码
+    cache->width = 0;
+    memset(cache->changed, !reuse, intervals);
+
+    /* pass 1: find the intervals whose pixels changed, keep the new frame */
+    while (next_band(bmpC)) {
+        UINT32 row = bmpC->i - 1;
+        int c, j;
+        for (c = 0; c < COMP_NUM; c++) {
+            for (j = 0; j < MCUSIZE; j++) {
+                UINT8 *old = cache->pixels + c * planeSize +
+                             (size_t) (row * MCUSIZE + j) * stride;
+                const UINT8 *cur = bmpC->band.plane[c] + (size_t) j * bmpC->band.stride;
+                if (reuse && memcmp(old, cur, stride) != 0) {
+                    UINT32 m;
+                    for (m = 0; m < mcusPerRow; m++)
+                        if (memcmp(old + m * DCTSIZE, cur + m * DCTSIZE, DCTSIZE) != 0)
+                            cache->changed[(row * mcusPerRow + m) / restart] = 1;
+                }
+                memcpy(old, cur, stride);
+            }
         }
-        rightMoveCnt--;
     }
+    free_bmp_data(bmpC);
+
+    /* pass 2: the coded intervals, new or from the cache, into memory */
+    mem_dest coded = {NULL, 0, 0};
+    out_target saved;
+    divert_output(cio, &coded, &saved);
+
+    UINT8 huffBuf[HUFF_BUF_SIZE];
+    pixel_band view;
+    view.stride = stride;
+    size_t oldStart = 0;
+    UINT32 dirty = 0;
+    UINT32 s;
+    for (s = 0; s < intervals; s++) {
+        size_t oldEnd = cache->ends[s];
+        if (cache->changed[s]) {
+            INT16 dc[COMP_NUM] = {0, 0, 0};
+            huff_state hs;
+            UINT32 m, last = (s + 1) * restart < mcus ? (s + 1) * restart : mcus;
+            hs.acc = 0;
+            hs.len = 0;
+            hs.out = huffBuf;
+            for (m = s * restart; m < last; m++) {
+                UINT32 row = m / mcusPerRow;
+                int c;
+                for (c = 0; c < COMP_NUM; c++)
+                    view.plane[c] = cache->pixels + c * planeSize +
+                                    (size_t) row * MCUSIZE * stride;
+                if (opts->degrade)
+                    degrade_mcu(k, &view, (m % mcusPerRow) * DCTSIZE, qtbl, &hs, dc, NULL,
+                                opts->degrade);
+                else
+                    encode_mcu(k, &view, (m % mcusPerRow) * DCTSIZE, qtbl, &hs, dc, NULL);
+                if (hs.out - huffBuf > HUFF_BUF_SIZE - 4 * HUFF_BLOCK_MAX)
+                    huff_flush(cio, &hs, huffBuf, k->stuff);
+            }
+            huff_pad(&hs);
+            huff_flush(cio, &hs, huffBuf, k->stuff);
+            dirty++;
+        } else
+            write_bytes(cio, cache->coded.data + oldStart, oldEnd - oldStart);
+        if (!(cio->out->flush_buffer)(cio))
+            err_exit(BUFFER_WRITE_ERR);
+        cache->ends[s] = coded.len;
+        oldStart = oldEnd;
+    }
+    restore_output(cio, &saved);
 
-    bits->len = len;
-    // 如果data大于等于0，则幅值的码字是data；如果data小于0，则幅值的码字是data的绝对值的反码
-    bits->val = data >= 0 ? abs : ~abs;
+    /* the JPEG: headers, the intervals with RSTn between them, EOI */
+    write_headers(cio, &frame, opts, restart, qtbl);
+    size_t start = 0;
+    for (s = 0; s < intervals; s++) {
+        write_bytes(cio, coded.data + start, cache->ends[s] - start);
+        if (s + 1 < intervals)
+            write_marker(cio, M_RST0 + (s & 7));
+        start = cache->ends[s];
+    }
+    write_file_trailer(cio);
+
+    free_mem_dest(&cache->coded);
+    cache->coded = coded;
+    cache->width = frame.width;
+    cache->height = frame.height;
+    cache->scale = opts->scale;
+    cache->restart = restart;
+    cache->ycc = ycc;
+    cache->dirty = dirty;
 }
 
-#ifdef DEBUG
-void
-print_bits(BITS bits)
-{
-    printf("%hu %hu\t", bits.len, bits.val);
+#ifdef JPEG_THREADS
+
+/* parallel huffman coding */
+
+/*
+ * a range of MCU rows coded by one thread into its own bit stream, not
+ * stuffed and not aligned: bits of it, the last byte filled from the top.
+ */
+typedef struct {
+    const jpeg_kernels *k;
+    const quant_tables *qtbl;
+    const UINT8 *pixels;        /* the whole frame, planar */
+    size_t planeSize;
+    UINT32 stride;
+    UINT32 row0;                /* MCU rows [row0, row1) */
+    UINT32 row1;
+    UINT8 *data;
+    size_t cap;
+    UINT64 bits;
+    bool failed;
+    mcu_stats *stats;           /* or NULL */
+} huff_chunk;
+
+/* MCU row row of a planar frame, as a band */
+static void
+frame_row(const UINT8 *pixels, size_t planeSize, UINT32 stride, UINT32 row,
+          pixel_band *view) {
+    int c;
+    view->stride = stride;
+    for (c = 0; c < COMP_NUM; c++)
+        view->plane[c] = (UINT8 *) pixels + c * planeSize +
+                         (size_t) row * MCUSIZE * stride;
+}
+
+/* the bands of bmpC left, into the planes of pixels */
+static void
+read_frame(struct bmp_complemented *bmpC, UINT8 *pixels, UINT32 stride,
+           size_t planeSize) {
+    while (next_band(bmpC)) {
+        UINT32 row = bmpC->i - 1;
+        int c, j;
+        for (c = 0; c < COMP_NUM; c++)
+            for (j = 0; j < MCUSIZE; j++)
+                memcpy(pixels + c * planeSize + (size_t) (row * MCUSIZE + j) * stride,
+                       bmpC->band.plane[c] + (size_t) j * bmpC->band.stride, stride);
+    }
+}
+
+static void *
+code_chunk(void *arg) {
+    huff_chunk *ch = (huff_chunk *) arg;
+    const jpeg_kernels *k = ch->k;
+    INT16 dc[COMP_NUM] = {0, 0, 0};
+    pixel_band view;
+    huff_state hs;
+    UINT32 row, x;
+
+    // DC是和前一个MCU的差，所以先算出前一段最后一个MCU的DC
+    if (ch->row0 > 0) {
+        ycbcr_unit ycc;
+        quant_unit q;
+        frame_row(ch->pixels, ch->planeSize, ch->stride, ch->row0 - 1, &view);
+        k->color(&view, ch->stride - DCTSIZE, &ycc);
+        k->fdct(&ycc);
+        k->quant(&ycc, &q, ch->qtbl);
+        dc[0] = q.y[0];
+        dc[1] = q.cb[0];
+        dc[2] = q.cr[0];
+    }
+
+    hs.acc = 0;
+    hs.len = 0;
+    hs.out = ch->data;
+    for (row = ch->row0; row < ch->row1; row++) {
+        frame_row(ch->pixels, ch->planeSize, ch->stride, row, &view);
+        for (x = 0; x < ch->stride; x += DCTSIZE) {
+            size_t used = hs.out - ch->data;
+            if (ch->cap - used < 4 * HUFF_BLOCK_MAX) {
+                size_t cap = ch->cap * 2;
+                UINT8 *data = (UINT8 *) realloc(ch->data, cap);
+                if (!data) {
+                    ch->failed = 1;
+                    return NULL;
+                }
+                ch->data = data;
+                ch->cap = cap;
+                hs.out = data + used;
+            }
+            encode_mcu(k, &view, x, ch->qtbl, &hs, dc,
+                       MCU_STAT(ch->stats, x / DCTSIZE, row));
+        }
+    }
+
+    ch->bits = (UINT64) (hs.out - ch->data) * 8 + hs.len;
+    while (hs.len >= 8) {
+        hs.len -= 8;
+        *hs.out++ = (UINT8) (hs.acc >> hs.len);
+    }
+    if (hs.len)
+        *hs.out = (UINT8) (hs.acc << (8 - hs.len));
+    return NULL;
 }
+
+/*
+ * code the rest of the image with threads MCU row ranges at once.  each
+ * range gets its own bit stream, starting from the DC of the range before;
+ * the bit lengths give the offset of every stream in the scan, and one
+ * pass shifts them together and stuffs the result.  the bits are those of
+ * the serial loop, the last partial byte is left in cio->temp_bits.
+ */
+static void
+huff_parallel(compress_io *cio, struct bmp_complemented *bmpC, UINT32 threads,
+              const jpeg_kernels *k, const quant_tables *qtbl, mcu_stats *stats) {
+    UINT32 stride = bmpC->complementedWidth;
+    UINT32 rows = bmpC->complementedHeight / MCUSIZE;
+    size_t planeSize = (size_t) stride * bmpC->complementedHeight;
+    UINT8 *pixels = (UINT8 *) malloc(planeSize * COMP_NUM);
+    huff_chunk *chunks = (huff_chunk *) calloc(threads, sizeof(huff_chunk));
+    pthread_t *tids = (pthread_t *) calloc(threads, sizeof(pthread_t));
+    UINT8 *merged = NULL;
+    UINT64 total = 0;
+    bool failed = 0;
+    UINT32 t;
+
+    if (threads > rows)
+        threads = rows;
+    if (!pixels || !chunks || !tids)
+        failed = 1;
+
+    // 先把整个图像读进来，每个线程编码其中连续的几行MCU
+    if (!failed)
+        read_frame(bmpC, pixels, stride, planeSize);
+
+    for (t = 0; !failed && t < threads; t++) {
+        huff_chunk *ch = &chunks[t];
+        ch->k = k;
+        ch->qtbl = qtbl;
+        ch->pixels = pixels;
+        ch->planeSize = planeSize;
+        ch->stride = stride;
+        ch->stats = stats;
+        ch->row0 = (UINT32) ((UINT64) rows * t / threads);
+        ch->row1 = (UINT32) ((UINT64) rows * (t + 1) / threads);
+        ch->cap = (size_t) (ch->row1 - ch->row0) * stride * 2 + 8 * HUFF_BLOCK_MAX;
+        ch->data = (UINT8 *) malloc(ch->cap);
+        if (!ch->data || pthread_create(&tids[t], NULL, code_chunk, ch) != 0) {
+            threads = t;
+            failed = 1;
+        }
+    }
+    for (t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        failed |= chunks[t].failed;
+        total += chunks[t].bits;
+    }
+
+    /* stitch: chunk t starts at the sum of the bit lengths before it */
+    if (!failed && !(merged = (UINT8 *) calloc(total / 8 + 2, 1)))
+        failed = 1;
+    if (!failed) {
+        UINT64 at = 0;
+        for (t = 0; t < threads; t++) {
+            const huff_chunk *ch = &chunks[t];
+            size_t n = (size_t) ((ch->bits + 7) / 8), i;
+            UINT8 *dst = merged + at / 8;
+            int phase = (int) (at % 8);
+            if (phase == 0)
+                memcpy(dst, ch->data, n);
+            else
+                for (i = 0; i < n; i++) {
+                    dst[i] |= ch->data[i] >> phase;
+                    dst[i + 1] = (UINT8) (ch->data[i] << (8 - phase));
+                }
+            at += ch->bits;
+        }
+        write_stuffed(cio, merged, (size_t) (total / 8), k->stuff);
+        cio->temp_bits.len = (UINT8) (total % 8);
+        cio->temp_bits.val = (UINT16) (merged[total / 8] >> (8 - total % 8));
+    }
+
+    for (t = 0; t < threads && chunks; t++)
+        free(chunks[t].data);
+    free(chunks);
+    free(tids);
+    free(pixels);
+    free(merged);
+    if (failed) {
+        free_bmp_data(bmpC);
+        err_exit(BUFFER_ALLOC_ERR);
+    }
+}
+
+/* parallel arithmetic coding */
+
+/*
+ * restart intervals [s0, s1) of the image, coded by one thread into its
+ * own coder: the intervals back to back, the end of each in ends.
+ */
+typedef struct {
+    const jpeg_kernels *k;
+    const quant_tables *qtbl;
+    const UINT8 *pixels;        /* the whole frame, planar */
+    size_t planeSize;
+    UINT32 stride;
+    UINT32 mcus;                /* MCUs of the image */
+    UINT16 restart;
+    int level;                  /* DEGRADE_* */
+    UINT32 s0;
+    UINT32 s1;
+    size_t *ends;               /* per interval of the image */
+    arith_coder e;
+} arith_chunk;
+
+static void *
+code_arith_chunk(void *arg) {
+    arith_chunk *ch = (arith_chunk *) arg;
+    UINT32 mcusPerRow = ch->stride / DCTSIZE;
+    pixel_band view;
+    quant_unit q;
+    UINT32 s, m;
+
+    for (s = ch->s0; s < ch->s1 && !ch->e.failed; s++) {
+        UINT32 last = (s + 1) * ch->restart < ch->mcus ? (s + 1) * ch->restart : ch->mcus;
+        arith_reset(&ch->e);
+        for (m = s * ch->restart; m < last; m++) {
+            frame_row(ch->pixels, ch->planeSize, ch->stride, m / mcusPerRow, &view);
+            quantize_mcu(ch->k, &view, (m % mcusPerRow) * DCTSIZE, ch->qtbl, ch->level, &q);
+            arith_encode_mcu(&ch->e, &q);
+        }
+        arith_finish(&ch->e);
+        ch->ends[s] = ch->e.len;
+    }
+    return NULL;
+}
+
+/*
+ * arithmetic code the rest of the image with threads ranges of restart
+ * intervals at once.  every interval starts the coder and its statistics
+ * afresh, so the ranges only have to be written in order, with the RSTn
+ * between the intervals.  the bytes are those of the serial loop.
+ */
+static void
+arith_parallel(compress_io *cio, struct bmp_complemented *bmpC, UINT32 threads,
+               const jpeg_kernels *k, const quant_tables *qtbl, UINT16 restart,
+               int level) {
+    UINT32 stride = bmpC->complementedWidth;
+    size_t planeSize = (size_t) stride * bmpC->complementedHeight;
+    UINT32 mcus = stride / DCTSIZE * (bmpC->complementedHeight / MCUSIZE);
+    UINT32 intervals = (mcus + restart - 1) / restart;
+    UINT8 *pixels = (UINT8 *) malloc(planeSize * COMP_NUM);
+    arith_chunk *chunks = (arith_chunk *) calloc(threads, sizeof(arith_chunk));
+    pthread_t *tids = (pthread_t *) calloc(threads, sizeof(pthread_t));
+    size_t *ends = (size_t *) calloc(intervals, sizeof(size_t));
+    bool failed = 0;
+    UINT32 t, s;
+
+    if (threads > intervals)
+        threads = intervals;
+    if (!pixels || !chunks || !tids || !ends)
+        failed = 1;
+    if (!failed)
+        read_frame(bmpC, pixels, stride, planeSize);
+
+    for (t = 0; !failed && t < threads; t++) {
+        arith_chunk *ch = &chunks[t];
+        ch->k = k;
+        ch->qtbl = qtbl;
+        ch->pixels = pixels;
+        ch->planeSize = planeSize;
+        ch->stride = stride;
+        ch->mcus = mcus;
+        ch->restart = restart;
+        ch->level = level;
+        ch->s0 = (UINT32) ((UINT64) intervals * t / threads);
+        ch->s1 = (UINT32) ((UINT64) intervals * (t + 1) / threads);
+        ch->ends = ends;
+        init_arith_coder(&ch->e);
+        if (pthread_create(&tids[t], NULL, code_arith_chunk, ch) != 0) {
+            threads = t;
+            failed = 1;
+        }
+    }
+    for (t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        failed |= chunks[t].e.failed;
+    }
+
+    for (t = 0; !failed && t < threads; t++) {
+        const arith_chunk *ch = &chunks[t];
+        size_t start = 0;
+        for (s = ch->s0; s < ch->s1; s++) {
+            write_bytes(cio, ch->e.out + start, ends[s] - start);
+            if (s + 1 < intervals)
+                write_marker(cio, M_RST0 + (s & 7));
+            start = ends[s];
+        }
+    }
+
+    for (t = 0; t < threads && chunks; t++)
+        free_arith_coder(&chunks[t].e);
+    free(chunks);
+    free(tids);
+    free(ends);
+    free(pixels);
+    if (failed) {
+        free_bmp_data(bmpC);
+        err_exit(BUFFER_ALLOC_ERR);
+    }
+}
+
+#endif /* JPEG_THREADS */
+
+
+/* arithmetic coding */
+
+/* move the coded bytes of e into the output */
+static void
+arith_flush(compress_io *cio, arith_coder *e, struct bmp_complemented *bmpC) {
+    if (e->failed) {
+        free_arith_coder(e);
+        free_bmp_data(bmpC);
+        err_exit(BUFFER_ALLOC_ERR);
+    }
+    write_bytes(cio, e->out, e->len);
+    e->len = 0;
+}
+
+/*
+ * encode_bands() with arithmetic coding: the MCUs go through the same
+ * color conversion, DCT and quantization (on the path opts->degrade), and
+ * the QM-coder of jarith.h.  at a restart interval the code ends on a
+ * byte and the statistics start again; with threads the intervals are
+ * coded at once, see arith_parallel().
+ */
+static void
+arith_bands(compress_io *cio, struct bmp_complemented *bmpC,
+            const encode_options *opts, const jpeg_kernels *k,
+            const quant_tables *qt) {
+    UINT16 restart = opts->restart;
+    UINT32 mcu = 0, rst = 0;
+    bmp_info frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.width = bmpC->realWidth;
+    frame.height = bmpC->realHeight;
+
+    write_headers(cio, &frame, opts, restart, qt);
+    if (opts->flush_rows)
+        flush_output(cio);
+
+    arith_coder e;
+    init_arith_coder(&e);
+#ifdef JPEG_THREADS
+    if (opts->threads > 1 && restart &&
+        (UINT64) bmpC->complementedWidth / DCTSIZE *
+        (bmpC->complementedHeight / MCUSIZE) > restart)
+        arith_parallel(cio, bmpC, opts->threads, k, qt, restart, opts->degrade);
 #endif
+    while (next_band(bmpC)) {
+        UINT32 x;
+        for (x = 0; x < bmpC->complementedWidth; x += DCTSIZE) {
+            // 一个restart interval结束：结束算术编码器，写RSTn，统计量和DC从头开始
+            if (restart && mcu > 0 && mcu % restart == 0) {
+                arith_finish(&e);
+                arith_flush(cio, &e, bmpC);
+                write_marker(cio, M_RST0 + (rst++ & 7));
+                arith_reset(&e);
+            }
+            quant_unit quantUnit;
+            quantize_mcu(k, &bmpC->band, x, qt, opts->degrade, &quantUnit);
+            arith_encode_mcu(&e, &quantUnit);
+            mcu++;
+        }
+        arith_flush(cio, &e, bmpC);
+        if (opts->flush_rows)
+            flush_output(cio);
+    }
+    // 并行编码的时候编码器没有用过，不用结束
+    if (mcu > 0) {
+        arith_finish(&e);
+        arith_flush(cio, &e, bmpC);
+    }
+    free_arith_coder(&e);
+
+    write_file_trailer(cio);
+    free_bmp_data(bmpC);
+}
+
+
+/* quality ladder */
+
+/* a rung of the ladder: its quant tables and huffman coder */
+typedef struct {
+    quant_tables qtbl;
+    const quant_tables *qt;
+    mem_dest *dest;         /* NULL for the output of cio */
+    huff_state hs;
+    INT16 lastDc[COMP_NUM];
+    UINT8 huffBuf[HUFF_BUF_SIZE];
+} ladder_rung;
 
 /*
- * compress JPEG
- * data: data[64]，经过离散余弦变换和量化的某个颜色分量
- * dc: int * dc，指向【上一个相同颜色分量mcu的dc系数】的指针
- * dc_htable，ac_htable：dc和ac分量对应的哈夫曼表
+ * move the coded bytes of a rung into its output; at the end of an
+ * interval padded and followed by marker, or at the end of the scan by
+ * the last bits when pad is 0 and marker is M_EOI
  */
-void
-jpeg_compress(compress_io *cio,
-              INT16 *data, INT16 *dc, BITS *dc_htable, BITS *ac_htable) {
-    INT16 zigzag_data[DCTSIZE2];
-    BITS bits;
-    INT16 diff;
-    int i, j;
-    int zero_num;
-    int mark;
+static void
+rung_flush(compress_io *cio, ladder_rung *g, const jpeg_kernels *k, bool pad,
+           int marker) {
+    out_target saved;
+    if (g->dest)
+        divert_output(cio, g->dest, &saved);
+    if (pad)
+        huff_pad(&g->hs);
+    huff_flush(cio, &g->hs, g->huffBuf, k->stuff);
+    if (marker == M_EOI) {
+        if (!pad)
+            write_align_bits(cio);
+        write_file_trailer(cio);
+    } else if (marker)
+        write_marker(cio, marker);
+    if (g->dest)
+        restore_output(cio, &saved);
+}
 
-    /* zigzag encode */
-    // zig-zag 编码
-    for (i = 0; i < DCTSIZE2; i++)
-        zigzag_data[ZIGZAG[i]] = data[i];
-
-    /* write DC */
-    // 写入DC
-    diff = zigzag_data[0] - *dc;
-    *dc = zigzag_data[0];
-
-    if (diff == 0)
-        // 先写【幅值所需要的位数】对应的哈夫曼码字
-        write_bits(cio, dc_htable[0]);
-        // 幅值所需要的位数是0，也就不写幅值了
-    else {
-        // 设置bits变量，存储了【幅值】所需要的位数，和幅值的码字
-        set_bits(&bits, diff);
-        // 写【幅值所需要的位数】对应的哈夫曼码字
-        write_bits(cio, dc_htable[bits.len]);
-        // 写【幅值】对应的码字
-        write_bits(cio, bits);
-    }
-
-    /* write AC */
-    // 写入AC
-    int end = DCTSIZE2 - 1;
-    while (zigzag_data[end] == 0 && end > 0)
-        // "跳过"掉zig-zag后末尾的0
-        end--;
-
-    // 从1开始，因为下标为0的是直流分量，之前已经写过了
-    for (i = 1; i <= end; i++) {
-        j = i;
-        // "跳过"连续的0
-        while (zigzag_data[j] == 0 && j <= end)
-            j++;
-        zero_num = j - i; // 连续的0的数目
-
-        // 如果连续的0超过16个，对于每连续的16个0，写入一个"1111/0000"对应的哈夫曼码字，用来表示16个0
-        for (mark = 0; mark < zero_num / 16; mark++)
-            write_bits(cio, ac_htable[0xF0]);
-        // 剩下的连续的0的数量（不满16个）
-        zero_num = zero_num % 16;
-        // bits变量存储了【幅值】所需要的位数，和幅值的码字
-        set_bits(&bits, zigzag_data[j]);
-        // 高4位表示连续0的个数，低4位表示幅值的所需要的位数，转换成哈夫曼码字后写入文件
-        write_bits(cio, ac_htable[zero_num * 16 + bits.len]);
-        // 写入幅值对应的码字
-        write_bits(cio, bits);
-        i = j;
-    }
-
-    /* write end of unit */
-    // 对于尾巴上连续的0，直接写入一个EOB(0/0)
-    if (end != DCTSIZE2 - 1)
-        write_bits(cio, ac_htable[0]);
+/*
+ * encode_bands() into a ladder of quality scales, opts->scale into the
+ * output and those of opts->ladder into its mem_dests.  color conversion
+ * and DCT of an MCU are done once, only quantization and huffman coding
+ * once per rung.
+ */
+static void
+ladder_bands(compress_io *cio, struct bmp_complemented *bmpC,
+             const encode_options *opts, const jpeg_kernels *k,
+             const quant_tables *qt) {
+    jpeg_ladder *ladder = opts->ladder;
+    int n = ladder->count + 1, r;
+    UINT16 restart = opts->restart;
+    UINT32 mcu = 0, rst = 0;
+    bmp_info frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.width = bmpC->realWidth;
+    frame.height = bmpC->realHeight;
+
+    ladder_rung *rungs = (ladder_rung *) calloc(n, sizeof(ladder_rung));
+    if (!rungs) {
+        free_bmp_data(bmpC);
+        err_exit(BUFFER_ALLOC_ERR);
+    }
+    // 第0级是opts->scale，写到cio的输出；其它的各自写到自己的mem_dest里
+    rungs[0].qt = qt;
+    write_headers(cio, &frame, opts, restart, qt);
+    rungs[0].hs.acc = cio->temp_bits.val;
+    rungs[0].hs.len = cio->temp_bits.len;
+    for (r = 1; r < n; r++) {
+        encode_options o = *opts;
+        out_target saved;
+        o.scale = ladder->scale[r - 1];
+        o.setup = NULL;
+        rungs[r].qt = frame_tables(&o, &rungs[r].qtbl);
+        rungs[r].dest = &ladder->out[r - 1];
+        divert_output(cio, rungs[r].dest, &saved);
+        write_headers(cio, &frame, &o, restart, rungs[r].qt);
+        restore_output(cio, &saved);
+    }
+    for (r = 0; r < n; r++)
+        rungs[r].hs.out = rungs[r].huffBuf;
+
+    while (next_band(bmpC)) {
+        UINT32 x;
+        for (x = 0; x < bmpC->complementedWidth; x += DCTSIZE) {
+            bool rstHere = restart && mcu > 0 && mcu % restart == 0;
+            // 颜色转换和DCT只做一次
+            ycbcr_unit ycbcrUnit;
+            k->color(&bmpC->band, x, &ycbcrUnit);
+            k->fdct(&ycbcrUnit);
+            for (r = 0; r < n; r++) {
+                ladder_rung *g = &rungs[r];
+                if (rstHere) {
+                    rung_flush(cio, g, k, 1, M_RST0 + (rst & 7));
+                    g->lastDc[0] = g->lastDc[1] = g->lastDc[2] = 0;
+                }
+                quant_unit quantUnit;
+                k->quant(&ycbcrUnit, &quantUnit, g->qt);
+                code_mcu(k, &quantUnit, &g->hs, g->lastDc, NULL);
+                if (g->hs.out - g->huffBuf > HUFF_BUF_SIZE - 4 * HUFF_BLOCK_MAX)
+                    rung_flush(cio, g, k, 0, 0);
+            }
+            if (rstHere)
+                rst++;
+            mcu++;
+        }
+        for (r = 0; r < n; r++)
+            rung_flush(cio, &rungs[r], k, 0, 0);
+    }
+
+    // 和encode_bands()一样：有restart interval的时候最后一个interval也补齐
+    for (r = 0; r < n; r++)
+        rung_flush(cio, &rungs[r], k, restart != 0, M_EOI);
+    free(rungs);
+    free_bmp_data(bmpC);
 }
 
 
+/* non-interleaved scans */
+
 /*
- * main JPEG encoding
+ * the scan of one component: its blocks, in the order of the MCUs, coded
+ * into its own buffer, stuffed and with the RSTn in it
  */
-void
-jpeg_encode(compress_io *cio, bmp_info *binfo) {
-    /* init tables */
-    UINT32 scale = 50;
-    init_ycbcr_tables();
-    init_quant_tables(scale);
-    init_huff_tables();
+typedef struct {
+    const jpeg_kernels *k;
+    const INT16 *coef;          /* its quantized blocks, 64 apiece */
+    UINT32 blocks;
+    int comp;                   /* 0 Y, 1 Cb, 2 Cr */
+    UINT16 restart;             /* blocks per interval, 0 for none */
+    UINT8 *data;
+    size_t len;
+    size_t cap;
+    bool failed;
+} comp_scan;
 
-    /* write info */
-    // 这里写入了SOI（Start Of Image）标记和APP0标记
+/* room for n more bytes in the buffer of sc */
+static bool
+scan_reserve(comp_scan *sc, size_t n) {
+    if (sc->len + n > sc->cap) {
+        size_t cap = sc->cap * 2 > sc->len + n ? sc->cap * 2 : sc->len + n;
+        UINT8 *data = (UINT8 *) realloc(sc->data, cap);
+        if (!data) {
+            sc->failed = 1;
+            return 0;
+        }
+        sc->data = data;
+        sc->cap = cap;
+    }
+    return 1;
+}
+
+/* huff_flush() into the buffer of sc */
+static void
+scan_flush(comp_scan *sc, huff_state *hs, UINT8 *buf) {
+    size_t n;
+    while (hs->len >= 8) {
+        hs->len -= 8;
+        *hs->out++ = (UINT8) (hs->acc >> hs->len);
+    }
+    n = hs->out - buf;
+    if (scan_reserve(sc, 2 * n))
+        sc->len += sc->k->stuff(sc->data + sc->len, buf, n);
+    hs->out = buf;
+}
+
+static void *
+code_scan(void *arg) {
+    comp_scan *sc = (comp_scan *) arg;
+    const BITS *dcTable = sc->comp ? h_tables.ch_dc : h_tables.lu_dc;
+    const BITS *acTable = sc->comp ? h_tables.ch_ac : h_tables.lu_ac;
+    UINT8 huffBuf[HUFF_BUF_SIZE];
+    huff_state hs;
+    INT16 dc = 0;
+    UINT32 b, rst = 0;
+
+    hs.acc = 0;
+    hs.len = 0;
+    hs.out = huffBuf;
+    for (b = 0; b < sc->blocks && !sc->failed; b++) {
+        // 单个分量的扫描里，一个MCU就是一个块，restart interval按块数
+        if (sc->restart && b > 0 && b % sc->restart == 0) {
+            huff_pad(&hs);
+            scan_flush(sc, &hs, huffBuf);
+            if (scan_reserve(sc, 2)) {
+                sc->data[sc->len++] = 0xFF;
+                sc->data[sc->len++] = (UINT8) (M_RST0 + (rst++ & 7));
+            }
+            dc = 0;
+        }
+        sc->k->huff(&hs, sc->coef + (size_t) b * DCTSIZE2, &dc, dcTable, acTable);
+        if (hs.out - huffBuf > HUFF_BUF_SIZE - 2 * HUFF_BLOCK_MAX)
+            scan_flush(sc, &hs, huffBuf);
+    }
+    // 每个扫描都结束在整字节上
+    huff_pad(&hs);
+    scan_flush(sc, &hs, huffBuf);
+    return NULL;
+}
+
+/*
+ * encode_bands() into one scan per component, Y, Cb and Cr one after the
+ * other: the MCUs are quantized as the bands come, into a plane of blocks
+ * per component, then the huffman coding
+ * of every component runs on its own thread (with opts->threads > 1) into
+ * its own buffer, and the buffers are written in order behind their SOS.
+ */
+static void
+scan_bands(compress_io *cio, struct bmp_complemented *bmpC,
+           const encode_options *opts, const jpeg_kernels *k,
+           const quant_tables *qt) {
+    UINT32 blocks = bmpC->complementedWidth / DCTSIZE * (bmpC->complementedHeight / MCUSIZE);
+    INT16 *coef = (INT16 *) malloc((size_t) blocks * sizeof(quant_unit));
+    comp_scan scans[COMP_NUM];
+    bool failed = 0;
+    UINT32 m = 0;
+    int c;
+    bmp_info frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.width = bmpC->realWidth;
+    frame.height = bmpC->realHeight;
+
+    if (!coef) {
+        free_bmp_data(bmpC);
+        err_exit(BUFFER_ALLOC_ERR);
+    }
     write_file_header(cio);
-    // 这里写入了DQT（量化表）标记和SOF（Start Of Frame）标记
-    write_frame_header(cio, binfo);
-    // 这里写入了DHT（Define Huffman Table）标记和SOS（Start of Scan）标记
-    write_scan_header(cio);
+    write_frame_header(cio, &frame, opts->abbreviated ? NULL : qt, 0);
 
-    // 把bmp的数据一次性读到内存里来
-    struct bmp_complemented bmpComplemented;
-    read_bmp_data(cio, binfo, &bmpComplemented);
+    while (next_band(bmpC)) {
+        UINT32 x;
+        for (x = 0; x < bmpC->complementedWidth; x += DCTSIZE, m++) {
+            quant_unit q;
+            quantize_mcu(k, &bmpC->band, x, qt, opts->degrade, &q);
+            memcpy(coef + (size_t) m * DCTSIZE2, q.y, sizeof(q.y));
+            memcpy(coef + ((size_t) blocks + m) * DCTSIZE2, q.cb, sizeof(q.cb));
+            memcpy(coef + ((size_t) 2 * blocks + m) * DCTSIZE2, q.cr, sizeof(q.cr));
+        }
+    }
+
+    memset(scans, 0, sizeof(scans));
+    for (c = 0; c < COMP_NUM; c++) {
+        scans[c].k = k;
+        scans[c].coef = coef + (size_t) c * blocks * DCTSIZE2;
+        scans[c].blocks = blocks;
+        scans[c].comp = c;
+        scans[c].restart = opts->restart;
+    }
+#ifdef JPEG_THREADS
+    if (opts->threads > 1) {
+        pthread_t tids[COMP_NUM];
+        bool started[COMP_NUM];
+        for (c = 0; c < COMP_NUM; c++)
+            started[c] = pthread_create(&tids[c], NULL, code_scan, &scans[c]) == 0;
+        // 没有起来的线程，在这里编码
+        for (c = 0; c < COMP_NUM; c++) {
+            if (started[c])
+                pthread_join(tids[c], NULL);
+            else
+                code_scan(&scans[c]);
+        }
+    } else
+#endif
+        for (c = 0; c < COMP_NUM; c++)
+            code_scan(&scans[c]);
+
+    for (c = 0; c < COMP_NUM; c++)
+        failed |= scans[c].failed;
+    for (c = 0; !failed && c < COMP_NUM; c++) {
+        write_component_scan_header(cio, c, opts->restart, !opts->abbreviated);
+        write_bytes(cio, scans[c].data, scans[c].len);
+        if (opts->flush_rows)
+            flush_output(cio);
+    }
+    if (!failed)
+        write_file_trailer(cio);
+
+    for (c = 0; c < COMP_NUM; c++)
+        free(scans[c].data);
+    free(coef);
+    free_bmp_data(bmpC);
+    if (failed)
+        err_exit(BUFFER_ALLOC_ERR);
+}
+
+
+/*
+ * main JPEG encoding, of the bands that read_bmp_data() or
+ * read_source_data() prepared.  the bands are freed.
+ */
+static void
+encode_bands(compress_io *cio, struct bmp_complemented *bmpC,
+             const encode_options *opts) {
+    /* init tables */
+    quant_tables qtbl;
+    init_tables_once();
+    const jpeg_kernels *k = jsimd_kernels();
+    const quant_tables *qt = frame_tables(opts, &qtbl);
+
+    // 输入已经是YCbCr（Y4M）的话，不做颜色转换，其它的kernel不变
+    jpeg_kernels yccKernels;
+    if (bmpC->src && bmpC->src->format == PIX_YCC) {
+        yccKernels = *k;
+        yccKernels.color = load_ycbcr;
+        k = &yccKernels;
+    }
+
+    if (opts->arithmetic) {
+        arith_bands(cio, bmpC, opts, k, qt);
+        return;
+    }
+    if (opts->ladder) {
+        ladder_bands(cio, bmpC, opts, k, qt);
+        return;
+    }
+    if (opts->component_scans) {
+        scan_bands(cio, bmpC, opts, k, qt);
+        return;
+    }
+    if (opts->incr) {
+        incr_encode(cio, bmpC, opts, k, qt);
+        return;
+    }
+
+    if (opts->stats && !start_mcu_stats(opts->stats, bmpC->complementedWidth / DCTSIZE,
+                                        bmpC->complementedHeight / MCUSIZE)) {
+        free_bmp_data(bmpC);
+        err_exit(BUFFER_ALLOC_ERR);
+    }
+    perf_profile *perf = opts->perf;
+    if (perf && !perf_units(perf, bmpC->complementedWidth / DCTSIZE)) {
+        free_bmp_data(bmpC);
+        err_exit(BUFFER_ALLOC_ERR);
+    }
+
+    // 图像的大小是裁剪以后的大小
+    bmp_info frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.width = bmpC->realWidth;
+    frame.height = bmpC->realHeight;
+
+    // 已经编码的MCU个数，和下一个RSTn标记的n
+    UINT32 mcu = 0, rst = 0;
+    UINT16 restart = opts->restart;
+
+    /* write info */
+    if (opts->seg_rows) {
+        // 分段编码：不写文件头，写段头。段必须从一个restart interval开始，
+        // 没有给restart的时候一行MCU一个interval；RSTn接着整幅图像里的编号
+        UINT32 mcusPerRow = bmpC->complementedWidth / DCTSIZE;
+        UINT64 firstMcu = (UINT64) opts->seg_first * mcusPerRow;
+        if (!restart && mcusPerRow <= 0xFFFF)
+            restart = (UINT16) mcusPerRow;
+        if (!restart || firstMcu % restart) {
+            free_bmp_data(bmpC);
+            err_exit(SEGMENT_ERR);
+        }
+        rst = (UINT32) (firstMcu / restart);
+        jpeg_segment seg;
+        memset(&seg, 0, sizeof(seg));
+        seg.width = frame.width;
+        seg.height = bmpC->frameHeight;
+        seg.scale = opts->scale;
+        seg.restart = restart;
+        seg.abbreviated = opts->abbreviated;
+        seg.first = opts->seg_first;
+        seg.rows = bmpC->complementedHeight / MCUSIZE;
+        write_segment_head(cio, &seg);
+    } else
+        write_headers(cio, &frame, opts, restart, qt);
+    if (opts->flush_rows)
+        flush_output(cio);
 
-    // 逐个从内存中的bmp图像中，迭代MCU
-    struct mcu my_mcu;
-    next_mcu(&bmpComplemented, &my_mcu);
     // 上一次的Y通道，Cb通道，Cr通道的Dc值
-    INT16 lastYDc = 0;
-    INT16 lastCbDc = 0;
-    INT16 lastCrDc = 0;
-    for (; my_mcu.rgbData != NULL; next_mcu(&bmpComplemented, &my_mcu)) {
-
-        // 将RGB数据转换为YCbCr数据，将YCbCr的数据减去128的工作，也在这个函数里面完成了
-        ycbcr_unit ycbcrUnit;
-        rgb_to_ycbcr(my_mcu.rgbData, &ycbcrUnit, 0, DCTSIZE);
-
-        // 离散余弦变换（对Y，Cb，Cr三个通道都进行离散余弦变换）
-        jpeg_fdct(ycbcrUnit.y);
-        jpeg_fdct(ycbcrUnit.cb);
-        jpeg_fdct(ycbcrUnit.cr);
-
-        // 将离散余弦变换的结果进行量化
-        quant_unit quantUnit;
-        jpeg_quant(&ycbcrUnit, &quantUnit);
-
-        // jpeg压缩，并写入文件（分别对Y，Cb，Cr三个分量）
-        jpeg_compress(cio,
-                      quantUnit.y,
-                      &lastYDc,
-                      h_tables.lu_dc,
-                      h_tables.lu_ac);
-        jpeg_compress(cio,
-                      quantUnit.cb,
-                      &lastCbDc,
-                      h_tables.ch_dc,
-                      h_tables.ch_ac);
-        jpeg_compress(cio,
-                      quantUnit.cr,
-                      &lastCrDc,
-                      h_tables.ch_dc,
-                      h_tables.ch_ac);
-
-
-        // 更新"上一次的直流分量值"
-        lastYDc = quantUnit.y[0];
-        lastCbDc = quantUnit.cb[0];
-        lastCrDc = quantUnit.cr[0];
-
-        // 释放内存
-        free_mcu_data(&my_mcu);
-    }
-
-    write_align_bits(cio);
+    INT16 lastDc[COMP_NUM] = {0, 0, 0};
+    UINT8 huffBuf[HUFF_BUF_SIZE];
+    huff_state hs;
+    hs.acc = cio->temp_bits.val;
+    hs.len = cio->temp_bits.len;
+    hs.out = huffBuf;
+#ifdef JPEG_THREADS
+    // 不要restart标记的时候，可以多线程编码，结果和下面的循环一样
+    if (opts->threads > 1 && !restart && !perf && !opts->deadline_us &&
+        !opts->degrade && bmpC->complementedHeight > MCUSIZE)
+        huff_parallel(cio, bmpC, opts->threads, k, qt, opts->stats);
+#endif
+    // 有时间预算的时候每编完一行MCU看一次时间，来不及就给剩下的行换便宜的路径
+    int level = opts->degrade;
+    deadline_clock dl;
+    if (opts->deadline_us)
+        start_deadline(&dl, opts->deadline_us, level, bmpC->complementedHeight / MCUSIZE);
+
+    // 计数模式：一行MCU先整行做完颜色转换、DCT和量化，每个阶段之间读一次计数器
+    if (perf && !level)
+        perf_start(perf);
+    while (next_band(bmpC)) {
+        if (perf && !level) {
+            perf_stage_done(perf, PERF_GATHER);
+            transform_band(k, &bmpC->band, bmpC->complementedWidth, qt, perf);
+        }
+
+        // 从左往右，逐个编码这一行的MCU
+        UINT32 x;
+        for (x = 0; x < bmpC->complementedWidth; x += DCTSIZE) {
+            // 一个restart interval结束：补齐到整字节，写RSTn，DC从0重新开始
+            if (restart && mcu > 0 && mcu % restart == 0) {
+                huff_pad(&hs);
+                huff_flush(cio, &hs, huffBuf, k->stuff);
+                write_marker(cio, M_RST0 + (rst++ & 7));
+                lastDc[0] = lastDc[1] = lastDc[2] = 0;
+            }
+
+            if (level)
+                degrade_mcu(k, &bmpC->band, x, qt, &hs, lastDc,
+                            MCU_STAT(opts->stats, x / DCTSIZE, bmpC->i - 1), level);
+            else if (perf)
+                code_mcu(k, &perf->q[x / DCTSIZE], &hs, lastDc,
+                         MCU_STAT(opts->stats, x / DCTSIZE, bmpC->i - 1));
+            else
+                encode_mcu(k, &bmpC->band, x, qt, &hs, lastDc,
+                           MCU_STAT(opts->stats, x / DCTSIZE, bmpC->i - 1));
+            mcu++;
+
+            // 剩下的空间可能放不下下一个MCU了，先写到输出里
+            if (hs.out - huffBuf > HUFF_BUF_SIZE - 4 * HUFF_BLOCK_MAX)
+                huff_flush(cio, &hs, huffBuf, k->stuff);
+        }
+
+        // 一行mcu编码完了，把输出推给下游
+        huff_flush(cio, &hs, huffBuf, k->stuff);
+        if (opts->flush_rows)
+            flush_output(cio);
+        if (perf && !level) {
+            perf_stage_done(perf, PERF_HUFF);
+            perf->mcus += bmpC->complementedWidth / DCTSIZE;
+        }
+        if (opts->deadline_us)
+            level = deadline_row_done(&dl, bmpC->i);
+    }
+
+    // 有restart interval的时候，最后一个interval和其它的一样补齐，这样和增量编码的结果相同
+    if (restart) {
+        huff_pad(&hs);
+        huff_flush(cio, &hs, huffBuf, k->stuff);
+    } else
+        write_align_bits(cio);
 
     /* write file end */
-    write_file_trailer(cio);
+    if (!opts->seg_rows)
+        write_file_trailer(cio);
+    if (opts->deadline_us) {
+        end_deadline(&dl);
+        if (opts->degraded)
+            *opts->degraded = dl.r;
+    }
 
-    free_bmp_data(&bmpComplemented);
+    free_bmp_data(bmpC);
 }
 
+void
+jpeg_encode(compress_io *cio, bmp_info *binfo, const encode_options *opts) {
+    // 准备读取bmp的数据（只读要编码的区域），每次读一行MCU（8行像素）到band里
+    struct bmp_complemented bmpComplemented;
+    read_bmp_data(cio, binfo, opts, &bmpComplemented);
+    encode_bands(cio, &bmpComplemented, opts);
+}
 
-bool
-is_bmp(FILE *fp) {
-    UINT8 marker[3];
-    // 这里原来的代码，明明只开了三个UINT8的空间，却读取了两个UINT16的值，导致溢出，导致程序一上来就崩，我也不知道助教为什么要这样写。。。。。。
-    //    if (fread(marker, sizeof(UINT16), 2, fp) != 2)
-    if (fread(marker, sizeof(UINT16), 1, fp) != 1)
-        err_exit(FILE_READ_ERR);
-    if (marker[0] != 0x42 || marker[1] != 0x4D)
-        return false;
-    rewind(fp);
-    return true;
+void
+jpeg_encode_source(compress_io *cio, image_source *src,
+                   const encode_options *opts) {
+    struct bmp_complemented bmpComplemented;
+    read_source_data(src, opts, &bmpComplemented);
+    encode_bands(cio, &bmpComplemented, opts);
 }
 
+
+
+
+/*
+ * convert a BMP stream, already checked by is_bmp(), into JPEG.
+ * cio comes from init_mem() and its buffers are reused across calls.
+ * the result goes to jpeg_fp, or is appended to dest when dest is not NULL.
+ */
 void
-err_exit(const char *error_string, int exit_num) {
-    printf(error_string);
-    exit(exit_num);
+bmp_to_jpeg(compress_io *cio, FILE *bmp_fp, FILE *jpeg_fp, mem_dest *dest,
+            const encode_options *opts) {
+    /* get bmp info */
+    bmp_info binfo;
+    read_bmp(bmp_fp, &binfo);
+    assert_true(binfo.bitppx == 24, "很抱歉，我只能转换24位bmp");
+
+    /* point the IO buffers at this image */
+    // 一行MCU（8行像素）的数据量。
+    // 因为bmp文件中，一行的字节数必须是4的倍数，因此(binfo.width * 3 + 3) / 4 * 4就可以将binfo.width向上对齐到最近的4的倍数
+    int in_size = MCUSIZE * ((binfo.width * 3 + 3) / 4 * 4);
+    reset_mem(cio, bmp_fp, in_size, jpeg_fp, dest);
+
+    /* main encode process */
+    jpeg_encode(cio, &binfo, opts);
+
+    /* flush, and detach the files so the caller may close them */
+    if (!(cio->out->flush_buffer)(cio))
+        err_exit(BUFFER_WRITE_ERR);
+    if (jpeg_fp)
+        fflush(jpeg_fp);
+    cio->in->fp = NULL;
+    cio->out->fp = NULL;
 }
 
 
+/*
+ * convert the image of a PPM, PAM, raw or Y4M reader into JPEG, like
+ * bmp_to_jpeg().  the reader does its own input, src is not closed.
+ */
 void
-print_help() {
-    printf("compress BMP file into JPEG file.\n");
-    printf("Usage:\n");
-    printf("    cjpeg {BMP} {JPEG}\n");
-    printf("\n");
-    printf("Author: Yu, Le <yeolar@gmail.com>\n");
-    printf("Homework by Haojie Zhang (HuaJuan) 19302010021@fudan.edu.cn");
-}
-
-
-int
-main(int argc, char *argv[]) {
-    if (argc == 3) {
-        /* open bmp file */
-        FILE *bmp_fp = fopen(argv[1], "rb");
-        if (!bmp_fp)
-            err_exit(FILE_OPEN_ERR);
-        if (!is_bmp(bmp_fp))
-            err_exit(FILE_TYPE_ERR);
-
-        /* open jpeg file */
-        FILE *jpeg_fp = fopen(argv[2], "wb");
-        if (!jpeg_fp)
-            err_exit(FILE_OPEN_ERR);
-
-        /* get bmp info */
-        bmp_info binfo;
-        read_bmp(bmp_fp, &binfo);
-        assert_true(binfo.bitppx == 24, "很抱歉，我只能转换24位bmp");
-
-        /* init memory for input and output */
-        compress_io cio;
-        // 一行的数据量。
-        // 因为bmp文件中，一行的字节数必须是4的倍数，因此(binfo.width * 3 + 3) / 4 * 4就可以将binfo.width向上对齐到最近的4的倍数
-        int in_size = (binfo.width * 3 + 3) / 4 * 4;
-        int out_size = MEM_OUT_SIZE;
-        init_mem(&cio, bmp_fp, in_size, jpeg_fp, out_size);
-
-        struct bmp_complemented bmpComplemented;
-        read_bmp_data(&cio, &binfo, &bmpComplemented);
-
-        /* main encode process */
-        jpeg_encode(&cio, &binfo);
-
-        /* flush and free memory, close files */
-        if (!(cio.out->flush_buffer)(&cio))
-            err_exit(BUFFER_WRITE_ERR);
-        free_mem(&cio);
-        fclose(bmp_fp);
-        fclose(jpeg_fp);
+image_to_jpeg(compress_io *cio, image_source *src, FILE *jpeg_fp,
+              mem_dest *dest, const encode_options *opts) {
+    reset_mem(cio, NULL, 0, jpeg_fp, dest);
+
+    jpeg_encode_source(cio, src, opts);
+
+    if (!(cio->out->flush_buffer)(cio))
+        err_exit(BUFFER_WRITE_ERR);
+    if (jpeg_fp)
+        fflush(jpeg_fp);
+    cio->out->fp = NULL;
+}
+
+
+/*
+ * write the tables-only datastream (SOI, DQT, DHT, EOI) that goes with the
+ * abbreviated images of opts, to jpeg_fp or dest.
+ */
+void
+tables_to_jpeg(compress_io *cio, FILE *jpeg_fp, mem_dest *dest,
+               const encode_options *opts) {
+    quant_tables qtbl;
+    reset_mem(cio, NULL, 0, jpeg_fp, dest);
+    init_tables_once();
+    write_tables_only(cio, frame_tables(opts, &qtbl));
+    if (!(cio->out->flush_buffer)(cio))
+        err_exit(BUFFER_WRITE_ERR);
+    if (jpeg_fp)
+        fflush(jpeg_fp);
+    cio->out->fp = NULL;
+}
+
+
+/* push encoding */
+
+/*
+ * an image whose rows the caller pushes: the rows go through a memory
+ * source into the bands of bmpC, in place when a push holds the rest of
+ * a band, else gathered in staging first.  every band is coded as soon
+ * as it is complete, like the loop of encode_bands().
+ */
+struct jpeg_push {
+    compress_io cio;
+    out_sink sink;
+    encode_options opts;
+    const jpeg_kernels *k;
+    quant_tables qtbl;
+    const quant_tables *qt;
+    image_source *src;
+    struct bmp_complemented bmpC;
+    UINT32 rows;                /* rows pushed so far */
+    UINT8 *staging;             /* rows of a band not yet complete */
+    size_t rowBytes;
+    UINT32 staged;
+    UINT32 mcu, rst;
+    INT16 lastDc[COMP_NUM];
+    huff_state hs;
+    UINT8 huffBuf[HUFF_BUF_SIZE];
+};
+
+/* free all of p, also when jpeg_push_begin() stopped half way */
+static void
+free_push(jpeg_push *p) {
+    free_bmp_data(&p->bmpC);
+    close_image_source(p->src);
+    if (p->cio.out && p->cio.out->set)
+        free_mem(&p->cio);
+    free(p->staging);
+    free(p);
+}
+
+jpeg_push *
+jpeg_push_begin(UINT32 width, UINT32 height, int order,
+                const encode_options *opts, out_sink *sink) {
+    // 只有一行MCU在内存里：不能裁剪、转置和上下翻转，也没有要整幅图像的模式
+    if (opts->crop_w || (opts->orient & (ORIENT_TRANSPOSE | ORIENT_FLIP_Y)) ||
+        opts->arithmetic || opts->incr || opts->seg_rows || opts->stats || opts->perf ||
+        opts->deadline_us || opts->degrade || opts->ladder || opts->component_scans)
+        err_exit(PUSH_OPTION_ERR);
+    jpeg_push *p = (jpeg_push *) calloc(1, sizeof(jpeg_push));
+    jmp_buf trap, *outer;
+    int code;
+    if (!p)
+        err_exit(BUFFER_ALLOC_ERR);
+
+    /* errors from here on free p on the way out */
+    outer = get_err_trap();
+    if ((code = setjmp(trap)) != 0) {
+        set_err_trap(outer);
+        free_push(p);
+        err_exit(last_err(), code);
+    }
+    set_err_trap(&trap);
+
+    p->opts = *opts;
+    p->sink = *sink;
+    p->rowBytes = (size_t) width * 3;
+    p->staging = (UINT8 *) malloc(p->rowBytes * MCUSIZE);
+    p->src = open_memory_source(NULL, width, height, 0, order);
+    if (!p->staging || !p->src)
+        err_exit(BUFFER_ALLOC_ERR);
+    init_mem(&p->cio, NULL, 0, NULL, MEM_OUT_SIZE);
+    use_sink(&p->cio, &p->sink);
+    read_source_data(p->src, &p->opts, &p->bmpC);
+
+    init_tables_once();
+    p->k = jsimd_kernels();
+    p->qt = frame_tables(&p->opts, &p->qtbl);
+
+    bmp_info frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.width = width;
+    frame.height = height;
+    write_headers(&p->cio, &frame, &p->opts, p->opts.restart, p->qt);
+    flush_output(&p->cio);
+    p->hs.out = p->huffBuf;
+    set_err_trap(outer);
+    return p;
+}
+
+/* code the band whose rows the memory source holds, and hand it on */
+static void
+push_band(jpeg_push *p) {
+    struct bmp_complemented *bmpC = &p->bmpC;
+    UINT16 restart = p->opts.restart;
+    UINT32 x;
+    next_band(bmpC);
+    for (x = 0; x < bmpC->complementedWidth; x += DCTSIZE) {
+        if (restart && p->mcu > 0 && p->mcu % restart == 0) {
+            huff_pad(&p->hs);
+            huff_flush(&p->cio, &p->hs, p->huffBuf, p->k->stuff);
+            write_marker(&p->cio, M_RST0 + (p->rst++ & 7));
+            p->lastDc[0] = p->lastDc[1] = p->lastDc[2] = 0;
+        }
+        encode_mcu(p->k, &bmpC->band, x, p->qt, &p->hs, p->lastDc, NULL);
+        p->mcu++;
+        if (p->hs.out - p->huffBuf > HUFF_BUF_SIZE - 4 * HUFF_BLOCK_MAX)
+            huff_flush(&p->cio, &p->hs, p->huffBuf, p->k->stuff);
+    }
+    huff_flush(&p->cio, &p->hs, p->huffBuf, p->k->stuff);
+    flush_output(&p->cio);
+}
+
+/* take nrows rows, and code every band they complete */
+static void
+push_rows(jpeg_push *p, const UINT8 *rows, size_t stride, UINT32 nrows) {
+    UINT32 height = p->src->height;
+    if (nrows > height - p->rows)
+        err_exit(PUSH_ROWS_ERR);
+    while (nrows > 0) {
+        // 当前这一行MCU一共有几行，还差几行
+        UINT32 bandRows = height - (p->rows - p->staged) < MCUSIZE ?
+                          height - (p->rows - p->staged) : MCUSIZE;
+        UINT32 need = bandRows - p->staged;
+        if (!p->staged && nrows >= need) {
+            // 这次给的行够一整行MCU，直接从调用者的内存里取
+            feed_memory_source(p->src, rows, stride, need);
+            push_band(p);
+            rows += stride * need;
+            nrows -= need;
+            p->rows += need;
+            continue;
+        }
+        UINT32 n = nrows < need ? nrows : need, i;
+        for (i = 0; i < n; i++)
+            memcpy(p->staging + (p->staged + i) * p->rowBytes, rows + stride * i, p->rowBytes);
+        rows += stride * n;
+        nrows -= n;
+        p->rows += n;
+        p->staged += n;
+        if (p->staged == bandRows) {
+            feed_memory_source(p->src, p->staging, p->rowBytes, bandRows);
+            push_band(p);
+            p->staged = 0;
+        }
+    }
+}
+
+void
+jpeg_push_rows(jpeg_push *p, const UINT8 *rows, size_t stride, UINT32 nrows) {
+    jmp_buf trap, *outer;
+    int code;
+
+    /* a sink that fails takes the encoder with it, as does any error */
+    outer = get_err_trap();
+    if ((code = setjmp(trap)) != 0) {
+        set_err_trap(outer);
+        free_push(p);
+        err_exit(last_err(), code);
+    }
+    set_err_trap(&trap);
+    push_rows(p, rows, stride, nrows);
+    set_err_trap(outer);
+}
+
+void
+jpeg_push_finish(jpeg_push *p) {
+    jmp_buf trap, *outer;
+    int code;
+
+    outer = get_err_trap();
+    if ((code = setjmp(trap)) != 0) {
+        set_err_trap(outer);
+        free_push(p);
+        err_exit(last_err(), code);
+    }
+    set_err_trap(&trap);
+
+    if (p->rows != p->src->height)
+        err_exit(PUSH_ROWS_ERR);
+    // 和encode_bands()一样结束：有restart interval的时候最后一个interval补齐
+    if (p->opts.restart) {
+        huff_pad(&p->hs);
+        huff_flush(&p->cio, &p->hs, p->huffBuf, p->k->stuff);
     } else
-        print_help();
-    exit(0);
+        write_align_bits(&p->cio);
+    write_file_trailer(&p->cio);
+    if (!(p->cio.out->flush_buffer)(&p->cio))
+        err_exit(BUFFER_WRITE_ERR);
+    set_err_trap(outer);
+    free_push(p);
+}
+
+
+/*
+ * error trap.  a caller that has to survive bad input (the server) sets a
+ * jmp_buf for its thread, and err_exit then jumps back to it instead of
+ * ending the process.
+ */
+
+static THREAD_LOCAL jmp_buf *err_trap;
+static THREAD_LOCAL const char *err_string;
+
+void
+set_err_trap(jmp_buf *trap) {
+    err_trap = trap;
+}
+
+jmp_buf *
+get_err_trap() {
+    return err_trap;
+}
+
+const char *
+last_err() {
+    return err_string;
+}
+
+void
+err_exit(const char *error_string, int exit_num) {
+    if (err_trap) {
+        err_string = error_string;
+        longjmp(*err_trap, exit_num);
+    }
+    fprintf(stderr, "%s\n", error_string);
+    exit(exit_num);
 }
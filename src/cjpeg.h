@@ -8,11 +8,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <setjmp.h>
 
 
 typedef unsigned char UINT8;
 typedef unsigned short UINT16;
 typedef unsigned int UINT32;
+typedef unsigned long long UINT64;
 
 typedef char INT8;
 typedef short INT16;
@@ -29,6 +31,20 @@ typedef unsigned char bool;   /* no bool type in C */
 #define BUFFER_ALLOC_ERR    "malloc: alloc buffer error", 4
 #define BUFFER_READ_ERR     "fread: read buffer error", 5
 #define BUFFER_WRITE_ERR    "fwrite: write buffer error", 6
+#define CROP_ERR            "crop region outside the image", 7
+#define SEGMENT_ERR         "segment outside the image or not on a restart interval", 8
+#define ORIENT_ERR          "a segment cannot be rotated or flipped", 9
+#define PUSH_ROWS_ERR       "rows pushed do not match the image height", 10
+#define PUSH_OPTION_ERR     "option not available to the push encoder", 11
+
+
+#if defined(__GNUC__)
+#define THREAD_LOCAL    __thread
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL    __declspec(thread)
+#else
+#define THREAD_LOCAL    _Thread_local
+#endif
 
 
 #define REVERSED        /* regularly, BMP image is stored reversely */
@@ -144,7 +160,7 @@ typedef struct {
     INT32 b2cr[256];
 } ycbcr_tables;
 
-extern ycbcr_tables ycc_tables;
+extern const ycbcr_tables ycc_tables;
 
 /* store color unit in YCbCr */
 // 每一个8*8=64的单元的，每个像素的y，cb和cr值
@@ -155,6 +171,15 @@ typedef struct {
 } ycbcr_unit;
 
 
+/* one MCU row of the image in planar form */
+// 一行MCU（8行像素）的R，G，B三个平面，每个平面有MCUSIZE行，每行stride个字节
+// 每个平面都是64字节对齐的，stride也是64的倍数，右边和下边补齐的像素已经填好了
+typedef struct {
+    UINT8 *plane[COMP_NUM];
+    UINT32 stride;
+} pixel_band;
+
+
 /* standard quantization tables */
 // 标准亮度量化表，用作y分量的量化
 static UINT8 STD_LU_QTABLE[DCTSIZE2] = {       /* luminance */
@@ -201,9 +226,11 @@ typedef struct {
     // 这里的quant_tables，已经是把8*8的量化表，按照zig-zag的顺序编程长度为64的一维数组了
     UINT8 lu[DCTSIZE2];
     UINT8 ch[DCTSIZE2];
+    // 量化时要乘的倒数，已经包含了AAN的缩放系数，按自然顺序存储
+    float lu_recip[DCTSIZE2];
+    float ch_recip[DCTSIZE2];
 } quant_tables;
 
-extern quant_tables q_tables;
 
 /* store color unit after quantizing operation */
 // 每一个8*8=64的单元的，每个像素的y，cb和cr值（量化后）
@@ -310,7 +337,7 @@ typedef struct {
     BITS ch_ac[256];
 } huff_tables;
 
-extern huff_tables h_tables;
+extern const huff_tables h_tables;
 
 
 /* store BMP image informations */
@@ -322,10 +349,178 @@ typedef struct {
     UINT32 height;    /* pixel height of bmp image:           22-25 */
     UINT16 bitppx;    /* bit number per pixel:                28-29 */
     UINT32 datasize;  /* image rgbData size:                     34-37 */
+    bool topdown;     /* rows stored top to bottom (negative height) */
 } bmp_info;
 
 
+/* encoder options */
+
+#define DEFAULT_SCALE   50      /* quant table scale of the original encoder */
+#define INCR_RESTART    16      /* restart interval of incremental encoding */
+
+/*
+ * orientation of the output, encode_options.orient: the region to encode
+ * is transposed (rows become columns), then mirrored left to right and
+ * upside down as the bits say.  the rotations are clockwise.
+ */
+#define ORIENT_FLIP_X       1
+#define ORIENT_FLIP_Y       2
+#define ORIENT_TRANSPOSE    4
+#define ORIENT_ROT90        (ORIENT_TRANSPOSE | ORIENT_FLIP_X)
+#define ORIENT_ROT180       (ORIENT_FLIP_X | ORIENT_FLIP_Y)
+#define ORIENT_ROT270       (ORIENT_TRANSPOSE | ORIENT_FLIP_Y)
+
+typedef struct incr_cache incr_cache;
+typedef struct frame_cache frame_cache;
+typedef struct image_source image_source;
+typedef struct mcu_stats mcu_stats;
+typedef struct perf_profile perf_profile;
+typedef struct deadline_report deadline_report;
+typedef struct jpeg_ladder jpeg_ladder;
+
+typedef struct {
+    UINT32 scale;     /* scale factor of the standard quant tables, percent */
+    bool flush_rows;  /* push the output downstream after every MCU row */
+    UINT32 crop_x;    /* region to encode, in pixels from the top left, */
+    UINT32 crop_y;    /* clipped to the image.  crop_w == 0 encodes all */
+    UINT32 crop_w;
+    UINT32 crop_h;
+    UINT16 restart;   /* MCUs per restart interval (DRI), 0 for none */
+    incr_cache *incr; /* previous frame, see incr_encode(); NULL for none */
+    frame_cache *setup; /* tables and headers kept between images, or NULL */
+    UINT32 threads;   /* threads coding one image (JPEG_THREADS builds) */
+    bool abbreviated; /* leave DQT and DHT out, see tables_to_jpeg() */
+    UINT32 seg_first; /* encode only MCU rows [seg_first, seg_first + */
+    UINT32 seg_rows;  /* seg_rows) as a segment (jsegment.h); 0 for all */
+    mcu_stats *stats; /* record the cost of every MCU (jstats.h), or NULL */
+    perf_profile *perf; /* count the stages (jperf.h), or NULL */
+    UINT32 deadline_us; /* time budget of an image (jdeadline.h), 0 for none */
+    int degrade;      /* cheaper path from the first MCU row, DEGRADE_* */
+    deadline_report *degraded; /* what the budget changed, or NULL */
+    bool arithmetic;  /* arithmetic coding, SOF9 (jarith.h); not with incr,
+                         seg_rows, abbreviated, stats, perf or deadline_us */
+    int orient;       /* ORIENT_* of the cropped region; not with seg_rows */
+    jpeg_ladder *ladder; /* more quality scales of the image, or NULL; not
+                            with arithmetic, incr, seg_rows, stats, perf or
+                            deadline_us */
+    bool component_scans; /* one scan per component instead of an
+                             interleaved one, coded on threads; not with
+                             arithmetic, incr, seg_rows, stats, perf,
+                             deadline_us or ladder */
+} encode_options;
+
+
 extern void err_exit(const char *error_string, int exit_num);
+void set_err_trap(jmp_buf *trap);
+jmp_buf *get_err_trap();
+const char *last_err();
+
+
+/* prototypes that need the IO manager */
+
+#include "cio.h"
+
+/*
+ * state of the incremental encoder between the frames of a sequence: the
+ * previous frame in planar form and its entropy coded restart intervals.
+ * an interval whose pixels did not change is copied from here instead of
+ * being encoded again.
+ */
+struct incr_cache {
+    UINT32 width;         /* frame the cache belongs to, 0 for none */
+    UINT32 height;
+    UINT32 scale;
+    UINT16 restart;       /* MCUs per restart interval */
+    bool ycc;             /* the planes are Y, Cb, Cr (a Y4M source) */
+    UINT32 stride;        /* bytes per row of a plane (padded width) */
+    UINT8 *pixels;        /* R, G and B planes of the padded frame */
+    mem_dest coded;       /* stuffed data of the intervals, back to back */
+    size_t *ends;         /* end of each interval in coded */
+    UINT32 intervals;
+    UINT8 *changed;       /* per interval, used while encoding a frame */
+    UINT32 dirty;         /* intervals encoded by the last frame */
+};
+
+/*
+ * setup that a caller encoding many images keeps between them: the quant
+ * tables, and the header bytes (SOI .. SOS) of the last image, a template
+ * for the same options that gets the size of the next image patched in and
+ * is written in one go.
+ */
+struct frame_cache {
+    bool has_tables;      /* qtbl is built for table_scale */
+    UINT32 table_scale;
+    quant_tables qtbl;
+    UINT32 width;         /* image the headers belong to, 0 for none */
+    UINT32 height;
+    UINT32 scale;
+    UINT16 restart;
+    bool abbreviated;
+    bool arithmetic;
+    mem_dest headers;
+    size_t sof;           /* offset of SOF0 or SOF9 in headers */
+};
+
+/*
+ * a quality ladder: the image coded at opts->scale into the output and at
+ * each of these scales into its mem_dest, from one color conversion and
+ * DCT per MCU.  the mem_dests must be zeroed or hold earlier output.
+ */
+#define LADDER_MAX      8
+
+struct jpeg_ladder {
+    int count;
+    UINT32 scale[LADDER_MAX];
+    mem_dest out[LADDER_MAX];
+};
+
+void init_encode_options(encode_options *opts);
+UINT32 quality_to_scale(int quality);
+
+void init_tables_once();
+void init_quant_tables(quant_tables *tbl, UINT32 scale_factor);
+
+/*
+ * ycc_tables, h_tables and std_quant_tables (the quant tables of
+ * DEFAULT_SCALE) are const data computed at build time with these.
+ */
+void init_ycbcr_tables(ycbcr_tables *tbl);
+void init_huff_tables(huff_tables *tbl);
+extern const quant_tables std_quant_tables;
+
+void jpeg_encode(compress_io *cio, bmp_info *binfo,
+                 const encode_options *opts);
+void init_frame_cache(frame_cache *cache);
+void free_frame_cache(frame_cache *cache);
+void init_incr_cache(incr_cache *cache);
+void free_incr_cache(incr_cache *cache);
+void bmp_to_jpeg(compress_io *cio, FILE *bmp_fp, FILE *jpeg_fp,
+                 mem_dest *dest, const encode_options *opts);
+void tables_to_jpeg(compress_io *cio, FILE *jpeg_fp, mem_dest *dest,
+                    const encode_options *opts);
+void jpeg_encode_source(compress_io *cio, image_source *src,
+                        const encode_options *opts);
+void image_to_jpeg(compress_io *cio, image_source *src, FILE *jpeg_fp,
+                   mem_dest *dest, const encode_options *opts);
+
+/*
+ * push encoding, for rows that come one at a time (a renderer): begin with
+ * the size, RAW_RGB or RAW_BGR order and options, push top-down rows of
+ * 3-byte pixels, stride bytes apart, in any number of calls, then finish.
+ * each MCU band is coded as soon as its rows are in, and the output goes
+ * to sink band by band; at most one band of pixels is held.  no crop,
+ * transpose or upside-down flip, and only the huffman coding of
+ * encode_bands() without stats, perf or deadlines.  finish writes EOI and
+ * frees the encoder.  any error in begin, rows or finish (a sink that
+ * fails, pushing more rows than the height, finishing with fewer) frees it
+ * before it ends in err_exit(), so the encoder is not used after that.
+ */
+typedef struct jpeg_push jpeg_push;
+
+jpeg_push *jpeg_push_begin(UINT32 width, UINT32 height, int order,
+                           const encode_options *opts, out_sink *sink);
+void jpeg_push_rows(jpeg_push *p, const UINT8 *rows, size_t stride, UINT32 nrows);
+void jpeg_push_finish(jpeg_push *p);
 
 
 #endif /* __CJPEG_H */
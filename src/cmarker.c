@@ -3,8 +3,10 @@
  * @brief write JPEG markers.
  */
 
+#include <string.h>
 #include "cjpeg.h"
 #include "cio.h"
+#include "jarith.h"
 
 /*
  * Length of APP0 block   (2 bytes)
@@ -35,10 +37,10 @@ write_app0(compress_io *cio) {
     write_byte(cio, 0);
 }
 
-// 写入SOF0标记
+// 写入SOF标记：SOF0是哈夫曼编码，SOF9是算术编码，后面的内容一样
 void
-write_sof0(compress_io *cio, bmp_info *binfo) {
-    write_marker(cio, M_SOF0);
+write_sof(compress_io *cio, bmp_info *binfo, JPEG_MARKER sof) {
+    write_marker(cio, sof);
     write_word(cio, 3 * COMP_NUM + 2 + 5 + 1); /* length */
     // 每个数据样本的位数为8
     write_byte(cio, PRECISION);
@@ -114,7 +116,7 @@ write_sos(compress_io *cio) {
 }
 
 void
-write_dqt(compress_io *cio) {
+write_dqt(compress_io *cio, const quant_tables *tbl) {
     /* index:
      *  bit 0..3: number of QT, Y = 0
      *  bit 4..7: precision of QT, 0 = 8 bit
@@ -130,13 +132,13 @@ write_dqt(compress_io *cio) {
     index = 0;                  /* table for Y */
     write_byte(cio, index);
     for (i = 0; i < DCTSIZE2; i++)
-        write_byte(cio, q_tables.lu[i]);
+        write_byte(cio, tbl->lu[i]);
 
     // 写入色度的量化表
     index = 1;                  /* table for Cb,Cr */
     write_byte(cio, index);
     for (i = 0; i < DCTSIZE2; i++)
-        write_byte(cio, q_tables.ch[i]);
+        write_byte(cio, tbl->ch[i]);
 }
 
 int
@@ -191,6 +193,34 @@ write_dht(compress_io *cio) {
     write_htable(cio, STD_CH_AC_NRCODES, STD_CH_AC_VALUES, len4, 0x11);
 }
 
+// 写入DAC标记：算术编码的条件参数，DC表的L和U，AC表的Kx，亮度和色度各一个
+void
+write_dac(compress_io *cio) {
+    int i;
+    write_marker(cio, M_DAC);
+    write_word(cio, 2 + 2 * 4); /* length */
+    /*
+     * Tc Tb:  bit 4..7: 0 = DC, 1 = AC;  bit 0..3: table No.
+     * Cs:     DC: U << 4 | L;  AC: Kx
+     */
+    for (i = 0; i < 2; i++) {
+        write_byte(cio, i);
+        write_byte(cio, ARITH_DC_U << 4 | ARITH_DC_L);
+    }
+    for (i = 0; i < 2; i++) {
+        write_byte(cio, 0x10 | i);
+        write_byte(cio, ARITH_AC_K);
+    }
+}
+
+// 写入DRI标记：每restart_interval个MCU之后有一个RSTn标记，解码器在那里把DC预测值清零
+void
+write_dri(compress_io *cio, UINT16 restart_interval) {
+    write_marker(cio, M_DRI);
+    write_word(cio, 4);         /* length */
+    write_word(cio, restart_interval);
+}
+
 /*
  * Write datastream header.
  * This consists of an SOI and optional APPn markers.
@@ -207,24 +237,73 @@ write_file_header(compress_io *cio) {
  * Note that we do not emit the SOF until we have emitted the DQT(s).
  * This avoids compatibility problems with incorrect implementations that
  * try to error-check the quant table numbers as soon as they see the SOF.
+ * With tbl NULL the DQT is left out (abbreviated image).  An arithmetic
+ * coded frame has SOF9 instead of SOF0.
  */
 void
-write_frame_header(compress_io *cio, bmp_info *binfo) {
-    write_dqt(cio);
-    write_sof0(cio, binfo);
+write_frame_header(compress_io *cio, bmp_info *binfo,
+                   const quant_tables *tbl, bool arith) {
+    if (tbl)
+        write_dqt(cio, tbl);
+    write_sof(cio, binfo, arith ? M_SOF9 : M_SOF0);
 }
 
 /*
  * Write scan header.
  * This consists of DHT or DAC markers, optional DRI, and SOS.
  * Compressed rgbData will be written following the SOS.
+ * Without with_dht the DHT is left out (abbreviated image).  An arithmetic
+ * coded scan has the DAC instead, always.
  */
 void
-write_scan_header(compress_io *cio) {
-    write_dht(cio);
+write_scan_header(compress_io *cio, UINT16 restart_interval, bool with_dht,
+                  bool arith) {
+    if (arith)
+        write_dac(cio);
+    else if (with_dht)
+        write_dht(cio);
+    if (restart_interval)
+        write_dri(cio, restart_interval);
     write_sos(cio);
 }
 
+/*
+ * Write the header of the non-interleaved scan of one component, comp 0
+ * for Y, 1 for Cb and 2 for Cr: before the first scan DHT and optional
+ * DRI, then the SOS of comp alone.
+ */
+void
+write_component_scan_header(compress_io *cio, int comp, UINT16 restart_interval,
+                            bool with_dht) {
+    if (comp == 0) {
+        if (with_dht)
+            write_dht(cio);
+        if (restart_interval)
+            write_dri(cio, restart_interval);
+    }
+    write_marker(cio, M_SOS);
+    write_word(cio, 2 + 1 + 2 + 3); /* length */
+    write_byte(cio, 1);
+    // 颜色ID是comp+1；Y用0号哈夫曼表，Cb和Cr用1号
+    write_byte(cio, (UINT8) (comp + 1));
+    write_byte(cio, comp ? 0x11 : 0x00);
+    write_byte(cio, 0);       /* Ss */
+    write_byte(cio, 0x3F);    /* Se */
+    write_byte(cio, 0);       /* Bf */
+}
+
+/*
+ * Write a tables-only datastream: SOI, DQT, DHT, EOI.
+ * The abbreviated images written with the same tables rely on it.
+ */
+void
+write_tables_only(compress_io *cio, const quant_tables *tbl) {
+    write_marker(cio, M_SOI);
+    write_dqt(cio, tbl);
+    write_dht(cio);
+    write_marker(cio, M_EOI);
+}
+
 /*
  * Write datastream trailer.
  */
@@ -233,3 +312,87 @@ write_file_trailer(compress_io *cio) {
     write_marker(cio, M_EOI);
 }
 
+
+
+/*
+ * Merge the DQT and DHT segments of a tables-only datastream into an
+ * abbreviated image: the DQTs go before the SOF and the DHTs right after
+ * it, where a full image written here has them, so the result is the same
+ * bytes.  Returns a malloc'd datastream, or NULL when either input is not
+ * a JPEG datastream.
+ */
+
+/* length of the marker segment at p (marker included), 0 if it overruns */
+static size_t
+segment_len(const UINT8 *p, const UINT8 *end) {
+    size_t len;
+    if (end - p < 4 || p[0] != 0xFF)
+        return 0;
+    len = 2 + ((size_t) p[2] << 8 | p[3]);
+    return len <= (size_t) (end - p) ? len : 0;
+}
+
+static bool
+is_sof(UINT8 marker) {
+    return marker >= M_SOF0 && marker <= M_SOF15 &&
+           marker != M_DHT && marker != M_JPG && marker != M_DAC;
+}
+
+UINT8 *
+merge_tables(const UINT8 *tables, size_t tables_len,
+             const UINT8 *image, size_t image_len, size_t *out_len) {
+    const UINT8 *tend = tables + tables_len, *iend = image + image_len;
+    const UINT8 *p, *sof = NULL;
+    size_t dqt = 0, dht = 0, len;
+    UINT8 *out, *o;
+
+    if (tables_len < 4 || tables[0] != 0xFF || tables[1] != M_SOI ||
+        image_len < 4 || image[0] != 0xFF || image[1] != M_SOI)
+        return NULL;
+    for (p = tables + 2; p < tend && !(p[0] == 0xFF && p + 1 < tend && p[1] == M_EOI); p += len) {
+        if (!(len = segment_len(p, tend)))
+            return NULL;
+        if (p[1] == M_DQT)
+            dqt += len;
+        else if (p[1] == M_DHT)
+            dht += len;
+    }
+    for (p = image + 2; p < iend; p += len) {
+        if (!(len = segment_len(p, iend)) || p[1] == M_SOS)
+            return NULL;
+        if (is_sof(p[1])) {
+            sof = p;
+            break;
+        }
+    }
+    if (!sof)
+        return NULL;
+
+    out = (UINT8 *) malloc(image_len + dqt + dht);
+    if (!out)
+        return NULL;
+    o = out;
+    memcpy(o, image, sof - image);
+    o += sof - image;
+    for (p = tables + 2; p < tend && p[1] != M_EOI; p += len) {
+        len = segment_len(p, tend);
+        if (p[1] == M_DQT) {
+            memcpy(o, p, len);
+            o += len;
+        }
+    }
+    memcpy(o, sof, segment_len(sof, iend));
+    o += segment_len(sof, iend);
+    for (p = tables + 2; p < tend && p[1] != M_EOI; p += len) {
+        len = segment_len(p, tend);
+        if (p[1] == M_DHT) {
+            memcpy(o, p, len);
+            o += len;
+        }
+    }
+    p = sof + segment_len(sof, iend);
+    memcpy(o, p, iend - p);
+    o += iend - p;
+    *out_len = o - out;
+    return out;
+}
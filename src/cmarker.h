@@ -11,12 +11,28 @@ void
 write_file_header(compress_io *cio);
 
 void
-write_frame_header(compress_io *cio, bmp_info *binfo);
+write_frame_header(compress_io *cio, bmp_info *binfo,
+                   const quant_tables *tbl, bool arith);
 
 void
-write_scan_header(compress_io *cio);
+write_scan_header(compress_io *cio, UINT16 restart_interval, bool with_dht,
+                  bool arith);
+
+void
+write_component_scan_header(compress_io *cio, int comp, UINT16 restart_interval,
+                            bool with_dht);
+
+void
+write_tables_only(compress_io *cio, const quant_tables *tbl);
+
+void
+write_dri(compress_io *cio, UINT16 restart_interval);
 
 void
 write_file_trailer(compress_io *cio);
 
+UINT8 *
+merge_tables(const UINT8 *tables, size_t tables_len,
+             const UINT8 *image, size_t image_len, size_t *out_len);
+
 #endif //BMP2JPEG_CODE_CMARKER_H
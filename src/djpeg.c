@@ -0,0 +1,766 @@
+/**
+ * @file djpeg.c
+ * @brief minimal baseline JPEG decoder, used to check the encoder output.
+ *
+ * Supports what a baseline encoder may emit: 8 bit sequential huffman
+ * frames with 1..4 components, any sampling factors, interleaved and
+ * non-interleaved scans and restart intervals.  Also sequential arithmetic
+ * coded frames (SOF9, with DAC), decoded with the probability states of
+ * jarith.h.  Speed is not a goal, the inverse DCT is a straight floating
+ * point matrix product.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "djpeg.h"
+#include "jarith.h"
+
+#define MAX_COMP    4
+
+#ifndef M_PI
+#define M_PI        3.14159265358979323846
+#endif
+
+typedef struct {
+    bool present;
+    UINT8 vals[256];
+    INT32 mincode[17];
+    INT32 maxcode[17];  /* -1 if no codes of this length */
+    int valptr[17];
+} dhuff_table;
+
+typedef struct {
+    int id;
+    int h, v;           /* sampling factors */
+    int tq;             /* quant table No. */
+    int td, ta;         /* huffman tables of the current scan */
+    int bw, bh;         /* blocks per row / column, padded to whole MCUs */
+    int dc_pred;
+    int dc_context;     /* arithmetic coding: conditioning of the next DC */
+    INT16 *coef;        /* bw * bh blocks, natural order, dequantized */
+} dcomp;
+
+typedef struct {
+    const UINT8 *pos;
+    const UINT8 *end;
+    UINT32 bit_buf;
+    int bit_cnt;
+    bool hit_marker;
+
+    UINT16 qt[4][DCTSIZE2];     /* zigzag order */
+    dhuff_table dc[4];
+    dhuff_table ac[4];
+
+    int width, height;
+    int ncomp;
+    int hmax, vmax;
+    int mcux, mcuy;             /* MCUs per row / column */
+    dcomp comp[MAX_COMP];
+    int restart_interval;
+    bool frame_seen;
+
+    /* SOF9: the DAC conditioning and the decoder, section D.2 */
+    bool arith;
+    UINT8 dc_L[4], dc_U[4], ac_K[4];
+    INT32 ac_c;
+    INT32 ac_a;
+    int ac_ct;
+    UINT8 dc_stats[4][ARITH_DC_BINS];
+    UINT8 ac_stats[4][ARITH_AC_BINS];
+    UINT8 fixed_bin;
+} djpeg_state;
+
+static int unzigzag[DCTSIZE2];  /* zigzag position -> natural order */
+static float idct_tbl[DCTSIZE][DCTSIZE];
+
+
+static void
+init_decoder_tables() {
+    int i, x, u;
+    for (i = 0; i < DCTSIZE2; i++)
+        unzigzag[ZIGZAG[i]] = i;
+    for (x = 0; x < DCTSIZE; x++)
+        for (u = 0; u < DCTSIZE; u++)
+            idct_tbl[x][u] = (float) ((u == 0 ? sqrt(0.5) : 1.0) / 2.0 *
+                                      cos((2 * x + 1) * u * M_PI / 16.0));
+}
+
+
+/*
+ * marker segment parsing.
+ */
+
+static int
+get_word(const UINT8 *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static const char *
+read_dqt(djpeg_state *st, const UINT8 *p, int len) {
+    while (len > 0) {
+        int pq = p[0] >> 4, tq = p[0] & 0x0F;
+        int i, n = pq ? 1 + 2 * DCTSIZE2 : 1 + DCTSIZE2;
+        if (tq > 3 || len < n)
+            return "bad DQT";
+        for (i = 0; i < DCTSIZE2; i++)
+            st->qt[tq][i] = pq ? get_word(p + 1 + 2 * i) : p[1 + i];
+        p += n;
+        len -= n;
+    }
+    return NULL;
+}
+
+static const char *
+read_dht(djpeg_state *st, const UINT8 *p, int len) {
+    while (len > 17) {
+        int tc = p[0] >> 4, th = p[0] & 0x0F;
+        int i, l, total = 0, code = 0;
+        dhuff_table *tbl;
+        if (tc > 1 || th > 3)
+            return "bad DHT";
+        tbl = tc ? &st->ac[th] : &st->dc[th];
+        for (l = 1; l <= 16; l++)
+            total += p[l];
+        if (total > 256 || len < 17 + total)
+            return "bad DHT";
+        memcpy(tbl->vals, p + 17, total);
+
+        /* canonical codes, as in set_huff_table() of the encoder */
+        for (l = 1, i = 0; l <= 16; l++) {
+            tbl->valptr[l] = i;
+            tbl->mincode[l] = code;
+            code += p[l];
+            i += p[l];
+            tbl->maxcode[l] = p[l] ? code - 1 : -1;
+            code <<= 1;
+        }
+        tbl->present = true;
+        p += 17 + total;
+        len -= 17 + total;
+    }
+    return len == 0 ? NULL : "bad DHT";
+}
+
+static const char *
+read_dac(djpeg_state *st, const UINT8 *p, int len) {
+    for (; len >= 2; p += 2, len -= 2) {
+        int tc = p[0] >> 4, tb = p[0] & 0x0F;
+        if (tc > 1 || tb > 3)
+            return "bad DAC";
+        if (tc) {
+            if (p[1] < 1 || p[1] > 63)
+                return "bad DAC";
+            st->ac_K[tb] = p[1];
+        } else {
+            if ((p[1] & 0x0F) > p[1] >> 4)
+                return "bad DAC";
+            st->dc_L[tb] = p[1] & 0x0F;
+            st->dc_U[tb] = p[1] >> 4;
+        }
+    }
+    return len == 0 ? NULL : "bad DAC";
+}
+
+static const char *
+read_sof(djpeg_state *st, const UINT8 *p, int len) {
+    int i;
+    if (len < 6 || p[0] != 8)
+        return "only 8 bit precision is supported";
+    st->height = get_word(p + 1);
+    st->width = get_word(p + 3);
+    st->ncomp = p[5];
+    if (st->width == 0 || st->height == 0)
+        return "bad image size";
+    if (st->ncomp < 1 || st->ncomp > MAX_COMP || len < 6 + 3 * st->ncomp)
+        return "bad SOF";
+
+    st->hmax = st->vmax = 1;
+    for (i = 0; i < st->ncomp; i++) {
+        dcomp *c = &st->comp[i];
+        c->id = p[6 + 3 * i];
+        c->h = p[7 + 3 * i] >> 4;
+        c->v = p[7 + 3 * i] & 0x0F;
+        c->tq = p[8 + 3 * i] & 0x03;
+        if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4)
+            return "bad sampling factor";
+        if (c->h > st->hmax)
+            st->hmax = c->h;
+        if (c->v > st->vmax)
+            st->vmax = c->v;
+    }
+    st->mcux = (st->width + DCTSIZE * st->hmax - 1) / (DCTSIZE * st->hmax);
+    st->mcuy = (st->height + DCTSIZE * st->vmax - 1) / (DCTSIZE * st->vmax);
+    for (i = 0; i < st->ncomp; i++) {
+        dcomp *c = &st->comp[i];
+        c->bw = st->mcux * c->h;
+        c->bh = st->mcuy * c->v;
+        c->coef = (INT16 *) calloc((size_t) c->bw * c->bh * DCTSIZE2,
+                                   sizeof(INT16));
+        if (!c->coef)
+            return "out of memory";
+    }
+    st->frame_seen = true;
+    return NULL;
+}
+
+
+/*
+ * entropy decoding.
+ */
+
+static int
+get_bit(djpeg_state *st) {
+    if (st->bit_cnt == 0) {
+        UINT8 b = 0;
+        if (!st->hit_marker && st->pos < st->end) {
+            b = *st->pos;
+            if (b == 0xFF) {
+                if (st->pos + 1 < st->end && st->pos[1] == 0x00)
+                    st->pos += 2;
+                else {
+                    /* a marker ends the entropy coded segment, feed zeros */
+                    st->hit_marker = true;
+                    b = 0;
+                }
+            } else
+                st->pos++;
+        }
+        st->bit_buf = b;
+        st->bit_cnt = 8;
+    }
+    st->bit_cnt--;
+    return (st->bit_buf >> st->bit_cnt) & 1;
+}
+
+static int
+receive_extend(djpeg_state *st, int s) {
+    int v = 0, i;
+    for (i = 0; i < s; i++)
+        v = (v << 1) | get_bit(st);
+    if (s > 0 && v < (1 << (s - 1)))
+        v -= (1 << s) - 1;
+    return v;
+}
+
+static int
+huff_decode(djpeg_state *st, const dhuff_table *tbl) {
+    INT32 code = 0;
+    int l;
+    for (l = 1; l <= 16; l++) {
+        code = (code << 1) | get_bit(st);
+        if (code <= tbl->maxcode[l])
+            return tbl->vals[tbl->valptr[l] + code - tbl->mincode[l]];
+    }
+    return -1;
+}
+
+static const char *
+decode_block(djpeg_state *st, dcomp *c, INT16 *blk) {
+    const UINT16 *qt = st->qt[c->tq];
+    int s, k, rs;
+
+    s = huff_decode(st, &st->dc[c->td]);
+    if (s < 0 || s > 11)
+        return "bad DC code";
+    c->dc_pred += receive_extend(st, s);
+    blk[0] = (INT16) (c->dc_pred * qt[0]);
+
+    for (k = 1; k < DCTSIZE2; k++) {
+        rs = huff_decode(st, &st->ac[c->ta]);
+        if (rs < 0)
+            return "bad AC code";
+        s = rs & 0x0F;
+        if (s == 0) {
+            if (rs != 0xF0)
+                break;          /* EOB */
+            k += 15;
+            continue;
+        }
+        k += rs >> 4;
+        if (k >= DCTSIZE2)
+            return "AC run past end of block";
+        blk[unzigzag[k]] = (INT16) (receive_extend(st, s) * qt[k]);
+    }
+    return NULL;
+}
+
+/* next byte of an arithmetic coded segment, 0s once a marker is reached */
+static int
+arith_byte(djpeg_state *st) {
+    int b;
+    if (st->hit_marker || st->pos >= st->end)
+        return 0;
+    b = *st->pos;
+    if (b == 0xFF) {
+        if (st->pos + 1 < st->end && st->pos[1] == 0x00) {
+            st->pos += 2;
+            return 0xFF;
+        }
+        st->hit_marker = true;
+        return 0;
+    }
+    st->pos++;
+    return b;
+}
+
+/* start of a scan or a restart interval: statistics and decoder afresh */
+static void
+arith_start(djpeg_state *st, dcomp **scomp, int ns) {
+    int i;
+    memset(st->dc_stats, 0, sizeof(st->dc_stats));
+    memset(st->ac_stats, 0, sizeof(st->ac_stats));
+    st->fixed_bin = 113;
+    for (i = 0; i < ns; i++)
+        scomp[i]->dc_context = 0;
+    st->ac_c = 0;
+    st->ac_a = 0;
+    st->ac_ct = -16;            /* the first two bytes fill c */
+}
+
+/* the decision in the bin sb, sections D.2.4 to D.2.6 */
+static int
+arith_decode(djpeg_state *st, UINT8 *sb) {
+    int sv = *sb;
+    INT32 qe, temp;
+    UINT8 nl, nm;
+
+    while (st->ac_a < 0x8000L) {
+        if (--st->ac_ct < 0) {
+            st->ac_c = (st->ac_c << 8) | arith_byte(st);
+            if ((st->ac_ct += 8) < 0 && ++st->ac_ct == 0)
+                st->ac_a = 0x8000L;     /* 0x10000 after the shift below */
+        }
+        st->ac_a <<= 1;
+    }
+
+    qe = (INT32) arith_qe[sv & 0x7F];
+    nl = (UINT8) (qe & 0xFF);
+    nm = (UINT8) ((qe >> 8) & 0xFF);
+    qe >>= 16;
+
+    temp = st->ac_a - qe;
+    st->ac_a = temp;
+    temp <<= st->ac_ct;
+    if (st->ac_c >= temp) {
+        st->ac_c -= temp;
+        /* the LPS, or the MPS when its interval is the smaller one */
+        if (st->ac_a < qe)
+            *sb = (UINT8) ((sv & 0x80) ^ nm);
+        else {
+            *sb = (UINT8) ((sv & 0x80) ^ nl);
+            sv ^= 0x80;
+        }
+        st->ac_a = qe;
+    } else if (st->ac_a < 0x8000L) {
+        if (st->ac_a < qe) {
+            *sb = (UINT8) ((sv & 0x80) ^ nl);
+            sv ^= 0x80;
+        } else
+            *sb = (UINT8) ((sv & 0x80) ^ nm);
+    }
+    return sv >> 7;
+}
+
+/* figures F.23 and F.24: the magnitude from bin x on, bits from x + 14 */
+static int
+arith_magnitude(djpeg_state *st, UINT8 *x, int m) {
+    int v;
+    while (arith_decode(st, x)) {
+        if ((m <<= 1) == 0x8000)
+            return -1;
+        x++;
+    }
+    v = m;
+    x += 14;
+    while (m >>= 1)
+        if (arith_decode(st, x))
+            v |= m;
+    return v;
+}
+
+/* a block of an arithmetic coded scan, sections F.2.4.1 and F.2.4.2 */
+static const char *
+decode_arith_block(djpeg_state *st, dcomp *c, INT16 *blk) {
+    const UINT16 *qt = st->qt[c->tq];
+    UINT8 *sb = st->dc_stats[c->td] + c->dc_context;
+    int k, v, sign;
+
+    if (arith_decode(st, sb) == 0)
+        c->dc_context = 0;
+    else {
+        sign = arith_decode(st, sb + 1);
+        sb += 2 + sign;
+        v = 0;
+        if (arith_decode(st, sb)) {
+            v = arith_magnitude(st, st->dc_stats[c->td] + 20, 1);
+            if (v < 0)
+                return "bad arithmetic DC code";
+        }
+        /* the top bit of v is its category */
+        k = v;
+        while (k & (k - 1))
+            k &= k - 1;
+        if (k < (1 << st->dc_L[c->td]) >> 1)
+            c->dc_context = 0;
+        else if (k > (1 << st->dc_U[c->td]) >> 1)
+            c->dc_context = 12 + sign * 4;
+        else
+            c->dc_context = 4 + sign * 4;
+        v += 1;
+        c->dc_pred += sign ? -v : v;
+    }
+    blk[0] = (INT16) (c->dc_pred * qt[0]);
+
+    for (k = 1; k < DCTSIZE2; k++) {
+        sb = st->ac_stats[c->ta] + 3 * (k - 1);
+        if (arith_decode(st, sb))
+            break;              /* EOB */
+        while (arith_decode(st, sb + 1) == 0) {
+            sb += 3;
+            if (++k >= DCTSIZE2)
+                return "AC run past end of block";
+        }
+        sign = arith_decode(st, &st->fixed_bin);
+        sb += 2;
+        /* the first two category decisions in sb, then X2 on */
+        v = 0;
+        if (arith_decode(st, sb)) {
+            v = 1;
+            if (arith_decode(st, sb))
+                v = arith_magnitude(st, st->ac_stats[c->ta] +
+                                        (k <= st->ac_K[c->ta] ? 189 : 217), 2);
+            if (v < 0)
+                return "bad arithmetic AC code";
+        }
+        v += 1;
+        blk[unzigzag[k]] = (INT16) ((sign ? -v : v) * qt[k]);
+    }
+    return NULL;
+}
+
+/* byte-align and consume the RSTn marker that must follow an interval */
+static const char *
+read_restart(djpeg_state *st, int *next_rst) {
+    st->bit_cnt = 0;
+    st->hit_marker = false;
+    /* the arithmetic decoder may stop short of the last bytes */
+    if (st->arith)
+        while (st->pos + 1 < st->end && !(st->pos[0] == 0xFF && st->pos[1] != 0x00))
+            st->pos += st->pos[0] == 0xFF ? 2 : 1;
+    while (st->pos + 1 < st->end && st->pos[0] == 0xFF && st->pos[1] == 0xFF)
+        st->pos++;
+    if (st->pos + 1 >= st->end || st->pos[0] != 0xFF ||
+        st->pos[1] != M_RST0 + *next_rst)
+        return "missing restart marker";
+    st->pos += 2;
+    *next_rst = (*next_rst + 1) & 7;
+    return NULL;
+}
+
+static const char *
+read_scan(djpeg_state *st, const UINT8 *p, int len) {
+    dcomp *scomp[MAX_COMP];
+    int ns, i, j, n, total, next_rst = 0;
+    const char *err;
+
+    if (!st->frame_seen)
+        return "SOS before SOF";
+    ns = p[0];
+    if (ns < 1 || ns > st->ncomp || len != 4 + 2 * ns)
+        return "bad SOS";
+    for (i = 0; i < ns; i++) {
+        scomp[i] = NULL;
+        for (j = 0; j < st->ncomp; j++)
+            if (st->comp[j].id == p[1 + 2 * i])
+                scomp[i] = &st->comp[j];
+        if (!scomp[i])
+            return "SOS names an unknown component";
+        scomp[i]->td = p[2 + 2 * i] >> 4;
+        scomp[i]->ta = p[2 + 2 * i] & 0x0F;
+        if (scomp[i]->td > 3 || scomp[i]->ta > 3)
+            return "bad SOS";
+        if (!st->arith &&
+            (!st->dc[scomp[i]->td].present || !st->ac[scomp[i]->ta].present))
+            return "scan uses an undefined huffman table";
+        scomp[i]->dc_pred = 0;
+    }
+    if (p[1 + 2 * ns] != 0 || p[2 + 2 * ns] != 63 || p[3 + 2 * ns] != 0)
+        return "progressive scans are not supported";
+
+    st->bit_cnt = 0;
+    st->hit_marker = false;
+    if (st->arith)
+        arith_start(st, scomp, ns);
+
+    if (ns == 1) {
+        /* non-interleaved: one block per MCU over the component's own size */
+        dcomp *c = scomp[0];
+        int cw = (st->width * c->h + st->hmax - 1) / st->hmax;
+        int ch = (st->height * c->v + st->vmax - 1) / st->vmax;
+        int bx, by, nbx = (cw + DCTSIZE - 1) / DCTSIZE;
+        int nby = (ch + DCTSIZE - 1) / DCTSIZE;
+        total = nbx * nby;
+        for (n = 0; n < total; n++) {
+            if (st->restart_interval && n > 0 &&
+                n % st->restart_interval == 0) {
+                if ((err = read_restart(st, &next_rst)) != NULL)
+                    return err;
+                c->dc_pred = 0;
+                if (st->arith)
+                    arith_start(st, scomp, ns);
+            }
+            by = n / nbx;
+            bx = n % nbx;
+            err = (st->arith ? decode_arith_block : decode_block)(
+                    st, c, c->coef + ((size_t) by * c->bw + bx) * DCTSIZE2);
+            if (err)
+                return err;
+        }
+    } else {
+        int mx, my, bx, by;
+        total = st->mcux * st->mcuy;
+        for (n = 0; n < total; n++) {
+            if (st->restart_interval && n > 0 &&
+                n % st->restart_interval == 0) {
+                if ((err = read_restart(st, &next_rst)) != NULL)
+                    return err;
+                for (i = 0; i < ns; i++)
+                    scomp[i]->dc_pred = 0;
+                if (st->arith)
+                    arith_start(st, scomp, ns);
+            }
+            my = n / st->mcux;
+            mx = n % st->mcux;
+            for (i = 0; i < ns; i++) {
+                dcomp *c = scomp[i];
+                for (by = 0; by < c->v; by++)
+                    for (bx = 0; bx < c->h; bx++) {
+                        size_t blk = (size_t) (my * c->v + by) * c->bw +
+                                     mx * c->h + bx;
+                        err = (st->arith ? decode_arith_block : decode_block)(
+                                st, c, c->coef + blk * DCTSIZE2);
+                        if (err)
+                            return err;
+                    }
+            }
+        }
+    }
+
+    /* leave pos at the marker following the entropy coded data */
+    while (st->pos + 1 < st->end &&
+           !(st->pos[0] == 0xFF && st->pos[1] != 0x00 &&
+             !(st->pos[1] >= M_RST0 && st->pos[1] <= M_RST7)))
+        st->pos++;
+    return NULL;
+}
+
+
+/*
+ * sample reconstruction.
+ */
+
+static void
+idct_block(const INT16 *coef, UINT8 *out, int stride) {
+    float tmp[DCTSIZE2];
+    int x, y, u;
+    for (y = 0; y < DCTSIZE; y++)           /* rows */
+        for (x = 0; x < DCTSIZE; x++) {
+            float s = 0;
+            for (u = 0; u < DCTSIZE; u++)
+                s += idct_tbl[x][u] * coef[y * DCTSIZE + u];
+            tmp[y * DCTSIZE + x] = s;
+        }
+    for (x = 0; x < DCTSIZE; x++)           /* columns */
+        for (y = 0; y < DCTSIZE; y++) {
+            float s = 128.0f;
+            int v;
+            for (u = 0; u < DCTSIZE; u++)
+                s += idct_tbl[y][u] * tmp[u * DCTSIZE + x];
+            v = (int) floorf(s + 0.5f);
+            out[y * stride + x] = (UINT8) (v < 0 ? 0 : v > 255 ? 255 : v);
+        }
+}
+
+static UINT8
+clamp_sample(float v) {
+    int i = (int) floorf(v + 0.5f);
+    return (UINT8) (i < 0 ? 0 : i > 255 ? 255 : i);
+}
+
+static const char *
+output_image(djpeg_state *st, decoded_image *img) {
+    UINT8 *plane[MAX_COMP];
+    int i, x, y, bx, by;
+    const char *err = NULL;
+
+    memset(plane, 0, sizeof(plane));
+    for (i = 0; i < st->ncomp; i++) {
+        dcomp *c = &st->comp[i];
+        int stride = c->bw * DCTSIZE;
+        plane[i] = (UINT8 *) malloc((size_t) stride * c->bh * DCTSIZE);
+        if (!plane[i]) {
+            err = "out of memory";
+            goto done;
+        }
+        for (by = 0; by < c->bh; by++)
+            for (bx = 0; bx < c->bw; bx++)
+                idct_block(c->coef + ((size_t) by * c->bw + bx) * DCTSIZE2,
+                           plane[i] + (size_t) by * DCTSIZE * stride +
+                           bx * DCTSIZE, stride);
+    }
+
+    img->width = st->width;
+    img->height = st->height;
+    img->ncomp = st->ncomp == 1 ? 1 : 3;
+    img->pixels = (UINT8 *) malloc((size_t) img->width * img->height *
+                                   img->ncomp);
+    if (!img->pixels) {
+        err = "out of memory";
+        goto done;
+    }
+
+    for (y = 0; y < st->height; y++)
+        for (x = 0; x < st->width; x++) {
+            float s[MAX_COMP];
+            UINT8 *dst = img->pixels + ((size_t) y * img->width + x) *
+                                       img->ncomp;
+            for (i = 0; i < st->ncomp; i++) {
+                dcomp *c = &st->comp[i];
+                int sx = x * c->h / st->hmax, sy = y * c->v / st->vmax;
+                s[i] = plane[i][(size_t) sy * c->bw * DCTSIZE + sx];
+            }
+            if (img->ncomp == 1)
+                dst[0] = (UINT8) s[0];
+            else {
+                float cb = s[1] - 128.0f, cr = s[2] - 128.0f;
+                dst[0] = clamp_sample(s[0] + 1.402f * cr);
+                dst[1] = clamp_sample(s[0] - 0.344136f * cb - 0.714136f * cr);
+                dst[2] = clamp_sample(s[0] + 1.772f * cb);
+            }
+        }
+
+done:
+    for (i = 0; i < st->ncomp; i++)
+        free(plane[i]);
+    return err;
+}
+
+
+const char *
+jpeg_decode(const UINT8 *data, size_t len, decoded_image *img) {
+    djpeg_state st;
+    const char *err = NULL;
+    bool done = 0, scanned = 0;
+    int i;
+
+    if (!unzigzag[1])
+        init_decoder_tables();
+    memset(&st, 0, sizeof(st));
+    memset(img, 0, sizeof(*img));
+    st.pos = data;
+    st.end = data + len;
+    for (i = 0; i < 4; i++) {
+        st.dc_U[i] = ARITH_DC_U;        /* the defaults, without a DAC */
+        st.dc_L[i] = ARITH_DC_L;
+        st.ac_K[i] = ARITH_AC_K;
+    }
+
+    if (len < 4 || data[0] != 0xFF || data[1] != M_SOI)
+        return "not a JPEG stream";
+    st.pos += 2;
+
+    while (!done && !err) {
+        int marker, seglen;
+        if (st.pos + 2 > st.end) {
+            err = "unexpected end of stream";
+            break;
+        }
+        if (st.pos[0] != 0xFF) {
+            err = "marker expected";
+            break;
+        }
+        marker = st.pos[1];
+        st.pos += 2;
+        if (marker == 0xFF) {           /* fill byte */
+            st.pos--;
+            continue;
+        }
+        if (marker == M_EOI) {
+            done = true;
+            break;
+        }
+        if (st.pos + 2 > st.end || (seglen = get_word(st.pos)) < 2 ||
+            st.pos + seglen > st.end) {
+            err = "truncated marker segment";
+            break;
+        }
+
+        switch (marker) {
+            case M_SOF0:
+            case M_SOF1:
+            case M_SOF9:
+                if (st.frame_seen)
+                    err = "more than one frame";
+                else {
+                    st.arith = marker == M_SOF9;
+                    err = read_sof(&st, st.pos + 2, seglen - 2);
+                }
+                break;
+            case M_SOF2:
+            case M_SOF3:
+            case M_SOF5:
+            case M_SOF6:
+            case M_SOF7:
+            case M_SOF10:
+            case M_SOF11:
+            case M_SOF13:
+            case M_SOF14:
+            case M_SOF15:
+                err = "only sequential huffman or arithmetic JPEG is supported";
+                break;
+            case M_DQT:
+                err = read_dqt(&st, st.pos + 2, seglen - 2);
+                break;
+            case M_DHT:
+                err = read_dht(&st, st.pos + 2, seglen - 2);
+                break;
+            case M_DAC:
+                err = read_dac(&st, st.pos + 2, seglen - 2);
+                break;
+            case M_DRI:
+                if (seglen != 4)
+                    err = "bad DRI";
+                else
+                    st.restart_interval = get_word(st.pos + 2);
+                break;
+            case M_SOS: {
+                const UINT8 *hdr = st.pos + 2;
+                st.pos += seglen;
+                err = read_scan(&st, hdr, seglen - 2);
+                scanned = true;
+                continue;
+            }
+            default:                    /* APPn, COM, ... */
+                break;
+        }
+        st.pos += seglen;
+    }
+
+    if (!err && !done)
+        err = "missing EOI";
+    if (!err && !scanned)
+        err = "no scan in stream";
+    if (!err)
+        err = output_image(&st, img);
+    for (i = 0; i < st.ncomp; i++)
+        free(st.comp[i].coef);
+    if (err)
+        free_decoded_image(img);
+    return err;
+}
+
+void
+free_decoded_image(decoded_image *img) {
+    free(img->pixels);
+    img->pixels = NULL;
+}
@@ -0,0 +1,28 @@
+/**
+ * @file djpeg.h
+ * @brief minimal baseline JPEG decoder, used to check the encoder output.
+ */
+
+#ifndef __DJPEG_H
+#define __DJPEG_H
+
+#include "cjpeg.h"
+
+/* decoded image, pixels are top-down RGB (or gray when ncomp == 1) */
+typedef struct {
+    int width;
+    int height;
+    int ncomp;
+    UINT8 *pixels;
+} decoded_image;
+
+/*
+ * decode a baseline (SOF0/SOF1) huffman or a sequential arithmetic (SOF9)
+ * coded JPEG held in memory.
+ * returns NULL on success, or a static message describing the error.
+ */
+const char *jpeg_decode(const UINT8 *data, size_t len, decoded_image *img);
+
+void free_decoded_image(decoded_image *img);
+
+#endif /* __DJPEG_H */
@@ -35,6 +35,7 @@
 
 #include "cjpeg.h"
 #include "fdctflt.h"
+#include "jsimd.h"
 
 /*
  * Perform the forward DCT on one block of samples.
@@ -152,3 +153,13 @@ jpeg_fdct(float *data) {
     }
 }
 
+
+/*
+ * the three blocks of a MCU.
+ */
+void
+jpeg_fdct_unit(ycbcr_unit *ycc_unit) {
+    jpeg_fdct(ycc_unit->y);
+    jpeg_fdct(ycc_unit->cb);
+    jpeg_fdct(ycc_unit->cr);
+}
@@ -4,101 +4,402 @@
 #include "huajuan_bmp.h"
 #include "string.h"
 
-void read_bmp_data(compress_io *cio,
-                   bmp_info *bmpInfo,
-                   struct bmp_complemented *bmpComplemented) {
-    // 设置文件指针到像素开始的位置
-    fseek(cio->in->fp, bmpInfo->offset, SEEK_SET);
+/* 出错的时候先释放内存，调用者可能会拦截错误继续运行（比如服务模式） */
+static void bmp_read_failed(struct bmp_complemented *bmpC) {
+    free_bmp_data(bmpC);
+    err_exit(BUFFER_READ_ERR);
+}
 
-    // 设置bmp_complemented的width和height
-    bmpComplemented->realWidth = bmpInfo->width;
-    bmpComplemented->realHeight = bmpInfo->height;
+/* 跳到文件中的第at个字节，大图像的位置可能超过long的范围 */
+static int seek_to(FILE *fp, long long at) {
+#ifdef _WIN32
+    return _fseeki64(fp, at, SEEK_SET);
+#else
+    return fseeko(fp, (off_t) at, SEEK_SET);
+#endif
+}
+
+/* 读取n个字节扔掉，这样输入也可以是管道 */
+static void skip_bytes(struct bmp_complemented *bmpC, size_t n) {
+    mem_mgr *in = bmpC->cio->in;
+    while (n > 0) {
+        size_t len = (size_t) (in->end - in->set) < n ? (size_t) (in->end - in->set) : n;
+        if (fread(in->set, sizeof(UINT8), len, in->fp) != len)
+            bmp_read_failed(bmpC);
+        n -= len;
+    }
+}
+
+/* 确定要编码的区域（超出图像的部分去掉），算出补齐以后的大小，分配band */
+static void set_region(struct bmp_complemented *bmpC, UINT32 width, UINT32 height,
+                       const encode_options *opts) {
+    // 要编码的区域，超出图像的部分去掉
+    UINT32 x = 0, y = 0, w = width, h = height;
+    if (opts->crop_w) {
+        if (opts->crop_x >= w || opts->crop_y >= h || opts->crop_h == 0)
+            err_exit(CROP_ERR);
+        x = opts->crop_x;
+        y = opts->crop_y;
+        w = opts->crop_w < w - x ? opts->crop_w : w - x;
+        h = opts->crop_h < h - y ? opts->crop_h : h - y;
+    }
+    // 分段编码的时候只要其中几行MCU，区域再往下缩，段以外的行和裁剪掉的一样不读
+    bmpC->frameHeight = h;
+    if (opts->seg_rows && opts->orient)
+        err_exit(ORIENT_ERR);
+    if (opts->seg_rows) {
+        UINT32 mcuRows = (h + MCUSIZE - 1) / MCUSIZE;
+        if (opts->seg_first >= mcuRows)
+            err_exit(SEGMENT_ERR);
+        y += opts->seg_first * MCUSIZE;
+        h -= opts->seg_first * MCUSIZE;
+        if (opts->seg_rows < mcuRows - opts->seg_first)
+            h = opts->seg_rows * MCUSIZE;
+    }
+    bmpC->cropX = x;
+    bmpC->cropY = y;
+
+    // 设置bmp_complemented的width和height，转置以后输出图像的宽和高是区域的高和宽
+    bmpC->orient = opts->orient;
+    bmpC->regionWidth = w;
+    bmpC->regionHeight = h;
+    bmpC->realWidth = opts->orient & ORIENT_TRANSPOSE ? h : w;
+    bmpC->realHeight = opts->orient & ORIENT_TRANSPOSE ? w : h;
 
     // 补齐到8的倍数的长度和宽度
-    UINT32 complementedWidth = (bmpComplemented->realWidth + (DCTSIZE - 1)) / DCTSIZE * DCTSIZE;
-    UINT32 complementedHeight = (bmpComplemented->realHeight + (DCTSIZE - 1)) / DCTSIZE * DCTSIZE;
-    bmpComplemented->complementedWidth = complementedWidth;
-    bmpComplemented->complementedHeight = complementedHeight;
-
-    // 因为还没有迭代过mcu，所以i和j都是0
-    bmpComplemented->i = 0;
-    bmpComplemented->j = 0;
-
-    // 把bmpComplement.rgbData 开成 complementedWidth * complementedHeight的数组
-    bmpComplemented->data = malloc((complementedHeight * complementedWidth) * sizeof(struct rgb_unit));
-
-    // 从cio中按行读取数据，不过bmp中原始数据流的数据，是从下至上，从左至右的。即第一个读取到的行是最后一行。。。。。。
-    for (int i = (int) bmpComplemented->realHeight - 1; i >= 0; i--) {
-        if (!cio->in->flush_buffer(cio)) {
-            err_exit(BUFFER_READ_ERR);
-        }
-        for (int j = 0; j < bmpComplemented->realWidth; j++) {
-            // bmp 里面，颜色数据是按照BGR的顺序存储的
-            int x = i * (int) complementedWidth + j;
-            bmpComplemented->data[x].b = *(cio->in->pos);
-            bmpComplemented->data[x].g = *(cio->in->pos + 1);
-            bmpComplemented->data[x].r = *(cio->in->pos + 2);
-            cio->in->pos += 3;
+    UINT32 complementedWidth = (bmpC->realWidth + (DCTSIZE - 1)) / DCTSIZE * DCTSIZE;
+    UINT32 complementedHeight = (bmpC->realHeight + (DCTSIZE - 1)) / DCTSIZE * DCTSIZE;
+    bmpC->complementedWidth = complementedWidth;
+    bmpC->complementedHeight = complementedHeight;
+
+    // 因为还没有读过band，所以i是0
+    bmpC->i = 0;
+
+    // band的每个通道各占 stride * MCUSIZE 个字节，stride向上对齐到64，每个通道都从cache line开始
+    // 一行MCU一共是 3 * 8 * width 个字节，宽度在一万以内的图都能放进L2
+    bmpC->band.stride = (complementedWidth + 63) / 64 * 64;
+    for (int c = 0; c < COMP_NUM; c++) {
+        bmpC->band.plane[c] = aligned_malloc((size_t) bmpC->band.stride * MCUSIZE);
+        if (!bmpC->band.plane[c]) {
+            free_bmp_data(bmpC);
+            err_exit(BUFFER_ALLOC_ERR);
         }
     }
 }
 
-void free_bmp_data(struct bmp_complemented *bmpComplemented) {
-    free(bmpComplemented->data);
+/* 要不要先把整个区域读进frame：转置的时候，和不能倒着读band的上下翻转 */
+static bool needs_frame(const struct bmp_complemented *bmpC) {
+    return (bmpC->orient & ORIENT_TRANSPOSE) ||
+           ((bmpC->orient & ORIENT_FLIP_Y) && !bmpC->seekable);
 }
 
-void next_mcu(struct bmp_complemented *bmpC, struct mcu *mcu) {
-    // 判断还有没有mcu可以读取
-    bool hasMcu = (0 <= bmpC->i && bmpC->i < bmpC->complementedHeight / MCUSIZE)
-                  && (0 <= bmpC->j && bmpC->j < bmpC->complementedWidth / MCUSIZE);
-    if (!hasMcu) {
-        // 把mcu的data设成null，来表示没有mcu可以读取了
-        mcu->rgbData = NULL;
+/*
+ * 把整个区域读进frame的三个平面。bmp的行按文件里的顺序读（能fseek的话先跳到区域的
+ * 第一行，不能的话读掉前面的行），src的行从上往下拉
+ */
+static void load_region(struct bmp_complemented *bmpC) {
+    UINT32 w = bmpC->regionWidth, h = bmpC->regionHeight;
+    for (int c = 0; c < COMP_NUM; c++) {
+        bmpC->frame[c] = malloc((size_t) w * h);
+        if (!bmpC->frame[c]) {
+            free_bmp_data(bmpC);
+            err_exit(BUFFER_ALLOC_ERR);
+        }
+    }
+
+    if (bmpC->src) {
+        for (UINT32 y = 0; y < h; y++) {
+            UINT8 *plane[COMP_NUM];
+            for (int c = 0; c < COMP_NUM; c++)
+                plane[c] = bmpC->frame[c] + (size_t) y * w;
+            if (!bmpC->src->pull_row(bmpC->src, bmpC->cropX, w, plane))
+                bmp_read_failed(bmpC);
+        }
         return;
     }
 
-    // 3：RGB的通道数
-    mcu->rgbData = malloc(sizeof(UINT8) * 3 * MCUSIZE * MCUSIZE);
+    // 区域在文件里的第一行：从上往下存储的是第cropY行，从下往上存储的是区域的最后一行
+    UINT32 first = bmpC->topdown ? bmpC->cropY : bmpC->srcHeight - bmpC->cropY - h;
+    FILE *fp = bmpC->cio->in->fp;
+    UINT8 *row = bmpC->cio->in->set;
+    if (bmpC->seekable) {
+        if (seek_to(fp, bmpC->dataStart + (long long) first * bmpC->rowStride) != 0)
+            bmp_read_failed(bmpC);
+    } else
+        skip_bytes(bmpC, (size_t) first * bmpC->rowStride);
+    for (UINT32 f = 0; f < h; f++) {
+        UINT32 y = bmpC->topdown ? f : h - 1 - f;
+        if (fread(row, sizeof(UINT8), bmpC->rowStride, fp) != bmpC->rowStride)
+            bmp_read_failed(bmpC);
+        const UINT8 *p = row + (size_t) bmpC->cropX * 3;
+        UINT8 *r = bmpC->frame[0] + (size_t) y * w;
+        UINT8 *g = bmpC->frame[1] + (size_t) y * w;
+        UINT8 *b = bmpC->frame[2] + (size_t) y * w;
+        for (UINT32 x = 0; x < w; x++, p += 3) {
+            b[x] = p[0];
+            g[x] = p[1];
+            r[x] = p[2];
+        }
+    }
+}
+
+void read_bmp_data(compress_io *cio,
+                   bmp_info *bmpInfo,
+                   const encode_options *opts,
+                   struct bmp_complemented *bmpComplemented) {
+    memset(bmpComplemented, 0, sizeof(*bmpComplemented));
+    bmpComplemented->cio = cio;
+    bmpComplemented->topdown = bmpInfo->topdown;
+    bmpComplemented->rowStride = (bmpInfo->width * 3 + 3) / 4 * 4;
+    bmpComplemented->srcHeight = bmpInfo->height;
 
-    // 读取mcu，即以(i*8, j*8) 为左上角的，8*8的方块
-    // dx，dy：偏移
-    for (int dx = 0; dx < MCUSIZE; ++dx) {
-        for (int dy = 0; dy < MCUSIZE; ++dy) {
-            // 实际的像素位置
-            int x = bmpC->i * MCUSIZE + dx;
-            int y = bmpC->j * MCUSIZE + dy;
-            // 实际的像素位置（一维）
-            int t = x * bmpC->complementedWidth + y;
+    // 跳到像素开始的位置。read_bmp已经读了BMP_HEAD_LEN个字节
+    skip_bytes(bmpComplemented, bmpInfo->offset - BMP_HEAD_LEN);
 
-            // 像素的rgb数据
-            UINT8 b = bmpC->data[t].b;
-            UINT8 g = bmpC->data[t].g;
-            UINT8 r = bmpC->data[t].r;
+    set_region(bmpComplemented, bmpInfo->width, bmpInfo->height, opts);
+    UINT32 x = bmpComplemented->cropX, y = bmpComplemented->cropY;
+    UINT32 w = bmpComplemented->realWidth, h = bmpComplemented->realHeight;
 
-            // 将(dx,dy)转换成1维数组的下标
-            t = dx * MCUSIZE + dy;
+    // 能fseek的话，每个band要用到的行直接跳过去读，其它的行不用读
+    long pos = ftell(cio->in->fp);
+    if (pos >= 0 && fseek(cio->in->fp, pos, SEEK_SET) == 0) {
+        bmpComplemented->seekable = 1;
+        bmpComplemented->dataStart = pos;
+    }
+    if (needs_frame(bmpComplemented)) {
+        load_region(bmpComplemented);
+        return;
+    }
+    if (bmpComplemented->seekable)
+        return;
 
-            // 3：RGB通道数
-            mcu->rgbData[3 * t] = b;
-            mcu->rgbData[3 * t + 1] = g;
-            mcu->rgbData[3 * t + 2] = r;
-        }
+    if (bmpInfo->topdown) {
+        // 从上往下存储的bmp，跳过裁剪区域上面的行，之后一个band一个band地按顺序读
+        skip_bytes(bmpComplemented, (size_t) y * bmpComplemented->rowStride);
+        return;
+    }
+
+    // 管道之类不能fseek、又是从下往上存储的bmp，第一行MCU在最后面
+    // 只好把裁剪区域的像素都读到内存里来，从上往下放
+    size_t rowBytes = (size_t) w * 3;
+    bmpComplemented->raw = malloc(rowBytes * h);
+    if (!bmpComplemented->raw) {
+        free_bmp_data(bmpComplemented);
+        err_exit(BUFFER_ALLOC_ERR);
     }
+    for (UINT32 f = 0; f < bmpInfo->height; f++) {
+        // 文件里的第f行是图像的第srcY行，在裁剪区域上面的行就不用读了
+        UINT32 srcY = bmpInfo->height - 1 - f;
+        if (srcY < y)
+            break;
+        if (fread(cio->in->set, sizeof(UINT8), bmpComplemented->rowStride, cio->in->fp) !=
+            bmpComplemented->rowStride)
+            bmp_read_failed(bmpComplemented);
+        if (srcY < y + h)
+            memcpy(bmpComplemented->raw + (srcY - y) * rowBytes, cio->in->set + (size_t) x * 3, rowBytes);
+    }
+}
 
-    // 更新i,j
-    bmpC->j = bmpC->j + 1;
+void read_source_data(image_source *src,
+                      const encode_options *opts,
+                      struct bmp_complemented *bmpComplemented) {
+    memset(bmpComplemented, 0, sizeof(*bmpComplemented));
+    bmpComplemented->src = src;
+    bmpComplemented->srcHeight = src->height;
+    set_region(bmpComplemented, src->width, src->height, opts);
 
-    // 如果这一行的mcu已经迭代完了，就换下一行的mcu
-    if (bmpC->j == bmpC->complementedWidth / MCUSIZE) {
-        bmpC->j = 0;
-        bmpC->i = bmpC->i + 1;
+    // 行是从上往下来的，裁剪区域上面的行拉过来扔掉
+    for (UINT32 y = 0; y < bmpComplemented->cropY; y++)
+        if (!src->pull_row(src, 0, 0, NULL))
+            bmp_read_failed(bmpComplemented);
+    if (needs_frame(bmpComplemented))
+        load_region(bmpComplemented);
+}
+
+void free_bmp_data(struct bmp_complemented *bmpComplemented) {
+    for (int c = 0; c < COMP_NUM; c++) {
+        aligned_free(bmpComplemented->band.plane[c]);
+        bmpComplemented->band.plane[c] = NULL;
+    }
+    free(bmpComplemented->raw);
+    bmpComplemented->raw = NULL;
+    for (int c = 0; c < COMP_NUM; c++) {
+        free(bmpComplemented->frame[c]);
+        bmpComplemented->frame[c] = NULL;
     }
 }
 
-void free_mcu_data(struct mcu *mcu) {
-    if (mcu->rgbData != NULL) {
-        free(mcu->rgbData);
+/* 右边补齐的部分复制最后一列，下边补齐的部分复制最后一行 */
+static void complement_band(struct bmp_complemented *bmpC, UINT32 rows) {
+    UINT32 bandStride = bmpC->band.stride;
+    UINT32 w = bmpC->realWidth;
+    for (int c = 0; c < COMP_NUM; c++) {
+        UINT8 *p = bmpC->band.plane[c];
+        for (UINT32 y = 0; y < rows; y++)
+            memset(p + y * bandStride + w, p[y * bandStride + w - 1], bmpC->complementedWidth - w);
+        for (UINT32 y = rows; y < MCUSIZE; y++)
+            memcpy(p + y * bandStride, p + (rows - 1) * bandStride, bmpC->complementedWidth);
     }
 }
 
+/* 把一行的w个像素左右倒过来 */
+static void reverse_row(UINT8 *p, UINT32 w) {
+    for (UINT32 x = 0; x < w / 2; x++) {
+        UINT8 t = p[x];
+        p[x] = p[w - 1 - x];
+        p[w - 1 - x] = t;
+    }
+}
+
+/* 从src拉这个band的行，直接放进band的三个平面 */
+static void next_source_band(struct bmp_complemented *bmpC, UINT32 rows) {
+    image_source *src = bmpC->src;
+    for (UINT32 y = 0; y < rows; y++) {
+        UINT8 *plane[COMP_NUM];
+        for (int c = 0; c < COMP_NUM; c++)
+            plane[c] = bmpC->band.plane[c] + y * bmpC->band.stride;
+        if (!src->pull_row(src, bmpC->cropX, bmpC->realWidth, plane))
+            bmp_read_failed(bmpC);
+        if (bmpC->orient & ORIENT_FLIP_X)
+            for (int c = 0; c < COMP_NUM; c++)
+                reverse_row(plane[c], bmpC->realWidth);
+    }
+    complement_band(bmpC, rows);
+}
 
+/*
+ * 从frame里取出输出图像的第i行MCU。输出的(ox, oy)先按翻转变成(u, v)，
+ * 转置的话是区域里的(v, u)，不转置就是(u, v)。
+ * 转置的时候一次做一个8*8的块：块的8列是区域里的8行，每行取同一列
+ */
+static void gather_band(struct bmp_complemented *bmpC, UINT32 rows) {
+    UINT32 ow = bmpC->realWidth, oh = bmpC->realHeight, fw = bmpC->regionWidth;
+    UINT32 y0 = bmpC->i * MCUSIZE, stride = bmpC->band.stride;
+    bool flipX = (bmpC->orient & ORIENT_FLIP_X) != 0;
+    bool flipY = (bmpC->orient & ORIENT_FLIP_Y) != 0;
+    for (int c = 0; c < COMP_NUM; c++) {
+        const UINT8 *f = bmpC->frame[c];
+        UINT8 *out = bmpC->band.plane[c];
+        if (!(bmpC->orient & ORIENT_TRANSPOSE)) {
+            for (UINT32 j = 0; j < rows; j++) {
+                const UINT8 *src = f + (size_t) (flipY ? oh - 1 - (y0 + j) : y0 + j) * fw;
+                memcpy(out + j * stride, src, ow);
+                if (flipX)
+                    reverse_row(out + j * stride, ow);
+            }
+            continue;
+        }
+        for (UINT32 x0 = 0; x0 < ow; x0 += DCTSIZE) {
+            const UINT8 *src[DCTSIZE];
+            UINT32 n = ow - x0 < DCTSIZE ? ow - x0 : DCTSIZE;
+            for (UINT32 k = 0; k < n; k++)
+                src[k] = f + (size_t) (flipX ? ow - 1 - (x0 + k) : x0 + k) * fw;
+            for (UINT32 j = 0; j < rows; j++) {
+                UINT32 sx = flipY ? oh - 1 - (y0 + j) : y0 + j;
+                UINT8 *dst = out + j * stride + x0;
+                for (UINT32 k = 0; k < n; k++)
+                    dst[k] = src[k][sx];
+            }
+        }
+    }
+    complement_band(bmpC, rows);
+}
+
+bool next_band(struct bmp_complemented *bmpC) {
+    // 判断还有没有MCU行可以读取
+    if (bmpC->i >= bmpC->complementedHeight / MCUSIZE)
+        return false;
+
+    if (bmpC->frame[0] || bmpC->src) {
+        UINT32 y0 = bmpC->i * MCUSIZE;
+        UINT32 rows = bmpC->realHeight - y0 < MCUSIZE ? bmpC->realHeight - y0 : MCUSIZE;
+        if (bmpC->frame[0])
+            gather_band(bmpC, rows);
+        else
+            next_source_band(bmpC, rows);
+        bmpC->i++;
+        return true;
+    }
+
+    // 这个band里真实存在的像素行：第y0行到第y0+rows-1行（从上往下数）
+    UINT32 y0 = bmpC->i * MCUSIZE;
+    UINT32 rows = bmpC->realHeight - y0 < MCUSIZE ? bmpC->realHeight - y0 : MCUSIZE;
+    UINT32 stride = bmpC->rowStride;
+    UINT8 *src = bmpC->cio->in->set;
+    FILE *fp = bmpC->cio->in->fp;
+
+    // 拿到这些行在文件里的数据。src指向第y0行裁剪区域的第一个像素，srcStep是往下一行要走的字节数
+    size_t rowBytes = (size_t) bmpC->realWidth * 3;
+    UINT32 srcY = bmpC->cropY + y0; // 这个band的第一行在bmp图像中是第几行
+    long srcStep;
+    // 上下翻转（只有能fseek的时候走到这里）：这个band是区域里倒数的rows行，倒着放
+    bool flipY = (bmpC->orient & ORIENT_FLIP_Y) != 0;
+    if (flipY)
+        srcY = bmpC->cropY + bmpC->realHeight - y0 - rows;
+    if (bmpC->raw) {
+        src = bmpC->raw + y0 * rowBytes;
+        srcStep = (long) rowBytes;
+    } else if (!bmpC->seekable) {
+        // 从上往下存储的bmp，按顺序读
+        if (fread(src, sizeof(UINT8), (size_t) rows * stride, fp) != (size_t) rows * stride)
+            bmp_read_failed(bmpC);
+        src += (size_t) bmpC->cropX * 3;
+        srcStep = stride;
+    } else if (rowBytes * 2 > stride) {
+        // 要的部分占了一行的大半，整行地读，这个band的行在文件里是连续的
+        // 从下往上存储的bmp，这个band的最后一行在最前面
+        UINT32 fileRow = bmpC->topdown ? srcY : bmpC->srcHeight - srcY - rows;
+        if (seek_to(fp, bmpC->dataStart + (long long) fileRow * stride) != 0 ||
+            fread(src, sizeof(UINT8), (size_t) rows * stride, fp) != (size_t) rows * stride)
+            bmp_read_failed(bmpC);
+        if (bmpC->topdown != flipY)
+            srcStep = stride;
+        else {
+            src += (size_t) (rows - 1) * stride;
+            srcStep = -(long) stride;
+        }
+        src += (size_t) bmpC->cropX * 3;
+    } else {
+        // 只要一行中的一小段，一行一行地跳过去读
+        for (UINT32 r = 0; r < rows; r++) {
+            UINT32 y = flipY ? srcY + rows - 1 - r : srcY + r;
+            UINT32 fileRow = bmpC->topdown ? y : bmpC->srcHeight - 1 - y;
+            long long at = bmpC->dataStart + (long long) fileRow * stride + (long long) bmpC->cropX * 3;
+            if (seek_to(fp, at) != 0 ||
+                fread(src + r * rowBytes, sizeof(UINT8), rowBytes, fp) != rowBytes)
+                bmp_read_failed(bmpC);
+        }
+        srcStep = (long) rowBytes;
+    }
+
+    // 把BGR交错存储的像素，拆成R，G，B三个平面
+    UINT8 *r = bmpC->band.plane[0];
+    UINT8 *g = bmpC->band.plane[1];
+    UINT8 *b = bmpC->band.plane[2];
+    UINT32 bandStride = bmpC->band.stride;
+    UINT32 w = bmpC->realWidth;
+    for (UINT32 y = 0; y < rows; y++) {
+        const UINT8 *p = src + srcStep * (long) y;
+        UINT32 o = y * bandStride;
+        if (bmpC->orient & ORIENT_FLIP_X) {
+            // 左右翻转：从右往左放
+            for (UINT32 x = w; x-- > 0; p += 3) {
+                b[o + x] = p[0];
+                g[o + x] = p[1];
+                r[o + x] = p[2];
+            }
+            continue;
+        }
+        for (UINT32 x = 0; x < w; x++) {
+            // bmp 里面，颜色数据是按照BGR的顺序存储的
+            b[o + x] = p[0];
+            g[o + x] = p[1];
+            r[o + x] = p[2];
+            p += 3;
+        }
+    }
+    complement_band(bmpC, rows);
+
+    bmpC->i++;
+    return true;
+}
@@ -7,51 +7,62 @@
 
 #include "../cjpeg.h"
 #include "../cio.h"
-
-/* RGB 颜色单元，包括RGB三个分量，原始的BMP图像中，数据是RGB编码的 */
-struct rgb_unit {
-    UINT8 b;
-    UINT8 g;
-    UINT8 r;
-};
+#include "../rdimg.h"
 
 /**
- * 经过8*8补齐的bmp数据。
+ * 经过8*8补齐的bmp数据，按MCU行（band）读取。
  * realWidth和realHeight是bmp图像的原始宽度和长度
  * complementedWidth和complementedHeight是bmp图像补齐到8的倍数以后的宽度和长度
- * 而data的长度和宽度是经过补齐到8的倍数的
- * 例如，如果有一个10*10的bmp图像，则realWidth=realHeight=10，而data是一个16*16=256的数组
+ * band里每次只放一行MCU（8行像素），补齐的部分复制最后一列/最后一行的像素
+ * 例如，如果有一个10*10的bmp图像，则realWidth=realHeight=10，一共有2个band，每个band是16*8
+ * 只编码一部分（裁剪）的时候，realWidth和realHeight是裁剪区域的大小，cropX和cropY是它左上角的位置
+ * 输入不是bmp（PPM，PAM，raw，Y4M）的时候，像素从src一行一行地拉过来，band的切法完全一样
+ * 旋转或翻转（orient）的时候，realWidth和realHeight是输出图像的大小，band是输出图像的一行MCU：
+ * 左右翻转在拆分平面的时候顺便做；上下翻转，能fseek的bmp倒着读band；
+ * 要转置的，或者不能倒着读的，先把整个区域读进frame，再按8*8的块取出每个band
  */
 struct bmp_complemented {
     UINT32 realWidth;
     UINT32 realHeight;
     UINT32 complementedWidth;
     UINT32 complementedHeight;
-    UINT32 i; // 当前在垂直方向，迭代到第几个MCU了
-    UINT32 j; // 当前在水平方向，迭代到几个MCU了
-    struct rgb_unit *data;
-};
+    UINT32 i; // 下一个要读取的MCU行
+    pixel_band band;
 
-/**
- * 一个8*8*3的MCU
- * 数据格式为
- * (0,0)B, (0,0)G, (0,0)R, (0,1)B, (0,1)G, (0,1)R.......
- */
-struct mcu {
-    UINT8 *rgbData; // length：8*8*3
+    UINT32 cropX; // 裁剪区域在bmp图像中的位置
+    UINT32 cropY;
+    UINT32 srcHeight; // bmp图像原始的高度
+    UINT32 frameHeight; // 裁剪后整幅图像的高度，分段编码时realHeight只是这一段的
+
+    compress_io *cio; // 从哪里读取像素
+    UINT32 rowStride; // bmp文件里一行的字节数（4字节对齐）
+    bool topdown; // bmp的行是不是从上往下存储的
+    bool seekable; // 输入能不能fseek（管道不行）
+    long dataStart; // 像素数据在文件中的位置（seekable时有效）
+    UINT8 *raw; // 从下往上存储、又不能fseek时，裁剪区域的像素数据都读到这里（从上往下）
+
+    image_source *src; // 不是bmp的时候，像素的来源。它给的可能已经是YCbCr（src->format）
+
+    int orient; // 输出的方向，ORIENT_*（cjpeg.h）
+    UINT32 regionWidth; // 要编码的区域在源图像里的宽和高，转置的时候和realWidth，realHeight相反
+    UINT32 regionHeight;
+    UINT8 *frame[COMP_NUM]; // 整个区域的三个平面，每个regionWidth*regionHeight个字节；不需要的时候是NULL
 };
 
-/* 读取bmp的数据 */
+/* 准备读取bmp的数据：确定裁剪区域，跳到像素开始的位置，分配band */
 void read_bmp_data(compress_io *cio,
                    bmp_info *bmpInfo,
+                   const encode_options *opts,
                    struct bmp_complemented *bmpComplemented);
 
-void free_bmp_data(struct bmp_complemented *bmpComplemented);
+/* 准备从其它格式的输入读取像素：和read_bmp_data一样确定裁剪区域，分配band */
+void read_source_data(image_source *src,
+                      const encode_options *opts,
+                      struct bmp_complemented *bmpComplemented);
 
-/* 获取下一个MCU */
-void next_mcu(struct bmp_complemented *bmpC, struct mcu *mcu);
+void free_bmp_data(struct bmp_complemented *bmpComplemented);
 
-/* 释放mcu录的data数据 */
-void free_mcu_data(struct mcu *mcu);
+/* 把下一行MCU的像素读到band里，没有了返回false */
+bool next_band(struct bmp_complemented *bmpC);
 
 #endif //BMP2JPEG_CMAKE_HUAJUAN_BMP_H
@@ -0,0 +1,404 @@
+/**
+ * @file jarith.c
+ * @brief the QM-coder: probability states, decisions and their output.
+ */
+
+#include <string.h>
+#include "jarith.h"
+#include "jsimd.h"
+
+#define QE(i, qe, lps, mps, sw) \
+    ((UINT32) (qe) << 16 | (UINT32) (mps) << 8 | (UINT32) (sw) << 7 | (lps))
+
+/* Table D.2: Qe, next index after an LPS, after an MPS, switch MPS */
+const UINT32 arith_qe[ARITH_QE_NUM] = {
+        QE(0, 0x5a1d, 1, 1, 1),
+        QE(1, 0x2586, 14, 2, 0),
+        QE(2, 0x1114, 16, 3, 0),
+        QE(3, 0x080b, 18, 4, 0),
+        QE(4, 0x03d8, 20, 5, 0),
+        QE(5, 0x01da, 23, 6, 0),
+        QE(6, 0x00e5, 25, 7, 0),
+        QE(7, 0x006f, 28, 8, 0),
+        QE(8, 0x0036, 30, 9, 0),
+        QE(9, 0x001a, 33, 10, 0),
+        QE(10, 0x000d, 35, 11, 0),
+        QE(11, 0x0006, 9, 12, 0),
+        QE(12, 0x0003, 10, 13, 0),
+        QE(13, 0x0001, 12, 13, 0),
+        QE(14, 0x5a7f, 15, 15, 1),
+        QE(15, 0x3f25, 36, 16, 0),
+        QE(16, 0x2cf2, 38, 17, 0),
+        QE(17, 0x207c, 39, 18, 0),
+        QE(18, 0x17b9, 40, 19, 0),
+        QE(19, 0x1182, 42, 20, 0),
+        QE(20, 0x0cef, 43, 21, 0),
+        QE(21, 0x09a1, 45, 22, 0),
+        QE(22, 0x072f, 46, 23, 0),
+        QE(23, 0x055c, 48, 24, 0),
+        QE(24, 0x0406, 49, 25, 0),
+        QE(25, 0x0303, 51, 26, 0),
+        QE(26, 0x0240, 52, 27, 0),
+        QE(27, 0x01b1, 54, 28, 0),
+        QE(28, 0x0144, 56, 29, 0),
+        QE(29, 0x00f5, 57, 30, 0),
+        QE(30, 0x00b7, 59, 31, 0),
+        QE(31, 0x008a, 60, 32, 0),
+        QE(32, 0x0068, 62, 33, 0),
+        QE(33, 0x004e, 63, 34, 0),
+        QE(34, 0x003b, 32, 35, 0),
+        QE(35, 0x002c, 33, 9, 0),
+        QE(36, 0x5ae1, 37, 37, 1),
+        QE(37, 0x484c, 64, 38, 0),
+        QE(38, 0x3a0d, 65, 39, 0),
+        QE(39, 0x2ef1, 67, 40, 0),
+        QE(40, 0x261f, 68, 41, 0),
+        QE(41, 0x1f33, 69, 42, 0),
+        QE(42, 0x19a8, 70, 43, 0),
+        QE(43, 0x1518, 72, 44, 0),
+        QE(44, 0x1177, 73, 45, 0),
+        QE(45, 0x0e74, 74, 46, 0),
+        QE(46, 0x0bfb, 75, 47, 0),
+        QE(47, 0x09f8, 77, 48, 0),
+        QE(48, 0x0861, 78, 49, 0),
+        QE(49, 0x0706, 79, 50, 0),
+        QE(50, 0x05cd, 48, 51, 0),
+        QE(51, 0x04de, 50, 52, 0),
+        QE(52, 0x040f, 50, 53, 0),
+        QE(53, 0x0363, 51, 54, 0),
+        QE(54, 0x02d4, 52, 55, 0),
+        QE(55, 0x025c, 53, 56, 0),
+        QE(56, 0x01f8, 54, 57, 0),
+        QE(57, 0x01a4, 55, 58, 0),
+        QE(58, 0x0160, 56, 59, 0),
+        QE(59, 0x0125, 57, 60, 0),
+        QE(60, 0x00f6, 58, 61, 0),
+        QE(61, 0x00cb, 59, 62, 0),
+        QE(62, 0x00ab, 61, 63, 0),
+        QE(63, 0x008f, 61, 32, 0),
+        QE(64, 0x5b12, 65, 65, 1),
+        QE(65, 0x4d04, 80, 66, 0),
+        QE(66, 0x412c, 81, 67, 0),
+        QE(67, 0x37d8, 82, 68, 0),
+        QE(68, 0x2fe8, 83, 69, 0),
+        QE(69, 0x293c, 84, 70, 0),
+        QE(70, 0x2379, 86, 71, 0),
+        QE(71, 0x1edf, 87, 72, 0),
+        QE(72, 0x1aa9, 87, 73, 0),
+        QE(73, 0x174e, 72, 74, 0),
+        QE(74, 0x1424, 72, 75, 0),
+        QE(75, 0x119c, 74, 76, 0),
+        QE(76, 0x0f6b, 74, 77, 0),
+        QE(77, 0x0d51, 75, 78, 0),
+        QE(78, 0x0bb6, 77, 79, 0),
+        QE(79, 0x0a40, 77, 48, 0),
+        QE(80, 0x5832, 80, 81, 1),
+        QE(81, 0x4d1c, 88, 82, 0),
+        QE(82, 0x438e, 89, 83, 0),
+        QE(83, 0x3bdd, 90, 84, 0),
+        QE(84, 0x34ee, 91, 85, 0),
+        QE(85, 0x2eae, 92, 86, 0),
+        QE(86, 0x299a, 93, 87, 0),
+        QE(87, 0x2516, 86, 71, 0),
+        QE(88, 0x5570, 88, 89, 1),
+        QE(89, 0x4ca9, 95, 90, 0),
+        QE(90, 0x44d9, 96, 91, 0),
+        QE(91, 0x3e22, 97, 92, 0),
+        QE(92, 0x3824, 99, 93, 0),
+        QE(93, 0x32b4, 99, 94, 0),
+        QE(94, 0x2e17, 93, 86, 0),
+        QE(95, 0x56a8, 95, 96, 1),
+        QE(96, 0x4f46, 101, 97, 0),
+        QE(97, 0x47e5, 102, 98, 0),
+        QE(98, 0x41cf, 103, 99, 0),
+        QE(99, 0x3c3d, 104, 100, 0),
+        QE(100, 0x375e, 99, 93, 0),
+        QE(101, 0x5231, 105, 102, 0),
+        QE(102, 0x4c0f, 106, 103, 0),
+        QE(103, 0x4639, 107, 104, 0),
+        QE(104, 0x415e, 103, 99, 0),
+        QE(105, 0x5627, 105, 106, 1),
+        QE(106, 0x50e7, 108, 107, 0),
+        QE(107, 0x4b85, 109, 103, 0),
+        QE(108, 0x5597, 110, 109, 0),
+        QE(109, 0x504f, 111, 107, 0),
+        QE(110, 0x5a10, 110, 111, 1),
+        QE(111, 0x5522, 112, 109, 0),
+        QE(112, 0x59eb, 112, 111, 1),
+        /* not in the standard: the fixed bin of the AC signs */
+        QE(113, 0x5a1d, 113, 113, 0)
+};
+
+
+void
+init_arith_coder(arith_coder *e) {
+    memset(e, 0, sizeof(*e));
+    arith_reset(e);
+}
+
+void
+free_arith_coder(arith_coder *e) {
+    free(e->out);
+    e->out = NULL;
+    e->len = e->cap = 0;
+}
+
+void
+arith_reset(arith_coder *e) {
+    memset(e->dc_stats, 0, sizeof(e->dc_stats));
+    memset(e->ac_stats, 0, sizeof(e->ac_stats));
+    memset(e->dc_context, 0, sizeof(e->dc_context));
+    memset(e->last_dc, 0, sizeof(e->last_dc));
+    e->fixed_bin = 113;
+    e->c = 0;
+    e->a = 0x10000L;
+    e->sc = 0;
+    e->zc = 0;
+    e->ct = 11;
+    e->buffer = -1;
+}
+
+static void
+emit_byte(arith_coder *e, int val) {
+    if (e->len == e->cap) {
+        size_t cap = e->cap ? e->cap * 2 : 1 << 16;
+        UINT8 *out = (UINT8 *) realloc(e->out, cap);
+        if (!out) {
+            // 内存不够：后面的字节都丢掉，由调用的人检查failed
+            e->failed = 1;
+            return;
+        }
+        e->out = out;
+        e->cap = cap;
+    }
+    e->out[e->len++] = (UINT8) val;
+}
+
+/* the held back 0x00 bytes, before a byte that is not 0x00 */
+static void
+emit_zeros(arith_coder *e) {
+    while (e->zc) {
+        emit_byte(e, 0x00);
+        e->zc--;
+    }
+}
+
+/* the buffered byte and the stacked 0xFF bytes, no carry can reach them */
+static void
+emit_stacked(arith_coder *e) {
+    if (e->buffer == 0)
+        e->zc++;
+    else if (e->buffer >= 0) {
+        emit_zeros(e);
+        emit_byte(e, e->buffer);
+    }
+    if (e->sc) {
+        emit_zeros(e);
+        do {
+            emit_byte(e, 0xFF);
+            emit_byte(e, 0x00);
+        } while (--e->sc);
+    }
+}
+
+/* a carry: the buffered byte plus one, the stacked 0xFF bytes become 0x00 */
+static void
+emit_carry(arith_coder *e) {
+    if (e->buffer >= 0) {
+        emit_zeros(e);
+        emit_byte(e, e->buffer + 1);
+        if (e->buffer + 1 == 0xFF)
+            emit_byte(e, 0x00);
+    }
+    e->zc += e->sc;
+    e->sc = 0;
+}
+
+/*
+ * code the decision val (0 or 1) in the bin st, sections D.1.4 to D.1.6.
+ * the bin holds the MPS in bit 7 and the index of its state below.  the
+ * registers are kept in locals: the stores to the bins and the output are
+ * bytes, which would make the compiler reload them after each one.
+ */
+static void
+arith_encode(arith_coder *e, UINT8 *st, int val) {
+    int sv = *st;
+    INT32 qe = (INT32) arith_qe[sv & 0x7F];
+    INT32 a = e->a - (qe >> 16), c;
+    int ct;
+
+    qe >>= 16;
+    if (val != (sv >> 7)) {
+        // 编码LPS；LPS的区间比MPS的大的时候两者交换
+        c = e->c;
+        if (a >= qe) {
+            c += a;
+            a = qe;
+        }
+        *st = (UINT8) ((sv & 0x80) ^ (arith_qe[sv & 0x7F] & 0xFF));
+    } else {
+        if (a >= 0x8000L) {
+            e->a = a;
+            return;
+        }
+        c = e->c;
+        if (a < qe) {
+            c += a;
+            a = qe;
+        }
+        *st = (UINT8) ((sv & 0x80) ^ ((arith_qe[sv & 0x7F] >> 8) & 0xFF));
+    }
+
+    /* renormalization, a byte out every 8 shifts */
+    ct = e->ct;
+    do {
+        a <<= 1;
+        c <<= 1;
+        if (--ct == 0) {
+            INT32 temp = c >> 19;
+            if (temp > 0xFF) {
+                emit_carry(e);
+                /* the 3 spacer bits of c keep the new byte below 0xFF */
+                e->buffer = temp & 0xFF;
+            } else if (temp == 0xFF)
+                e->sc++;
+            else {
+                emit_stacked(e);
+                e->buffer = temp & 0xFF;
+            }
+            c &= 0x7FFFFL;
+            ct += 8;
+        }
+    } while (a < 0x8000L);
+    e->a = a;
+    e->c = c;
+    e->ct = ct;
+}
+
+void
+arith_finish(arith_coder *e) {
+    /* section D.1.8: the value in the interval with the most trailing 0s */
+    INT32 temp = (e->a - 1 + e->c) & 0xFFFF0000L;
+    e->c = temp < e->c ? temp + 0x8000L : temp;
+    e->c <<= e->ct;
+    if (e->c & 0xF8000000L)
+        emit_carry(e);
+    else
+        emit_stacked(e);
+
+    // 最后的0x00字节不用写，解码器读到标记以后自己补0
+    if (e->c & 0x7FFF800L) {
+        emit_zeros(e);
+        emit_byte(e, (e->c >> 19) & 0xFF);
+        if (((e->c >> 19) & 0xFF) == 0xFF)
+            emit_byte(e, 0x00);
+        if (e->c & 0x7F800L) {
+            emit_byte(e, (e->c >> 11) & 0xFF);
+            if (((e->c >> 11) & 0xFF) == 0xFF)
+                emit_byte(e, 0x00);
+        }
+    }
+}
+
+/* figure F.9: end of the category in st, the bits of v below m from st + 14 */
+static void
+encode_bits(arith_coder *e, UINT8 *st, int m, int v) {
+    arith_encode(e, st, 0);
+    st += 14;
+    while (m >>= 1)
+        arith_encode(e, st, (m & v) ? 1 : 0);
+}
+
+/* one block: DC difference (F.1.4.1) and the ACs (F.1.4.2), table tbl */
+static void
+encode_block(arith_coder *e, const INT16 *coef, int ci, int tbl) {
+    UINT8 *st = e->dc_stats[tbl] + e->dc_context[ci];
+    int v = coef[0] - e->last_dc[ci];
+    int m, v2, k, ke;
+
+    if (v == 0) {
+        arith_encode(e, st, 0);
+        e->dc_context[ci] = 0;
+    } else {
+        e->last_dc[ci] = coef[0];
+        arith_encode(e, st, 1);
+        if (v > 0) {
+            arith_encode(e, st + 1, 0);
+            st += 2;
+            e->dc_context[ci] = 4;
+        } else {
+            v = -v;
+            arith_encode(e, st + 1, 1);
+            st += 3;
+            e->dc_context[ci] = 8;
+        }
+        /* figure F.8: the category of v - 1, X1 on from bin 20 */
+        m = 0;
+        if ((v -= 1) != 0) {
+            arith_encode(e, st, 1);
+            m = 1;
+            v2 = v;
+            st = e->dc_stats[tbl] + 20;
+            while (v2 >>= 1) {
+                arith_encode(e, st, 1);
+                m <<= 1;
+                st++;
+            }
+        }
+        /* section F.1.4.4.1.2: the conditioning of the next DC */
+        if (m < (1 << ARITH_DC_L) >> 1)
+            e->dc_context[ci] = 0;
+        else if (m > (1 << ARITH_DC_U) >> 1)
+            e->dc_context[ci] += 8;
+        encode_bits(e, st, m, v);
+    }
+
+    // 最后一个不是0的系数之后，编码一个EOB判决
+    for (ke = DCTSIZE2 - 1; ke > 0; ke--)
+        if (coef[NATURAL[ke]])
+            break;
+    for (k = 1; k <= ke; k++) {
+        st = e->ac_stats[tbl] + 3 * (k - 1);
+        arith_encode(e, st, 0);
+        while ((v = coef[NATURAL[k]]) == 0) {
+            arith_encode(e, st + 1, 0);
+            st += 3;
+            k++;
+        }
+        arith_encode(e, st + 1, 1);
+        if (v > 0)
+            arith_encode(e, &e->fixed_bin, 0);
+        else {
+            v = -v;
+            arith_encode(e, &e->fixed_bin, 1);
+        }
+        st += 2;
+        /* the first two category decisions in st, X2 on from bin 189 or 217 */
+        m = 0;
+        if ((v -= 1) != 0) {
+            arith_encode(e, st, 1);
+            m = 1;
+            v2 = v;
+            if (v2 >>= 1) {
+                arith_encode(e, st, 1);
+                m <<= 1;
+                st = e->ac_stats[tbl] + (k <= ARITH_AC_K ? 189 : 217);
+                while (v2 >>= 1) {
+                    arith_encode(e, st, 1);
+                    m <<= 1;
+                    st++;
+                }
+            }
+        }
+        encode_bits(e, st, m, v);
+    }
+    if (k <= DCTSIZE2 - 1)
+        arith_encode(e, e->ac_stats[tbl] + 3 * (k - 1), 1);
+}
+
+void
+arith_encode_mcu(arith_coder *e, const quant_unit *q) {
+    encode_block(e, q->y, 0, 0);
+    encode_block(e, q->cb, 1, 1);
+    encode_block(e, q->cr, 2, 1);
+}
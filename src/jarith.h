@@ -0,0 +1,60 @@
+/**
+ * @file jarith.h
+ * @brief arithmetic coding (QM-coder) of the quantized MCUs, SOF9 frames.
+ *
+ * The entropy coder of ITU T.81 annex D and F.1.4, in place of the
+ * huffman coding of h_tables: binary decisions coded against adaptive
+ * statistics, 49 DC and 245 AC bins per table, conditioned as the
+ * default DAC (L = 0, U = 1, Kx = 5) says.  Color conversion, DCT and
+ * quantization are those of the huffman path.  The coder and the bins
+ * start afresh in every restart interval, so intervals can be coded
+ * apart and joined with their RSTn.
+ */
+
+#ifndef __JARITH_H
+#define __JARITH_H
+
+#include "cjpeg.h"
+
+#define ARITH_DC_BINS   64
+#define ARITH_AC_BINS   256
+#define ARITH_DC_L      0       /* DC conditioning bounds, as in the DAC */
+#define ARITH_DC_U      1
+#define ARITH_AC_K      5       /* AC conditioning: first Kx coefficients */
+#define ARITH_QE_NUM    114     /* the 113 states of Table D.2, and 0.5 */
+
+/*
+ * probability estimation states: Qe << 16 | next MPS index << 8 |
+ * switch MPS << 7 | next LPS index
+ */
+extern const UINT32 arith_qe[ARITH_QE_NUM];
+
+typedef struct {
+    INT32 c;                    /* code register */
+    INT32 a;                    /* interval size */
+    INT32 sc;                   /* 0xFF bytes stacked for a carry */
+    INT32 zc;                   /* 0x00 bytes held back */
+    int ct;                     /* bits until the next byte */
+    int buffer;                 /* byte waiting for a carry, -1 for none */
+    UINT8 dc_stats[2][ARITH_DC_BINS];   /* luminance and chrominance */
+    UINT8 ac_stats[2][ARITH_AC_BINS];
+    UINT8 fixed_bin;            /* sign of the ACs, probability 0.5 */
+    int dc_context[COMP_NUM];
+    INT16 last_dc[COMP_NUM];
+    UINT8 *out;                 /* coded bytes, stuffed */
+    size_t len;
+    size_t cap;
+    bool failed;                /* out was not grown */
+} arith_coder;
+
+void init_arith_coder(arith_coder *e);
+void free_arith_coder(arith_coder *e);
+
+/* start of the scan or of a restart interval */
+void arith_reset(arith_coder *e);
+/* code the MCU q, natural order */
+void arith_encode_mcu(arith_coder *e, const quant_unit *q);
+/* end of the scan or of a restart interval: out the rest of the code */
+void arith_finish(arith_coder *e);
+
+#endif /* __JARITH_H */
@@ -0,0 +1,463 @@
+/**
+ * @file jcache.c
+ * @brief on-disk cache of encoded JPEGs, keyed by a hash of the pixels.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+#include "jcache.h"
+#include "rdbmp.h"
+#include "huajuan/huajuan_bmp.h"
+
+#define CACHE_VERSION   1       /* bump when the encoder output changes */
+#define CACHE_TMP_AGE   3600    /* seconds before a stray temp file goes */
+
+
+/*
+ * XXH64, streaming.  a few GB/s, so hashing the pixels costs little next
+ * to encoding them.
+ */
+
+#define P1  0x9E3779B185EBCA87ULL
+#define P2  0xC2B2AE3D27D4EB4FULL
+#define P3  0x165667B19E3779F9ULL
+#define P4  0x85EBCA77C2B2AE63ULL
+#define P5  0x27D4EB2F165667C5ULL
+
+typedef struct {
+    UINT64 v[4];
+    UINT64 total;
+    UINT8 buf[32];
+    size_t buf_len;
+    UINT64 seed;
+} hash_state;
+
+static inline UINT64
+rotl64(UINT64 x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline UINT64
+read64(const UINT8 *p) {
+    UINT64 v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline UINT64
+hash_round(UINT64 acc, UINT64 input) {
+    return rotl64(acc + input * P2, 31) * P1;
+}
+
+static void
+hash_init(hash_state *hs, UINT64 seed) {
+    hs->seed = seed;
+    hs->v[0] = seed + P1 + P2;
+    hs->v[1] = seed + P2;
+    hs->v[2] = seed;
+    hs->v[3] = seed - P1;
+    hs->total = 0;
+    hs->buf_len = 0;
+}
+
+static void
+hash_stripes(hash_state *hs, const UINT8 *p, size_t n) {
+    UINT64 v0 = hs->v[0], v1 = hs->v[1], v2 = hs->v[2], v3 = hs->v[3];
+    for (; n >= 32; n -= 32, p += 32) {
+        v0 = hash_round(v0, read64(p));
+        v1 = hash_round(v1, read64(p + 8));
+        v2 = hash_round(v2, read64(p + 16));
+        v3 = hash_round(v3, read64(p + 24));
+    }
+    hs->v[0] = v0;
+    hs->v[1] = v1;
+    hs->v[2] = v2;
+    hs->v[3] = v3;
+}
+
+static void
+hash_update(hash_state *hs, const void *data, size_t len) {
+    const UINT8 *p = (const UINT8 *) data;
+    hs->total += len;
+    if (hs->buf_len) {
+        size_t n = 32 - hs->buf_len < len ? 32 - hs->buf_len : len;
+        memcpy(hs->buf + hs->buf_len, p, n);
+        hs->buf_len += n;
+        p += n;
+        len -= n;
+        if (hs->buf_len < 32)
+            return;
+        hash_stripes(hs, hs->buf, 32);
+        hs->buf_len = 0;
+    }
+    hash_stripes(hs, p, len & ~(size_t) 31);
+    p += len & ~(size_t) 31;
+    len &= 31;
+    memcpy(hs->buf, p, len);
+    hs->buf_len = len;
+}
+
+static inline UINT64
+hash_merge(UINT64 acc, UINT64 v) {
+    acc ^= hash_round(0, v);
+    return acc * P1 + P4;
+}
+
+static UINT64
+hash_final(const hash_state *hs) {
+    const UINT8 *p = hs->buf;
+    size_t len = hs->buf_len;
+    UINT64 h;
+    if (hs->total >= 32) {
+        h = rotl64(hs->v[0], 1) + rotl64(hs->v[1], 7) +
+            rotl64(hs->v[2], 12) + rotl64(hs->v[3], 18);
+        h = hash_merge(h, hs->v[0]);
+        h = hash_merge(h, hs->v[1]);
+        h = hash_merge(h, hs->v[2]);
+        h = hash_merge(h, hs->v[3]);
+    } else
+        h = hs->seed + P5;
+    h += hs->total;
+    for (; len >= 8; len -= 8, p += 8) {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * P1 + P4;
+    }
+    if (len >= 4) {
+        UINT32 v;
+        memcpy(&v, p, 4);
+        h ^= (UINT64) v * P1;
+        h = rotl64(h, 23) * P2 + P3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; len--, p++) {
+        h ^= *p * P5;
+        h = rotl64(h, 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+UINT64
+hash64(const void *data, size_t len) {
+    hash_state hs;
+    hash_init(&hs, 0);
+    hash_update(&hs, data, len);
+    return hash_final(&hs);
+}
+
+
+/*
+ * the cache directory.
+ */
+
+typedef struct {
+    time_t mtime;
+    UINT64 size;
+    char name[32];
+} cache_entry;
+
+static bool
+is_entry(const char *name) {
+    size_t n = strlen(name);
+    return n == 20 && !strcmp(name + 16, ".jpg");
+}
+
+static bool
+is_tmp(const char *name) {
+    return !strncmp(name, ".tmp-", 5);
+}
+
+static int
+by_mtime(const void *a, const void *b) {
+    time_t x = ((const cache_entry *) a)->mtime;
+    time_t y = ((const cache_entry *) b)->mtime;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * count the entries, and with evict drop the oldest until the cache is
+ * down to 90% of its limit.  stray temporary files of dead processes go
+ * too.  called with the lock held.
+ */
+static void
+scan_cache(jpeg_cache *cache, bool evict) {
+    DIR *d = opendir(cache->dir);
+    cache_entry *ents = NULL;
+    size_t n = 0, cap = 0, i;
+    char path[4096];
+    struct dirent *de;
+    time_t now = time(NULL);
+    UINT64 size = 0;
+
+    if (!d)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+        bool tmp = is_tmp(de->d_name);
+        if (!tmp && !is_entry(de->d_name))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, de->d_name);
+        if (stat(path, &st) != 0)
+            continue;
+        if (tmp) {
+            if (evict && now - st.st_mtime > CACHE_TMP_AGE)
+                unlink(path);
+            continue;
+        }
+        size += st.st_size;
+        if (!evict)
+            continue;
+        if (n == cap) {
+            cache_entry *e;
+            cap = cap ? cap * 2 : 256;
+            e = (cache_entry *) realloc(ents, cap * sizeof(cache_entry));
+            if (!e)
+                break;
+            ents = e;
+        }
+        ents[n].mtime = st.st_mtime;
+        ents[n].size = st.st_size;
+        strcpy(ents[n].name, de->d_name);
+        n++;
+    }
+    closedir(d);
+
+    if (evict && cache->limit) {
+        qsort(ents, n, sizeof(cache_entry), by_mtime);
+        for (i = 0; i < n && size > cache->limit / 10 * 9; i++) {
+            snprintf(path, sizeof(path), "%s/%s", cache->dir, ents[i].name);
+            if (unlink(path) == 0) {
+                size -= ents[i].size;
+                cache->evicted++;
+            }
+        }
+    }
+    free(ents);
+    cache->size = size;
+}
+
+int
+open_jpeg_cache(jpeg_cache *cache, const char *dir, UINT64 limit) {
+    memset(cache, 0, sizeof(*cache));
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        return -1;
+    if (!(cache->dir = strdup(dir)))
+        return -1;
+    cache->limit = limit;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_mutex_lock(&cache->lock);
+    scan_cache(cache, 0);
+    if (cache->limit && cache->size > cache->limit)
+        scan_cache(cache, 1);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+void
+close_jpeg_cache(jpeg_cache *cache) {
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->dir);
+    cache->dir = NULL;
+}
+
+void
+print_cache_stats(jpeg_cache *cache, FILE *fp) {
+    pthread_mutex_lock(&cache->lock);
+    fprintf(fp, "cache %s: %lu hits, %lu misses, %lu evicted, %llu bytes\n",
+            cache->dir, cache->hits, cache->misses, cache->evicted,
+            (unsigned long long) cache->size);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+/*
+ * the key: the pixels of the bands the encoder would get (so crop, row
+ * order and the padding of the BMP rows do not matter), the size and the
+ * options that change the output.
+ */
+static UINT64
+pixel_key(compress_io *cio, bmp_info *binfo, const encode_options *opts) {
+    struct bmp_complemented bmpC;
+    hash_state hs;
+    UINT32 head[5];
+
+    read_bmp_data(cio, binfo, opts, &bmpC);
+    head[0] = CACHE_VERSION;
+    head[1] = bmpC.realWidth;
+    head[2] = bmpC.realHeight;
+    head[3] = opts->scale;
+    head[4] = opts->restart | (UINT32) opts->abbreviated << 16 |
+              (UINT32) opts->arithmetic << 17 | (UINT32) opts->component_scans << 18;
+    hash_init(&hs, 0);
+    hash_update(&hs, head, sizeof(head));
+    while (next_band(&bmpC)) {
+        int c, j;
+        for (c = 0; c < COMP_NUM; c++)
+            for (j = 0; j < MCUSIZE; j++)
+                hash_update(&hs, bmpC.band.plane[c] + (size_t) j * bmpC.band.stride,
+                            bmpC.complementedWidth);
+    }
+    free_bmp_data(&bmpC);
+    return hash_final(&hs);
+}
+
+/* the whole entry, or NULL when there is none */
+static UINT8 *
+load_entry(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    UINT8 *data = NULL;
+    struct stat st;
+    if (!fp)
+        return NULL;
+    if (fstat(fileno(fp), &st) == 0 && st.st_size > 0 &&
+        (data = (UINT8 *) malloc(st.st_size)) != NULL &&
+        fread(data, 1, st.st_size, fp) != (size_t) st.st_size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *len = data ? (size_t) st.st_size : 0;
+    return data;
+}
+
+/* write the entry under a temporary name and rename it into place */
+static void
+store_entry(jpeg_cache *cache, const char *path, const UINT8 *data,
+            size_t len) {
+    char tmp[4096];
+    FILE *fp;
+    unsigned long seq;
+
+    pthread_mutex_lock(&cache->lock);
+    seq = cache->tmp_seq++;
+    pthread_mutex_unlock(&cache->lock);
+    snprintf(tmp, sizeof(tmp), "%s/.tmp-%ld-%lu", cache->dir, (long) getpid(), seq);
+    if (!(fp = fopen(tmp, "wb")))
+        return;
+    if (fwrite(data, 1, len, fp) != len || fclose(fp) != 0 ||
+        rename(tmp, path) != 0) {
+        unlink(tmp);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->size += len;
+    if (cache->limit && cache->size > cache->limit)
+        scan_cache(cache, 1);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void
+put_output(compress_io *cio, FILE *jpeg_fp, mem_dest *dest,
+           const UINT8 *data, size_t len) {
+    if (dest) {
+        use_mem_dest(cio, dest);
+        cio->out->pos = cio->out->set;
+        write_bytes(cio, data, len);
+        if (!(cio->out->flush_buffer)(cio))
+            err_exit(BUFFER_WRITE_ERR);
+    } else if (fwrite(data, 1, len, jpeg_fp) != len || fflush(jpeg_fp) != 0)
+        err_exit(BUFFER_WRITE_ERR);
+}
+
+bool
+cached_bmp_to_jpeg(jpeg_cache *cache, compress_io *cio, FILE *bmp_fp,
+                   FILE *jpeg_fp, mem_dest *dest, const encode_options *opts) {
+    FILE *volatile in = bmp_fp;
+    FILE *volatile mem_fp = NULL;
+    UINT8 *volatile slurp = NULL;
+    mem_dest *volatile out = NULL;  /* the encode of a miss, on the heap for the trap */
+    jmp_buf trap, *outer;
+    bmp_info binfo;
+    char path[4096];
+    UINT8 *data;
+    size_t len;
+    long start;
+    int code;
+
+    // 管道不能回头再读一遍，先都读到内存里
+    start = ftell(bmp_fp);
+    if (start < 0 || fseek(bmp_fp, start, SEEK_SET) != 0) {
+        size_t cap = 1 << 20, n = 0, got;
+        UINT8 *buf = (UINT8 *) malloc(cap);
+        while (buf && (got = fread(buf + n, 1, cap - n, bmp_fp)) > 0) {
+            n += got;
+            if (n == cap) {
+                UINT8 *b = (UINT8 *) realloc(buf, cap *= 2);
+                if (!b)
+                    free(buf);
+                buf = b;
+            }
+        }
+        if (!buf || !(mem_fp = fmemopen(buf, n ? n : 1, "rb"))) {
+            free(buf);
+            err_exit(BUFFER_ALLOC_ERR);
+        }
+        slurp = buf;
+        in = mem_fp;
+        start = 0;
+    }
+
+    /* errors in here have to close the memory stream on the way out */
+    outer = get_err_trap();
+    if ((code = setjmp(trap)) != 0) {
+        if (mem_fp)
+            fclose(mem_fp);
+        free(slurp);
+        if (out) {
+            free_mem_dest(out);
+            free(out);
+        }
+        set_err_trap(outer);
+        err_exit(last_err(), code);
+    }
+    set_err_trap(&trap);
+
+    read_bmp(in, &binfo);
+    reset_mem(cio, in, MCUSIZE * ((binfo.width * 3 + 3) / 4 * 4), NULL, NULL);
+    snprintf(path, sizeof(path), "%s/%016llx.jpg", cache->dir,
+             (unsigned long long) pixel_key(cio, &binfo, opts));
+
+    data = load_entry(path, &len);
+    pthread_mutex_lock(&cache->lock);
+    if (data)
+        cache->hits++;
+    else
+        cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (data) {
+        utime(path, NULL);      /* used just now, for the LRU order */
+        put_output(cio, jpeg_fp, dest, data, len);
+        free(data);
+    } else {
+        if (fseek(in, start, SEEK_SET) != 0)
+            err_exit(FILE_READ_ERR);
+        if (!(out = (mem_dest *) calloc(1, sizeof(mem_dest))))
+            err_exit(BUFFER_ALLOC_ERR);
+        bmp_to_jpeg(cio, in, NULL, out, opts);
+        if (!opts->deadline_us && !opts->degrade)
+            store_entry(cache, path, out->data, out->len);
+        put_output(cio, jpeg_fp, dest, out->data, out->len);
+        free_mem_dest(out);
+        free(out);
+    }
+
+    set_err_trap(outer);
+    cio->in->fp = NULL;
+    cio->out->fp = NULL;
+    if (mem_fp)
+        fclose(mem_fp);
+    free(slurp);
+    return data != NULL;
+}
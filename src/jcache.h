@@ -0,0 +1,51 @@
+/**
+ * @file jcache.h
+ * @brief on-disk cache of encoded JPEGs, keyed by a hash of the pixels.
+ *
+ * An entry is DIR/<key>.jpg, the key being a 64 bit hash (XXH64) of the
+ * pixels as the encoder sees them, the image size and the options that
+ * change the output.  So the same pixels hit whatever the BMP header
+ * says.  Entries are written to a temporary name and renamed into place,
+ * so processes sharing DIR never see half an entry.  A hit touches the
+ * entry; when the cache grows over its limit, the entries used longest
+ * ago are removed.
+ */
+
+#ifndef __JCACHE_H
+#define __JCACHE_H
+
+#include <pthread.h>
+#include "cjpeg.h"
+
+typedef struct {
+    char *dir;
+    UINT64 limit;           /* bytes, 0 for no limit */
+    UINT64 size;            /* bytes in the cache, as last counted */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evicted;
+    unsigned long tmp_seq;  /* names of the temporary files */
+    pthread_mutex_t lock;
+} jpeg_cache;
+
+/* create dir if needed and count what it holds.  -1 on error */
+int open_jpeg_cache(jpeg_cache *cache, const char *dir, UINT64 limit);
+void close_jpeg_cache(jpeg_cache *cache);
+
+/*
+ * bmp_to_jpeg() through the cache: hash the pixels, and on a hit copy the
+ * stored JPEG to jpeg_fp or dest without encoding.  on a miss encode and
+ * store the result, unless it was timed (deadline_us or degrade) and cannot
+ * be made again.  bmp_fp is right after is_bmp(), a pipe is read into
+ * memory first.  returns 1 on a hit.
+ */
+bool cached_bmp_to_jpeg(jpeg_cache *cache, compress_io *cio, FILE *bmp_fp,
+                        FILE *jpeg_fp, mem_dest *dest,
+                        const encode_options *opts);
+
+void print_cache_stats(jpeg_cache *cache, FILE *fp);
+
+/* XXH64 of len bytes, seed 0 (the cache keys, the pack index) */
+UINT64 hash64(const void *data, size_t len);
+
+#endif /* __JCACHE_H */
@@ -0,0 +1,125 @@
+/**
+ * @file jdeadline.c
+ * @brief the time budget of an image: projection and choice of path.
+ */
+
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "jdeadline.h"
+
+static const char *DEGRADE_NAMES[DEGRADE_LEVELS] = {"full", "coarse", "dc"};
+
+/*
+ * cost of a row on each path against the full one, until it is measured.
+ * measured on the test images: DEGRADE_COARSE saves a part of the huffman
+ * coding, DEGRADE_DC also the color conversion, DCT and quantization; the
+ * gather of the rows stays.
+ */
+static const double PRIOR_COST[DEGRADE_LEVELS] = {1.0, 0.9, 0.5};
+
+/* rows not measured, they warm the caches up */
+#define DEADLINE_WARMUP 1
+
+/* the projection must fit this share of the budget */
+#define DEADLINE_MARGIN 0.95
+
+
+static double
+now_seconds() {
+#ifdef _WIN32
+    LARGE_INTEGER freq, cnt;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&cnt);
+    return (double) cnt.QuadPart / (double) freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+void
+start_deadline(deadline_clock *dl, UINT32 budget_us, int level, UINT32 rows) {
+    int l;
+    memset(dl, 0, sizeof(*dl));
+    dl->r.budget = budget_us * 1e-6;
+    dl->r.rows = rows;
+    dl->r.level = level;
+    for (l = 0; l < DEGRADE_LEVELS; l++)
+        dl->r.from_row[l] = l == level ? 0 : rows;
+    dl->start = dl->last = now_seconds();
+}
+
+/* seconds per row on path l, from what was measured on the path before */
+static double
+row_cost(const deadline_clock *dl, int l) {
+    if (dl->row_cost[l] > 0)
+        return dl->row_cost[l];
+    return dl->row_cost[dl->r.level] * PRIOR_COST[l] / PRIOR_COST[dl->r.level];
+}
+
+int
+deadline_row_done(deadline_clock *dl, UINT32 done) {
+    double now = now_seconds();
+    double cost = now - dl->last;
+    double *c = &dl->row_cost[dl->r.level];
+    UINT32 left = dl->r.rows - done;
+    int l;
+
+    dl->last = now;
+    // 第一行有冷的cache，不算进每行的耗时；之后取滑动平均
+    if (done <= DEADLINE_WARMUP)
+        return dl->r.level;
+    *c = *c > 0 ? (*c + cost) / 2 : cost;
+    if (!left || dl->r.level == DEGRADE_LEVELS - 1)
+        return dl->r.level;
+
+    // 找第一条剩下的行来得及的路径，都来不及就用最便宜的
+    for (l = dl->r.level; l < DEGRADE_LEVELS - 1; l++)
+        if (now - dl->start + left * row_cost(dl, l) <= dl->r.budget * DEADLINE_MARGIN)
+            break;
+    if (l != dl->r.level) {
+        if (dl->r.projected == 0)
+            dl->r.projected = now - dl->start + left * row_cost(dl, dl->r.level);
+        dl->r.from_row[l] = done;
+        dl->r.level = l;
+    }
+    return l;
+}
+
+void
+end_deadline(deadline_clock *dl) {
+    dl->r.elapsed = now_seconds() - dl->start;
+}
+
+const char *
+degrade_name(int level) {
+    return level >= 0 && level < DEGRADE_LEVELS ? DEGRADE_NAMES[level] : "?";
+}
+
+void
+print_deadline_report(const deadline_report *r, FILE *fp) {
+    int l, first = 0;
+    for (l = 0; l < DEGRADE_LEVELS; l++)
+        if (r->from_row[l] == 0)
+            first = l;
+    fprintf(fp, "deadline %.3f ms: %.3f ms", r->budget * 1e3, r->elapsed * 1e3);
+    if (r->projected > 0)
+        fprintf(fp, " (projected %.3f ms all %s)", r->projected * 1e3,
+                DEGRADE_NAMES[first]);
+    fprintf(fp, ", %s\n", r->elapsed > r->budget ? "missed" : "met");
+    for (l = 0; l < DEGRADE_LEVELS; l++) {
+        UINT32 end = r->rows;
+        int m;
+        if (r->from_row[l] >= r->rows)
+            continue;
+        for (m = l + 1; m < DEGRADE_LEVELS; m++)
+            if (r->from_row[m] < end)
+                end = r->from_row[m];
+        fprintf(fp, "  %-6s MCU rows %u .. %u\n", DEGRADE_NAMES[l],
+                r->from_row[l], end - 1);
+    }
+}
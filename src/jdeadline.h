@@ -0,0 +1,61 @@
+/**
+ * @file jdeadline.h
+ * @brief encoding against a time budget: cheaper paths for the rest of an image.
+ *
+ * With encode_options.deadline_us set the encoder times every MCU row.
+ * After each row it projects the time of the rows left from the measured
+ * cost per row (the image size is in the row count), and when the budget
+ * would be missed it switches the rest of the image to the first cheaper
+ * path that fits:
+ *
+ *   DEGRADE_COARSE  the AC coefficients after zigzag COARSE_COEFS are
+ *                   dropped: coarser quantization of the high frequencies,
+ *                   with the same DQT, and less to code
+ *   DEGRADE_DC      no DCT: the DC of a block is the sum of its samples,
+ *                   all ACs are 0 (8x8 flat blocks)
+ *
+ * The quant and huffman tables do not change, so the JPEG stays valid and
+ * every row decodes.  The paths are only taken towards cheaper ones.
+ * encode_options.degrade starts the image on a path instead.
+ */
+
+#ifndef __JDEADLINE_H
+#define __JDEADLINE_H
+
+#include "cjpeg.h"
+
+#define DEGRADE_NONE    0
+#define DEGRADE_COARSE  1
+#define DEGRADE_DC      2
+#define DEGRADE_LEVELS  3
+
+#define COARSE_COEFS    10      /* zigzag coefficients kept by DEGRADE_COARSE */
+
+struct deadline_report {
+    double budget;              /* seconds */
+    double elapsed;             /* from the first MCU row to the last */
+    double projected;           /* the full image on the first path, at the
+                                   first switch; 0 when it never switched */
+    UINT32 rows;
+    UINT32 from_row[DEGRADE_LEVELS];    /* first row on each path, rows for none */
+    int level;                  /* path of the last row */
+};
+
+typedef struct {
+    deadline_report r;
+    double start;
+    double last;                /* end of the last row */
+    double row_cost[DEGRADE_LEVELS];    /* measured seconds per row, 0 unknown */
+} deadline_clock;
+
+/* an image of rows MCU rows, the first one on path level */
+void start_deadline(deadline_clock *dl, UINT32 budget_us, int level,
+                    UINT32 rows);
+/* the first done rows are coded; the path for the next one */
+int deadline_row_done(deadline_clock *dl, UINT32 done);
+void end_deadline(deadline_clock *dl);
+
+const char *degrade_name(int level);
+void print_deadline_report(const deadline_report *r, FILE *fp);
+
+#endif /* __JDEADLINE_H */
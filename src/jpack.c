@@ -0,0 +1,279 @@
+/**
+ * @file jpack.c
+ * @brief pack files: writer with aligned block writes and batched syncs,
+ * and the reading of the index and the entries.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "jpack.h"
+#include "jcache.h"
+
+#define PACK_RECORD_LEN     26      /* a record without its name */
+
+
+static UINT8 *
+put_le(UINT8 *p, UINT64 v, int n) {
+    int i;
+    for (i = 0; i < n; i++)
+        p[i] = (UINT8) (v >> (8 * i));
+    return p + n;
+}
+
+static UINT64
+get_le(const UINT8 *p, int n) {
+    UINT64 v = 0;
+    int i;
+    for (i = n - 1; i >= 0; i--)
+        v = v << 8 | p[i];
+    return v;
+}
+
+/* write all of data at offset at, retrying short writes */
+static int
+write_at(int fd, const UINT8 *data, size_t len, UINT64 at) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t) at);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t) n;
+        at += (UINT64) n;
+    }
+    return 0;
+}
+
+
+/*
+ * writing.
+ */
+
+int
+open_pack(pack_writer *pw, const char *path, UINT32 sync_every) {
+    size_t n = strlen(path);
+    char *idx_path = (char *) malloc(n + 5);
+    memset(pw, 0, sizeof(*pw));
+    pw->fd = -1;
+    pw->sync_every = sync_every ? sync_every : PACK_SYNC_DEFAULT;
+    pw->block = (UINT8 *) malloc(PACK_BLOCK);
+    if (!idx_path || !pw->block) {
+        free(idx_path);
+        free(pw->block);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(idx_path, path, n);
+    memcpy(idx_path + n, ".idx", 5);
+
+    pw->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (pw->fd >= 0)
+        pw->idx = fopen(idx_path, "wb");
+    free(idx_path);
+    if (!pw->idx || fwrite(PACK_MAGIC, 1, PACK_MAGIC_LEN, pw->idx) != PACK_MAGIC_LEN ||
+        fflush(pw->idx) != 0) {
+        int err = errno;
+        if (pw->idx)
+            fclose(pw->idx);
+        if (pw->fd >= 0)
+            close(pw->fd);
+        free(pw->block);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int
+pack_add(pack_writer *pw, const char *name, const UINT8 *data, size_t len,
+         UINT32 width, UINT32 height) {
+    pack_entry *e;
+    size_t name_len = strlen(name);
+    if (len > 0xFFFFFFFFu || name_len > 0xFFFF || width > 0xFFFF || height > 0xFFFF) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pw->npending == pw->cap) {
+        UINT32 cap = pw->cap ? pw->cap * 2 : 64;
+        pack_entry *p = (pack_entry *) realloc(pw->pending, cap * sizeof(pack_entry));
+        if (!p)
+            return -1;
+        pw->pending = p;
+        pw->cap = cap;
+    }
+    e = &pw->pending[pw->npending];
+    if (!(e->name = strdup(name)))
+        return -1;
+    e->offset = pw->size;
+    e->length = (UINT32) len;
+    e->width = (UINT16) width;
+    e->height = (UINT16) height;
+    e->hash = hash64(data, len);
+    pw->npending++;
+
+    // 攒满一个块才写，每次写的都是对齐的整块
+    while (len > 0) {
+        size_t n = PACK_BLOCK - pw->block_len < len ? PACK_BLOCK - pw->block_len : len;
+        memcpy(pw->block + pw->block_len, data, n);
+        pw->block_len += n;
+        pw->size += n;
+        data += n;
+        len -= n;
+        if (pw->block_len == PACK_BLOCK) {
+            if (write_at(pw->fd, pw->block, PACK_BLOCK, pw->block_start) < 0)
+                return -1;
+            pw->block_start += PACK_BLOCK;
+            pw->block_len = 0;
+        }
+    }
+
+    if (pw->npending >= pw->sync_every)
+        return pack_commit(pw);
+    return 0;
+}
+
+int
+pack_commit(pack_writer *pw) {
+    UINT8 rec[PACK_RECORD_LEN];
+    UINT32 i;
+    if (pw->npending == 0)
+        return 0;
+
+    // 不满的最后一块先写进去，块满了以后会在同一个位置再写一次整块
+    if (pw->block_len && write_at(pw->fd, pw->block, pw->block_len, pw->block_start) < 0)
+        return -1;
+    if (fsync(pw->fd) != 0)
+        return -1;
+
+    // 数据落盘以后，索引才记录这些条目
+    for (i = 0; i < pw->npending; i++) {
+        pack_entry *e = &pw->pending[i];
+        size_t name_len = strlen(e->name);
+        UINT8 *p = put_le(rec, e->offset, 8);
+        p = put_le(p, e->length, 4);
+        p = put_le(p, e->width, 2);
+        p = put_le(p, e->height, 2);
+        p = put_le(p, e->hash, 8);
+        put_le(p, name_len, 2);
+        if (fwrite(rec, 1, PACK_RECORD_LEN, pw->idx) != PACK_RECORD_LEN ||
+            fwrite(e->name, 1, name_len, pw->idx) != name_len)
+            return -1;
+    }
+    if (fflush(pw->idx) != 0 || fsync(fileno(pw->idx)) != 0)
+        return -1;
+
+    for (i = 0; i < pw->npending; i++)
+        free(pw->pending[i].name);
+    pw->entries += pw->npending;
+    pw->npending = 0;
+    pw->commits++;
+    return 0;
+}
+
+int
+close_pack(pack_writer *pw) {
+    int ret = pack_commit(pw);
+    UINT32 i;
+    for (i = 0; i < pw->npending; i++)
+        free(pw->pending[i].name);
+    free(pw->pending);
+    free(pw->block);
+    if (fclose(pw->idx) != 0)
+        ret = -1;
+    if (close(pw->fd) != 0)
+        ret = -1;
+    pw->pending = NULL;
+    pw->block = NULL;
+    return ret;
+}
+
+
+/*
+ * reading.
+ */
+
+pack_entry *
+read_pack_index(const char *pack_path, UINT32 *count) {
+    size_t n = strlen(pack_path);
+    char *idx_path = (char *) malloc(n + 5);
+    FILE *fp;
+    UINT8 magic[PACK_MAGIC_LEN], rec[PACK_RECORD_LEN];
+    pack_entry *entries = NULL;
+    UINT32 cap = 0;
+
+    *count = 0;
+    if (!idx_path)
+        return NULL;
+    memcpy(idx_path, pack_path, n);
+    memcpy(idx_path + n, ".idx", 5);
+    fp = fopen(idx_path, "rb");
+    free(idx_path);
+    if (!fp)
+        return NULL;
+    if (fread(magic, 1, PACK_MAGIC_LEN, fp) != PACK_MAGIC_LEN ||
+        memcmp(magic, PACK_MAGIC, PACK_MAGIC_LEN) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    // 最后一条记录可能只写了一半（写的时候中断了），就不要它
+    while (fread(rec, 1, PACK_RECORD_LEN, fp) == PACK_RECORD_LEN) {
+        size_t name_len = (size_t) get_le(rec + 24, 2);
+        char *name = (char *) malloc(name_len + 1);
+        pack_entry *e;
+        if (!name)
+            break;
+        if (fread(name, 1, name_len, fp) != name_len) {
+            free(name);
+            break;
+        }
+        name[name_len] = '\0';
+        if (*count == cap) {
+            UINT32 c = cap ? cap * 2 : 256;
+            pack_entry *p = (pack_entry *) realloc(entries, c * sizeof(pack_entry));
+            if (!p) {
+                free(name);
+                break;
+            }
+            entries = p;
+            cap = c;
+        }
+        e = &entries[(*count)++];
+        e->name = name;
+        e->offset = get_le(rec, 8);
+        e->length = (UINT32) get_le(rec + 8, 4);
+        e->width = (UINT16) get_le(rec + 12, 2);
+        e->height = (UINT16) get_le(rec + 14, 2);
+        e->hash = get_le(rec + 16, 8);
+    }
+    fclose(fp);
+    if (!entries)   /* an empty pack */
+        entries = (pack_entry *) malloc(sizeof(pack_entry));
+    return entries;
+}
+
+void
+free_pack_index(pack_entry *entries, UINT32 count) {
+    UINT32 i;
+    for (i = 0; i < count; i++)
+        free(entries[i].name);
+    free(entries);
+}
+
+UINT8 *
+read_pack_entry(FILE *pack, const pack_entry *e) {
+    UINT8 *data = (UINT8 *) malloc(e->length ? e->length : 1);
+    if (!data)
+        return NULL;
+    if (fseeko(pack, (off_t) e->offset, SEEK_SET) != 0 ||
+        fread(data, 1, e->length, pack) != e->length ||
+        hash64(data, e->length) != e->hash) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
@@ -0,0 +1,72 @@
+/**
+ * @file jpack.h
+ * @brief pack files: many JPEGs in one file, with a sidecar index.
+ *
+ * PACK holds the JPEGs back to back.  PACK.idx starts with PACK_MAGIC and
+ * has one record per entry: offset and length in PACK, width, height, the
+ * XXH64 of the JPEG bytes and the name.  The pack is written in blocks of
+ * PACK_BLOCK bytes at block aligned offsets.  A commit, every sync_every
+ * entries and at the end, writes the partial last block as well, syncs the
+ * pack, and only then appends the records of the new entries to the index
+ * and syncs it.  So the index never names bytes that are not on disk,
+ * wherever the writer stops; a reader ignores a half written record.
+ */
+
+#ifndef __JPACK_H
+#define __JPACK_H
+
+#include "cjpeg.h"
+
+#define PACK_MAGIC          "BJPKIDX1"
+#define PACK_MAGIC_LEN      8
+#define PACK_BLOCK          (1 << 20)   /* bytes per write */
+#define PACK_SYNC_DEFAULT   1024        /* entries per commit */
+
+typedef struct {
+    char *name;
+    UINT64 offset;
+    UINT32 length;
+    UINT16 width;
+    UINT16 height;
+    UINT64 hash;
+} pack_entry;
+
+typedef struct {
+    int fd;                 /* the pack */
+    FILE *idx;
+    UINT8 *block;           /* the block being filled */
+    UINT64 block_start;     /* its offset in the pack */
+    size_t block_len;
+    UINT64 size;            /* bytes in the pack */
+    pack_entry *pending;    /* entries since the last commit */
+    UINT32 npending;
+    UINT32 cap;
+    UINT32 sync_every;
+    UINT64 entries;         /* committed */
+    UINT32 commits;
+} pack_writer;
+
+/* create (truncate) path and path.idx.  -1 with errno set on failure */
+int open_pack(pack_writer *pw, const char *path, UINT32 sync_every);
+
+/* append a JPEG; commits when sync_every entries are pending.  -1 on error */
+int pack_add(pack_writer *pw, const char *name, const UINT8 *data,
+             size_t len, UINT32 width, UINT32 height);
+
+int pack_commit(pack_writer *pw);
+
+/* commit what is pending and close.  -1 when that fails */
+int close_pack(pack_writer *pw);
+
+
+/* the committed entries of pack_path.idx, NULL when it cannot be read */
+pack_entry *read_pack_index(const char *pack_path, UINT32 *count);
+void free_pack_index(pack_entry *entries, UINT32 count);
+
+/*
+ * the bytes of entry e of the pack, malloc'd.  NULL when they cannot be
+ * read or their hash is not the one of the index.
+ */
+UINT8 *read_pack_entry(FILE *pack, const pack_entry *e);
+
+#endif /* __JPACK_H */
@@ -0,0 +1,245 @@
+/**
+ * @file jperf.c
+ * @brief per stage counters: a perf_event_open group read at the boundaries.
+ */
+
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "jperf.h"
+
+static const char *STAGE_NAMES[PERF_STAGES] = {
+        "gather", "color", "fdct", "quant", "huff"
+};
+
+
+static double
+now_seconds() {
+#ifdef _WIN32
+    LARGE_INTEGER freq, cnt;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&cnt);
+    return (double) cnt.QuadPart / (double) freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+#ifdef __linux__
+
+static int
+open_counter(UINT32 type, UINT64 config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group < 0;      /* the group starts with its leader */
+    attr.exclude_kernel = 1;        /* allowed with perf_event_paranoid 2 */
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/* the counters now, the running ones scaled up when they were multiplexed */
+static bool
+read_group(perf_profile *p, UINT64 now[PERF_EVENTS], UINT64 *enabled,
+           UINT64 *running) {
+    UINT64 buf[3 + PERF_EVENTS];
+    int e;
+    if (read(p->group, buf, sizeof(buf)) < (ssize_t) (3 + p->open) * 8)
+        return false;
+    *enabled = buf[1];
+    *running = buf[2];
+    for (e = 0; e < PERF_EVENTS; e++)
+        now[e] = p->slot[e] < 0 ? 0 : buf[3 + p->slot[e]];
+    return true;
+}
+
+#endif /* __linux__ */
+
+void
+init_perf_profile(perf_profile *p) {
+    memset(p, 0, sizeof(*p));
+    p->group = -1;
+    memset(p->fd, -1, sizeof(p->fd));
+    memset(p->slot, -1, sizeof(p->slot));
+#ifdef __linux__
+    static const UINT32 types[PERF_EVENTS] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+    };
+    static const UINT64 configs[PERF_EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int e, err = 0;
+
+    // 第一个能打开的计数器做组长，其它的加进这个组，打不开的就不算了
+    for (e = 0; e < PERF_EVENTS; e++) {
+        int fd = open_counter(types[e], configs[e], p->group);
+        if (fd < 0) {
+            if (!err)
+                err = errno;
+            continue;
+        }
+        if (p->group < 0)
+            p->group = fd;
+        p->fd[e] = fd;
+        p->slot[e] = p->open++;
+    }
+    if (p->group < 0) {
+        p->missing = err == ENOSYS ? "perf_event_open is not available"
+                   : err == EACCES || err == EPERM
+                     ? "no permission (see /proc/sys/kernel/perf_event_paranoid)"
+                     : "no hardware counters";
+        return;
+    }
+    ioctl(p->group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+    p->missing = "hardware counters need Linux";
+#endif
+}
+
+static void
+close_counters(perf_profile *p) {
+#ifdef __linux__
+    int e;
+    if (p->group >= 0)
+        ioctl(p->group, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    for (e = 0; e < PERF_EVENTS; e++)
+        if (p->fd[e] >= 0)
+            close(p->fd[e]);
+#endif
+    memset(p->fd, -1, sizeof(p->fd));
+    p->group = -1;
+}
+
+void
+free_perf_profile(perf_profile *p) {
+    close_counters(p);
+    free(p->ycc);
+    free(p->q);
+    p->ycc = NULL;
+    p->q = NULL;
+    p->units = 0;
+}
+
+bool
+perf_units(perf_profile *p, UINT32 n) {
+    if (n > p->units) {
+        ycbcr_unit *ycc = (ycbcr_unit *) realloc(p->ycc, n * sizeof(ycbcr_unit));
+        if (ycc)
+            p->ycc = ycc;
+        quant_unit *q = (quant_unit *) realloc(p->q, n * sizeof(quant_unit));
+        if (q)
+            p->q = q;
+        if (!ycc || !q)
+            return false;
+        p->units = n;
+    }
+    return true;
+}
+
+void
+perf_start(perf_profile *p) {
+#ifdef __linux__
+    if (p->group >= 0 &&
+        !read_group(p, p->last, &p->last_enabled, &p->last_running)) {
+        close_counters(p);
+        p->missing = "reading the counters failed";
+    }
+#endif
+    p->images++;
+    p->last_time = now_seconds();
+}
+
+void
+perf_stage_done(perf_profile *p, perf_stage s) {
+#ifdef __linux__
+    if (p->group >= 0) {
+        UINT64 now[PERF_EVENTS], enabled, running;
+        if (read_group(p, now, &enabled, &running)) {
+            UINT64 de = enabled - p->last_enabled, dr = running - p->last_running;
+            int e;
+            for (e = 0; e < PERF_EVENTS; e++) {
+                UINT64 d = now[e] - p->last[e];
+                // 计数器轮流上PMU的时候，按没有计数的时间比例放大
+                if (dr && dr < de)
+                    d = (UINT64) ((double) d * de / dr);
+                p->count[s][e] += d;
+                p->last[e] = now[e];
+            }
+            p->last_enabled = enabled;
+            p->last_running = running;
+        } else {
+            close_counters(p);
+            p->missing = "reading the counters failed";
+        }
+    }
+#endif
+    double t = now_seconds();
+    p->seconds[s] += t - p->last_time;
+    p->last_time = t;
+}
+
+/* counter e, or NULL when it is missing */
+static const UINT64 *
+counted(const perf_profile *p, perf_stage s, perf_event e) {
+    return p->missing || p->slot[e] < 0 ? NULL : &p->count[s][e];
+}
+
+static void
+print_per_mcu(FILE *fp, const UINT64 *c, double mcus, int digits) {
+    if (c)
+        fprintf(fp, " %10.*f", digits, *c / mcus);
+    else
+        fprintf(fp, " %10s", "-");
+}
+
+void
+print_perf_profile(const perf_profile *p, FILE *fp) {
+    double total = 0;
+    double mcus = p->mcus ? (double) p->mcus : 1;
+    int s;
+
+    for (s = 0; s < PERF_STAGES; s++)
+        total += p->seconds[s];
+    fprintf(fp, "%u image(s), %llu MCUs, %.3f ms in the stages\n", p->images,
+            (unsigned long long) p->mcus, total * 1e3);
+    if (p->missing)
+        fprintf(fp, "hardware counters: %s, time only\n", p->missing);
+    fprintf(fp, "%-7s %9s %6s %10s %6s %10s %10s %10s\n", "stage", "ms", "%",
+            "cyc/MCU", "IPC", "L1D/MCU", "LLC/MCU", "br/MCU");
+    for (s = 0; s < PERF_STAGES; s++) {
+        const UINT64 *cycles = counted(p, s, PERF_CYCLES);
+        const UINT64 *insns = counted(p, s, PERF_INSTRUCTIONS);
+        fprintf(fp, "%-7s %9.3f %6.1f", STAGE_NAMES[s], p->seconds[s] * 1e3,
+                total > 0 ? p->seconds[s] * 100 / total : 0);
+        print_per_mcu(fp, cycles, mcus, 1);
+        if (cycles && insns && *cycles)
+            fprintf(fp, " %6.2f", (double) *insns / *cycles);
+        else
+            fprintf(fp, " %6s", "-");
+        print_per_mcu(fp, counted(p, s, PERF_L1D_MISSES), mcus, 2);
+        print_per_mcu(fp, counted(p, s, PERF_LLC_MISSES), mcus, 3);
+        print_per_mcu(fp, counted(p, s, PERF_BRANCH_MISSES), mcus, 2);
+        fprintf(fp, "\n");
+    }
+}
@@ -0,0 +1,73 @@
+/**
+ * @file jperf.h
+ * @brief hardware counters of the encoder stages (perf_event_open, Linux).
+ *
+ * With encode_options.perf set the encoder runs every MCU row one stage at
+ * a time: the gather of the band from the input, color conversion, DCT,
+ * quantization and huffman coding (with stuffing and output) of all its
+ * MCUs.  Between the stages it reads a group of counters: cycles,
+ * instructions, L1D read misses, last level cache misses and branch
+ * misses, in user space only.  The output is that of the usual loop.
+ *
+ * Where the counters cannot be opened (not Linux, perf_event_paranoid, a
+ * container that blocks the syscall) or one of them is missing, the
+ * profile has the time of the stages and whatever counters there are.
+ */
+
+#ifndef __JPERF_H
+#define __JPERF_H
+
+#include "cjpeg.h"
+
+typedef enum {
+    PERF_GATHER,
+    PERF_COLOR,
+    PERF_FDCT,
+    PERF_QUANT,
+    PERF_HUFF,
+    PERF_STAGES
+} perf_stage;
+
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_EVENTS
+} perf_event;
+
+struct perf_profile {
+    int fd[PERF_EVENTS];        /* -1 when missing */
+    int group;                  /* fd of the group leader, -1 for none */
+    int slot[PERF_EVENTS];      /* index in a group read, -1 when missing */
+    int open;                   /* counters in the group */
+    const char *missing;        /* why there are no counters, or NULL */
+    UINT64 last[PERF_EVENTS];   /* at the last boundary */
+    UINT64 last_enabled;
+    UINT64 last_running;
+    double last_time;
+    UINT64 count[PERF_STAGES][PERF_EVENTS];
+    double seconds[PERF_STAGES];
+    UINT64 mcus;
+    UINT32 images;
+    ycbcr_unit *ycc;            /* the MCUs of a band between the stages */
+    quant_unit *q;
+    UINT32 units;
+};
+
+/* open the counters of the calling thread; without them only time */
+void init_perf_profile(perf_profile *p);
+void free_perf_profile(perf_profile *p);
+/* room for the MCUs of a band of n MCUs.  0 on no memory */
+bool perf_units(perf_profile *p, UINT32 n);
+
+/* the next stage boundary is the start of the image */
+void perf_start(perf_profile *p);
+/* what happened since the last boundary was stage s */
+void perf_stage_done(perf_profile *p, perf_stage s);
+
+/* time, IPC and misses per MCU of every stage */
+void print_perf_profile(const perf_profile *p, FILE *fp);
+
+#endif /* __JPERF_H */
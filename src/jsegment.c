@@ -0,0 +1,138 @@
+/**
+ * @file jsegment.c
+ * @brief segments of MCU rows: their files, and merging them into a JPEG.
+ */
+
+#include <string.h>
+#include "jsegment.h"
+#include "cmarker.h"
+
+
+static UINT8 *
+put_le32(UINT8 *p, UINT32 v) {
+    p[0] = (UINT8) v;
+    p[1] = (UINT8) (v >> 8);
+    p[2] = (UINT8) (v >> 16);
+    p[3] = (UINT8) (v >> 24);
+    return p + 4;
+}
+
+static UINT32
+get_le32(const UINT8 *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (UINT32) p[3] << 24;
+}
+
+void
+write_segment_head(compress_io *cio, const jpeg_segment *seg) {
+    UINT8 head[SEG_HEAD_LEN];
+    UINT8 *p = head + SEG_MAGIC_LEN;
+    memcpy(head, SEG_MAGIC, SEG_MAGIC_LEN);
+    p = put_le32(p, seg->width);
+    p = put_le32(p, seg->height);
+    p = put_le32(p, seg->scale);
+    p = put_le32(p, seg->restart);
+    p = put_le32(p, seg->abbreviated);
+    p = put_le32(p, seg->first);
+    put_le32(p, seg->rows);
+    write_bytes(cio, head, SEG_HEAD_LEN);
+}
+
+bool
+read_segment(FILE *fp, jpeg_segment *seg) {
+    UINT8 head[SEG_HEAD_LEN];
+    size_t cap = 1 << 16, n;
+    memset(seg, 0, sizeof(*seg));
+    if (fread(head, 1, SEG_HEAD_LEN, fp) != SEG_HEAD_LEN ||
+        memcmp(head, SEG_MAGIC, SEG_MAGIC_LEN) != 0)
+        return false;
+    seg->width = get_le32(head + 8);
+    seg->height = get_le32(head + 12);
+    seg->scale = get_le32(head + 16);
+    seg->restart = (UINT16) get_le32(head + 20);
+    seg->abbreviated = get_le32(head + 24) != 0;
+    seg->first = get_le32(head + 28);
+    seg->rows = get_le32(head + 32);
+    if (!seg->width || !seg->height || !seg->restart || !seg->rows)
+        return false;
+
+    /* the data runs to the end of the file */
+    if (!(seg->data = (UINT8 *) malloc(cap)))
+        err_exit(BUFFER_ALLOC_ERR);
+    while ((n = fread(seg->data + seg->len, 1, cap - seg->len, fp)) > 0) {
+        seg->len += n;
+        if (seg->len == cap) {
+            UINT8 *data = (UINT8 *) realloc(seg->data, cap *= 2);
+            if (!data) {
+                free_segment(seg);
+                err_exit(BUFFER_ALLOC_ERR);
+            }
+            seg->data = data;
+        }
+    }
+    if (ferror(fp)) {
+        free_segment(seg);
+        return false;
+    }
+    return true;
+}
+
+void
+free_segment(jpeg_segment *seg) {
+    free(seg->data);
+    seg->data = NULL;
+    seg->len = 0;
+}
+
+static int
+cmp_first(const void *a, const void *b) {
+    UINT32 x = ((const jpeg_segment *) a)->first;
+    UINT32 y = ((const jpeg_segment *) b)->first;
+    return x < y ? -1 : x > y;
+}
+
+void
+merge_segments(compress_io *cio, jpeg_segment *segs, int count) {
+    UINT32 mcusPerRow, mcuRows, next = 0;
+    quant_tables qtbl;
+    bmp_info frame;
+    int i;
+
+    if (count < 1)
+        err_exit(SEGMENT_ERR);
+    qsort(segs, count, sizeof(jpeg_segment), cmp_first);
+    mcusPerRow = (segs[0].width + DCTSIZE - 1) / DCTSIZE;
+    mcuRows = (segs[0].height + MCUSIZE - 1) / MCUSIZE;
+    // 每一段都是同一幅图像、同样的参数，一段接着一段，正好盖满所有的MCU行
+    for (i = 0; i < count; i++) {
+        const jpeg_segment *s = &segs[i];
+        if (s->width != segs[0].width || s->height != segs[0].height ||
+            s->scale != segs[0].scale || s->restart != segs[0].restart ||
+            s->abbreviated != segs[0].abbreviated || s->first != next ||
+            s->rows > mcuRows - next ||
+            (UINT64) s->first * mcusPerRow % s->restart)
+            err_exit(SEGMENT_ERR);
+        next += s->rows;
+    }
+    if (next != mcuRows)
+        err_exit(SEGMENT_ERR);
+
+    /* the headers of a single process encode */
+    init_tables_once();
+    init_quant_tables(&qtbl, segs[0].scale);
+    memset(&frame, 0, sizeof(frame));
+    frame.width = segs[0].width;
+    frame.height = segs[0].height;
+    write_file_header(cio);
+    write_frame_header(cio, &frame, segs[0].abbreviated ? NULL : &qtbl, 0);
+    write_scan_header(cio, segs[0].restart, !segs[0].abbreviated, 0);
+
+    // 段之间的RSTn是下一段第一个interval前面的那个，编号接着整幅图像
+    for (i = 0; i < count; i++) {
+        if (i > 0) {
+            UINT64 interval = (UINT64) segs[i].first * mcusPerRow / segs[i].restart;
+            write_marker(cio, M_RST0 + (int) ((interval - 1) & 7));
+        }
+        write_bytes(cio, segs[i].data, segs[i].len);
+    }
+    write_file_trailer(cio);
+}
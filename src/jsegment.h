@@ -0,0 +1,51 @@
+/**
+ * @file jsegment.h
+ * @brief segments: the entropy coded data of a range of MCU rows, encoded
+ * on its own, and the merging of segments into one JPEG.
+ *
+ * A segment covers MCU rows [first, first + rows) of the image.  It starts
+ * on a restart interval with the DC predictions reset and ends padded to a
+ * byte, so segments coded by different processes or machines join with
+ * an RSTn marker between them.  The merged JPEG is the one a single
+ * process writes with the same restart interval (one interval per MCU row
+ * when none is given).  A segment file is SEG_HEAD_LEN bytes of head, all
+ * little endian, and the stuffed data:
+ *
+ *   SEG_MAGIC, width, height, scale, restart, abbreviated, first, rows
+ */
+
+#ifndef __JSEGMENT_H
+#define __JSEGMENT_H
+
+#include "cjpeg.h"
+
+#define SEG_MAGIC       "BJSEG001"
+#define SEG_MAGIC_LEN   8
+#define SEG_HEAD_LEN    36
+
+typedef struct {
+    UINT32 width;       /* the whole (cropped) image */
+    UINT32 height;
+    UINT32 scale;
+    UINT16 restart;     /* MCUs per restart interval */
+    bool abbreviated;
+    UINT32 first;       /* MCU rows of the segment */
+    UINT32 rows;
+    UINT8 *data;        /* the stuffed data, when read */
+    size_t len;
+} jpeg_segment;
+
+void write_segment_head(compress_io *cio, const jpeg_segment *seg);
+
+/* read a segment file.  0 when fp does not hold one */
+bool read_segment(FILE *fp, jpeg_segment *seg);
+void free_segment(jpeg_segment *seg);
+
+/*
+ * write the JPEG of count segments, given in any order: headers, the data
+ * with RSTn between the segments, EOI.  the segments must belong to one
+ * image and cover each of its MCU rows once, or SEGMENT_ERR.
+ */
+void merge_segments(compress_io *cio, jpeg_segment *segs, int count);
+
+#endif /* __JSEGMENT_H */
@@ -0,0 +1,300 @@
+/**
+ * @file jsimd.c
+ * @brief CPU feature detection, kernel selection and the kernel self-test.
+ */
+
+#include <string.h>
+#include "jsimd.h"
+
+#ifdef JSIMD_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+
+const jpeg_kernels jsimd_scalar = {
+        "scalar",
+        rgb_to_ycbcr,
+        jpeg_fdct_unit,
+        jpeg_quant,
+        jpeg_huff_block,
+        stuff_bytes
+};
+
+static const char *LEVEL_NAMES[SIMD_LEVELS] = {
+        "scalar", "sse2", "avx2", "avx512"
+};
+
+
+/*
+ * the best level this CPU and OS can run.  AVX needs the OS to save the
+ * ymm (and for AVX-512 the zmm and mask) registers, checked with xgetbv.
+ */
+simd_level
+jsimd_detect() {
+#ifdef JSIMD_X86
+    unsigned int a, b, c, d;
+    unsigned long long xcr0;
+    simd_level level = SIMD_SCALAR;
+    int leaf7 = 0;
+
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 0);
+    leaf7 = r[0] >= 7;
+    __cpuid(r, 1);
+    a = r[0], b = r[1], c = r[2], d = r[3];
+#else
+    leaf7 = __get_cpuid_max(0, NULL) >= 7;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return SIMD_SCALAR;
+#endif
+    if (!(d & (1u << 26)))                      /* SSE2 */
+        return level;
+    level = SIMD_SSE2;
+    if (!(c & (1u << 27)) || !(c & (1u << 28)) || !leaf7)  /* OSXSAVE, AVX */
+        return level;
+
+#if defined(_MSC_VER)
+    xcr0 = _xgetbv(0);
+    __cpuidex(r, 7, 0);
+    b = r[1];
+#else
+    {
+        unsigned int lo, hi;
+        __asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+        xcr0 = ((unsigned long long) hi << 32) | lo;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+#endif
+    if ((xcr0 & 0x06) != 0x06 || !(b & (1u << 5)))     /* ymm state, AVX2 */
+        return level;
+    level = SIMD_AVX2;
+    if ((xcr0 & 0xE6) == 0xE6 &&                       /* zmm and k state */
+        (b & (1u << 16)) && (b & (1u << 30)))          /* AVX512F, AVX512BW */
+        level = SIMD_AVX512;
+    return level;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+/* kernel table of a level, NULL when it is not built in */
+const jpeg_kernels *
+jsimd_variant(simd_level level) {
+    switch (level) {
+        case SIMD_SCALAR:
+            return &jsimd_scalar;
+#ifdef JSIMD_X86
+        case SIMD_SSE2:
+            return &jsimd_sse2;
+        case SIMD_AVX2:
+            return &jsimd_avx2;
+        case SIMD_AVX512:
+            return &jsimd_avx512;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+
+static const jpeg_kernels *bound;
+
+static simd_level
+level_by_name(const char *name) {
+    int i;
+    for (i = 0; i < SIMD_LEVELS; i++)
+        if (!strcmp(name, LEVEL_NAMES[i]))
+            return (simd_level) i;
+    return SIMD_LEVELS;
+}
+
+/*
+ * bind the kernels of a level by name ("scalar", "sse2", "avx2", "avx512"),
+ * or "auto" for the best one.  a level the CPU cannot run falls back to the
+ * best one it can.  returns -1 for an unknown name.
+ */
+int
+jsimd_select(const char *name) {
+    simd_level best = jsimd_detect();
+    simd_level level = strcmp(name, "auto") ? level_by_name(name) : best;
+    if (level == SIMD_LEVELS)
+        return -1;
+    if (level > best) {
+        fprintf(stderr, "%s is not supported here, using %s\n",
+                name, LEVEL_NAMES[best]);
+        level = best;
+    }
+    bound = jsimd_variant(level);
+    return 0;
+}
+
+/*
+ * kernels in use.  the first call picks them, from BMP2JPEG_SIMD when it is
+ * set; threaded callers make it through init_tables_once() first.
+ */
+const jpeg_kernels *
+jsimd_kernels() {
+    if (!bound) {
+        const char *env = getenv("BMP2JPEG_SIMD");
+        if (!env || jsimd_select(env) < 0)
+            jsimd_select("auto");
+    }
+    return bound;
+}
+
+
+/*
+ * self-test: run every kernel the CPU supports on random input and compare
+ * it with the scalar one.  returns the number of mismatches.
+ */
+
+static UINT32 test_seed;
+
+static UINT32
+test_rand() {
+    test_seed = test_seed * 1103515245 + 12345;
+    return test_seed >> 8;
+}
+
+static int
+test_color(const jpeg_kernels *k) {
+    UINT8 planes[COMP_NUM][64 * MCUSIZE];
+    pixel_band band;
+    ycbcr_unit ref, out;
+    int i, c, x;
+    for (c = 0; c < COMP_NUM; c++) {
+        for (i = 0; i < 64 * MCUSIZE; i++)
+            planes[c][i] = (UINT8) test_rand();
+        band.plane[c] = planes[c];
+    }
+    /* the extremes, they decide the wrap of cb and cr */
+    for (i = 0; i < COMP_NUM; i++)
+        for (c = 0; c < COMP_NUM; c++)
+            planes[c][i] = c == i ? 255 : 0;
+    band.stride = 64;
+    for (x = 0; x < 64; x += DCTSIZE) {
+        jsimd_scalar.color(&band, x, &ref);
+        k->color(&band, x, &out);
+        if (memcmp(&ref, &out, sizeof(ref)))
+            return 1;
+    }
+    return 0;
+}
+
+static int
+test_fdct(const jpeg_kernels *k) {
+    ycbcr_unit ref, out;
+    float *f = (float *) &ref;
+    int i;
+    for (i = 0; i < 3 * DCTSIZE2; i++)
+        f[i] = (float) ((int) (test_rand() % 256) - 128);
+    out = ref;
+    jsimd_scalar.fdct(&ref);
+    k->fdct(&out);
+    return memcmp(&ref, &out, sizeof(ref)) != 0;
+}
+
+static int
+test_quant(const jpeg_kernels *k, UINT32 scale) {
+    ycbcr_unit ycc;
+    quant_unit ref, out;
+    quant_tables tbl;
+    float *f = (float *) &ycc;
+    int i;
+    init_quant_tables(&tbl, scale);
+    for (i = 0; i < 3 * DCTSIZE2; i++)
+        f[i] = (float) ((int) (test_rand() % 16384) - 8192) / 3.0f;
+    jsimd_scalar.quant(&ycc, &ref, &tbl);
+    k->quant(&ycc, &out, &tbl);
+    return memcmp(&ref, &out, sizeof(ref)) != 0;
+}
+
+static int
+test_huff(const jpeg_kernels *k) {
+    UINT8 ref_buf[4 * HUFF_BLOCK_MAX], out_buf[4 * HUFF_BLOCK_MAX];
+    INT16 coef[DCTSIZE2];
+    INT16 ref_dc = 0, out_dc = 0;
+    huff_state ref, out;
+    int i, n;
+    ref.acc = out.acc = 0;
+    ref.len = out.len = 0;
+    ref.out = ref_buf;
+    out.out = out_buf;
+    for (n = 0; n < 4; n++) {
+        /* from dense to sparse, with long zero runs */
+        for (i = 0; i < DCTSIZE2; i++) {
+            INT16 v = (INT16) ((int) (test_rand() % 2047) - 1023);
+            coef[i] = test_rand() % 4 < (UINT32) (3 - n) ? v : 0;
+        }
+        if (n == 3)
+            coef[DCTSIZE2 - 1] = -1;
+        jsimd_scalar.huff(&ref, coef, &ref_dc, h_tables.lu_dc, h_tables.lu_ac);
+        k->huff(&out, coef, &out_dc, h_tables.lu_dc, h_tables.lu_ac);
+    }
+    return ref.out - ref_buf != out.out - out_buf || ref.len != out.len ||
+           ref_dc != out_dc || memcmp(ref_buf, out_buf, ref.out - ref_buf) ||
+           ((ref.acc ^ out.acc) & ((1ull << ref.len) - 1));
+}
+
+static int
+test_stuff(const jpeg_kernels *k) {
+    UINT8 src[300], ref[600], out[600];
+    size_t len, i;
+    for (i = 0; i < sizeof(src); i++)
+        src[i] = test_rand() % 3 ? 0xFF : (UINT8) test_rand();
+    for (len = 0; len <= sizeof(src); len += 1 + len / 4) {
+        size_t n = jsimd_scalar.stuff(ref, src + sizeof(src) - len, len);
+        if (k->stuff(out, src + sizeof(src) - len, len) != n ||
+            memcmp(ref, out, n))
+            return 1;
+    }
+    return 0;
+}
+
+int
+jsimd_self_test(FILE *report) {
+    static const UINT32 scales[] = {1, 25, 50, 100, 200, 5000};
+    simd_level best = jsimd_detect();
+    int level, i, fails = 0;
+
+    init_tables_once();
+    for (i = 0; i < DCTSIZE2; i++)
+        if (NATURAL[ZIGZAG[i]] != i)
+            fails++;
+
+    for (level = SIMD_SCALAR + 1; level < SIMD_LEVELS; level++) {
+        const jpeg_kernels *k = jsimd_variant((simd_level) level);
+        int bad = 0, round, s;
+        if (!k || level > (int) best) {
+            fprintf(report, "%-8s skipped (%s)\n", LEVEL_NAMES[level],
+                    k ? "not supported by this CPU" : "not built in");
+            continue;
+        }
+        test_seed = 1;
+        for (round = 0; round < 200; round++) {
+            if (test_color(k))
+                bad |= 1;
+            if (test_fdct(k))
+                bad |= 2;
+            for (s = 0; s < (int) (sizeof(scales) / sizeof(scales[0])); s++)
+                if (test_quant(k, scales[s]))
+                    bad |= 4;
+            if (test_huff(k))
+                bad |= 8;
+            if (test_stuff(k))
+                bad |= 16;
+        }
+        fprintf(report, "%-8s %s%s%s%s%s%s\n", LEVEL_NAMES[level],
+                bad ? "FAILED:" : "ok",
+                bad & 1 ? " color" : "", bad & 2 ? " fdct" : "",
+                bad & 4 ? " quant" : "", bad & 8 ? " huff" : "",
+                bad & 16 ? " stuff" : "");
+        fails += bad != 0;
+    }
+    return fails;
+}
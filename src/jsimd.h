@@ -0,0 +1,185 @@
+/**
+ * @file jsimd.h
+ * @brief hot encoder stages, one kernel table per instruction set.
+ *
+ * every table produces bit-identical output, the scalar one is the
+ * reference.  the best table the CPU supports is bound on first use, the
+ * BMP2JPEG_SIMD environment variable or jsimd_select() can force another.
+ */
+
+#ifndef __JSIMD_H
+#define __JSIMD_H
+
+#include "cjpeg.h"
+
+#if defined(JSIMD_X86_KERNELS) && (defined(__x86_64__) || defined(_M_X64))
+#define JSIMD_X86   1           /* SSE2, AVX2 and AVX-512 kernels built in */
+#endif
+
+
+typedef enum {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_LEVELS
+} simd_level;
+
+
+/* huffman coder state, bits are collected in acc and written to out */
+typedef struct {
+    UINT64 acc;
+    int len;                    /* valid bits at the bottom of acc */
+    UINT8 *out;                 /* raw bytes, not yet stuffed */
+} huff_state;
+
+#define HUFF_BLOCK_MAX  256     /* worst case bytes of one coded block */
+
+/* one quantized block, reordered and ready for coding */
+typedef struct {
+    UINT64 nonzero;             /* bit k set when zigzag coefficient k != 0 */
+    UINT8 nbits[DCTSIZE2];      /* bit length of |coefficient| */
+    UINT16 val[DCTSIZE2];       /* amplitude bits, v - 1 for negative v */
+} huff_block;
+
+typedef struct {
+    const char *name;
+    /* 8x8 block of a pixel band at column x to YCbCr, minus 128 */
+    void (*color)(const pixel_band *band, int x, ycbcr_unit *ycc);
+    /* forward DCT of the three blocks */
+    void (*fdct)(ycbcr_unit *ycc);
+    void (*quant)(const ycbcr_unit *ycc, quant_unit *q,
+                  const quant_tables *tbl);
+    /* code one block (natural order) into hs */
+    void (*huff)(huff_state *hs, const INT16 *coef, INT16 *dc,
+                 const BITS *dc_htable, const BITS *ac_htable);
+    /* copy len bytes, with a 0x00 after every 0xFF, return bytes written */
+    size_t (*stuff)(UINT8 *dst, const UINT8 *src, size_t len);
+} jpeg_kernels;
+
+
+/* natural order index of each zigzag position, the inverse of ZIGZAG */
+static const UINT8 NATURAL[DCTSIZE2] = {
+        0, 1, 8, 16, 9, 2, 3, 10,
+        17, 24, 32, 25, 18, 11, 4, 5,
+        12, 19, 26, 33, 40, 48, 41, 34,
+        27, 20, 13, 6, 7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36,
+        29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46,
+        53, 60, 61, 54, 47, 55, 62, 63
+};
+
+
+/* scalar kernels */
+
+void rgb_to_ycbcr(const pixel_band *band, int x, ycbcr_unit *ycc_unit);
+void jpeg_fdct_unit(ycbcr_unit *ycc_unit);
+void jpeg_quant(const ycbcr_unit *ycc_unit, quant_unit *q_unit,
+                const quant_tables *tbl);
+void jpeg_huff_block(huff_state *hs, const INT16 *coef, INT16 *dc,
+                     const BITS *dc_htable, const BITS *ac_htable);
+size_t stuff_bytes(UINT8 *dst, const UINT8 *src, size_t len);
+
+extern const jpeg_kernels jsimd_scalar;
+#ifdef JSIMD_X86
+extern const jpeg_kernels jsimd_sse2;
+extern const jpeg_kernels jsimd_avx2;
+extern const jpeg_kernels jsimd_avx512;
+#endif
+
+
+/* dispatch */
+
+simd_level jsimd_detect();
+const jpeg_kernels *jsimd_variant(simd_level level);
+int jsimd_select(const char *name);
+const jpeg_kernels *jsimd_kernels();
+int jsimd_self_test(FILE *report);
+
+
+/*
+ * the coding itself is the same for every table, the kernels differ in how
+ * they fill the huff_block.
+ */
+
+static inline int
+huff_nbits(UINT32 v) {
+#if defined(__GNUC__)
+    return v ? 32 - __builtin_clz(v) : 0;
+#else
+    int n = 0;
+    while (v) {
+        n++;
+        v >>= 1;
+    }
+    return n;
+#endif
+}
+
+static inline int
+huff_ctz64(UINT64 v) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    while (!(v & 1)) {
+        n++;
+        v >>= 1;
+    }
+    return n;
+#endif
+}
+
+/* append the low len bits of code, len <= 32 */
+static inline void
+huff_put(huff_state *hs, UINT32 code, int len) {
+    hs->acc = (hs->acc << len) | code;
+    hs->len += len;
+    if (hs->len >= 32) {
+        while (hs->len >= 8) {
+            hs->len -= 8;
+            *hs->out++ = (UINT8) (hs->acc >> hs->len);
+        }
+    }
+}
+
+static inline void
+huff_emit(huff_state *hs, const huff_block *blk, INT16 coef_dc, INT16 *dc,
+          const BITS *dc_htable, const BITS *ac_htable) {
+    UINT64 nz;
+    int last = 0;
+
+    /* DC: the difference to the previous block of the same component */
+    // 先写【幅值所需要的位数】对应的哈夫曼码字，再写幅值对应的码字
+    INT16 diff = coef_dc - *dc;
+    int n = huff_nbits(diff >= 0 ? diff : -diff);
+    UINT16 bits = diff >= 0 ? diff : diff - 1;
+    *dc = coef_dc;
+    huff_put(hs, ((UINT32) dc_htable[n].val << n) | (bits & ((1u << n) - 1)),
+             dc_htable[n].len + n);
+
+    /* AC: run of zeros and bit length in one code, then the amplitude */
+    // 连续的0超过16个，每16个0写一个"1111/0000"（ZRL）
+    for (nz = blk->nonzero & ~(UINT64) 1; nz; nz &= nz - 1) {
+        int k = huff_ctz64(nz);
+        int run = k - last - 1;
+        const BITS *code;
+        while (run >= 16) {
+            huff_put(hs, ac_htable[0xF0].val, ac_htable[0xF0].len);
+            run -= 16;
+        }
+        n = blk->nbits[k];
+        code = &ac_htable[run * 16 + n];
+        huff_put(hs, ((UINT32) code->val << n) | (blk->val[k] & ((1u << n) - 1)),
+                 code->len + n);
+        last = k;
+    }
+
+    /* end of block, unless the last coefficient is not 0 */
+    // 对于尾巴上连续的0，直接写入一个EOB(0/0)
+    if (last != DCTSIZE2 - 1)
+        huff_put(hs, ac_htable[0].val, ac_htable[0].len);
+}
+
+#endif /* __JSIMD_H */
@@ -0,0 +1,141 @@
+/**
+ * @file jstats.c
+ * @brief per MCU bit costs: storage, files and summary.
+ */
+
+#include <string.h>
+#include "jstats.h"
+
+
+void
+init_mcu_stats(mcu_stats *st) {
+    memset(st, 0, sizeof(*st));
+}
+
+void
+free_mcu_stats(mcu_stats *st) {
+    free(st->mcu);
+    init_mcu_stats(st);
+}
+
+bool
+start_mcu_stats(mcu_stats *st, UINT32 cols, UINT32 rows) {
+    size_t n = (size_t) cols * rows;
+    if (n != (size_t) st->cols * st->rows) {
+        mcu_stat *mcu = (mcu_stat *) realloc(st->mcu, (n ? n : 1) * sizeof(mcu_stat));
+        if (!mcu)
+            return false;
+        st->mcu = mcu;
+    }
+    st->cols = cols;
+    st->rows = rows;
+    memset(st->mcu, 0, n * sizeof(mcu_stat));
+    return true;
+}
+
+static UINT32
+total_bits(const mcu_stat *m) {
+    return (UINT32) m->bits[0] + m->bits[1] + m->bits[2];
+}
+
+static void
+put_le(UINT8 *p, UINT32 v, int n) {
+    int i;
+    for (i = 0; i < n; i++)
+        p[i] = (UINT8) (v >> (8 * i));
+}
+
+bool
+write_mcu_stats(const mcu_stats *st, FILE *fp) {
+    UINT8 rec[8];
+    size_t i, n = (size_t) st->cols * st->rows;
+    put_le(rec, st->cols, 4);
+    put_le(rec + 4, st->rows, 4);
+    if (fwrite(STATS_MAGIC, 1, STATS_MAGIC_LEN, fp) != STATS_MAGIC_LEN ||
+        fwrite(rec, 1, 8, fp) != 8)
+        return false;
+    for (i = 0; i < n; i++) {
+        const mcu_stat *m = &st->mcu[i];
+        put_le(rec, m->bits[0], 2);
+        put_le(rec + 2, m->bits[1], 2);
+        put_le(rec + 4, m->bits[2], 2);
+        rec[6] = m->nonzero;
+        rec[7] = m->flags;
+        if (fwrite(rec, 1, 8, fp) != 8)
+            return false;
+    }
+    return true;
+}
+
+bool
+write_mcu_heatmap(const mcu_stats *st, FILE *fp) {
+    size_t i, n = (size_t) st->cols * st->rows;
+    UINT32 max = 1;
+    for (i = 0; i < n; i++)
+        if (total_bits(&st->mcu[i]) > max)
+            max = total_bits(&st->mcu[i]);
+    fprintf(fp, "P5\n# bits per MCU, 255 = %u\n%u %u\n255\n", max, st->cols, st->rows);
+    for (i = 0; i < n; i++)
+        if (fputc((int) ((UINT64) total_bits(&st->mcu[i]) * 255 / max), fp) == EOF)
+            return false;
+    return true;
+}
+
+#define BITS_BUCKETS    12      /* < 16, < 32, ... , < 16 << 10, the rest */
+#define NZ_BUCKETS      13      /* 0, 1..16, 17..32, ... , 177..192 */
+
+void
+print_mcu_summary(const mcu_stats *st, FILE *fp) {
+    UINT64 comp[COMP_NUM] = {0, 0, 0}, total = 0;
+    UINT64 bitsCount[BITS_BUCKETS] = {0}, bitsSum[BITS_BUCKETS] = {0};
+    UINT64 nzCount[NZ_BUCKETS] = {0}, nzSum[NZ_BUCKETS] = {0};
+    UINT64 dcOnly = 0, dcOnlyBits = 0;
+    size_t i, n = (size_t) st->cols * st->rows;
+    int b, c;
+
+    for (i = 0; i < n; i++) {
+        const mcu_stat *m = &st->mcu[i];
+        UINT32 bits = total_bits(m);
+        for (c = 0; c < COMP_NUM; c++)
+            comp[c] += m->bits[c];
+        total += bits;
+        for (b = 0; b < BITS_BUCKETS - 1 && bits >= (16u << b); b++)
+            ;
+        bitsCount[b]++;
+        bitsSum[b] += bits;
+        b = (m->nonzero + 15) / 16;
+        nzCount[b]++;
+        nzSum[b] += bits;
+        if (m->flags & STAT_DC_ONLY) {
+            dcOnly++;
+            dcOnlyBits += bits;
+        }
+    }
+    if (!n || !total)
+        return;
+
+    fprintf(fp, "%u x %u MCUs, %llu bits, %.1f bits per MCU\n", st->cols, st->rows,
+            (unsigned long long) total, (double) total / n);
+    fprintf(fp, "Y %.1f%%  Cb %.1f%%  Cr %.1f%% of the bits\n", 100.0 * comp[0] / total,
+            100.0 * comp[1] / total, 100.0 * comp[2] / total);
+    fprintf(fp, "DC only: %.1f%% of the MCUs, %.1f%% of the bits\n",
+            100.0 * dcOnly / n, 100.0 * dcOnlyBits / total);
+    fprintf(fp, "bits per MCU      MCUs    bits\n");
+    for (b = 0; b < BITS_BUCKETS; b++) {
+        if (!bitsCount[b])
+            continue;
+        if (b < BITS_BUCKETS - 1)
+            fprintf(fp, "  %5u..%-5u  %6.1f%%  %5.1f%%\n", b ? 16u << (b - 1) : 0,
+                    (16u << b) - 1, 100.0 * bitsCount[b] / n, 100.0 * bitsSum[b] / total);
+        else
+            fprintf(fp, "  %5u..       %6.1f%%  %5.1f%%\n", 16u << (b - 1),
+                    100.0 * bitsCount[b] / n, 100.0 * bitsSum[b] / total);
+    }
+    fprintf(fp, "non-zero coefs    MCUs    bits\n");
+    for (b = 0; b < NZ_BUCKETS; b++) {
+        if (!nzCount[b])
+            continue;
+        fprintf(fp, "  %5u..%-5u  %6.1f%%  %5.1f%%\n", b ? 16u * (b - 1) + 1 : 0,
+                16u * b, 100.0 * nzCount[b] / n, 100.0 * nzSum[b] / total);
+    }
+}
@@ -0,0 +1,52 @@
+/**
+ * @file jstats.h
+ * @brief where the bits go: the cost of every MCU of an image.
+ *
+ * With encode_options.stats set the encoder records, per MCU, the huffman
+ * coded bits of Y, Cb and Cr (before byte stuffing), the non-zero quantized
+ * coefficients and whether only the DCs are non-zero.  Without it nothing
+ * is measured.  The record is written as a binary file, a PGM heatmap with
+ * one pixel per MCU, and a summary with histograms.
+ *
+ * The binary file is STATS_MAGIC, the columns and rows of MCUs (LE u32)
+ * and 8 bytes per MCU, row by row: bits of Y, Cb, Cr (LE u16), non-zero
+ * coefficients and flags (STAT_DC_ONLY).
+ */
+
+#ifndef __JSTATS_H
+#define __JSTATS_H
+
+#include "cjpeg.h"
+
+#define STATS_MAGIC     "BJMCUST1"
+#define STATS_MAGIC_LEN 8
+#define STAT_DC_ONLY    0x01
+
+typedef struct {
+    UINT16 bits[COMP_NUM];
+    UINT8 nonzero;      /* of the 3 * 64 coefficients */
+    UINT8 flags;
+} mcu_stat;
+
+struct mcu_stats {
+    UINT32 cols;        /* MCUs per row */
+    UINT32 rows;
+    mcu_stat *mcu;      /* rows * cols */
+};
+
+void init_mcu_stats(mcu_stats *st);
+void free_mcu_stats(mcu_stats *st);
+/* size st for an image of cols * rows MCUs, cleared.  0 on no memory */
+bool start_mcu_stats(mcu_stats *st, UINT32 cols, UINT32 rows);
+
+/* the entry of the MCU at (col, row), or NULL when st is NULL */
+#define MCU_STAT(st, col, row) \
+    ((st) ? &(st)->mcu[(size_t) (row) * (st)->cols + (col)] : NULL)
+
+/* 0 on a write error */
+bool write_mcu_stats(const mcu_stats *st, FILE *fp);
+/* total bits per MCU as gray levels, the costliest MCU white */
+bool write_mcu_heatmap(const mcu_stats *st, FILE *fp);
+void print_mcu_summary(const mcu_stats *st, FILE *fp);
+
+#endif /* __JSTATS_H */
@@ -0,0 +1,116 @@
+/**
+ * @file jtables.c
+ * @brief the computation of the color conversion, quantization and huffman
+ * tables.
+ *
+ * The tables of the standard options are computed once, at build time, by
+ * tools/gen_tables.c, which links this file and writes them out as const
+ * data (jtables_gen.c in the build directory).  The encoder only calls
+ * init_quant_tables() itself, for a scale other than DEFAULT_SCALE.
+ */
+
+#include "cjpeg.h"
+
+
+/*
+ * precalculated tables for a faster YCbCr->RGB transformation.
+ * use a INT32 table because we'll scale values by 2^16 and
+ * work with integers.
+ */
+
+void
+init_ycbcr_tables(ycbcr_tables *tbl) {
+    UINT16 i;
+    for (i = 0; i < 256; i++) {
+        tbl->r2y[i] = (INT32) (65536 * 0.299 + 0.5) * i;
+        tbl->r2cb[i] = (INT32) (65536 * -0.16874 + 0.5) * i;
+        tbl->r2cr[i] = (INT32) (32768) * i;
+        tbl->g2y[i] = (INT32) (65536 * 0.587 + 0.5) * i;
+        tbl->g2cb[i] = (INT32) (65536 * -0.33126 + 0.5) * i;
+        tbl->g2cr[i] = (INT32) (65536 * -0.41869 + 0.5) * i;
+        tbl->b2y[i] = (INT32) (65536 * 0.114 + 0.5) * i;
+        tbl->b2cb[i] = (INT32) (32768) * i;
+        tbl->b2cr[i] = (INT32) (65536 * -0.08131 + 0.5) * i;
+    }
+}
+
+
+/* quantization */
+
+void
+init_quant_tables(quant_tables *tbl, UINT32 scale_factor) {
+    int temp1, temp2;
+    int i, x, y;
+    for (i = 0; i < DCTSIZE2; i++) {
+        temp1 = ((UINT32) STD_LU_QTABLE[i] * scale_factor + 50) / 100;
+        if (temp1 < 1)
+            temp1 = 1;
+        if (temp1 > 255)
+            temp1 = 255;
+        tbl->lu[ZIGZAG[i]] = (UINT8) temp1;
+
+        temp2 = ((UINT32) STD_CH_QTABLE[i] * scale_factor + 50) / 100;
+        if (temp2 < 1)
+            temp2 = 1;
+        if (temp2 > 255)
+            temp2 = 255;
+        tbl->ch[ZIGZAG[i]] = (UINT8) temp2;
+    }
+
+    // 量化时要除以的数，和AAN的缩放系数一起算好倒数，量化的时候只要做乘法
+    i = 0;
+    for (x = 0; x < DCTSIZE; x++) {
+        for (y = 0; y < DCTSIZE; y++) {
+            tbl->lu_recip[i] = 1.0 / ((double) tbl->lu[ZIGZAG[i]] * \
+                    AAN_SCALE_FACTOR[x] * AAN_SCALE_FACTOR[y] * 8.0);
+            tbl->ch_recip[i] = 1.0 / ((double) tbl->ch[ZIGZAG[i]] * \
+                    AAN_SCALE_FACTOR[x] * AAN_SCALE_FACTOR[y] * 8.0);
+            i++;
+        }
+    }
+}
+
+
+/* huffman compression */
+
+void
+set_huff_table(UINT8 *nrcodes, UINT8 *values, BITS *h_table) {
+    // nrcodes：长度位i的哈夫曼码字有nrcides[i]个
+    // values：哈夫曼码字的解码后的值（原始值）
+    // 变量名都是abcdijk，很难读懂到底在写什么。。。。。。
+    // values和value，看着两个变量差不多，其实意思完全不一样。。。。。。
+    int i, j, k;
+    j = 0;
+    // value：哈夫曼码字
+    UINT16 value = 0;
+    for (i = 1; i <= 16; i++) {
+        // i：哈夫曼码字的长度
+        // nrcodes[i]：长度位i的哈夫曼码字有多少个
+        for (k = 0; k < nrcodes[i]; k++) {
+            // j：当前迭代到第几个【原始值】了
+            // 构建【原始值】->【哈夫曼码字】的映射
+            // 设置哈夫曼码字的长度和哈夫曼码字的值
+            h_table[values[j]].len = i;
+            h_table[values[j]].val = value;
+            j++;
+            // 迭代哈夫曼码字。在哈夫曼码字长度不变的情况下，下一个哈夫曼码字就是当前的哈夫曼码字加一
+            value++;
+        }
+        // 迭代哈夫曼码字。如果进入下一个哈夫曼码字长度（哈夫曼码字长度加1）
+        // 则下一个哈夫曼码字就是当前的哈夫曼码字后面填个0，也就是左移1位！
+        value <<= 1;
+    }
+}
+
+void
+init_huff_tables(huff_tables *tbl) {
+    // 设置【原始值】->【哈夫曼码字】的映射，方便jpeg编码的时候用
+    // 亮度，DC哈夫曼表
+    set_huff_table(STD_LU_DC_NRCODES, STD_LU_DC_VALUES, tbl->lu_dc);
+    // 亮度，AC哈夫曼表
+    set_huff_table(STD_LU_AC_NRCODES, STD_LU_AC_VALUES, tbl->lu_ac);
+    // 色度，DC哈夫曼表
+    set_huff_table(STD_CH_DC_NRCODES, STD_CH_DC_VALUES, tbl->ch_dc);
+    // 色度，AC哈夫曼表
+    set_huff_table(STD_CH_AC_NRCODES, STD_CH_AC_VALUES, tbl->ch_ac);
+}
@@ -0,0 +1,365 @@
+/**
+ * @file jwatch.c
+ * @brief watch folder: inotify events to a pool of encoder threads.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+#include "jwatch.h"
+#include "rdbmp.h"
+#include "rdimg.h"
+
+typedef struct watch_job {
+    struct watch_job *next;
+    char *name;                 /* in the spool */
+    double landed;              /* when the event came */
+} watch_job;
+
+static struct {
+    const watch_options *wopts;
+    const encode_options *opts;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    watch_job *todo_head;
+    watch_job *todo_tail;
+    bool stopping;
+    UINT32 depth;               /* queued and being encoded */
+    UINT32 max_depth;
+    unsigned long done;
+    unsigned long failed;
+    double recent[WATCH_RECENT];
+    unsigned long latencies;    /* ever recorded, the last ones in recent */
+    double max_latency;
+} wq;
+
+static volatile sig_atomic_t stop_requested;
+static volatile sig_atomic_t stats_requested;
+
+
+static void
+on_signal(int sig) {
+    if (sig == SIGUSR1)
+        stats_requested = 1;
+    else
+        stop_requested = 1;
+}
+
+static double
+now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *
+join_path(const char *dir, const char *name, const char *suffix) {
+    char *path = (char *) malloc(strlen(dir) + strlen(name) + strlen(suffix) + 2);
+    if (path)
+        sprintf(path, "%s/%s%s", dir, name, suffix);
+    return path;
+}
+
+/* ".name", JPEGs and the like are not for us */
+static bool
+wanted_name(const char *name) {
+    const char *dot = strrchr(name, '.');
+    if (name[0] == '.')
+        return 0;
+    return !dot || (strcasecmp(dot, ".jpg") && strcasecmp(dot, ".jpeg"));
+}
+
+
+/*
+ * worker side.
+ */
+
+/* encode job into its output, renamed into place.  0 or the err_exit code */
+static int
+encode_job(compress_io *cio, frame_cache *fc, watch_job *job, int worker) {
+    const watch_options *wopts = wq.wopts;
+    const char *out_dir = wopts->out_dir ? wopts->out_dir : wopts->spool;
+    encode_options opts = *wq.opts;
+    FILE *volatile in_fp = NULL;
+    FILE *volatile out_fp = NULL;
+    image_source *volatile src = NULL;
+    char *volatile tmp_path = NULL;
+    char *volatile out_path = NULL;
+    char *in_path = join_path(wopts->spool, job->name, "");
+    const char *dot = strrchr(job->name, '.');
+    UINT8 magic[2];
+    jmp_buf trap;
+    int code, n;
+
+    opts.setup = fc;
+    if ((code = setjmp(trap)) != 0) {
+        fc->width = 0;
+        goto done;
+    }
+    set_err_trap(&trap);
+
+    // 输出先写到.名字.worker.tmp，写完了再改名，读输出目录的人看不到写了一半的JPEG
+    n = dot && dot != job->name ? (int) (dot - job->name) : (int) strlen(job->name);
+    out_path = (char *) malloc(strlen(out_dir) + n + 6);
+    tmp_path = (char *) malloc(strlen(out_dir) + n + 32);
+    if (!in_path || !out_path || !tmp_path)
+        err_exit(BUFFER_ALLOC_ERR);
+    sprintf(out_path, "%s/%.*s.jpg", out_dir, n, job->name);
+    sprintf(tmp_path, "%s/.%.*s.%d.tmp", out_dir, n, job->name, worker);
+
+    if (!(in_fp = fopen(in_path, "rb")))
+        err_exit(FILE_OPEN_ERR);
+    if (fread(magic, 1, 2, in_fp) != 2)
+        err_exit(FILE_READ_ERR);
+    if (!(magic[0] == 0x42 && magic[1] == 0x4D) && !(src = open_image_source(in_fp, magic)))
+        err_exit(FILE_TYPE_ERR);
+    if (!(out_fp = fopen(tmp_path, "wb")))
+        err_exit(FILE_OPEN_ERR);
+    if (src)
+        image_to_jpeg(cio, src, out_fp, NULL, &opts);
+    else
+        bmp_to_jpeg(cio, in_fp, out_fp, NULL, &opts);
+    code = fclose(out_fp);
+    out_fp = NULL;
+    if (code != 0 || rename(tmp_path, out_path) != 0)
+        err_exit(BUFFER_WRITE_ERR);
+    code = 0;
+
+done:
+    set_err_trap(NULL);
+    close_image_source(src);
+    if (in_fp)
+        fclose(in_fp);
+    if (out_fp)
+        fclose(out_fp);
+    if (code) {
+        fprintf(stderr, "%s: %s\n", job->name, last_err());
+        if (tmp_path)
+            remove(tmp_path);
+    } else if (wopts->done_dir) {
+        char *done_path = join_path(wopts->done_dir, job->name, "");
+        if (!done_path || rename(in_path, done_path) != 0)
+            perror(job->name);
+        free(done_path);
+    } else if (wopts->remove_source && remove(in_path) != 0)
+        perror(job->name);
+    free(in_path);
+    free(tmp_path);
+    free(out_path);
+    return code;
+}
+
+static void *
+worker_main(void *arg) {
+    int worker = (int) (size_t) arg;
+    compress_io cio;
+    frame_cache fc;
+
+    /* warm state, kept for every file of this worker */
+    init_mem(&cio, NULL, 0, NULL, MEM_OUT_SIZE);
+    init_frame_cache(&fc);
+
+    for (;;) {
+        watch_job *job;
+        double latency;
+        int code;
+
+        pthread_mutex_lock(&wq.lock);
+        while (!wq.todo_head && !wq.stopping)
+            pthread_cond_wait(&wq.cond, &wq.lock);
+        job = wq.todo_head;
+        if (!job) {
+            pthread_mutex_unlock(&wq.lock);
+            break;
+        }
+        wq.todo_head = job->next;
+        if (!wq.todo_head)
+            wq.todo_tail = NULL;
+        pthread_mutex_unlock(&wq.lock);
+
+        code = encode_job(&cio, &fc, job, worker);
+        latency = now_seconds() - job->landed;
+
+        pthread_mutex_lock(&wq.lock);
+        wq.depth--;
+        if (code)
+            wq.failed++;
+        else {
+            wq.done++;
+            wq.recent[wq.latencies++ % WATCH_RECENT] = latency;
+            if (latency > wq.max_latency)
+                wq.max_latency = latency;
+        }
+        pthread_mutex_unlock(&wq.lock);
+        free(job->name);
+        free(job);
+    }
+
+    free_frame_cache(&fc);
+    free_mem(&cio);
+    return NULL;
+}
+
+
+/*
+ * watching side.
+ */
+
+static void
+queue_file(const char *name, double landed) {
+    watch_job *job = (watch_job *) malloc(sizeof(watch_job));
+    if (!job || !(job->name = strdup(name))) {
+        free(job);
+        fprintf(stderr, "%s: out of memory, skipped\n", name);
+        return;
+    }
+    job->next = NULL;
+    job->landed = landed;
+    pthread_mutex_lock(&wq.lock);
+    if (wq.todo_tail)
+        wq.todo_tail->next = job;
+    else
+        wq.todo_head = job;
+    wq.todo_tail = job;
+    if (++wq.depth > wq.max_depth)
+        wq.max_depth = wq.depth;
+    pthread_cond_signal(&wq.cond);
+    pthread_mutex_unlock(&wq.lock);
+}
+
+/* what is in the spool already, or was missed by an event queue overflow */
+static void
+scan_spool(const char *spool) {
+    DIR *dir = opendir(spool);
+    struct dirent *de;
+    double now = now_seconds();
+    if (!dir) {
+        perror(spool);
+        return;
+    }
+    while ((de = readdir(dir)) != NULL)
+        if ((de->d_type == DT_REG || de->d_type == DT_UNKNOWN) && wanted_name(de->d_name))
+            queue_file(de->d_name, now);
+    closedir(dir);
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+print_watch_stats(FILE *fp) {
+    double sorted[WATCH_RECENT];
+    size_t n;
+
+    pthread_mutex_lock(&wq.lock);
+    n = wq.latencies < WATCH_RECENT ? (size_t) wq.latencies : WATCH_RECENT;
+    memcpy(sorted, wq.recent, n * sizeof(double));
+    fprintf(fp, "queue %u (max %u), %lu done, %lu failed", wq.depth,
+            wq.max_depth, wq.done, wq.failed);
+    if (n) {
+        qsort(sorted, n, sizeof(double), cmp_double);
+        fprintf(fp, ", latency p50 %.3f ms p99 %.3f ms max %.3f ms (last %lu)",
+                sorted[n / 2] * 1e3, sorted[(size_t) (n * 0.99)] * 1e3,
+                wq.max_latency * 1e3, (unsigned long) n);
+    }
+    fprintf(fp, "\n");
+    pthread_mutex_unlock(&wq.lock);
+}
+
+int
+watch_folder(const watch_options *wopts, const encode_options *opts) {
+    int workers = wopts->workers < 1 ? 1 : wopts->workers;
+    pthread_t *threads;
+    struct sigaction sa;
+    union {
+        struct inotify_event ev;
+        char buf[16 * (sizeof(struct inotify_event) + 256)];
+    } events;
+    int fd, i;
+
+    init_tables_once();
+    memset(&wq, 0, sizeof(wq));
+    wq.wopts = wopts;
+    wq.opts = opts;
+    pthread_mutex_init(&wq.lock, NULL);
+    pthread_cond_init(&wq.cond, NULL);
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, wopts->spool, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror(wopts->spool);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    threads = (pthread_t *) malloc(workers * sizeof(pthread_t));
+    if (!threads)
+        err_exit(BUFFER_ALLOC_ERR);
+    for (i = 0; i < workers; i++)
+        pthread_create(&threads[i], NULL, worker_main, (void *) (size_t) i);
+    fprintf(stderr, "watching %s with %d workers\n", wopts->spool, workers);
+
+    // 先装好watch再扫一遍目录，这样中间落下的文件不会漏掉（可能会编码两次）
+    scan_spool(wopts->spool);
+
+    while (!stop_requested) {
+        struct pollfd pfd;
+        ssize_t len;
+        char *p;
+
+        if (stats_requested) {
+            stats_requested = 0;
+            print_watch_stats(stderr);
+        }
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        while ((len = read(fd, events.buf, sizeof(events.buf))) > 0) {
+            double now = now_seconds();
+            for (p = events.buf; p < events.buf + len;) {
+                struct inotify_event *ev = (struct inotify_event *) p;
+                if (ev->mask & IN_Q_OVERFLOW)
+                    scan_spool(wopts->spool);
+                else if (ev->len && !(ev->mask & IN_ISDIR) && wanted_name(ev->name))
+                    queue_file(ev->name, now);
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+    }
+
+    /* finish what is queued */
+    pthread_mutex_lock(&wq.lock);
+    wq.stopping = 1;
+    pthread_cond_broadcast(&wq.cond);
+    pthread_mutex_unlock(&wq.lock);
+    for (i = 0; i < workers; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    close(fd);
+
+    print_watch_stats(stderr);
+    return 0;
+}
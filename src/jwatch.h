@@ -0,0 +1,39 @@
+/**
+ * @file jwatch.h
+ * @brief watch folder: encode the images dropped into a spool directory.
+ *
+ * inotify reports every file closed after writing (IN_CLOSE_WRITE) or
+ * moved into the directory (IN_MOVED_TO); the file is queued right away
+ * to a pool of encoder threads, which keep their buffers and header setup
+ * between files.  A JPEG is written to a temporary name and renamed into
+ * place, so a reader of the output directory never sees half of one.  The
+ * source is then left, moved or deleted.  Names starting with '.' and
+ * JPEGs are ignored, so the spool may be the output directory as well.
+ *
+ * The counters (queue depth, files done and failed, latency from the
+ * event to the renamed JPEG) are printed on SIGUSR1 and at the end.
+ */
+
+#ifndef __JWATCH_H
+#define __JWATCH_H
+
+#include "cjpeg.h"
+
+#define WATCH_RECENT    4096    /* latencies kept for the percentiles */
+
+typedef struct {
+    const char *spool;
+    const char *out_dir;        /* NULL for the spool */
+    const char *done_dir;       /* move sources here, or NULL */
+    bool remove_source;         /* delete sources, when no done_dir */
+    int workers;
+} watch_options;
+
+/*
+ * encode what lands in wopts->spool, files already there first, until
+ * SIGINT or SIGTERM; the files queued by then are finished.  returns 0, or
+ * 1 when the spool cannot be watched.
+ */
+int watch_folder(const watch_options *wopts, const encode_options *opts);
+
+#endif /* __JWATCH_H */
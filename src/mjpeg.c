@@ -0,0 +1,521 @@
+/**
+ * @file mjpeg.c
+ * @brief Motion-JPEG: a sequence of BMP frames into an AVI, a JPEG stream or
+ * a pack file.
+ *
+ * Worker threads take the frames in order and encode each one into a slot
+ * of a ring, 2 slots per worker.  The calling thread writes the slots out
+ * in frame order and frees them, so no more frames than that are held in
+ * memory however long the sequence is.  The slot buffers keep their size
+ * from frame to frame, and so do the IO buffers, quant tables and header
+ * bytes of every worker (frame_cache).
+ */
+
+#include <glob.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "mjpeg.h"
+#include "rdbmp.h"
+#include "jpack.h"
+
+typedef struct {
+    bool done;          /* encoded, waiting to be written */
+    INT32 status;       /* 0, or the err_exit code */
+    const char *err;
+    UINT32 width;       /* size of the frame, for the AVI headers */
+    UINT32 height;
+    mem_dest jpeg;
+} seq_slot;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char **frames;
+    int count;
+    int next;           /* next frame to hand to a worker */
+    int written;        /* frames written out */
+    bool stopping;
+    seq_slot *slots;
+    int depth;
+    const encode_options *opts;
+} seq;
+
+
+/*
+ * frame list.
+ */
+
+static bool
+add_frame(char ***frames, int *count, int *cap, const char *name) {
+    if (*count == *cap) {
+        int n = *cap ? *cap * 2 : 64;
+        char **f = (char **) realloc(*frames, n * sizeof(char *));
+        if (!f)
+            return 0;
+        *frames = f;
+        *cap = n;
+    }
+    if (!((*frames)[*count] = strdup(name)))
+        return 0;
+    (*count)++;
+    return 1;
+}
+
+static bool
+add_list(char ***frames, int *count, int *cap, const char *list) {
+    char line[4096];
+    FILE *fp = fopen(list, "r");
+    bool ok = 1;
+    if (!fp)
+        return 0;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0])
+            ok = add_frame(frames, count, cap, line);
+    }
+    fclose(fp);
+    return ok;
+}
+
+char **
+expand_frames(char **args, int nargs, int *count) {
+    char **frames = NULL;
+    int cap = 0, i;
+    bool ok = 1;
+    *count = 0;
+    for (i = 0; ok && i < nargs; i++) {
+        if (args[i][0] == '@')
+            ok = add_list(&frames, count, &cap, args[i] + 1);
+        else if (strpbrk(args[i], "*?[")) {
+            glob_t g;
+            size_t j;
+            ok = glob(args[i], 0, NULL, &g) == 0;
+            for (j = 0; ok && j < g.gl_pathc; j++)
+                ok = add_frame(&frames, count, &cap, g.gl_pathv[j]);
+            globfree(&g);
+        } else
+            ok = add_frame(&frames, count, &cap, args[i]);
+    }
+    if (!ok) {
+        free_frames(frames, *count);
+        return NULL;
+    }
+    return frames;
+}
+
+void
+free_frames(char **frames, int count) {
+    int i;
+    for (i = 0; i < count; i++)
+        free(frames[i]);
+    free(frames);
+}
+
+
+/*
+ * workers.
+ */
+
+static void
+encode_frame(compress_io *cio, frame_cache *fc, const char *path,
+             seq_slot *slot) {
+    encode_options opts = *seq.opts;
+    FILE *volatile bmp_fp = NULL;
+    jmp_buf trap;
+    int code;
+
+    opts.setup = fc;
+    slot->jpeg.len = 0;
+    slot->status = 0;
+    slot->err = NULL;
+
+    if ((code = setjmp(trap)) != 0) {
+        slot->status = code;
+        slot->err = last_err();
+        /* the headers may be half written */
+        fc->width = 0;
+        goto done;
+    }
+    set_err_trap(&trap);
+
+    bmp_fp = fopen(path, "rb");
+    if (!bmp_fp)
+        err_exit(FILE_OPEN_ERR);
+    if (!is_bmp(bmp_fp))
+        err_exit(FILE_TYPE_ERR);
+    bmp_to_jpeg(cio, bmp_fp, NULL, &slot->jpeg, &opts);
+    slot->width = fc->width;
+    slot->height = fc->height;
+
+done:
+    set_err_trap(NULL);
+    if (bmp_fp)
+        fclose(bmp_fp);
+}
+
+static void *
+seq_worker(void *arg) {
+    compress_io cio;
+    frame_cache fc;
+    (void) arg;
+
+    init_mem(&cio, NULL, 0, NULL, MEM_OUT_SIZE);
+    init_frame_cache(&fc);
+
+    for (;;) {
+        int i;
+
+        pthread_mutex_lock(&seq.lock);
+        while (!seq.stopping && seq.next < seq.count &&
+               seq.next - seq.written >= seq.depth)
+            pthread_cond_wait(&seq.cond, &seq.lock);
+        if (seq.stopping || seq.next >= seq.count) {
+            pthread_mutex_unlock(&seq.lock);
+            break;
+        }
+        i = seq.next++;
+        pthread_mutex_unlock(&seq.lock);
+
+        encode_frame(&cio, &fc, seq.frames[i], &seq.slots[i % seq.depth]);
+
+        pthread_mutex_lock(&seq.lock);
+        seq.slots[i % seq.depth].done = 1;
+        pthread_cond_broadcast(&seq.cond);
+        pthread_mutex_unlock(&seq.lock);
+    }
+
+    free_frame_cache(&fc);
+    free_mem(&cio);
+    return NULL;
+}
+
+
+/*
+ * AVI container: RIFF 'AVI ' with the headers (hdrl), the frames as '00dc'
+ * chunks (movi) and an index (idx1).  the headers have a fixed size and are
+ * written again with the final numbers at the end.
+ */
+
+#define AVI_HEAD_LEN    224     /* RIFF .. LIST movi */
+#define AVI_MAX_SIZE    0xFFFF0000u
+
+typedef struct {
+    UINT32 offset;      /* from the 'movi' fourcc */
+    UINT32 size;
+} avi_index;
+
+typedef struct {
+    UINT32 frames;
+    UINT32 width;
+    UINT32 height;
+    UINT32 max_frame;
+    UINT32 movi_len;    /* chunks in movi, with their headers */
+    avi_index *index;
+    UINT32 index_cap;
+} avi_writer;
+
+static UINT8 *
+put32(UINT8 *p, UINT32 v) {
+    p[0] = (UINT8) v;
+    p[1] = (UINT8) (v >> 8);
+    p[2] = (UINT8) (v >> 16);
+    p[3] = (UINT8) (v >> 24);
+    return p + 4;
+}
+
+static UINT8 *
+put16(UINT8 *p, UINT16 v) {
+    p[0] = (UINT8) v;
+    p[1] = (UINT8) (v >> 8);
+    return p + 2;
+}
+
+static UINT8 *
+putcc(UINT8 *p, const char *fourcc) {
+    memcpy(p, fourcc, 4);
+    return p + 4;
+}
+
+static bool
+avi_write_head(FILE *fp, const avi_writer *avi, int fps) {
+    UINT8 head[AVI_HEAD_LEN];
+    UINT8 *p = head;
+    UINT32 idx_len = 8 + avi->frames * 16;
+
+    p = putcc(p, "RIFF");
+    p = put32(p, AVI_HEAD_LEN - 8 + avi->movi_len + idx_len);
+    p = putcc(p, "AVI ");
+
+    p = putcc(p, "LIST");
+    p = put32(p, 192);
+    p = putcc(p, "hdrl");
+    p = putcc(p, "avih");
+    p = put32(p, 56);
+    p = put32(p, 1000000 / fps);            /* microseconds per frame */
+    p = put32(p, avi->max_frame * fps);     /* max bytes per second */
+    p = put32(p, 0);                        /* padding granularity */
+    p = put32(p, 0x10);                     /* AVIF_HASINDEX */
+    p = put32(p, avi->frames);
+    p = put32(p, 0);                        /* initial frames */
+    p = put32(p, 1);                        /* streams */
+    p = put32(p, avi->max_frame);           /* suggested buffer size */
+    p = put32(p, avi->width);
+    p = put32(p, avi->height);
+    memset(p, 0, 16);
+    p += 16;
+
+    p = putcc(p, "LIST");
+    p = put32(p, 116);
+    p = putcc(p, "strl");
+    p = putcc(p, "strh");
+    p = put32(p, 56);
+    p = putcc(p, "vids");
+    p = putcc(p, "MJPG");
+    p = put32(p, 0);                        /* flags */
+    p = put16(p, 0);                        /* priority */
+    p = put16(p, 0);                        /* language */
+    p = put32(p, 0);                        /* initial frames */
+    p = put32(p, 1);                        /* scale */
+    p = put32(p, fps);                      /* rate, rate / scale = fps */
+    p = put32(p, 0);                        /* start */
+    p = put32(p, avi->frames);              /* length */
+    p = put32(p, avi->max_frame);
+    p = put32(p, 0xFFFFFFFF);               /* quality: default */
+    p = put32(p, 0);                        /* sample size: varies */
+    p = put16(p, 0);                        /* frame rectangle */
+    p = put16(p, 0);
+    p = put16(p, (UINT16) avi->width);
+    p = put16(p, (UINT16) avi->height);
+
+    p = putcc(p, "strf");                   /* BITMAPINFOHEADER */
+    p = put32(p, 40);
+    p = put32(p, 40);
+    p = put32(p, avi->width);
+    p = put32(p, avi->height);
+    p = put16(p, 1);                        /* planes */
+    p = put16(p, 24);                       /* bits per pixel */
+    p = putcc(p, "MJPG");
+    p = put32(p, avi->width * avi->height * 3);
+    memset(p, 0, 16);
+    p += 16;
+
+    p = putcc(p, "LIST");
+    p = put32(p, 4 + avi->movi_len);
+    p = putcc(p, "movi");
+
+    return fwrite(head, 1, AVI_HEAD_LEN, fp) == AVI_HEAD_LEN;
+}
+
+static bool
+avi_write_frame(FILE *fp, avi_writer *avi, const seq_slot *slot) {
+    UINT8 chunk[8];
+    UINT32 len = (UINT32) slot->jpeg.len;
+    UINT32 padded = len + (len & 1);
+
+    if (avi->frames == 0) {
+        avi->width = slot->width;
+        avi->height = slot->height;
+    } else if (slot->width != avi->width || slot->height != avi->height)
+        return 0;
+    if ((UINT64) AVI_HEAD_LEN + avi->movi_len + 8 + padded +
+        (UINT64) (avi->frames + 1) * 16 + 8 > AVI_MAX_SIZE)
+        return 0;
+    if (avi->frames == avi->index_cap) {
+        UINT32 n = avi->index_cap ? avi->index_cap * 2 : 256;
+        avi_index *idx = (avi_index *) realloc(avi->index, n * sizeof(avi_index));
+        if (!idx)
+            return 0;
+        avi->index = idx;
+        avi->index_cap = n;
+    }
+
+    put32(putcc(chunk, "00dc"), len);
+    if (fwrite(chunk, 1, 8, fp) != 8 ||
+        fwrite(slot->jpeg.data, 1, len, fp) != len ||
+        (len & 1 && fputc(0, fp) == EOF))
+        return 0;
+    avi->index[avi->frames].offset = 4 + avi->movi_len;
+    avi->index[avi->frames].size = len;
+    avi->frames++;
+    avi->movi_len += 8 + padded;
+    if (len > avi->max_frame)
+        avi->max_frame = len;
+    return 1;
+}
+
+static bool
+avi_finish(FILE *fp, const avi_writer *avi, int fps) {
+    UINT8 entry[16];
+    UINT32 i;
+
+    put32(putcc(entry, "idx1"), avi->frames * 16);
+    if (fwrite(entry, 1, 8, fp) != 8)
+        return 0;
+    for (i = 0; i < avi->frames; i++) {
+        UINT8 *p = putcc(entry, "00dc");
+        p = put32(p, 0x10);                 /* AVIIF_KEYFRAME */
+        p = put32(p, avi->index[i].offset);
+        put32(p, avi->index[i].size);
+        if (fwrite(entry, 1, 16, fp) != 16)
+            return 0;
+    }
+    return fseek(fp, 0, SEEK_SET) == 0 && avi_write_head(fp, avi, fps);
+}
+
+
+/*
+ * the sequence.
+ */
+
+/* the exit code of an error of cjpeg.h */
+static int
+err_code(const char *error_string, int exit_num) {
+    (void) error_string;
+    return exit_num;
+}
+
+static double
+now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+encode_sequence(const char *out_path, char **frames, int count,
+                const seq_options *sopts, const encode_options *opts) {
+    bool to_std = !strcmp(out_path, "-");
+    int workers = sopts->workers > 0 ? sopts->workers : 1;
+    int fps = sopts->fps > 0 ? sopts->fps : SEQ_DEFAULT_FPS;
+    avi_writer avi;
+    pack_writer pack;
+    pthread_t *threads;
+    FILE *fp = NULL;
+    double start;
+    int i, ret = 0;
+
+    if (sopts->container != SEQ_RAW && to_std) {
+        fprintf(stderr, "an AVI or a pack cannot be written to stdout\n");
+        return 1;
+    }
+    if (sopts->container == SEQ_PACK) {
+        if (open_pack(&pack, out_path, sopts->sync_every) < 0) {
+            perror(out_path);
+            return 2;
+        }
+    } else if (!(fp = to_std ? stdout : fopen(out_path, "wb"))) {
+        fprintf(stderr, "%s: cannot open\n", out_path);
+        return 2;
+    }
+    memset(&avi, 0, sizeof(avi));
+    /* before the workers start: they would wait on the writer for good */
+    if (sopts->container == SEQ_AVI && !avi_write_head(fp, &avi, fps)) {
+        fprintf(stderr, "%s: write failed\n", out_path);
+        fclose(fp);
+        remove(out_path);
+        return err_code(BUFFER_WRITE_ERR);
+    }
+    if (sopts->container == SEQ_RAW && sopts->tables_first) {
+        compress_io cio;
+        init_mem(&cio, NULL, 0, NULL, MEM_OUT_SIZE);
+        tables_to_jpeg(&cio, fp, NULL, opts);
+        free_mem(&cio);
+    }
+
+    init_tables_once();
+    memset(&seq, 0, sizeof(seq));
+    pthread_mutex_init(&seq.lock, NULL);
+    pthread_cond_init(&seq.cond, NULL);
+    seq.frames = frames;
+    seq.count = count;
+    seq.opts = opts;
+    seq.depth = 2 * workers;
+    seq.slots = (seq_slot *) calloc(seq.depth, sizeof(seq_slot));
+    threads = (pthread_t *) calloc(workers, sizeof(pthread_t));
+    if (!seq.slots || !threads)
+        err_exit(BUFFER_ALLOC_ERR);
+
+    start = now_sec();
+    for (i = 0; i < workers; i++)
+        if (pthread_create(&threads[i], NULL, seq_worker, NULL) != 0)
+            err_exit("pthread_create failed", 1);
+
+    /* write the frames in order as they come */
+    for (i = 0; i < count && !ret; i++) {
+        seq_slot *slot = &seq.slots[i % seq.depth];
+
+        pthread_mutex_lock(&seq.lock);
+        while (!slot->done)
+            pthread_cond_wait(&seq.cond, &seq.lock);
+        pthread_mutex_unlock(&seq.lock);
+
+        if (slot->status) {
+            fprintf(stderr, "%s: %s\n", frames[i], slot->err);
+            ret = slot->status;
+        } else if (sopts->container == SEQ_AVI) {
+            if (!avi_write_frame(fp, &avi, slot)) {
+                fprintf(stderr, "%s: %s\n", frames[i],
+                        avi.frames && (slot->width != avi.width ||
+                                       slot->height != avi.height)
+                        ? "frame size differs from the first frame"
+                        : "AVI write failed or over 4 GB");
+                ret = err_code(BUFFER_WRITE_ERR);
+            }
+        } else if (sopts->container == SEQ_PACK) {
+            if (pack_add(&pack, frames[i], slot->jpeg.data, slot->jpeg.len,
+                         slot->width, slot->height) < 0) {
+                perror(out_path);
+                ret = err_code(BUFFER_WRITE_ERR);
+            }
+        } else if (fwrite(slot->jpeg.data, 1, slot->jpeg.len, fp) != slot->jpeg.len) {
+            fprintf(stderr, "%s: write failed\n", out_path);
+            ret = err_code(BUFFER_WRITE_ERR);
+        }
+
+        pthread_mutex_lock(&seq.lock);
+        slot->done = 0;
+        seq.written++;
+        if (ret)
+            seq.stopping = 1;
+        pthread_cond_broadcast(&seq.cond);
+        pthread_mutex_unlock(&seq.lock);
+    }
+
+    for (i = 0; i < workers; i++)
+        pthread_join(threads[i], NULL);
+
+    if (!ret && sopts->container == SEQ_AVI && !avi_finish(fp, &avi, fps)) {
+        fprintf(stderr, "%s: write failed\n", out_path);
+        ret = err_code(BUFFER_WRITE_ERR);
+    }
+    /* a pack keeps the entries before an error, they are committed here */
+    if (sopts->container == SEQ_PACK && close_pack(&pack) < 0 && !ret) {
+        perror(out_path);
+        ret = err_code(BUFFER_WRITE_ERR);
+    }
+    if (!ret) {
+        double sec = now_sec() - start;
+        fprintf(stderr, "%d frames in %.3f s: %.1f frames/sec with %d workers\n",
+                count, sec, sec > 0 ? count / sec : 0.0, workers);
+        if (sopts->container == SEQ_PACK)
+            fprintf(stderr, "%llu entries, %.1f MB in %u commits\n",
+                    (unsigned long long) pack.entries, pack.size / 1048576.0,
+                    pack.commits);
+    }
+
+    for (i = 0; i < seq.depth; i++)
+        free_mem_dest(&seq.slots[i].jpeg);
+    free(seq.slots);
+    free(threads);
+    free(avi.index);
+    pthread_cond_destroy(&seq.cond);
+    pthread_mutex_destroy(&seq.lock);
+    if (fp && to_std)
+        fflush(fp);
+    else if (fp && fclose(fp) != 0 && !ret)
+        ret = err_code(BUFFER_WRITE_ERR);
+    if (ret && fp && !to_std)
+        remove(out_path);
+    return ret;
+}
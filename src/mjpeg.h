@@ -0,0 +1,45 @@
+/**
+ * @file mjpeg.h
+ * @brief Motion-JPEG: a sequence of BMP frames into an AVI, a JPEG stream or
+ * a pack file (jpack.h).
+ */
+
+#ifndef __MJPEG_H
+#define __MJPEG_H
+
+#include "cjpeg.h"
+
+#define SEQ_RAW         0       /* the JPEGs back to back */
+#define SEQ_AVI         1       /* RIFF AVI, one MJPG video stream */
+#define SEQ_PACK        2       /* a pack file and its index, see jpack.h */
+
+#define SEQ_DEFAULT_FPS 25
+
+typedef struct {
+    int container;      /* SEQ_RAW or SEQ_AVI */
+    int workers;        /* encoder threads */
+    int fps;            /* frame rate stored in the AVI */
+    UINT32 sync_every;  /* pack entries per commit, 0 for the default */
+    bool tables_first;  /* raw, abbreviated frames: a tables-only stream first */
+} seq_options;
+
+/*
+ * the frame list of the command line: a name with * ? or [ is expanded
+ * with glob() (sorted), @FILE reads one name per line.  returns a malloc'd
+ * array of malloc'd names, or NULL when a pattern or list fails.
+ */
+char **expand_frames(char **args, int nargs, int *count);
+void free_frames(char **frames, int count);
+
+/*
+ * encode frames into out_path ("-" for stdout, raw only) with a pool of
+ * workers, at most 2 frames per worker in flight.  every worker keeps its
+ * IO buffers, quant tables and header bytes for the whole sequence.  the
+ * frame rate achieved is reported on stderr.  the entries of a pack are
+ * named after the frames, and the ones before an error are kept.  returns 0, or the err_exit
+ * code of the first frame that failed.
+ */
+int encode_sequence(const char *out_path, char **frames, int count,
+                    const seq_options *sopts, const encode_options *opts);
+
+#endif /* __MJPEG_H */
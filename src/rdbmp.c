@@ -21,22 +21,17 @@ extract_uint(const UINT8 *dataptr, UINT32 start, UINT32 len) {
     return uint;
 }
 
-int
-get_file_size(FILE *bmp_fp) {
-    fpos_t fpos;
-    int len;
-    fgetpos(bmp_fp, &fpos);
-    fseek(bmp_fp, 0, SEEK_END);
-    len = ftell(bmp_fp);
-    fsetpos(bmp_fp, &fpos);
-    return len;
-}
-
+/*
+ * read the BMP head.  the stream must be right after the signature checked
+ * by is_bmp(); reading is forward only, so pipes work as well as files.
+ */
 void
 read_bmp(FILE *bmp_fp, bmp_info *binfo) {
     size_t len = BMP_HEAD_LEN;
     UINT8 bmp_head[len];
-    if (fread(bmp_head, sizeof(UINT8), len, bmp_fp) != len)
+    bmp_head[0] = 0x42;
+    bmp_head[1] = 0x4D;
+    if (fread(bmp_head + 2, sizeof(UINT8), len - 2, bmp_fp) != len - 2)
         err_exit(FILE_READ_ERR);
 
     binfo->size = extract_uint(bmp_head, 2, 4);
@@ -45,8 +40,27 @@ read_bmp(FILE *bmp_fp, bmp_info *binfo) {
     binfo->height = extract_uint(bmp_head, 22, 4);
     binfo->bitppx = extract_uint(bmp_head, 28, 2);
     binfo->datasize = extract_uint(bmp_head, 34, 4);
+
+    /* a negative height marks a top-down BMP */
+    binfo->topdown = (INT32) binfo->height < 0;
+    if (binfo->topdown)
+        binfo->height = -(INT32) binfo->height;
+    if (binfo->offset < BMP_HEAD_LEN || binfo->width == 0 || binfo->height == 0)
+        err_exit(FILE_TYPE_ERR);
     if (binfo->datasize == 0)   /* data size not included in some BMP */
-        binfo->datasize = get_file_size(bmp_fp) - binfo->offset;
+        binfo->datasize = (binfo->width * 3 + 3) / 4 * 4 * binfo->height;
 }
 
-
+/*
+ * check the "BM" signature.  only the two signature bytes are consumed,
+ * read_bmp() continues from there.
+ */
+bool
+is_bmp(FILE *fp) {
+    UINT8 marker[2];
+    if (fread(marker, sizeof(UINT8), 2, fp) != 2)
+        err_exit(FILE_READ_ERR);
+    if (marker[0] != 0x42 || marker[1] != 0x4D)
+        return false;
+    return true;
+}
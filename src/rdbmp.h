@@ -10,4 +10,7 @@
 void
 read_bmp(FILE *bmp_fp, bmp_info *binfo);
 
+bool
+is_bmp(FILE *fp);
+
 #endif //BMP2JPEG_CODE_READ_BMP_H
@@ -0,0 +1,386 @@
+/**
+ * @file rdimg.c
+ * @brief routines for reading PPM/PGM, PAM, raw RGB and Y4M images.
+ */
+
+#include <string.h>
+#include "rdimg.h"
+
+#define MAX_SIDE        65535   /* the SOF0 marker holds 16 bit sizes */
+#define Y4M_LINE        1024    /* longest Y4M stream or frame header */
+
+
+/*
+ * PPM, PGM, PAM and raw pixels: rows of interleaved samples, top to bottom,
+ * so a row is read only when the encoder asks for it.  pixels already in
+ * memory are taken from there, row by row, without a copy.
+ */
+
+typedef struct {
+    image_source pub;
+    FILE *fp;
+    UINT32 channels;            /* samples per pixel */
+    UINT32 bytes;               /* bytes per sample, 1 or 2 (big endian) */
+    UINT32 maxval;
+    UINT32 order[COMP_NUM];     /* sample of R, G and B in a pixel */
+    UINT8 *lut;                 /* 1 byte samples to 0..255, NULL if maxval is 255 */
+    UINT8 *row;
+    size_t rowBytes;
+    const UINT8 *mem;           /* next row, for pixels in memory */
+    size_t memStride;
+    UINT32 memRows;             /* rows left in memory */
+} packed_source;
+
+static bool
+pull_packed_row(image_source *src, UINT32 x, UINT32 w, UINT8 *plane[COMP_NUM]) {
+    packed_source *ps = (packed_source *) src;
+    const UINT8 *row = ps->row;
+    if (ps->mem) {
+        if (ps->memRows == 0)
+            return 0;
+        row = ps->mem;
+        ps->mem += ps->memStride;
+        ps->memRows--;
+    } else if (fread(ps->row, sizeof(UINT8), ps->rowBytes, ps->fp) != ps->rowBytes)
+        return 0;
+    if (!plane)
+        return 1;
+
+    UINT32 step = ps->channels * ps->bytes;
+    const UINT8 *p = row + (size_t) x * step;
+    UINT32 i;
+    int c;
+    if (ps->bytes == 1 && !ps->lut) {
+        for (c = 0; c < COMP_NUM; c++) {
+            const UINT8 *s = p + ps->order[c];
+            UINT8 *d = plane[c];
+            for (i = 0; i < w; i++, s += step)
+                d[i] = *s;
+        }
+    } else if (ps->bytes == 1) {
+        for (c = 0; c < COMP_NUM; c++) {
+            const UINT8 *s = p + ps->order[c];
+            UINT8 *d = plane[c];
+            for (i = 0; i < w; i++, s += step)
+                d[i] = ps->lut[*s];
+        }
+    } else {
+        UINT32 half = ps->maxval / 2;
+        for (c = 0; c < COMP_NUM; c++) {
+            const UINT8 *s = p + 2 * ps->order[c];
+            UINT8 *d = plane[c];
+            for (i = 0; i < w; i++, s += step)
+                d[i] = (UINT8) ((((UINT32) s[0] << 8 | s[1]) * 255 + half) / ps->maxval);
+        }
+    }
+    return 1;
+}
+
+static void
+close_packed(image_source *src) {
+    packed_source *ps = (packed_source *) src;
+    free(ps->lut);
+    free(ps->row);
+    free(ps);
+}
+
+/*
+ * a packed_source for pixels of channels samples up to maxval.  one or two
+ * samples are gray, three or four are R, G, B (and alpha, ignored).
+ */
+static image_source *
+new_packed(FILE *fp, const char *name, UINT32 width, UINT32 height,
+           UINT32 channels, UINT32 maxval) {
+    if (width == 0 || height == 0 || width > MAX_SIDE || height > MAX_SIDE ||
+        channels == 0 || channels > 4 || maxval == 0 || maxval > 65535)
+        err_exit(FILE_TYPE_ERR);
+
+    packed_source *ps = (packed_source *) calloc(1, sizeof(packed_source));
+    if (!ps)
+        err_exit(BUFFER_ALLOC_ERR);
+    ps->pub.name = name;
+    ps->pub.width = width;
+    ps->pub.height = height;
+    ps->pub.format = PIX_RGB;
+    ps->pub.pull_row = pull_packed_row;
+    ps->pub.close = close_packed;
+    ps->fp = fp;
+    ps->channels = channels;
+    ps->bytes = maxval > 255 ? 2 : 1;
+    ps->maxval = maxval;
+    if (channels >= 3) {
+        ps->order[0] = 0;
+        ps->order[1] = 1;
+        ps->order[2] = 2;
+    }
+    ps->rowBytes = (size_t) width * channels * ps->bytes;
+    ps->row = (UINT8 *) malloc(fp ? ps->rowBytes : 1);
+    if (ps->row && ps->bytes == 1 && maxval != 255) {
+        UINT32 v;
+        ps->lut = (UINT8 *) calloc(256, 1);
+        if (ps->lut)
+            for (v = 0; v <= maxval; v++)
+                ps->lut[v] = (UINT8) ((v * 255 + maxval / 2) / maxval);
+    }
+    if (!ps->row || (ps->bytes == 1 && maxval != 255 && !ps->lut)) {
+        close_packed(&ps->pub);
+        err_exit(BUFFER_ALLOC_ERR);
+    }
+    return &ps->pub;
+}
+
+image_source *
+open_raw_source(FILE *fp, UINT32 width, UINT32 height, int order) {
+    image_source *src = new_packed(fp, "raw", width, height, 3, 255);
+    if (order == RAW_BGR) {
+        packed_source *ps = (packed_source *) src;
+        ps->order[0] = 2;
+        ps->order[2] = 0;
+    }
+    return src;
+}
+
+image_source *
+open_memory_source(const UINT8 *pixels, UINT32 width, UINT32 height,
+                   size_t stride, int order) {
+    image_source *src = open_raw_source(NULL, width, height, order);
+    packed_source *ps = (packed_source *) src;
+    ps->mem = pixels;
+    ps->memStride = stride;
+    ps->memRows = height;
+    return src;
+}
+
+void
+feed_memory_source(image_source *src, const UINT8 *pixels, size_t stride,
+                   UINT32 rows) {
+    packed_source *ps = (packed_source *) src;
+    ps->mem = pixels;
+    ps->memStride = stride;
+    ps->memRows = rows;
+}
+
+
+/* PPM and PGM: "P6" or "P5", width, height, maxval, one white space */
+
+/* next number of the header, after white space and # comments */
+static UINT32
+pnm_number(FILE *fp) {
+    int ch = getc(fp);
+    for (;;) {
+        if (ch == '#')
+            while (ch != '\n' && ch != EOF)
+                ch = getc(fp);
+        else if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r')
+            ch = getc(fp);
+        else
+            break;
+    }
+    if (ch < '0' || ch > '9')
+        err_exit(FILE_TYPE_ERR);
+    UINT32 v = 0;
+    while (ch >= '0' && ch <= '9') {
+        if (v > 6553500)
+            err_exit(FILE_TYPE_ERR);
+        v = v * 10 + (ch - '0');
+        ch = getc(fp);
+    }
+    /* the white space ending the number is consumed, the pixels follow maxval */
+    return v;
+}
+
+static image_source *
+open_pnm(FILE *fp, bool color) {
+    UINT32 width = pnm_number(fp);
+    UINT32 height = pnm_number(fp);
+    UINT32 maxval = pnm_number(fp);
+    return new_packed(fp, "ppm", width, height, color ? 3 : 1, maxval);
+}
+
+
+/* PAM: "P7", then lines of "KEY value" up to ENDHDR */
+
+static image_source *
+open_pam(FILE *fp) {
+    char line[256];
+    UINT32 width = 0, height = 0, depth = 0, maxval = 0;
+    for (;;) {
+        char key[16];
+        unsigned v;
+        if (!fgets(line, sizeof(line), fp))
+            err_exit(FILE_TYPE_ERR);
+        if (line[0] == '#' || sscanf(line, "%15s", key) != 1)
+            continue;
+        if (!strcmp(key, "ENDHDR"))
+            break;
+        if (!strcmp(key, "TUPLTYPE"))
+            continue;   /* DEPTH alone tells gray, gray + alpha, RGB, RGB + alpha */
+        if (sscanf(line, "%15s %u", key, &v) != 2)
+            err_exit(FILE_TYPE_ERR);
+        if (!strcmp(key, "WIDTH"))
+            width = v;
+        else if (!strcmp(key, "HEIGHT"))
+            height = v;
+        else if (!strcmp(key, "DEPTH"))
+            depth = v;
+        else if (!strcmp(key, "MAXVAL"))
+            maxval = v;
+    }
+    return new_packed(fp, "pam", width, height, depth, maxval);
+}
+
+
+/*
+ * Y4M: "YUV4MPEG2" and tags, then "FRAME" and the Y, Cb and Cr planes of
+ * each frame.  the first frame is encoded.  its planes are already YCbCr,
+ * so they go to the DCT as they are; limited range video (the default of
+ * Y4M) is stretched to the full range JFIF uses, and subsampled chroma is
+ * repeated, the JPEG being 4:4:4.  a chroma plane comes after the whole Y
+ * plane, so the frame is read at once.
+ */
+
+typedef struct {
+    image_source pub;
+    UINT8 *frame;               /* Y plane, then Cb and Cr */
+    UINT32 cw;                  /* size of a chroma plane */
+    UINT32 ch;
+    int hshift;                 /* chroma subsampling, log2 */
+    int vshift;
+    bool mono;                  /* no chroma planes */
+    UINT32 row;                 /* next row to pull */
+    UINT8 lut_y[256];           /* to full range */
+    UINT8 lut_c[256];
+} y4m_source;
+
+static bool
+pull_y4m_row(image_source *src, UINT32 x, UINT32 w, UINT8 *plane[COMP_NUM]) {
+    y4m_source *ys = (y4m_source *) src;
+    if (ys->row >= src->height)
+        return 0;
+    UINT32 r = ys->row++;
+    if (!plane)
+        return 1;
+
+    const UINT8 *yp = ys->frame + (size_t) r * src->width + x;
+    UINT32 i;
+    for (i = 0; i < w; i++)
+        plane[0][i] = ys->lut_y[yp[i]];
+    if (ys->mono) {
+        memset(plane[1], 128, w);
+        memset(plane[2], 128, w);
+        return 1;
+    }
+    size_t chromaSize = (size_t) ys->cw * ys->ch;
+    const UINT8 *cb = ys->frame + (size_t) src->width * src->height +
+                      (size_t) (r >> ys->vshift) * ys->cw;
+    const UINT8 *cr = cb + chromaSize;
+    for (i = 0; i < w; i++) {
+        UINT32 cx = (x + i) >> ys->hshift;
+        plane[1][i] = ys->lut_c[cb[cx]];
+        plane[2][i] = ys->lut_c[cr[cx]];
+    }
+    return 1;
+}
+
+static void
+close_y4m(image_source *src) {
+    y4m_source *ys = (y4m_source *) src;
+    free(ys->frame);
+    free(ys);
+}
+
+static UINT8
+clamp_sample(int v) {
+    return (UINT8) (v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+static image_source *
+open_y4m(FILE *fp) {
+    char line[Y4M_LINE];
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, "V4MPEG2", 7) != 0 ||
+        !strchr(line, '\n'))
+        err_exit(FILE_TYPE_ERR);
+
+    UINT32 width = 0, height = 0;
+    int hshift = 1, vshift = 1;
+    bool mono = 0, full = 0;
+    char *tag;
+    for (tag = strtok(line + 7, " \n"); tag; tag = strtok(NULL, " \n")) {
+        if (tag[0] == 'W')
+            width = (UINT32) strtoul(tag + 1, NULL, 10);
+        else if (tag[0] == 'H')
+            height = (UINT32) strtoul(tag + 1, NULL, 10);
+        else if (tag[0] == 'C') {
+            if (!strcmp(tag, "C444"))
+                hshift = vshift = 0;
+            else if (!strcmp(tag, "C422")) {
+                hshift = 1;
+                vshift = 0;
+            } else if (!strcmp(tag, "Cmono"))
+                mono = 1;
+            else if (strcmp(tag, "C420") && strcmp(tag, "C420jpeg") &&
+                     strcmp(tag, "C420paldv") && strcmp(tag, "C420mpeg2"))
+                err_exit(FILE_TYPE_ERR);
+        } else if (!strcmp(tag, "XCOLORRANGE=FULL"))
+            full = 1;
+    }
+    if (width == 0 || height == 0 || width > MAX_SIDE || height > MAX_SIDE)
+        err_exit(FILE_TYPE_ERR);
+
+    /* the header of the first frame */
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, "FRAME", 5) != 0 ||
+        !strchr(line, '\n'))
+        err_exit(FILE_READ_ERR);
+
+    y4m_source *ys = (y4m_source *) calloc(1, sizeof(y4m_source));
+    if (!ys)
+        err_exit(BUFFER_ALLOC_ERR);
+    ys->pub.name = "y4m";
+    ys->pub.width = width;
+    ys->pub.height = height;
+    ys->pub.format = PIX_YCC;
+    ys->pub.pull_row = pull_y4m_row;
+    ys->pub.close = close_y4m;
+    ys->hshift = hshift;
+    ys->vshift = vshift;
+    ys->mono = mono;
+    ys->cw = mono ? 0 : (width + (1u << hshift) - 1) >> hshift;
+    ys->ch = mono ? 0 : (height + (1u << vshift) - 1) >> vshift;
+
+    size_t frameSize = (size_t) width * height + 2 * (size_t) ys->cw * ys->ch;
+    ys->frame = (UINT8 *) malloc(frameSize);
+    if (!ys->frame) {
+        close_y4m(&ys->pub);
+        err_exit(BUFFER_ALLOC_ERR);
+    }
+    if (fread(ys->frame, sizeof(UINT8), frameSize, fp) != frameSize) {
+        close_y4m(&ys->pub);
+        err_exit(FILE_READ_ERR);
+    }
+
+    /* BT.601 limited range: Y 16..235, Cb and Cr 16..240 around 128 */
+    int v;
+    for (v = 0; v < 256; v++) {
+        ys->lut_y[v] = full ? (UINT8) v : clamp_sample(((v - 16) * 255 + 109) / 219);
+        ys->lut_c[v] = full ? (UINT8) v : clamp_sample(128 + ((v - 128) * 255 + (v < 128 ? -112 : 112)) / 224);
+    }
+    return &ys->pub;
+}
+
+
+image_source *
+open_image_source(FILE *fp, const UINT8 magic[2]) {
+    if (magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6'))
+        return open_pnm(fp, magic[1] == '6');
+    if (magic[0] == 'P' && magic[1] == '7')
+        return open_pam(fp);
+    if (magic[0] == 'Y' && magic[1] == 'U')
+        return open_y4m(fp);
+    return NULL;
+}
+
+void
+close_image_source(image_source *src) {
+    if (src)
+        src->close(src);
+}
@@ -0,0 +1,63 @@
+/**
+ * @file rdimg.h
+ * @brief readers of the inputs other than BMP: PPM/PGM, PAM, raw RGB and Y4M.
+ *
+ * every reader is an image_source: the size of the image, the kind of
+ * pixels it gives, and a function pulling the next row, top to bottom.
+ * huajuan_bmp.c cuts the rows into MCU bands exactly as it does for a BMP,
+ * so crop, restart intervals, threads and incremental encoding all work.
+ */
+
+#ifndef __RDIMG_H
+#define __RDIMG_H
+
+#include "cjpeg.h"
+
+#define PIX_RGB         0       /* planes are R, G, B */
+#define PIX_YCC         1       /* planes are Y, Cb, Cr: no color conversion */
+
+#define RAW_RGB         0       /* byte order of raw pixels */
+#define RAW_BGR         1
+
+struct image_source {
+    const char *name;   /* "ppm", "pam", "raw" or "y4m" */
+    UINT32 width;
+    UINT32 height;
+    int format;         /* PIX_RGB or PIX_YCC */
+    /*
+     * read the next row and put columns [x, x + w) of it into the three
+     * planes, or only skip the row when plane is NULL.  0 on a short read.
+     */
+    bool (*pull_row)(image_source *src, UINT32 x, UINT32 w,
+                     UINT8 *plane[COMP_NUM]);
+    void (*close)(image_source *src);
+};
+
+/*
+ * the reader of a PPM/PGM (P6, P5), PAM (P7) or Y4M stream, whose first
+ * two bytes have been read into magic.  NULL when magic is none of them.
+ * a header that cannot be used ends with FILE_TYPE_ERR.
+ */
+image_source *open_image_source(FILE *fp, const UINT8 magic[2]);
+
+/* width * height pixels of 3 bytes, RAW_RGB or RAW_BGR, no row padding */
+image_source *open_raw_source(FILE *fp, UINT32 width, UINT32 height,
+                              int order);
+
+/*
+ * the same pixels already in memory, top-down rows of stride bytes.  they
+ * are read in place and must stay until the image is encoded.
+ */
+image_source *open_memory_source(const UINT8 *pixels, UINT32 width,
+                                 UINT32 height, size_t stride, int order);
+
+/*
+ * the next rows of a memory source, for pixels that come piece by piece:
+ * rows more rows of stride bytes at pixels, in place of those left
+ */
+void feed_memory_source(image_source *src, const UINT8 *pixels, size_t stride,
+                        UINT32 rows);
+
+void close_image_source(image_source *src);
+
+#endif /* __RDIMG_H */
@@ -0,0 +1,556 @@
+/**
+ * @file server.c
+ * @brief persistent encoder serving requests over a Unix domain socket.
+ *
+ * One thread runs a poll() event loop that accepts connections, reads
+ * requests and writes responses.  Complete requests are queued to a pool
+ * of worker threads.  Each worker keeps its own IO buffers (init_mem) for
+ * its whole life, the color and huffman tables are built once per process,
+ * so a request only pays for the encode itself.  Workers hand finished
+ * jobs back through a done list and wake the loop with a pipe.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.h"
+#include "rdbmp.h"
+
+enum {
+    CONN_HEAD,          /* reading a request head */
+    CONN_BODY,          /* reading the paths / inline BMP */
+    CONN_BUSY,          /* request queued or being encoded */
+    CONN_WRITE,         /* sending the response */
+    CONN_CLOSED
+};
+
+struct conn;
+
+typedef struct server_job {
+    struct server_job *next;
+    struct conn *conn;
+    req_head head;
+    UINT8 *in;          /* path (NUL terminated) or BMP bytes */
+    char *out_path;     /* NULL for REQ_INLINE_OUT */
+    INT32 status;
+    const char *err;
+    mem_dest reply;
+} server_job;
+
+typedef struct conn {
+    int fd;
+    int state;
+    UINT8 head[REQ_HEAD_LEN];
+    size_t got;         /* bytes of the head or body read so far */
+    server_job *job;
+    UINT8 resp[RESP_HEAD_LEN];
+    const UINT8 *payload;
+    size_t payload_len;
+    size_t sent;
+} conn;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    server_job *todo_head;
+    server_job *todo_tail;
+    server_job *done;
+    bool stopping;
+    int wake[2];        /* workers and signals -> event loop */
+    unsigned long served;
+    unsigned long failed;
+    jpeg_cache *cache;
+} srv;
+
+static volatile sig_atomic_t stop_requested;
+
+
+static void
+on_stop_signal(int sig) {
+    int saved = errno;
+    (void) sig;
+    stop_requested = 1;
+    if (write(srv.wake[1], "s", 1) < 0) {
+        /* the loop is woken anyway once poll is interrupted */
+    }
+    errno = saved;
+}
+
+static int
+set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void
+free_job(server_job *job) {
+    free(job->in);
+    free(job->out_path);
+    free_mem_dest(&job->reply);
+    free(job);
+}
+
+
+/*
+ * worker side.
+ */
+
+static void
+run_job(compress_io *cio, server_job *job) {
+    encode_options opts;
+    FILE *volatile bmp_fp = NULL;
+    FILE *volatile jpeg_fp = NULL;
+    bool inline_out = (job->head.flags & REQ_INLINE_OUT) != 0;
+    jmp_buf trap;
+    int code;
+
+    init_encode_options(&opts);
+    if (job->head.scale)
+        opts.scale = job->head.scale;
+    memset(&job->reply, 0, sizeof(job->reply));
+    job->status = 0;
+    job->err = NULL;
+
+    if ((code = setjmp(trap)) != 0) {
+        job->status = code;
+        job->err = last_err();
+        goto done;
+    }
+    set_err_trap(&trap);
+
+    if (job->head.flags & REQ_INLINE_IN)
+        bmp_fp = fmemopen(job->in, job->head.in_len, "rb");
+    else
+        bmp_fp = fopen((const char *) job->in, "rb");
+    if (!bmp_fp)
+        err_exit(FILE_OPEN_ERR);
+    if (!is_bmp(bmp_fp))
+        err_exit(FILE_TYPE_ERR);
+    if (!inline_out) {
+        jpeg_fp = fopen(job->out_path, "wb");
+        if (!jpeg_fp)
+            err_exit(FILE_OPEN_ERR);
+    }
+    if (srv.cache)
+        cached_bmp_to_jpeg(srv.cache, cio, bmp_fp, jpeg_fp,
+                           inline_out ? &job->reply : NULL, &opts);
+    else
+        bmp_to_jpeg(cio, bmp_fp, jpeg_fp, inline_out ? &job->reply : NULL, &opts);
+
+done:
+    set_err_trap(NULL);
+    if (bmp_fp)
+        fclose(bmp_fp);
+    if (jpeg_fp) {
+        fclose(jpeg_fp);
+        if (job->status)
+            remove(job->out_path);
+    }
+    if (job->status)
+        free_mem_dest(&job->reply);
+}
+
+static void *
+worker_main(void *arg) {
+    compress_io cio;
+    (void) arg;
+
+    /* warm state, kept for every request this worker serves */
+    init_mem(&cio, NULL, 0, NULL, MEM_OUT_SIZE);
+
+    for (;;) {
+        server_job *job;
+
+        pthread_mutex_lock(&srv.lock);
+        while (!srv.todo_head && !srv.stopping)
+            pthread_cond_wait(&srv.cond, &srv.lock);
+        job = srv.todo_head;
+        if (!job) {
+            pthread_mutex_unlock(&srv.lock);
+            break;
+        }
+        srv.todo_head = job->next;
+        if (!srv.todo_head)
+            srv.todo_tail = NULL;
+        pthread_mutex_unlock(&srv.lock);
+
+        run_job(&cio, job);
+
+        pthread_mutex_lock(&srv.lock);
+        job->next = srv.done;
+        srv.done = job;
+        pthread_mutex_unlock(&srv.lock);
+        if (write(srv.wake[1], "j", 1) < 0) {
+            /* pipe full: the loop has a wakeup pending already */
+        }
+    }
+
+    free_mem(&cio);
+    return NULL;
+}
+
+
+/*
+ * event loop side.
+ */
+
+static void
+queue_job(server_job *job) {
+    pthread_mutex_lock(&srv.lock);
+    job->next = NULL;
+    if (srv.todo_tail)
+        srv.todo_tail->next = job;
+    else
+        srv.todo_head = job;
+    srv.todo_tail = job;
+    pthread_cond_signal(&srv.cond);
+    pthread_mutex_unlock(&srv.lock);
+}
+
+static void
+start_response(conn *c) {
+    server_job *job = c->job;
+    resp_head head;
+
+    head.magic = RESP_MAGIC;
+    head.status = job->status;
+    if (job->status) {
+        c->payload = (const UINT8 *) job->err;
+        c->payload_len = job->err ? strlen(job->err) : 0;
+        srv.failed++;
+    } else {
+        c->payload = job->reply.data;
+        c->payload_len = job->reply.len;
+        srv.served++;
+    }
+    head.len = (UINT32) c->payload_len;
+    memcpy(c->resp, &head, RESP_HEAD_LEN);
+    c->sent = 0;
+    c->state = CONN_WRITE;
+}
+
+/* check a complete request head and set up its job.  -1 on bad input */
+static int
+parse_head(conn *c) {
+    req_head head;
+    server_job *job;
+
+    memcpy(&head, c->head, REQ_HEAD_LEN);
+    if (head.magic != REQ_MAGIC || head.in_len == 0)
+        return -1;
+    if (head.flags & REQ_INLINE_IN ? head.in_len > REQ_MAX_IN
+                                   : head.in_len > REQ_MAX_PATH)
+        return -1;
+    if (head.flags & REQ_INLINE_OUT ? head.out_len != 0
+                                    : head.out_len == 0 ||
+                                      head.out_len > REQ_MAX_PATH)
+        return -1;
+
+    job = (server_job *) calloc(1, sizeof(server_job));
+    if (!job)
+        return -1;
+    job->conn = c;
+    job->head = head;
+    job->in = (UINT8 *) malloc(head.in_len + 1);
+    if (head.out_len)
+        job->out_path = (char *) malloc(head.out_len + 1);
+    if (!job->in || (head.out_len && !job->out_path)) {
+        free_job(job);
+        return -1;
+    }
+    c->job = job;
+    c->got = 0;
+    c->state = CONN_BODY;
+    return 0;
+}
+
+/* read as much as is available.  -1 when the connection has to go */
+static int
+handle_read(conn *c) {
+    for (;;) {
+        UINT8 *dst;
+        size_t want;
+        ssize_t n;
+
+        if (c->state == CONN_HEAD) {
+            dst = c->head + c->got;
+            want = REQ_HEAD_LEN - c->got;
+        } else if (c->state == CONN_BODY) {
+            req_head *h = &c->job->head;
+            if (c->got < h->in_len) {
+                dst = c->job->in + c->got;
+                want = h->in_len - c->got;
+            } else {
+                dst = (UINT8 *) c->job->out_path + (c->got - h->in_len);
+                want = h->in_len + h->out_len - c->got;
+            }
+        } else
+            return 0;
+
+        n = read(c->fd, dst, want);
+        if (n == 0)
+            return -1;
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+                   ? 0 : -1;
+        c->got += n;
+
+        if (c->state == CONN_HEAD && c->got == REQ_HEAD_LEN) {
+            if (parse_head(c) < 0)
+                return -1;
+        } else if (c->state == CONN_BODY &&
+                   c->got == c->job->head.in_len + c->job->head.out_len) {
+            c->job->in[c->job->head.in_len] = '\0';
+            if (c->job->out_path)
+                c->job->out_path[c->job->head.out_len] = '\0';
+            c->state = CONN_BUSY;
+            queue_job(c->job);
+            return 0;
+        }
+    }
+}
+
+/* send as much as the socket takes.  -1 when the connection has to go */
+static int
+handle_write(conn *c) {
+    while (c->state == CONN_WRITE) {
+        struct iovec iov[2];
+        int cnt = 0;
+        ssize_t n;
+
+        if (c->sent < RESP_HEAD_LEN) {
+            iov[cnt].iov_base = c->resp + c->sent;
+            iov[cnt++].iov_len = RESP_HEAD_LEN - c->sent;
+            if (c->payload_len) {
+                iov[cnt].iov_base = (void *) c->payload;
+                iov[cnt++].iov_len = c->payload_len;
+            }
+        } else {
+            iov[cnt].iov_base = (void *) (c->payload +
+                                          (c->sent - RESP_HEAD_LEN));
+            iov[cnt++].iov_len = RESP_HEAD_LEN + c->payload_len - c->sent;
+        }
+
+        n = writev(c->fd, iov, cnt);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+                   ? 0 : -1;
+        c->sent += n;
+        if (c->sent == RESP_HEAD_LEN + c->payload_len) {
+            free_job(c->job);
+            c->job = NULL;
+            c->got = 0;
+            c->state = CONN_HEAD;
+        }
+    }
+    return 0;
+}
+
+static void
+collect_done_jobs() {
+    server_job *job, *next;
+    char drain[64];
+
+    while (read(srv.wake[0], drain, sizeof(drain)) > 0)
+        continue;
+    pthread_mutex_lock(&srv.lock);
+    job = srv.done;
+    srv.done = NULL;
+    pthread_mutex_unlock(&srv.lock);
+
+    for (; job; job = next) {
+        next = job->next;
+        start_response(job->conn);
+    }
+}
+
+static int
+open_listener(const char *socket_path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    unlink(socket_path);            /* stale socket of an earlier run */
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0 || set_nonblocking(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int
+serve(const char *socket_path, int workers, jpeg_cache *cache) {
+    pthread_t *threads;
+    conn **conns = NULL;
+    struct pollfd *pfds = NULL;
+    int nconn = 0, cap = 0;
+    int listen_fd, i, ret = 0;
+    struct sigaction sa;
+
+    if (workers < 1)
+        workers = 1;
+    init_tables_once();
+
+    memset(&srv, 0, sizeof(srv));
+    srv.cache = cache;
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.cond, NULL);
+    if (pipe(srv.wake) < 0 || set_nonblocking(srv.wake[0]) < 0 ||
+        set_nonblocking(srv.wake[1]) < 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    listen_fd = open_listener(socket_path);
+    if (listen_fd < 0) {
+        perror(socket_path);
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    threads = (pthread_t *) malloc(workers * sizeof(pthread_t));
+    if (!threads)
+        err_exit(BUFFER_ALLOC_ERR);
+    for (i = 0; i < workers; i++)
+        pthread_create(&threads[i], NULL, worker_main, NULL);
+    fprintf(stderr, "serving on %s with %d workers\n", socket_path, workers);
+
+    while (!stop_requested) {
+        int npfd = 2, j;
+
+        if (cap < nconn + 2) {
+            cap = (nconn + 2) * 2;
+            pfds = (struct pollfd *) realloc(pfds, cap * sizeof(*pfds));
+            if (!pfds)
+                err_exit(BUFFER_ALLOC_ERR);
+        }
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = srv.wake[0];
+        pfds[1].events = POLLIN;
+        for (i = 0; i < nconn; i++) {
+            /*
+             * a busy connection is left out (negative fd) until the wake
+             * pipe says its job is done: POLLHUP is reported whatever the
+             * events, and a client hanging up would make poll spin
+             */
+            pfds[npfd].fd = conns[i]->state == CONN_BUSY ? -1 : conns[i]->fd;
+            pfds[npfd].events = conns[i]->state == CONN_WRITE ? POLLOUT : POLLIN;
+            npfd++;
+        }
+
+        if (poll(pfds, npfd, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            ret = 1;
+            break;
+        }
+
+        for (i = 0; i < nconn; i++) {
+            conn *c = conns[i];
+            short rev = pfds[2 + i].revents;
+            if (c->state == CONN_BUSY || !rev)
+                continue;
+            if ((rev & POLLIN) || (rev & (POLLHUP | POLLERR) &&
+                                   c->state != CONN_WRITE)) {
+                if (handle_read(c) < 0)
+                    c->state = CONN_CLOSED;
+            } else if (rev & (POLLOUT | POLLHUP | POLLERR)) {
+                if (handle_write(c) < 0)
+                    c->state = CONN_CLOSED;
+            }
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            collect_done_jobs();
+            for (i = 0; i < nconn; i++)
+                if (conns[i]->state == CONN_WRITE && handle_write(conns[i]) < 0)
+                    conns[i]->state = CONN_CLOSED;
+        }
+
+        /* drop closed connections, keeping the order of the others */
+        for (i = 0, j = 0; i < nconn; i++) {
+            if (conns[i]->state == CONN_CLOSED) {
+                close(conns[i]->fd);
+                if (conns[i]->job)
+                    free_job(conns[i]->job);
+                free(conns[i]);
+            } else
+                conns[j++] = conns[i];
+        }
+        nconn = j;
+
+        if (pfds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                conn *c;
+                if (set_nonblocking(fd) < 0 ||
+                    !(c = (conn *) calloc(1, sizeof(conn)))) {
+                    close(fd);
+                    continue;
+                }
+                c->fd = fd;
+                c->state = CONN_HEAD;
+                if (nconn % 64 == 0) {
+                    conns = (conn **) realloc(conns,
+                                              (nconn + 64) * sizeof(conn *));
+                    if (!conns)
+                        err_exit(BUFFER_ALLOC_ERR);
+                }
+                conns[nconn++] = c;
+            }
+        }
+    }
+
+    /* shutdown: let the workers finish what they hold, then clean up */
+    pthread_mutex_lock(&srv.lock);
+    srv.stopping = 1;
+    pthread_cond_broadcast(&srv.cond);
+    pthread_mutex_unlock(&srv.lock);
+    for (i = 0; i < workers; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    /* every queued or finished job is still owned by its connection */
+    for (i = 0; i < nconn; i++) {
+        close(conns[i]->fd);
+        if (conns[i]->job)
+            free_job(conns[i]->job);
+        free(conns[i]);
+    }
+    free(conns);
+    free(pfds);
+    close(listen_fd);
+    close(srv.wake[0]);
+    close(srv.wake[1]);
+    unlink(socket_path);
+
+    fprintf(stderr, "served %lu requests, %lu failed\n",
+            srv.served, srv.failed);
+    if (cache)
+        print_cache_stats(cache, stderr);
+    return ret;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file server.h
+ * @brief persistent encoder serving requests over a Unix domain socket.
+ *
+ * Wire format, all integers in host byte order (the socket is local):
+ *
+ *   request:   magic "BJRQ"  flags  scale  in_len  out_len
+ *              in_len bytes:  BMP file path, or the BMP itself (REQ_INLINE_IN)
+ *              out_len bytes: JPEG file path, or nothing (REQ_INLINE_OUT)
+ *
+ *   response:  magic "BJRS"  status  len
+ *              len bytes:     the JPEG for REQ_INLINE_OUT, an error message
+ *                             when status is not 0, otherwise nothing
+ *
+ * A connection may carry any number of requests, answered in order.
+ */
+
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include "cjpeg.h"
+#include "jcache.h"
+
+#define REQ_MAGIC       0x51524A42      /* "BJRQ" */
+#define RESP_MAGIC      0x53524A42      /* "BJRS" */
+#define REQ_HEAD_LEN    20
+#define RESP_HEAD_LEN   12
+
+#define REQ_INLINE_IN   0x01    /* payload is the BMP, not a path */
+#define REQ_INLINE_OUT  0x02    /* reply with the JPEG, write no file */
+
+#define REQ_MAX_IN      (256u << 20)    /* largest inline BMP accepted */
+#define REQ_MAX_PATH    4096
+
+typedef struct {
+    UINT32 magic;
+    UINT32 flags;
+    UINT32 scale;       /* quant table scale, 0 for the default */
+    UINT32 in_len;
+    UINT32 out_len;
+} req_head;
+
+typedef struct {
+    UINT32 magic;
+    INT32 status;       /* 0 on success, else the err_exit code */
+    UINT32 len;
+} resp_head;
+
+/*
+ * listen on socket_path and serve until SIGINT or SIGTERM.
+ * workers: number of encoder threads.  cache: output cache shared by the
+ * workers, or NULL.  returns 0 on a clean shutdown.
+ */
+int serve(const char *socket_path, int workers, jpeg_cache *cache);
+
+#endif /* __SERVER_H */
@@ -0,0 +1,322 @@
+/**
+ * @file shmring.c
+ * @brief frame rings in POSIX shared memory, and the encoder serving them.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "shmring.h"
+#include "rdimg.h"
+
+
+/*
+ * the counters.  the value is published with release order, so what was
+ * written to a slot before is seen by the side that loads the counter.
+ */
+
+UINT32
+ring_load(const ring_counter *c) {
+    return __atomic_load_n(&c->v, __ATOMIC_ACQUIRE);
+}
+
+void
+ring_store(ring_counter *c, UINT32 v) {
+    __atomic_store_n(&c->v, v, __ATOMIC_RELEASE);
+#ifdef __linux__
+    syscall(SYS_futex, &c->v, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+void
+ring_wait(ring_counter *c, UINT32 seen, int timeout_ms) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long) (timeout_ms % 1000) * 1000000;
+    /* returns at once when the value is not seen any more */
+    syscall(SYS_futex, &c->v, FUTEX_WAIT, seen, &ts, NULL, 0);
+#else
+    struct timespec ts = {0, 100000};
+    int i;
+    for (i = 0; i < timeout_ms * 10 && ring_load(c) == seen; i++)
+        nanosleep(&ts, NULL);
+#endif
+}
+
+
+/*
+ * the shared memory object.
+ */
+
+static size_t
+ring_size(UINT32 in_slots, UINT32 in_slot_size, UINT32 out_slots,
+          UINT32 out_slot_size) {
+    return RING_PAGE + (size_t) in_slots * in_slot_size +
+           (size_t) out_slots * out_slot_size;
+}
+
+/* shm_open() wants "/name" */
+static char *
+shm_name(const char *name) {
+    char *s = (char *) malloc(strlen(name) + 2);
+    if (s)
+        sprintf(s, "%s%s", name[0] == '/' ? "" : "/", name);
+    return s;
+}
+
+int
+ring_create(shm_ring *ring, const char *name, UINT32 in_slots,
+            UINT32 in_slot_size, UINT32 out_slots, UINT32 out_slot_size) {
+    int fd;
+    memset(ring, 0, sizeof(*ring));
+    in_slot_size = (in_slot_size + RING_PAGE - 1) / RING_PAGE * RING_PAGE;
+    out_slot_size = (out_slot_size + RING_PAGE - 1) / RING_PAGE * RING_PAGE;
+    if (!in_slots || !out_slots || in_slot_size <= RING_SLOT_HEAD ||
+        out_slot_size <= RING_SLOT_HEAD) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(ring->name = shm_name(name)))
+        return -1;
+    ring->size = ring_size(in_slots, in_slot_size, out_slots, out_slot_size);
+
+    shm_unlink(ring->name);
+    fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t) ring->size) != 0 ||
+        (ring->head = (ring_head *) mmap(NULL, ring->size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        int err = errno;
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(ring->name);
+        }
+        free(ring->name);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+
+    ring->head->version = RING_VERSION;
+    ring->head->in_slots = in_slots;
+    ring->head->in_slot_size = in_slot_size;
+    ring->head->out_slots = out_slots;
+    ring->head->out_slot_size = out_slot_size;
+    __atomic_store_n(&ring->head->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int
+ring_attach(shm_ring *ring, const char *name) {
+    struct stat st;
+    ring_head *h;
+    int fd;
+    memset(ring, 0, sizeof(*ring));
+    if (!(ring->name = shm_name(name)))
+        return -1;
+    fd = shm_open(ring->name, O_RDWR, 0);
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ring_head) ||
+        (h = (ring_head *) mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        int err = errno;
+        if (fd >= 0)
+            close(fd);
+        free(ring->name);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+    ring->head = h;
+    ring->size = (size_t) st.st_size;
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+        h->version != RING_VERSION || !h->in_slots || !h->out_slots ||
+        h->in_slot_size <= RING_SLOT_HEAD || h->out_slot_size <= RING_SLOT_HEAD ||
+        ring_size(h->in_slots, h->in_slot_size, h->out_slots, h->out_slot_size) > ring->size) {
+        ring_detach(ring, 0);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void
+ring_detach(shm_ring *ring, bool remove) {
+    if (ring->head)
+        munmap(ring->head, ring->size);
+    if (remove)
+        shm_unlink(ring->name);
+    free(ring->name);
+    memset(ring, 0, sizeof(*ring));
+}
+
+ring_frame *
+ring_in_slot(const shm_ring *ring, UINT32 n) {
+    const ring_head *h = ring->head;
+    return (ring_frame *) ((UINT8 *) h + RING_PAGE +
+                           (size_t) (n % h->in_slots) * h->in_slot_size);
+}
+
+ring_result *
+ring_out_slot(const shm_ring *ring, UINT32 n) {
+    const ring_head *h = ring->head;
+    return (ring_result *) ((UINT8 *) h + RING_PAGE +
+                            (size_t) h->in_slots * h->in_slot_size +
+                            (size_t) (n % h->out_slots) * h->out_slot_size);
+}
+
+
+/*
+ * the encoder.
+ */
+
+static volatile sig_atomic_t ring_stop;
+
+static void
+on_stop_signal(int sig) {
+    (void) sig;
+    ring_stop = 1;
+}
+
+/* the output slot: cap bytes, the JPEG must fit */
+typedef struct {
+    UINT8 *data;
+    size_t len;
+    size_t cap;
+} slot_dest;
+
+static bool
+flush_cout_slot(void *cio) {
+    mem_mgr *out = ((compress_io *) cio)->out;
+    slot_dest *dest = (slot_dest *) out->user;
+    size_t len = out->pos - out->set;
+    if (dest->len + len > dest->cap)
+        return false;
+    memcpy(dest->data + dest->len, out->set, len);
+    dest->len += len;
+    out->pos = out->set;
+    return true;
+}
+
+/*
+ * encode frame f from its slot into result r.  the pixels are read in place;
+ * only the coded bytes pass through the IO buffer on the way to r.  the
+ * header of f is copied once, so a producer rewriting it cannot move the
+ * reads past the slot after the check.
+ */
+static void
+encode_slot(compress_io *cio, frame_cache *fc, const encode_options *opts,
+            const shm_ring *ring, const ring_frame *f, ring_result *r) {
+    const ring_head *h = ring->head;
+    encode_options o = *opts;
+    ring_frame fr = *f;
+    image_source *volatile src = NULL;
+    slot_dest dest;
+    jmp_buf trap;
+    int code;
+
+    o.setup = fc;
+    r->seq = fr.seq;
+    r->len = 0;
+    r->status = 0;
+    dest.data = RING_DATA(r);
+    dest.len = 0;
+    dest.cap = h->out_slot_size - RING_SLOT_HEAD;
+
+    if ((code = setjmp(trap)) != 0) {
+        /* the message goes in place of the JPEG */
+        const char *msg = last_err();
+        size_t n = strlen(msg) < dest.cap ? strlen(msg) : dest.cap;
+        memcpy(dest.data, msg, n);
+        r->len = (UINT32) n;
+        r->status = code;
+        fc->width = 0;
+        goto done;
+    }
+    set_err_trap(&trap);
+
+    // 帧头是生产者写的，先确认像素都在这个槽里
+    if ((fr.format != RING_BGR24 && fr.format != RING_RGB24) || fr.width == 0 ||
+        fr.height == 0 || fr.stride < (UINT64) fr.width * 3 ||
+        (UINT64) fr.stride * fr.height > h->in_slot_size - RING_SLOT_HEAD)
+        err_exit(FILE_TYPE_ERR);
+    src = open_memory_source(RING_DATA(f), fr.width, fr.height, fr.stride,
+                             fr.format == RING_BGR24 ? RAW_BGR : RAW_RGB);
+
+    reset_mem(cio, NULL, 0, NULL, NULL);
+    cio->out->flush_buffer = flush_cout_slot;
+    cio->out->user = &dest;
+    jpeg_encode_source(cio, src, &o);
+    if (!(cio->out->flush_buffer)(cio))
+        err_exit(BUFFER_WRITE_ERR);
+    r->len = (UINT32) dest.len;
+
+done:
+    set_err_trap(NULL);
+    close_image_source(src);
+}
+
+int
+encode_ring(const char *name, const encode_options *opts) {
+    shm_ring ring;
+    ring_head *h;
+    compress_io cio;
+    frame_cache fc;
+    UINT32 tail, out;
+    unsigned long frames = 0, failed = 0;
+
+    if (ring_attach(&ring, name) < 0) {
+        perror(name);
+        return 1;
+    }
+    h = ring.head;
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
+    init_tables_once();
+    init_mem(&cio, NULL, 0, NULL, MEM_OUT_SIZE);
+    init_frame_cache(&fc);
+    fprintf(stderr, "encoding frames of ring %s\n", name);
+
+    tail = ring_load(&h->in_tail);
+    out = ring_load(&h->out_head);
+    while (!ring_stop) {
+        UINT32 head = ring_load(&h->in_head);
+        UINT32 done = ring_load(&h->out_tail);
+        ring_result *r;
+        if (head == tail) {
+            // 生产者先发布最后一帧再设closed，所以看到closed以后再看一次head
+            if (__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) &&
+                ring_load(&h->in_head) == tail)
+                break;
+            ring_wait(&h->in_head, head, 100);
+            continue;
+        }
+        if (out - done >= h->out_slots) {
+            ring_wait(&h->out_tail, done, 100);
+            continue;
+        }
+
+        r = ring_out_slot(&ring, out);
+        encode_slot(&cio, &fc, opts, &ring, ring_in_slot(&ring, tail), r);
+        if (r->status)
+            failed++;
+        frames++;
+        ring_store(&h->out_head, ++out);
+        ring_store(&h->in_tail, ++tail);
+    }
+
+    fprintf(stderr, "%lu frames encoded, %lu failed\n", frames, failed);
+    free_frame_cache(&fc);
+    free_mem(&cio);
+    ring_detach(&ring, 0);
+    return 0;
+}
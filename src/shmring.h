@@ -0,0 +1,97 @@
+/**
+ * @file shmring.h
+ * @brief frame rings in POSIX shared memory, between a capture process
+ * and the encoder on the same machine.
+ *
+ * The producer creates the shared memory object: a head page, in_slots
+ * input slots and out_slots output slots.  An input slot is a ring_frame
+ * and the pixels after it, top-down rows of stride bytes; an output slot
+ * is a ring_result and the JPEG after it.  Each ring is single producer,
+ * single consumer: head counts the slots published, tail the slots taken
+ * back, both only grow (modulo 2^32) and each is written by one side.
+ * The encoder reads the pixels where the producer put them and writes the
+ * JPEG straight into its output slot, so no file and no extra copy of a
+ * frame is involved.  A side that finds a ring empty or full sleeps on the
+ * counter the other side moves (a futex on Linux).
+ */
+
+#ifndef __SHMRING_H
+#define __SHMRING_H
+
+#include "cjpeg.h"
+
+#define RING_MAGIC      0x474E5242      /* "BRNG" */
+#define RING_VERSION    1
+#define RING_PAGE       4096            /* the head, and slot alignment */
+#define RING_SLOT_HEAD  64              /* ring_frame / ring_result, padded */
+
+#define RING_BGR24      0               /* formats of a frame */
+#define RING_RGB24      1
+
+/* a counter on its own cache line */
+typedef struct {
+    volatile UINT32 v;
+    UINT32 pad[15];
+} ring_counter;
+
+typedef struct {
+    UINT32 magic;
+    UINT32 version;
+    UINT32 in_slots;
+    UINT32 in_slot_size;        /* bytes, header included */
+    UINT32 out_slots;
+    UINT32 out_slot_size;
+    volatile UINT32 closed;     /* set by the producer after its last frame */
+    UINT32 pad[9];
+    ring_counter in_head;       /* frames published by the producer */
+    ring_counter in_tail;       /* frames done with by the encoder */
+    ring_counter out_head;      /* results published by the encoder */
+    ring_counter out_tail;      /* results taken by the producer */
+} ring_head;
+
+typedef struct {
+    UINT64 seq;                 /* any number, copied to the result */
+    UINT32 width;
+    UINT32 height;
+    UINT32 stride;              /* bytes per row */
+    UINT32 format;              /* RING_BGR24 or RING_RGB24 */
+} ring_frame;
+
+typedef struct {
+    UINT64 seq;
+    UINT32 len;                 /* bytes of JPEG */
+    INT32 status;               /* 0, or the err_exit code */
+} ring_result;
+
+typedef struct {
+    ring_head *head;
+    size_t size;                /* of the mapping */
+    char *name;
+} shm_ring;
+
+/* create (replace) the shared memory object name.  -1 with errno on error */
+int ring_create(shm_ring *ring, const char *name, UINT32 in_slots,
+                UINT32 in_slot_size, UINT32 out_slots, UINT32 out_slot_size);
+/* map the object a producer created.  -1 with errno on error */
+int ring_attach(shm_ring *ring, const char *name);
+/* unmap; the creator also removes the object */
+void ring_detach(shm_ring *ring, bool remove);
+
+ring_frame *ring_in_slot(const shm_ring *ring, UINT32 n);
+ring_result *ring_out_slot(const shm_ring *ring, UINT32 n);
+#define RING_DATA(slot) ((UINT8 *) (slot) + RING_SLOT_HEAD)
+
+UINT32 ring_load(const ring_counter *c);
+/* publish a new value and wake the other side */
+void ring_store(ring_counter *c, UINT32 v);
+/* sleep until c is not seen any more, or for at most timeout_ms */
+void ring_wait(ring_counter *c, UINT32 seen, int timeout_ms);
+
+/*
+ * the encoder side: encode every frame of the ring name until the producer
+ * closes it (or SIGINT / SIGTERM).  returns 0, or 1 when the ring cannot be
+ * attached.
+ */
+int encode_ring(const char *name, const encode_options *opts);
+
+#endif /* __SHMRING_H */
@@ -0,0 +1,223 @@
+/**
+ * @file jsimd_avx2.c
+ * @brief AVX2 kernels, 8 lanes of float and 16 of INT16.
+ */
+
+#include <string.h>
+#include "jsimd_x86.h"
+
+#ifdef JSIMD_X86
+
+#define VEC         __m256
+#define VADD        _mm256_add_ps
+#define VSUB        _mm256_sub_ps
+#define VMUL        _mm256_mul_ps
+#define VSET1       _mm256_set1_ps
+
+
+static inline __m256i
+color_sum(__m256i rg, __m256i gb, __m256i br, color_pairs c) {
+    __m256i s = _mm256_madd_epi16(rg, _mm256_set1_epi32(c.rg));
+    s = _mm256_add_epi32(s, _mm256_madd_epi16(gb, _mm256_set1_epi32(c.gb)));
+    return _mm256_add_epi32(s, _mm256_madd_epi16(br, _mm256_set1_epi32(c.br)));
+}
+
+static inline __m256
+color_luma(__m256i s) {
+    s = _mm256_srli_epi32(_mm256_slli_epi32(s, 8), 24);
+    return _mm256_cvtepi32_ps(_mm256_sub_epi32(s, _mm256_set1_epi32(128)));
+}
+
+static inline __m256
+color_chroma(__m256i s) {
+    return _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(s, 8), 24));
+}
+
+/* 8 pixels of two rows, widened to [row j | row j+1] */
+static inline __m256i
+load_rows(const UINT8 *p, UINT32 stride) {
+    __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *) p),
+                                   _mm_loadl_epi64((const __m128i *) (p + stride)));
+    return _mm256_cvtepu8_epi16(v);
+}
+
+/* the sums come as [j 0..3 | j+1 0..3] and [j 4..7 | j+1 4..7] */
+static inline void
+store_rows(float *dst, __m256 lo, __m256 hi) {
+    _mm256_storeu_ps(dst, _mm256_permute2f128_ps(lo, hi, 0x20));
+    _mm256_storeu_ps(dst + DCTSIZE, _mm256_permute2f128_ps(lo, hi, 0x31));
+}
+
+static void
+color_avx2(const pixel_band *band, int x, ycbcr_unit *ycc) {
+    COLOR_PAIRS(cy, ccb, ccr);
+    int j;
+    for (j = 0; j < DCTSIZE; j += 2) {
+        size_t o = (size_t) j * band->stride + x;
+        __m256i r = load_rows(band->plane[0] + o, band->stride);
+        __m256i g = load_rows(band->plane[1] + o, band->stride);
+        __m256i b = load_rows(band->plane[2] + o, band->stride);
+        __m256i rg0 = _mm256_unpacklo_epi16(r, g), rg1 = _mm256_unpackhi_epi16(r, g);
+        __m256i gb0 = _mm256_unpacklo_epi16(g, b), gb1 = _mm256_unpackhi_epi16(g, b);
+        __m256i br0 = _mm256_unpacklo_epi16(b, r), br1 = _mm256_unpackhi_epi16(b, r);
+        int at = j * DCTSIZE;
+        store_rows(ycc->y + at, color_luma(color_sum(rg0, gb0, br0, cy)),
+                   color_luma(color_sum(rg1, gb1, br1, cy)));
+        store_rows(ycc->cb + at, color_chroma(color_sum(rg0, gb0, br0, ccb)),
+                   color_chroma(color_sum(rg1, gb1, br1, ccb)));
+        store_rows(ycc->cr + at, color_chroma(color_sum(rg0, gb0, br0, ccr)),
+                   color_chroma(color_sum(rg1, gb1, br1, ccr)));
+    }
+}
+
+
+static inline void
+transpose8(__m256 *r) {
+    __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+    __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+    __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+    __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+    __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+    r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+    r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+    r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+    r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+    r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+    r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+    r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+/* fdct: a row is one vector, the row pass runs on the transposed block */
+void
+jsimd_fdct_avx2(float *data) {
+    __m256 r[DCTSIZE];
+    int k;
+    for (k = 0; k < DCTSIZE; k++)
+        r[k] = _mm256_loadu_ps(data + k * DCTSIZE);
+    transpose8(r);
+    FDCT_PASS(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+    transpose8(r);
+    FDCT_PASS(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+    for (k = 0; k < DCTSIZE; k++)
+        _mm256_storeu_ps(data + k * DCTSIZE, r[k]);
+}
+
+static void
+fdct_avx2(ycbcr_unit *ycc) {
+    jsimd_fdct_avx2(ycc->y);
+    jsimd_fdct_avx2(ycc->cb);
+    jsimd_fdct_avx2(ycc->cr);
+}
+
+
+static void
+quant_block_avx2(const float *v, const float *recip, INT16 *q) {
+    const __m256d half = _mm256_set1_pd(16384.5);
+    const __m128i bias = _mm_set1_epi32(16384);
+    int i;
+    for (i = 0; i < DCTSIZE2; i += 8) {
+        __m256 p = _mm256_mul_ps(_mm256_loadu_ps(v + i), _mm256_loadu_ps(recip + i));
+        __m128i lo = _mm256_cvttpd_epi32(
+                _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(p)), half));
+        __m128i hi = _mm256_cvttpd_epi32(
+                _mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(p, 1)), half));
+        _mm_storeu_si128((__m128i *) (q + i),
+                         _mm_packs_epi32(_mm_sub_epi32(lo, bias),
+                                         _mm_sub_epi32(hi, bias)));
+    }
+}
+
+static void
+quant_avx2(const ycbcr_unit *ycc, quant_unit *q, const quant_tables *tbl) {
+    quant_block_avx2(ycc->y, tbl->lu_recip, q->y);
+    quant_block_avx2(ycc->cb, tbl->ch_recip, q->cb);
+    quant_block_avx2(ycc->cr, tbl->ch_recip, q->cr);
+}
+
+
+/* bit lengths of 8 coefficients, from the float exponent */
+static inline __m256i
+nbits8(__m128i abs16) {
+    __m256i a = _mm256_cvtepu16_epi32(abs16);
+    __m256i e = _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(a)), 23);
+    return _mm256_max_epi32(_mm256_sub_epi32(e, _mm256_set1_epi32(126)),
+                            _mm256_setzero_si256());
+}
+
+static void
+huff_avx2(huff_state *hs, const INT16 *coef, INT16 *dc,
+          const BITS *dc_htable, const BITS *ac_htable) {
+    INT16 zz[DCTSIZE2];
+    huff_block blk;
+    const __m256i zero = _mm256_setzero_si256();
+    int k;
+
+    for (k = 0; k < DCTSIZE2; k++)
+        zz[k] = coef[NATURAL[k]];
+
+    blk.nonzero = 0;
+    for (k = 0; k < DCTSIZE2; k += 32) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *) (zz + k));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *) (zz + k + 16));
+        __m256i eq = _mm256_packs_epi16(_mm256_cmpeq_epi16(v0, zero),
+                                        _mm256_cmpeq_epi16(v1, zero));
+        UINT32 m = _mm256_movemask_epi8(_mm256_permute4x64_epi64(eq, 0xD8));
+        blk.nonzero |= (UINT64) ~m << k;
+
+        __m256i a0 = _mm256_abs_epi16(v0), a1 = _mm256_abs_epi16(v1);
+        __m256i n0 = _mm256_permute4x64_epi64(
+                _mm256_packs_epi32(nbits8(_mm256_castsi256_si128(a0)),
+                                   nbits8(_mm256_extracti128_si256(a0, 1))), 0xD8);
+        __m256i n1 = _mm256_permute4x64_epi64(
+                _mm256_packs_epi32(nbits8(_mm256_castsi256_si128(a1)),
+                                   nbits8(_mm256_extracti128_si256(a1, 1))), 0xD8);
+        _mm256_storeu_si256((__m256i *) (blk.nbits + k),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(n0, n1), 0xD8));
+        _mm256_storeu_si256((__m256i *) (blk.val + k),
+                            _mm256_add_epi16(v0, _mm256_srai_epi16(v0, 15)));
+        _mm256_storeu_si256((__m256i *) (blk.val + k + 16),
+                            _mm256_add_epi16(v1, _mm256_srai_epi16(v1, 15)));
+    }
+    huff_emit(hs, &blk, coef[0], dc, dc_htable, ac_htable);
+}
+
+
+static size_t
+stuff_avx2(UINT8 *dst, const UINT8 *src, size_t len) {
+    const __m256i ff = _mm256_set1_epi8((char) 0xFF);
+    UINT8 *start = dst;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+        if (!_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ff))) {
+            _mm256_storeu_si256((__m256i *) dst, v);
+            dst += 32;
+        } else
+            dst += stuff_bytes(dst, src + i, 32);
+    }
+    return dst - start + stuff_bytes(dst, src + i, len - i);
+}
+
+
+const jpeg_kernels jsimd_avx2 = {
+        "avx2",
+        color_avx2,
+        fdct_avx2,
+        quant_avx2,
+        huff_avx2,
+        stuff_avx2
+};
+
+#endif /* JSIMD_X86 */
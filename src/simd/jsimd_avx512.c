@@ -0,0 +1,235 @@
+/**
+ * @file jsimd_avx512.c
+ * @brief AVX-512 (F and BW) kernels, 16 lanes of float and 32 of INT16.
+ */
+
+#include <string.h>
+#include "jsimd_x86.h"
+
+#ifdef JSIMD_X86
+
+#define VEC         __m512
+#define VADD        _mm512_add_ps
+#define VSUB        _mm512_sub_ps
+#define VMUL        _mm512_mul_ps
+#define VSET1       _mm512_set1_ps
+
+
+static inline __m512i
+color_sum(__m512i rg, __m512i gb, __m512i br, color_pairs c) {
+    __m512i s = _mm512_madd_epi16(rg, _mm512_set1_epi32(c.rg));
+    s = _mm512_add_epi32(s, _mm512_madd_epi16(gb, _mm512_set1_epi32(c.gb)));
+    return _mm512_add_epi32(s, _mm512_madd_epi16(br, _mm512_set1_epi32(c.br)));
+}
+
+static inline __m512
+color_luma(__m512i s) {
+    s = _mm512_srli_epi32(_mm512_slli_epi32(s, 8), 24);
+    return _mm512_cvtepi32_ps(_mm512_sub_epi32(s, _mm512_set1_epi32(128)));
+}
+
+static inline __m512
+color_chroma(__m512i s) {
+    return _mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(s, 8), 24));
+}
+
+/* 8 pixels of four rows, one row per 128 bit lane */
+static inline __m512i
+load_rows(const UINT8 *p, UINT32 stride) {
+    __m128i a = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *) p),
+                                   _mm_loadl_epi64((const __m128i *) (p + stride)));
+    __m128i b = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *) (p + 2 * stride)),
+                                   _mm_loadl_epi64((const __m128i *) (p + 3 * stride)));
+    return _mm512_cvtepu8_epi16(_mm256_inserti128_si256(_mm256_castsi128_si256(a), b, 1));
+}
+
+/* lo has pixels 0..3 and hi 4..7 of each row, in row order per lane */
+static inline void
+store_rows(float *dst, __m512 lo, __m512 hi) {
+    const __m512i first = _mm512_setr_epi32(0, 1, 2, 3, 16, 17, 18, 19,
+                                            4, 5, 6, 7, 20, 21, 22, 23);
+    const __m512i second = _mm512_setr_epi32(8, 9, 10, 11, 24, 25, 26, 27,
+                                             12, 13, 14, 15, 28, 29, 30, 31);
+    _mm512_storeu_ps(dst, _mm512_permutex2var_ps(lo, first, hi));
+    _mm512_storeu_ps(dst + 2 * DCTSIZE, _mm512_permutex2var_ps(lo, second, hi));
+}
+
+static void
+color_avx512(const pixel_band *band, int x, ycbcr_unit *ycc) {
+    COLOR_PAIRS(cy, ccb, ccr);
+    int j;
+    for (j = 0; j < DCTSIZE; j += 4) {
+        size_t o = (size_t) j * band->stride + x;
+        __m512i r = load_rows(band->plane[0] + o, band->stride);
+        __m512i g = load_rows(band->plane[1] + o, band->stride);
+        __m512i b = load_rows(band->plane[2] + o, band->stride);
+        __m512i rg0 = _mm512_unpacklo_epi16(r, g), rg1 = _mm512_unpackhi_epi16(r, g);
+        __m512i gb0 = _mm512_unpacklo_epi16(g, b), gb1 = _mm512_unpackhi_epi16(g, b);
+        __m512i br0 = _mm512_unpacklo_epi16(b, r), br1 = _mm512_unpackhi_epi16(b, r);
+        int at = j * DCTSIZE;
+        store_rows(ycc->y + at, color_luma(color_sum(rg0, gb0, br0, cy)),
+                   color_luma(color_sum(rg1, gb1, br1, cy)));
+        store_rows(ycc->cb + at, color_chroma(color_sum(rg0, gb0, br0, ccb)),
+                   color_chroma(color_sum(rg1, gb1, br1, ccb)));
+        store_rows(ycc->cr + at, color_chroma(color_sum(rg0, gb0, br0, ccr)),
+                   color_chroma(color_sum(rg1, gb1, br1, ccr)));
+    }
+}
+
+
+/*
+ * fdct: y and cb go together, a vector holds the same row of both.  the
+ * transpose is the AVX2 one done in each 256 bit half.
+ */
+static inline void
+transpose8x2(__m512 *r) {
+    const __m512i first = _mm512_setr_epi32(0, 1, 2, 3, 16, 17, 18, 19,
+                                            8, 9, 10, 11, 24, 25, 26, 27);
+    const __m512i second = _mm512_setr_epi32(4, 5, 6, 7, 20, 21, 22, 23,
+                                             12, 13, 14, 15, 28, 29, 30, 31);
+    __m512 t0 = _mm512_unpacklo_ps(r[0], r[1]);
+    __m512 t1 = _mm512_unpackhi_ps(r[0], r[1]);
+    __m512 t2 = _mm512_unpacklo_ps(r[2], r[3]);
+    __m512 t3 = _mm512_unpackhi_ps(r[2], r[3]);
+    __m512 t4 = _mm512_unpacklo_ps(r[4], r[5]);
+    __m512 t5 = _mm512_unpackhi_ps(r[4], r[5]);
+    __m512 t6 = _mm512_unpacklo_ps(r[6], r[7]);
+    __m512 t7 = _mm512_unpackhi_ps(r[6], r[7]);
+    __m512 s0 = _mm512_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m512 s1 = _mm512_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m512 s2 = _mm512_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m512 s3 = _mm512_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m512 s4 = _mm512_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m512 s5 = _mm512_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m512 s6 = _mm512_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m512 s7 = _mm512_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    r[0] = _mm512_permutex2var_ps(s0, first, s4);
+    r[1] = _mm512_permutex2var_ps(s1, first, s5);
+    r[2] = _mm512_permutex2var_ps(s2, first, s6);
+    r[3] = _mm512_permutex2var_ps(s3, first, s7);
+    r[4] = _mm512_permutex2var_ps(s0, second, s4);
+    r[5] = _mm512_permutex2var_ps(s1, second, s5);
+    r[6] = _mm512_permutex2var_ps(s2, second, s6);
+    r[7] = _mm512_permutex2var_ps(s3, second, s7);
+}
+
+static void
+fdct_avx512(ycbcr_unit *ycc) {
+    __m512 r[DCTSIZE];
+    int k;
+    for (k = 0; k < DCTSIZE; k++)
+        r[k] = _mm512_insertf32x4(_mm512_insertf32x4(
+                _mm512_castps256_ps512(_mm256_loadu_ps(ycc->y + k * DCTSIZE)),
+                _mm_loadu_ps(ycc->cb + k * DCTSIZE), 2),
+                _mm_loadu_ps(ycc->cb + k * DCTSIZE + 4), 3);
+    transpose8x2(r);
+    FDCT_PASS(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+    transpose8x2(r);
+    FDCT_PASS(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+    for (k = 0; k < DCTSIZE; k++) {
+        _mm256_storeu_ps(ycc->y + k * DCTSIZE, _mm512_castps512_ps256(r[k]));
+        _mm_storeu_ps(ycc->cb + k * DCTSIZE, _mm512_extractf32x4_ps(r[k], 2));
+        _mm_storeu_ps(ycc->cb + k * DCTSIZE + 4, _mm512_extractf32x4_ps(r[k], 3));
+    }
+    jsimd_fdct_avx2(ycc->cr);
+}
+
+
+static void
+quant_block_avx512(const float *v, const float *recip, INT16 *q) {
+    const __m512d half = _mm512_set1_pd(16384.5);
+    const __m512i bias = _mm512_set1_epi32(16384);
+    int i;
+    for (i = 0; i < DCTSIZE2; i += 16) {
+        __m512 p = _mm512_mul_ps(_mm512_loadu_ps(v + i), _mm512_loadu_ps(recip + i));
+        __m256i lo = _mm512_cvttpd_epi32(
+                _mm512_add_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(p)), half));
+        __m256i hi = _mm512_cvttpd_epi32(_mm512_add_pd(_mm512_cvtps_pd(
+                _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(p), 1))), half));
+        __m512i n = _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+        _mm256_storeu_si256((__m256i *) (q + i),
+                            _mm512_cvtepi32_epi16(_mm512_sub_epi32(n, bias)));
+    }
+}
+
+static void
+quant_avx512(const ycbcr_unit *ycc, quant_unit *q, const quant_tables *tbl) {
+    quant_block_avx512(ycc->y, tbl->lu_recip, q->y);
+    quant_block_avx512(ycc->cb, tbl->ch_recip, q->cb);
+    quant_block_avx512(ycc->cr, tbl->ch_recip, q->cr);
+}
+
+
+/* bit lengths of 16 coefficients, from the float exponent */
+static inline __m128i
+nbits16(__m256i abs16) {
+    __m512i a = _mm512_cvtepu16_epi32(abs16);
+    __m512i e = _mm512_srli_epi32(_mm512_castps_si512(_mm512_cvtepi32_ps(a)), 23);
+    e = _mm512_max_epi32(_mm512_sub_epi32(e, _mm512_set1_epi32(126)),
+                         _mm512_setzero_si512());
+    return _mm512_cvtepi32_epi8(e);
+}
+
+/* the zigzag reorder is two permutes over the whole block, NATURAL as INT16 */
+static const INT16 ORDER[DCTSIZE2] = {
+        0, 1, 8, 16, 9, 2, 3, 10,
+        17, 24, 32, 25, 18, 11, 4, 5,
+        12, 19, 26, 33, 40, 48, 41, 34,
+        27, 20, 13, 6, 7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36,
+        29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46,
+        53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static void
+huff_avx512(huff_state *hs, const INT16 *coef, INT16 *dc,
+            const BITS *dc_htable, const BITS *ac_htable) {
+    huff_block blk;
+    __m512i lo = _mm512_loadu_si512(coef), hi = _mm512_loadu_si512(coef + 32);
+    int k;
+
+    blk.nonzero = 0;
+    for (k = 0; k < DCTSIZE2; k += 32) {
+        __m512i v = _mm512_permutex2var_epi16(
+                lo, _mm512_loadu_si512(ORDER + k), hi);
+        __m512i a = _mm512_abs_epi16(v);
+        blk.nonzero |= (UINT64) _mm512_test_epi16_mask(v, v) << k;
+        _mm_storeu_si128((__m128i *) (blk.nbits + k),
+                         nbits16(_mm512_castsi512_si256(a)));
+        _mm_storeu_si128((__m128i *) (blk.nbits + k + 16),
+                         nbits16(_mm512_extracti64x4_epi64(a, 1)));
+        _mm512_storeu_si512(blk.val + k,
+                            _mm512_add_epi16(v, _mm512_srai_epi16(v, 15)));
+    }
+    huff_emit(hs, &blk, coef[0], dc, dc_htable, ac_htable);
+}
+
+
+static size_t
+stuff_avx512(UINT8 *dst, const UINT8 *src, size_t len) {
+    const __m512i ff = _mm512_set1_epi8((char) 0xFF);
+    UINT8 *start = dst;
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m512i v = _mm512_loadu_si512(src + i);
+        if (!_mm512_cmpeq_epi8_mask(v, ff)) {
+            _mm512_storeu_si512(dst, v);
+            dst += 64;
+        } else
+            dst += stuff_bytes(dst, src + i, 64);
+    }
+    return dst - start + stuff_bytes(dst, src + i, len - i);
+}
+
+
+const jpeg_kernels jsimd_avx512 = {
+        "avx512",
+        color_avx512,
+        fdct_avx512,
+        quant_avx512,
+        huff_avx512,
+        stuff_avx512
+};
+
+#endif /* JSIMD_X86 */
@@ -0,0 +1,209 @@
+/**
+ * @file jsimd_sse2.c
+ * @brief SSE2 kernels, 4 lanes of float and 8 of INT16.
+ */
+
+#include <string.h>
+#include "jsimd_x86.h"
+
+#ifdef JSIMD_X86
+
+#define VEC         __m128
+#define VADD        _mm_add_ps
+#define VSUB        _mm_sub_ps
+#define VMUL        _mm_mul_ps
+#define VSET1       _mm_set1_ps
+
+
+/* y, cb, cr of 4 pixels from their (r,g), (g,b), (b,r) pairs */
+static inline __m128i
+color_sum(__m128i rg, __m128i gb, __m128i br, color_pairs c) {
+    __m128i s = _mm_madd_epi16(rg, _mm_set1_epi32(c.rg));
+    s = _mm_add_epi32(s, _mm_madd_epi16(gb, _mm_set1_epi32(c.gb)));
+    return _mm_add_epi32(s, _mm_madd_epi16(br, _mm_set1_epi32(c.br)));
+}
+
+/* bits 16..23 of the sums as rgb_to_ycbcr() takes them */
+static inline __m128
+color_luma(__m128i s) {
+    s = _mm_srli_epi32(_mm_slli_epi32(s, 8), 24);
+    return _mm_cvtepi32_ps(_mm_sub_epi32(s, _mm_set1_epi32(128)));
+}
+
+static inline __m128
+color_chroma(__m128i s) {
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(s, 8), 24));
+}
+
+static void
+color_sse2(const pixel_band *band, int x, ycbcr_unit *ycc) {
+    COLOR_PAIRS(cy, ccb, ccr);
+    const __m128i zero = _mm_setzero_si128();
+    int j;
+    for (j = 0; j < DCTSIZE; j++) {
+        size_t o = (size_t) j * band->stride + x;
+        __m128i r = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *) (band->plane[0] + o)), zero);
+        __m128i g = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *) (band->plane[1] + o)), zero);
+        __m128i b = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *) (band->plane[2] + o)), zero);
+        __m128i rg[2], gb[2], br[2];
+        int h;
+        rg[0] = _mm_unpacklo_epi16(r, g);
+        rg[1] = _mm_unpackhi_epi16(r, g);
+        gb[0] = _mm_unpacklo_epi16(g, b);
+        gb[1] = _mm_unpackhi_epi16(g, b);
+        br[0] = _mm_unpacklo_epi16(b, r);
+        br[1] = _mm_unpackhi_epi16(b, r);
+        for (h = 0; h < 2; h++) {
+            int at = j * DCTSIZE + h * 4;
+            _mm_storeu_ps(ycc->y + at,
+                          color_luma(color_sum(rg[h], gb[h], br[h], cy)));
+            _mm_storeu_ps(ycc->cb + at,
+                          color_chroma(color_sum(rg[h], gb[h], br[h], ccb)));
+            _mm_storeu_ps(ycc->cr + at,
+                          color_chroma(color_sum(rg[h], gb[h], br[h], ccr)));
+        }
+    }
+}
+
+
+/*
+ * fdct: a row is two vectors, l (columns 0..3) and r (columns 4..7).  the
+ * row pass transposes the 4x4 quarters there and back, the column pass
+ * works on the rows directly.
+ */
+static void
+fdct_block_sse2(float *data) {
+    __m128 l[DCTSIZE], r[DCTSIZE];
+    int k, g;
+
+    for (k = 0; k < DCTSIZE; k++) {
+        l[k] = _mm_loadu_ps(data + k * DCTSIZE);
+        r[k] = _mm_loadu_ps(data + k * DCTSIZE + 4);
+    }
+
+    /* pass 1: rows, 4 at a time */
+    for (g = 0; g < DCTSIZE; g += 4) {
+        __m128 *a = l + g, *b = r + g;
+        _MM_TRANSPOSE4_PS(a[0], a[1], a[2], a[3]);
+        _MM_TRANSPOSE4_PS(b[0], b[1], b[2], b[3]);
+        FDCT_PASS(a[0], a[1], a[2], a[3], b[0], b[1], b[2], b[3]);
+        _MM_TRANSPOSE4_PS(a[0], a[1], a[2], a[3]);
+        _MM_TRANSPOSE4_PS(b[0], b[1], b[2], b[3]);
+    }
+    /* pass 2: columns */
+    FDCT_PASS(l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+    FDCT_PASS(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+
+    for (k = 0; k < DCTSIZE; k++) {
+        _mm_storeu_ps(data + k * DCTSIZE, l[k]);
+        _mm_storeu_ps(data + k * DCTSIZE + 4, r[k]);
+    }
+}
+
+static void
+fdct_sse2(ycbcr_unit *ycc) {
+    fdct_block_sse2(ycc->y);
+    fdct_block_sse2(ycc->cb);
+    fdct_block_sse2(ycc->cr);
+}
+
+
+/* quantization, rounded in double like jpeg_quant() */
+static inline __m128i
+quant4(const float *v, const float *recip) {
+    __m128 p = _mm_mul_ps(_mm_loadu_ps(v), _mm_loadu_ps(recip));
+    const __m128d half = _mm_set1_pd(16384.5);
+    __m128i lo = _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(p), half));
+    __m128i hi = _mm_cvttpd_epi32(
+            _mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(p, p)), half));
+    return _mm_sub_epi32(_mm_unpacklo_epi64(lo, hi), _mm_set1_epi32(16384));
+}
+
+static void
+quant_block_sse2(const float *v, const float *recip, INT16 *q) {
+    int i;
+    for (i = 0; i < DCTSIZE2; i += 8)
+        _mm_storeu_si128((__m128i *) (q + i),
+                         _mm_packs_epi32(quant4(v + i, recip + i),
+                                         quant4(v + i + 4, recip + i + 4)));
+}
+
+static void
+quant_sse2(const ycbcr_unit *ycc, quant_unit *q, const quant_tables *tbl) {
+    quant_block_sse2(ycc->y, tbl->lu_recip, q->y);
+    quant_block_sse2(ycc->cb, tbl->ch_recip, q->cb);
+    quant_block_sse2(ycc->cr, tbl->ch_recip, q->cr);
+}
+
+
+/*
+ * huffman: reorder with a table, then the zero mask, bit lengths and
+ * amplitudes 8 coefficients at a time.  the bit length is read from the
+ * exponent of the coefficient converted to float.
+ */
+static inline __m128i
+nbits4(__m128i abs32) {
+    __m128i e = _mm_srli_epi32(_mm_castps_si128(_mm_cvtepi32_ps(abs32)), 23);
+    e = _mm_sub_epi32(e, _mm_set1_epi32(126));
+    return _mm_and_si128(e, _mm_cmpgt_epi32(abs32, _mm_setzero_si128()));
+}
+
+static void
+huff_sse2(huff_state *hs, const INT16 *coef, INT16 *dc,
+          const BITS *dc_htable, const BITS *ac_htable) {
+    INT16 zz[DCTSIZE2];
+    huff_block blk;
+    const __m128i zero = _mm_setzero_si128();
+    int k;
+
+    for (k = 0; k < DCTSIZE2; k++)
+        zz[k] = coef[NATURAL[k]];
+
+    blk.nonzero = 0;
+    for (k = 0; k < DCTSIZE2; k += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (zz + k));
+        __m128i eq = _mm_cmpeq_epi16(v, zero);
+        __m128i abs = _mm_max_epi16(v, _mm_sub_epi16(zero, v));
+        __m128i n = _mm_packs_epi32(nbits4(_mm_unpacklo_epi16(abs, zero)),
+                                    nbits4(_mm_unpackhi_epi16(abs, zero)));
+        UINT32 m = _mm_movemask_epi8(_mm_packs_epi16(eq, zero)) & 0xFF;
+        blk.nonzero |= (UINT64) (~m & 0xFF) << k;
+        _mm_storel_epi64((__m128i *) (blk.nbits + k), _mm_packus_epi16(n, zero));
+        _mm_storeu_si128((__m128i *) (blk.val + k),
+                         _mm_add_epi16(v, _mm_srai_epi16(v, 15)));
+    }
+    huff_emit(hs, &blk, coef[0], dc, dc_htable, ac_htable);
+}
+
+
+/* byte stuffing, 16 bytes without a 0xFF are copied in one go */
+static size_t
+stuff_sse2(UINT8 *dst, const UINT8 *src, size_t len) {
+    const __m128i ff = _mm_set1_epi8((char) 0xFF);
+    UINT8 *start = dst;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        if (!_mm_movemask_epi8(_mm_cmpeq_epi8(v, ff))) {
+            _mm_storeu_si128((__m128i *) dst, v);
+            dst += 16;
+        } else
+            dst += stuff_bytes(dst, src + i, 16);
+    }
+    return dst - start + stuff_bytes(dst, src + i, len - i);
+}
+
+
+const jpeg_kernels jsimd_sse2 = {
+        "sse2",
+        color_sse2,
+        fdct_sse2,
+        quant_sse2,
+        huff_sse2,
+        stuff_sse2
+};
+
+#endif /* JSIMD_X86 */
@@ -0,0 +1,99 @@
+/**
+ * @file jsimd_x86.h
+ * @brief pieces shared by the SSE2, AVX2 and AVX-512 kernels.
+ */
+
+#ifndef __JSIMD_X86_H
+#define __JSIMD_X86_H
+
+#include "../jsimd.h"
+
+#ifdef JSIMD_X86
+
+#include <immintrin.h>
+
+/*
+ * one pass of jpeg_fdct() over the vectors d0..d7, lane i of dk is element k
+ * of the i-th row (or column).  the operations and their order are those of
+ * the scalar code, so every lane gets the same bits.  the including file
+ * defines VEC, VADD, VSUB, VMUL and VSET1.
+ */
+#define FDCT_PASS(d0, d1, d2, d3, d4, d5, d6, d7) do {                  \
+    VEC tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;                 \
+    VEC tmp10, tmp11, tmp12, tmp13;                                     \
+    VEC z1, z2, z3, z4, z5, z11, z13;                                   \
+    tmp0 = VADD(d0, d7);                                                \
+    tmp7 = VSUB(d0, d7);                                                \
+    tmp1 = VADD(d1, d6);                                                \
+    tmp6 = VSUB(d1, d6);                                                \
+    tmp2 = VADD(d2, d5);                                                \
+    tmp5 = VSUB(d2, d5);                                                \
+    tmp3 = VADD(d3, d4);                                                \
+    tmp4 = VSUB(d3, d4);                                                \
+    /* even part */                                                     \
+    tmp10 = VADD(tmp0, tmp3);                                           \
+    tmp13 = VSUB(tmp0, tmp3);                                           \
+    tmp11 = VADD(tmp1, tmp2);                                           \
+    tmp12 = VSUB(tmp1, tmp2);                                           \
+    d0 = VADD(tmp10, tmp11);                                            \
+    d4 = VSUB(tmp10, tmp11);                                            \
+    z1 = VMUL(VADD(tmp12, tmp13), VSET1((float) 0.707106781));          \
+    d2 = VADD(tmp13, z1);                                               \
+    d6 = VSUB(tmp13, z1);                                               \
+    /* odd part */                                                      \
+    tmp10 = VADD(tmp4, tmp5);                                           \
+    tmp11 = VADD(tmp5, tmp6);                                           \
+    tmp12 = VADD(tmp6, tmp7);                                           \
+    z5 = VMUL(VSUB(tmp10, tmp12), VSET1((float) 0.382683433));          \
+    z2 = VADD(VMUL(VSET1((float) 0.541196100), tmp10), z5);             \
+    z4 = VADD(VMUL(VSET1((float) 1.306562965), tmp12), z5);             \
+    z3 = VMUL(tmp11, VSET1((float) 0.707106781));                       \
+    z11 = VADD(tmp7, z3);                                               \
+    z13 = VSUB(tmp7, z3);                                               \
+    d5 = VADD(z13, z2);                                                 \
+    d3 = VSUB(z13, z2);                                                 \
+    d1 = VADD(z11, z4);                                                 \
+    d7 = VSUB(z11, z4);                                                 \
+} while (0)
+
+
+/*
+ * color conversion with pmaddwd.  a coefficient c of ycc_tables does not
+ * always fit in 16 bits, so it is split in two halves, and the three sums
+ * r*c_r + g*c_g + b*c_b are taken over the pixel pairs (r,g), (g,b), (b,r),
+ * each pixel meeting one half of its coefficient in two of them.
+ */
+typedef struct {
+    INT32 rg, gb, br;           /* two 16 bit coefficients per lane */
+} color_pairs;
+
+static inline INT32
+color_pair(INT32 lo, INT32 hi) {
+    return (INT32) (((UINT32) (UINT16) hi << 16) | (UINT16) lo);
+}
+
+static inline color_pairs
+color_split(INT32 cr, INT32 cg, INT32 cb) {
+    color_pairs p;
+    INT32 cr1 = cr / 2, cg1 = cg / 2, cb1 = cb / 2;
+    p.rg = color_pair(cr1, cg1);
+    p.gb = color_pair(cg - cg1, cb1);
+    p.br = color_pair(cb - cb1, cr - cr1);
+    return p;
+}
+
+/* the coefficients are the table entries for 1 */
+#define COLOR_PAIRS(y, cb, cr)                                           \
+    color_pairs y = color_split(ycc_tables.r2y[1], ycc_tables.g2y[1],   \
+                                ycc_tables.b2y[1]);                     \
+    color_pairs cb = color_split(ycc_tables.r2cb[1], ycc_tables.g2cb[1], \
+                                 ycc_tables.b2cb[1]);                   \
+    color_pairs cr = color_split(ycc_tables.r2cr[1], ycc_tables.g2cr[1], \
+                                 ycc_tables.b2cr[1])
+
+/* fdct of one block with AVX2, also used by the AVX-512 kernels */
+void jsimd_fdct_avx2(float *data);
+
+#endif /* JSIMD_X86 */
+
+#endif /* __JSIMD_X86_H */
@@ -0,0 +1,297 @@
+/**
+ * @file bmp2jpeg_client.c
+ * @brief client for the encoder server, for testing and load generation.
+ *
+ * Sends the same request -n times on each of -c concurrent connections and
+ * reports throughput and latency.  By default the server opens the BMP and
+ * writes the JPEG itself; -I sends the BMP bytes inline and -O asks for the
+ * JPEG in the reply, which the client then writes to the JPEG path.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "../server.h"
+
+typedef struct {
+    const char *socket_path;
+    req_head head;
+    const UINT8 *in;
+    const char *out;
+    const char *save_path;      /* where to write an inline reply */
+    int count;
+    double *latency;            /* count entries */
+    int errors;
+} client_thread;
+
+
+static double
+now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len) {
+    const UINT8 *p = (const UINT8 *) buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len) {
+    UINT8 *p = (UINT8 *) buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+connect_server(const char *socket_path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *
+client_main(void *arg) {
+    client_thread *t = (client_thread *) arg;
+    UINT8 *reply = NULL;
+    size_t reply_cap = 0;
+    int fd, i;
+
+    fd = connect_server(t->socket_path);
+    if (fd < 0) {
+        perror(t->socket_path);
+        t->errors = t->count;
+        return NULL;
+    }
+
+    for (i = 0; i < t->count; i++) {
+        resp_head resp;
+        double start = now_seconds();
+
+        if (write_all(fd, &t->head, REQ_HEAD_LEN) < 0 ||
+            write_all(fd, t->in, t->head.in_len) < 0 ||
+            (t->head.out_len && write_all(fd, t->out, t->head.out_len) < 0) ||
+            read_all(fd, &resp, RESP_HEAD_LEN) < 0 ||
+            resp.magic != RESP_MAGIC) {
+            fprintf(stderr, "connection lost\n");
+            t->errors += t->count - i;
+            break;
+        }
+        if (resp.len > reply_cap) {
+            reply_cap = resp.len;
+            reply = (UINT8 *) realloc(reply, reply_cap);
+            if (!reply) {
+                t->errors += t->count - i;
+                break;
+            }
+        }
+        if (resp.len && read_all(fd, reply, resp.len) < 0) {
+            t->errors += t->count - i;
+            break;
+        }
+        t->latency[i] = now_seconds() - start;
+
+        if (resp.status) {
+            fprintf(stderr, "error %d: %.*s\n", resp.status,
+                    (int) resp.len, (const char *) reply);
+            t->errors++;
+        } else if (t->save_path && i == 0) {
+            FILE *fp = fopen(t->save_path, "wb");
+            if (!fp || fwrite(reply, 1, resp.len, fp) != resp.len)
+                perror(t->save_path);
+            if (fp)
+                fclose(fp);
+        }
+    }
+
+    free(reply);
+    close(fd);
+    return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* make a path absolute, the server may run in another directory */
+static char *
+absolute_path(const char *path) {
+    char cwd[PATH_MAX];
+    char *abs;
+    if (path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+        return strdup(path);
+    abs = (char *) malloc(strlen(cwd) + strlen(path) + 2);
+    if (abs)
+        sprintf(abs, "%s/%s", cwd, path);
+    return abs;
+}
+
+static UINT8 *
+load_file(const char *path, UINT32 *len) {
+    FILE *fp = fopen(path, "rb");
+    UINT8 *data;
+    long size;
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    data = (UINT8 *) malloc(size > 0 ? size : 1);
+    if (!data || fread(data, 1, size, fp) != (size_t) size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *len = (UINT32) size;
+    return data;
+}
+
+static void
+print_help() {
+    printf("send BMP to JPEG requests to a bmp2jpeg server.\n");
+    printf("Usage:\n");
+    printf("    bmp2jpeg_client -s SOCKET [options] {BMP} [JPEG]\n");
+    printf("Options:\n");
+    printf("    -q N    quality 1..100\n");
+    printf("    -I      send the BMP inline instead of its path\n");
+    printf("    -O      receive the JPEG inline (implied without JPEG)\n");
+    printf("    -n N    requests per connection (default 1)\n");
+    printf("    -c N    concurrent connections (default 1)\n");
+}
+
+int
+main(int argc, char *argv[]) {
+    const char *socket_path = NULL;
+    bool inline_in = 0, inline_out = 0;
+    int quality = 0, count = 1, conns = 1;
+    int argi, i, total, errors = 0;
+    client_thread *threads;
+    pthread_t *tids;
+    double *all, start, elapsed;
+    req_head head;
+    UINT8 *in;
+    char *out = NULL;
+
+    for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++) {
+        const char *opt = argv[argi];
+        if (!strcmp(opt, "-I"))
+            inline_in = 1;
+        else if (!strcmp(opt, "-O"))
+            inline_out = 1;
+        else if (argi + 1 < argc && !strcmp(opt, "-s"))
+            socket_path = argv[++argi];
+        else if (argi + 1 < argc && !strcmp(opt, "-q"))
+            quality = atoi(argv[++argi]);
+        else if (argi + 1 < argc && !strcmp(opt, "-n"))
+            count = atoi(argv[++argi]);
+        else if (argi + 1 < argc && !strcmp(opt, "-c"))
+            conns = atoi(argv[++argi]);
+        else {
+            print_help();
+            return 2;
+        }
+    }
+    if (!socket_path || argc - argi < 1 || argc - argi > 2 ||
+        count < 1 || conns < 1) {
+        print_help();
+        return 2;
+    }
+    if (argc - argi == 1)
+        inline_out = 1;
+
+    memset(&head, 0, sizeof(head));
+    head.magic = REQ_MAGIC;
+    head.scale = quality ? quality_to_scale(quality) : 0;
+    if (inline_in) {
+        head.flags |= REQ_INLINE_IN;
+        in = load_file(argv[argi], &head.in_len);
+    } else {
+        in = (UINT8 *) absolute_path(argv[argi]);
+        head.in_len = in ? (UINT32) strlen((char *) in) : 0;
+    }
+    if (!in) {
+        perror(argv[argi]);
+        return 1;
+    }
+    if (inline_out)
+        head.flags |= REQ_INLINE_OUT;
+    else {
+        out = absolute_path(argv[argi + 1]);
+        head.out_len = out ? (UINT32) strlen(out) : 0;
+    }
+
+    threads = (client_thread *) calloc(conns, sizeof(client_thread));
+    tids = (pthread_t *) malloc(conns * sizeof(pthread_t));
+    all = (double *) calloc((size_t) conns * count, sizeof(double));
+    if (!threads || !tids || !all)
+        return 1;
+
+    start = now_seconds();
+    for (i = 0; i < conns; i++) {
+        threads[i].socket_path = socket_path;
+        threads[i].head = head;
+        threads[i].in = in;
+        threads[i].out = out;
+        threads[i].save_path = inline_out && i == 0 && argc - argi == 2
+                               ? argv[argi + 1] : NULL;
+        threads[i].count = count;
+        threads[i].latency = all + (size_t) i * count;
+        pthread_create(&tids[i], NULL, client_main, &threads[i]);
+    }
+    for (i = 0; i < conns; i++) {
+        pthread_join(tids[i], NULL);
+        errors += threads[i].errors;
+    }
+    elapsed = now_seconds() - start;
+
+    total = conns * count;
+    if (total > 1 || errors) {
+        qsort(all, total, sizeof(double), cmp_double);
+        printf("%d requests, %d errors, %.3f s, %.1f req/s, "
+               "latency p50 %.3f ms p99 %.3f ms\n",
+               total, errors, elapsed, total / elapsed,
+               all[total / 2] * 1e3, all[(int) (total * 0.99)] * 1e3);
+    }
+
+    free(all);
+    free(tids);
+    free(threads);
+    free(in);
+    free(out);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,232 @@
+/**
+ * @file bmp2jpeg_ring.c
+ * @brief a producer for bmp2jpeg --shm, for testing and measuring.
+ *
+ * Creates the ring, then one thread puts the frames of the BMPs into the
+ * input slots, -n frames in turn, as a capture process would, while the
+ * main thread takes the JPEGs from the output slots.  The latency of a
+ * frame is from publishing it to its JPEG being published; no file is
+ * involved.  Start bmp2jpeg --shm NAME once the ring is created.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "../shmring.h"
+#include "../rdbmp.h"
+
+typedef struct {
+    UINT8 *pixels;              /* top-down BGR rows of stride bytes */
+    UINT32 width;
+    UINT32 height;
+    UINT32 stride;
+} frame;
+
+typedef struct {
+    shm_ring *ring;
+    const frame *frames;
+    int nframes;
+    int count;
+    double *published;          /* count entries, set by the pusher */
+} pusher;
+
+
+static double
+now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* the pixels of a 24-bit BMP, turned top-down; the row padding stays */
+static bool
+load_frame(const char *path, frame *f) {
+    FILE *fp = fopen(path, "rb");
+    bmp_info binfo;
+    UINT32 i;
+    if (!fp)
+        return 0;
+    if (!is_bmp(fp)) {
+        fclose(fp);
+        return 0;
+    }
+    read_bmp(fp, &binfo);
+    f->width = binfo.width;
+    f->height = binfo.height;
+    f->stride = (binfo.width * 3 + 3) / 4 * 4;
+    f->pixels = (UINT8 *) malloc((size_t) f->stride * f->height);
+    if (binfo.bitppx != 24 || !f->pixels ||
+        fseek(fp, binfo.offset, SEEK_SET) != 0) {
+        free(f->pixels);
+        fclose(fp);
+        return 0;
+    }
+    for (i = 0; i < f->height; i++) {
+        UINT32 row = binfo.topdown ? i : f->height - 1 - i;
+        if (fread(f->pixels + (size_t) row * f->stride, 1, f->stride, fp) != f->stride) {
+            free(f->pixels);
+            fclose(fp);
+            return 0;
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+static void *
+pusher_main(void *arg) {
+    pusher *p = (pusher *) arg;
+    ring_head *h = p->ring->head;
+    UINT32 head = ring_load(&h->in_head);
+    int i;
+
+    for (i = 0; i < p->count; i++) {
+        const frame *src = &p->frames[i % p->nframes];
+        UINT32 tail;
+        ring_frame *f;
+        while (head - (tail = ring_load(&h->in_tail)) >= h->in_slots)
+            ring_wait(&h->in_tail, tail, 100);
+        f = ring_in_slot(p->ring, head);
+        f->seq = (UINT64) i;
+        f->width = src->width;
+        f->height = src->height;
+        f->stride = src->stride;
+        f->format = RING_BGR24;
+        memcpy(RING_DATA(f), src->pixels, (size_t) src->stride * src->height);
+        p->published[i] = now_seconds();
+        ring_store(&h->in_head, ++head);
+    }
+    /* after the last frame, see encode_ring() */
+    __atomic_store_n(&h->closed, 1, __ATOMIC_RELEASE);
+    ring_store(&h->in_head, head);
+    return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+print_help() {
+    printf("put BMP frames into a shared memory ring for bmp2jpeg --shm.\n");
+    printf("Usage:\n");
+    printf("    bmp2jpeg_ring -r NAME [options] {BMP} ...\n");
+    printf("Options:\n");
+    printf("    -n N    frames, the BMPs in turn (default the number of BMPs)\n");
+    printf("    -s N    input and output slots (default 4)\n");
+    printf("    -o DIR  write the JPEGs to DIR/frameNNNNNN.jpg\n");
+}
+
+int
+main(int argc, char *argv[]) {
+    const char *name = NULL, *dir = NULL;
+    int count = 0, slots = 4, nframes, argi, i, errors = 0;
+    UINT32 max_size = 0, tail;
+    double *published, *latency, start, elapsed;
+    frame *frames;
+    shm_ring ring;
+    pusher p;
+    pthread_t tid;
+
+    for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++) {
+        const char *opt = argv[argi];
+        if (argi + 1 < argc && !strcmp(opt, "-r"))
+            name = argv[++argi];
+        else if (argi + 1 < argc && !strcmp(opt, "-n"))
+            count = atoi(argv[++argi]);
+        else if (argi + 1 < argc && !strcmp(opt, "-s"))
+            slots = atoi(argv[++argi]);
+        else if (argi + 1 < argc && !strcmp(opt, "-o"))
+            dir = argv[++argi];
+        else {
+            print_help();
+            return 2;
+        }
+    }
+    nframes = argc - argi;
+    if (!name || nframes < 1 || count < 0 || slots < 1) {
+        print_help();
+        return 2;
+    }
+    if (count == 0)
+        count = nframes;
+
+    frames = (frame *) calloc(nframes, sizeof(frame));
+    published = (double *) calloc(count, sizeof(double));
+    latency = (double *) calloc(count, sizeof(double));
+    if (!frames || !published || !latency)
+        return 1;
+    for (i = 0; i < nframes; i++) {
+        if (!load_frame(argv[argi + i], &frames[i])) {
+            fprintf(stderr, "%s: not a 24-bit BMP\n", argv[argi + i]);
+            return 1;
+        }
+        if (frames[i].stride * frames[i].height > max_size)
+            max_size = frames[i].stride * frames[i].height;
+    }
+
+    /* a JPEG is smaller than its pixels but for tiny or noisy images */
+    if (ring_create(&ring, name, slots, RING_SLOT_HEAD + max_size, slots,
+                    RING_SLOT_HEAD + max_size + 65536) < 0) {
+        perror(name);
+        return 1;
+    }
+    printf("ring %s created, waiting for bmp2jpeg --shm %s\n", name, name);
+    fflush(stdout);
+
+    p.ring = &ring;
+    p.frames = frames;
+    p.nframes = nframes;
+    p.count = count;
+    p.published = published;
+    pthread_create(&tid, NULL, pusher_main, &p);
+
+    start = 0;
+    tail = ring_load(&ring.head->out_tail);
+    for (i = 0; i < count; i++) {
+        UINT32 head;
+        ring_result *r;
+        while ((head = ring_load(&ring.head->out_head)) == tail)
+            ring_wait(&ring.head->out_head, head, 100);
+        r = ring_out_slot(&ring, tail);
+        latency[i] = now_seconds() - published[r->seq];
+        if (i == 0)
+            start = published[0];
+        if (r->status) {
+            fprintf(stderr, "frame %llu: error %d: %.*s\n",
+                    (unsigned long long) r->seq, r->status, (int) r->len,
+                    (const char *) RING_DATA(r));
+            errors++;
+        } else if (dir) {
+            char path[4096];
+            FILE *fp;
+            snprintf(path, sizeof(path), "%s/frame%06llu.jpg", dir,
+                     (unsigned long long) r->seq);
+            fp = fopen(path, "wb");
+            if (!fp || fwrite(RING_DATA(r), 1, r->len, fp) != r->len)
+                perror(path);
+            if (fp)
+                fclose(fp);
+        }
+        ring_store(&ring.head->out_tail, ++tail);
+    }
+    elapsed = now_seconds() - start;
+    pthread_join(tid, NULL);
+
+    qsort(latency, count, sizeof(double), cmp_double);
+    printf("%d frames, %d errors, %.3f s, %.1f frames/s, "
+           "latency p50 %.3f ms p99 %.3f ms\n",
+           count, errors, elapsed, count / elapsed,
+           latency[count / 2] * 1e3, latency[(int) (count * 0.99)] * 1e3);
+
+    ring_detach(&ring, 1);
+    for (i = 0; i < nframes; i++)
+        free(frames[i].pixels);
+    free(frames);
+    free(published);
+    free(latency);
+    return errors ? 1 : 0;
+}
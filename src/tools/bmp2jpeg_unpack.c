@@ -0,0 +1,207 @@
+/**
+ * @file bmp2jpeg_unpack.c
+ * @brief lists and extracts the entries of a pack file (bmp2jpeg --pack).
+ *
+ * Only the entries of the index are seen, so a pack whose writer was
+ * stopped gives what it had committed.  Every entry read is checked
+ * against the hash of the index.  Abbreviated entries (--tables) get the
+ * tables of -t merged back in; -m does the same for a single file.
+ */
+
+#include <string.h>
+#include "../jpack.h"
+#include "../cmarker.h"
+
+static void
+print_help() {
+    printf("list or extract the JPEGs of a pack file.\n");
+    printf("Usage:\n");
+    printf("    bmp2jpeg_unpack {PACK}                     list the entries\n");
+    printf("    bmp2jpeg_unpack -x [-d DIR] {PACK} [NAME ...]\n");
+    printf("                   extract all or the named entries to DIR (default .)\n");
+    printf("                   as the base name of the entry with .jpg\n");
+    printf("    bmp2jpeg_unpack -c {PACK} {NAME}           write one entry to stdout\n");
+    printf("    bmp2jpeg_unpack -t TABLES -m {IN} {JPEG}   merge TABLES into one file\n");
+    printf("Options:\n");
+    printf("    -t TABLES  a tables-only datastream (bmp2jpeg --tables), merged\n");
+    printf("               into every JPEG written\n");
+}
+
+static UINT8 *
+load_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    UINT8 *data = NULL;
+    long size;
+    if (fp && fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 &&
+        fseek(fp, 0, SEEK_SET) == 0 && (data = (UINT8 *) malloc(size ? size : 1)) &&
+        fread(data, 1, size, fp) == (size_t) size)
+        *len = (size_t) size;
+    else {
+        free(data);
+        data = NULL;
+    }
+    if (fp)
+        fclose(fp);
+    return data;
+}
+
+/* write data, with the tables merged in when there are tables */
+static bool
+put_jpeg(FILE *fp, const UINT8 *data, size_t len, const UINT8 *tables,
+         size_t tables_len) {
+    UINT8 *merged = NULL;
+    bool ok;
+    if (tables) {
+        if (!(merged = merge_tables(tables, tables_len, data, len, &len)))
+            return 0;
+        data = merged;
+    }
+    ok = fwrite(data, 1, len, fp) == len;
+    free(merged);
+    return ok;
+}
+
+/* DIR/base name of name, its extension replaced by .jpg */
+static char *
+out_name(const char *dir, const char *name) {
+    const char *base = strrchr(name, '/');
+    const char *dot;
+    size_t n;
+    char *path;
+    base = base ? base + 1 : name;
+    dot = strrchr(base, '.');
+    n = dot && dot != base ? (size_t) (dot - base) : strlen(base);
+    path = (char *) malloc(strlen(dir) + n + 6);
+    if (path)
+        sprintf(path, "%s/%.*s.jpg", dir, (int) n, base);
+    return path;
+}
+
+static bool
+wanted(const char *name, char **names, int nnames) {
+    int i;
+    if (nnames == 0)
+        return 1;
+    for (i = 0; i < nnames; i++)
+        if (!strcmp(names[i], name))
+            return 1;
+    return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+    bool extract = 0, to_stdout = 0, merge = 0;
+    const char *dir = ".";
+    const char *tables_path = NULL;
+    UINT8 *tables = NULL;
+    size_t tables_len = 0;
+    int argi, ret = 0, found = 0;
+    UINT32 count, i;
+    pack_entry *entries;
+    FILE *pack;
+
+    for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++) {
+        const char *opt = argv[argi];
+        if (!strcmp(opt, "-x"))
+            extract = 1;
+        else if (!strcmp(opt, "-c"))
+            to_stdout = 1;
+        else if (!strcmp(opt, "-m"))
+            merge = 1;
+        else if (argi + 1 < argc && !strcmp(opt, "-t"))
+            tables_path = argv[++argi];
+        else if (argi + 1 < argc && !strcmp(opt, "-d"))
+            dir = argv[++argi];
+        else {
+            print_help();
+            return 2;
+        }
+    }
+    if (argc - argi < 1 || extract + to_stdout + merge > 1 ||
+        ((to_stdout || merge) && argc - argi != 2) ||
+        (!extract && !to_stdout && !merge && argc - argi != 1) ||
+        (merge && !tables_path)) {
+        print_help();
+        return 2;
+    }
+    if (tables_path && !(tables = load_file(tables_path, &tables_len))) {
+        perror(tables_path);
+        return 1;
+    }
+
+    if (merge) {
+        size_t len;
+        UINT8 *data = load_file(argv[argi], &len);
+        FILE *fp = data ? fopen(argv[argi + 1], "wb") : NULL;
+        if (!data || !fp) {
+            perror(data ? argv[argi + 1] : argv[argi]);
+            ret = 1;
+        } else if (!put_jpeg(fp, data, len, tables, tables_len)) {
+            fprintf(stderr, "%s: not a JPEG, or %s not tables\n", argv[argi], tables_path);
+            ret = 1;
+        }
+        if (fp && fclose(fp) != 0)
+            ret = 1;
+        free(data);
+        free(tables);
+        return ret;
+    }
+
+    entries = read_pack_index(argv[argi], &count);
+    if (!entries) {
+        fprintf(stderr, "%s.idx: not a pack index\n", argv[argi]);
+        free(tables);
+        return 1;
+    }
+    pack = fopen(argv[argi], "rb");
+    if (!pack) {
+        perror(argv[argi]);
+        free_pack_index(entries, count);
+        free(tables);
+        return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        const pack_entry *e = &entries[i];
+        UINT8 *data;
+        if (!extract && !to_stdout) {
+            printf("%s\t%llu\t%u\t%ux%u\t%016llx\n", e->name,
+                   (unsigned long long) e->offset, e->length, e->width,
+                   e->height, (unsigned long long) e->hash);
+            continue;
+        }
+        if (!wanted(e->name, argv + argi + 1, argc - argi - 1))
+            continue;
+        found++;
+        if (!(data = read_pack_entry(pack, e))) {
+            fprintf(stderr, "%s: missing or damaged\n", e->name);
+            ret = 1;
+            continue;
+        }
+        if (to_stdout) {
+            if (!put_jpeg(stdout, data, e->length, tables, tables_len))
+                ret = 1;
+        } else {
+            char *path = out_name(dir, e->name);
+            FILE *fp = path ? fopen(path, "wb") : NULL;
+            if (!fp || !put_jpeg(fp, data, e->length, tables, tables_len)) {
+                perror(path ? path : e->name);
+                ret = 1;
+            }
+            if (fp && fclose(fp) != 0)
+                ret = 1;
+            free(path);
+        }
+        free(data);
+    }
+    if ((extract || to_stdout) && found < argc - argi - 1) {
+        fprintf(stderr, "%d of %d names not in the pack\n",
+                argc - argi - 1 - found, argc - argi - 1);
+        ret = 1;
+    }
+
+    fclose(pack);
+    free_pack_index(entries, count);
+    free(tables);
+    return ret;
+}
@@ -0,0 +1,95 @@
+/**
+ * @file gen_tables.c
+ * @brief build step: writes the constant tables of the encoder as C.
+ *
+ * Usage: gen_tables OUT.c
+ *
+ * The tables are computed by the code of jtables.c, the floats of the
+ * quant tables written as hexadecimal literals, so the encoder gets the
+ * very values it computed at run time before.
+ */
+
+#include "../cjpeg.h"
+
+static void
+put_ints(FILE *fp, const char *name, const INT32 *v, int n) {
+    int i;
+    fprintf(fp, "        /* %s */ {", name);
+    for (i = 0; i < n; i++)
+        fprintf(fp, "%s%d,", i % 8 ? " " : "\n                ", v[i]);
+    fprintf(fp, "\n        },\n");
+}
+
+static void
+put_bytes(FILE *fp, const UINT8 *v, int n) {
+    int i;
+    fprintf(fp, "        {");
+    for (i = 0; i < n; i++)
+        fprintf(fp, "%s%u,", i % 16 ? " " : "\n                ", v[i]);
+    fprintf(fp, "\n        },\n");
+}
+
+static void
+put_floats(FILE *fp, const float *v, int n) {
+    int i;
+    fprintf(fp, "        {");
+    for (i = 0; i < n; i++)
+        fprintf(fp, "%s%a,", i % 4 ? " " : "\n                ", (double) v[i]);
+    fprintf(fp, "\n        },\n");
+}
+
+static void
+put_bits(FILE *fp, const char *name, const BITS *v, int n) {
+    int i;
+    fprintf(fp, "        /* %s */ {", name);
+    for (i = 0; i < n; i++)
+        fprintf(fp, "%s{%u, %u},", i % 8 ? " " : "\n                ", v[i].len, v[i].val);
+    fprintf(fp, "\n        },\n");
+}
+
+int
+main(int argc, char *argv[]) {
+    static ycbcr_tables ycc;
+    static huff_tables huff;
+    static quant_tables quant;
+    FILE *fp;
+
+    if (argc != 2 || !(fp = fopen(argv[1], "w"))) {
+        fprintf(stderr, "usage: gen_tables OUT.c\n");
+        return 2;
+    }
+    init_ycbcr_tables(&ycc);
+    init_huff_tables(&huff);
+    init_quant_tables(&quant, DEFAULT_SCALE);
+
+    fprintf(fp, "/* generated by gen_tables from jtables.c, do not edit */\n\n");
+    fprintf(fp, "#include \"cjpeg.h\"\n\n");
+
+    fprintf(fp, "const ycbcr_tables ycc_tables = {\n");
+    put_ints(fp, "r2y", ycc.r2y, 256);
+    put_ints(fp, "r2cb", ycc.r2cb, 256);
+    put_ints(fp, "r2cr", ycc.r2cr, 256);
+    put_ints(fp, "g2y", ycc.g2y, 256);
+    put_ints(fp, "g2cb", ycc.g2cb, 256);
+    put_ints(fp, "g2cr", ycc.g2cr, 256);
+    put_ints(fp, "b2y", ycc.b2y, 256);
+    put_ints(fp, "b2cb", ycc.b2cb, 256);
+    put_ints(fp, "b2cr", ycc.b2cr, 256);
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp, "const huff_tables h_tables = {\n");
+    put_bits(fp, "lu_dc", huff.lu_dc, 12);
+    put_bits(fp, "lu_ac", huff.lu_ac, 256);
+    put_bits(fp, "ch_dc", huff.ch_dc, 12);
+    put_bits(fp, "ch_ac", huff.ch_ac, 256);
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp, "const quant_tables std_quant_tables = {\n");
+    put_bytes(fp, quant.lu, DCTSIZE2);
+    put_bytes(fp, quant.ch, DCTSIZE2);
+    put_floats(fp, quant.lu_recip, DCTSIZE2);
+    put_floats(fp, quant.ch_recip, DCTSIZE2);
+    fprintf(fp, "};\n");
+
+    return fclose(fp) == 0 ? 0 : 1;
+}
@@ -0,0 +1,567 @@
+/**
+ * @file jpeg_eval.c
+ * @brief quality-vs-speed evaluation of the encoder.
+ *
+ * Encodes every image of the corpus (the BMP files given on the command
+ * line plus a few synthetic images) with each encoder mode and scale,
+ * decodes the result with the embedded decoder and measures PSNR and SSIM
+ * against the source pixels.  One CSV line is written per point; the exit
+ * status is non-zero if any point fails to decode or falls outside the
+ * thresholds of its mode.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "../cjpeg.h"
+#include "../rdbmp.h"
+#include "../djpeg.h"
+#include "../jdeadline.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+
+/*
+ * encoder modes under evaluation.  the first one is the reference, the
+ * others are judged by how much they lose against it.
+ */
+typedef struct {
+    const char *name;
+    void (*setup)(encode_options *opts);
+    double max_psnr_loss;   /* dB below the reference at the same point */
+    double max_ssim_loss;
+    double max_size_ratio;  /* output size over the reference size */
+    double min_psnr;        /* floor whatever the reference, 0 for none */
+    double min_ssim;
+} eval_mode;
+
+static void
+setup_float(encode_options *opts) {
+    (void) opts;
+}
+
+/*
+ * the cheaper paths --deadline-ms switches to, for the whole image.  they
+ * trade most of the detail for time, how much depends on the image: the
+ * bounds are the worst measured points (checker and noise lose the most)
+ * with 1.5 dB and 0.02 of margin.  DCs only must also be clearly smaller
+ * than the full image.  on the checkerboard the DCs are flat grey, SSIM
+ * about 0.01, so dc-only has no SSIM floor and a loss bound just under 1.
+ */
+static void
+setup_coarse(encode_options *opts) {
+    opts->degrade = DEGRADE_COARSE;
+}
+
+static void
+setup_dc(encode_options *opts) {
+    opts->degrade = DEGRADE_DC;
+}
+
+/*
+ * arithmetic coding (jarith.h): the same coefficients as the reference,
+ * so no loss at all, in fewer bytes; encode_ms against float-444 is the
+ * price.  with restart intervals the threads code them at once, which
+ * costs a little of the gain in size.
+ */
+static void
+setup_arith(encode_options *opts) {
+    opts->arithmetic = 1;
+}
+
+static void
+setup_arith_mt(encode_options *opts) {
+    opts->arithmetic = 1;
+    opts->restart = 128;
+    opts->threads = 4;
+}
+
+static const eval_mode MODES[] = {
+        {"float-444", setup_float, 0.0, 0.0, 1.0, 0.0, 0.0},
+        {"coarse", setup_coarse, 24.7, 0.755, 1.0, 9.9, 0.24},
+        {"dc-only", setup_dc, 31.5, 0.995, 0.85, 6.2, 0.0},
+        {"arith", setup_arith, 0.0, 0.0, 1.0, 0.0, 0.0},
+        {"arith-mt", setup_arith_mt, 0.0, 0.0, 1.0, 0.0, 0.0},
+};
+
+#define MODE_NUM    (int) (sizeof(MODES) / sizeof(MODES[0]))
+
+/* quant table scales, and the PSNR the reference mode must reach at each */
+static const UINT32 SCALES[] = {25, 50, 100, 200};
+static const double REF_MIN_PSNR[] = {26.0, 20.0, 15.0, 11.0};
+
+#define SCALE_NUM   (int) (sizeof(SCALES) / sizeof(SCALES[0]))
+
+/* allowed drift against a baseline CSV given with -b */
+#define BASE_PSNR_LOSS  0.05
+#define BASE_SSIM_LOSS  0.002
+#define BASE_SIZE_GROW  1.01
+
+
+/* source image, top-down RGB */
+typedef struct {
+    char name[64];
+    const char *path;       /* BMP on disk, NULL for synthetic images */
+    int width;
+    int height;
+    UINT8 *rgb;
+} eval_image;
+
+typedef struct {
+    char image[64];
+    char mode[32];
+    UINT32 scale;
+    double psnr;
+    double ssim;
+    size_t bytes;
+} eval_point;
+
+
+static double
+now_seconds() {
+#ifdef _WIN32
+    LARGE_INTEGER freq, cnt;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&cnt);
+    return (double) cnt.QuadPart / (double) freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+
+/*
+ * BMP reading and writing, independent of the encoder's own reader.
+ */
+
+static UINT32
+le32(const UINT8 *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32) p[3] << 24);
+}
+
+static void
+put_le32(UINT8 *p, UINT32 v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static bool
+load_bmp(const char *path, eval_image *img) {
+    UINT8 head[BMP_HEAD_LEN];
+    FILE *fp = fopen(path, "rb");
+    INT32 h;
+    int y, x, stride;
+    UINT8 *row;
+
+    if (!fp)
+        return false;
+    if (fread(head, 1, BMP_HEAD_LEN, fp) != BMP_HEAD_LEN ||
+        head[0] != 'B' || head[1] != 'M' || head[28] != 24) {
+        fclose(fp);
+        return false;
+    }
+    img->width = (int) le32(head + 18);
+    h = (INT32) le32(head + 22);
+    img->height = h < 0 ? -h : h;
+    stride = (img->width * 3 + 3) / 4 * 4;
+    img->rgb = (UINT8 *) malloc((size_t) img->width * img->height * 3);
+    row = (UINT8 *) malloc(stride);
+    if (!img->rgb || !row)
+        err_exit(BUFFER_ALLOC_ERR);
+
+    fseek(fp, le32(head + 10), SEEK_SET);
+    for (y = 0; y < img->height; y++) {
+        UINT8 *dst = img->rgb + (size_t) (h < 0 ? y : img->height - 1 - y) *
+                                img->width * 3;
+        if (fread(row, 1, stride, fp) != (size_t) stride) {
+            free(row);
+            fclose(fp);
+            return false;
+        }
+        for (x = 0; x < img->width; x++) {
+            dst[3 * x] = row[3 * x + 2];
+            dst[3 * x + 1] = row[3 * x + 1];
+            dst[3 * x + 2] = row[3 * x];
+        }
+    }
+    free(row);
+    fclose(fp);
+    return true;
+}
+
+static void
+write_bmp(FILE *fp, const eval_image *img) {
+    UINT8 head[BMP_HEAD_LEN];
+    int stride = (img->width * 3 + 3) / 4 * 4;
+    UINT8 *row = (UINT8 *) calloc(stride, 1);
+    int y, x;
+
+    if (!row)
+        err_exit(BUFFER_ALLOC_ERR);
+    memset(head, 0, sizeof(head));
+    head[0] = 'B';
+    head[1] = 'M';
+    put_le32(head + 2, BMP_HEAD_LEN + stride * img->height);
+    put_le32(head + 10, BMP_HEAD_LEN);
+    put_le32(head + 14, 40);
+    put_le32(head + 18, img->width);
+    put_le32(head + 22, img->height);
+    head[26] = 1;
+    head[28] = 24;
+    put_le32(head + 34, stride * img->height);
+    fwrite(head, 1, BMP_HEAD_LEN, fp);
+    for (y = img->height - 1; y >= 0; y--) {
+        const UINT8 *src = img->rgb + (size_t) y * img->width * 3;
+        for (x = 0; x < img->width; x++) {
+            row[3 * x] = src[3 * x + 2];
+            row[3 * x + 1] = src[3 * x + 1];
+            row[3 * x + 2] = src[3 * x];
+        }
+        fwrite(row, 1, stride, fp);
+    }
+    free(row);
+}
+
+
+/*
+ * synthetic corpus.  odd sizes so that the edge padding is exercised.
+ */
+
+static void
+make_synthetic(eval_image *img, const char *name, int w, int h) {
+    UINT32 seed = 12345;
+    int x, y;
+
+    strncpy(img->name, name, sizeof(img->name) - 1);
+    img->path = NULL;
+    img->width = w;
+    img->height = h;
+    img->rgb = (UINT8 *) malloc((size_t) w * h * 3);
+    if (!img->rgb)
+        err_exit(BUFFER_ALLOC_ERR);
+
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++) {
+            UINT8 *p = img->rgb + ((size_t) y * w + x) * 3;
+            if (!strcmp(name, "gradient")) {
+                p[0] = (UINT8) (255 * x / (w - 1));
+                p[1] = (UINT8) (255 * y / (h - 1));
+                p[2] = (UINT8) (255 * (x + y) / (w + h - 2));
+            } else if (!strcmp(name, "bars")) {
+                static const UINT8 bars[8][3] = {
+                        {255, 255, 255}, {255, 255, 0}, {0, 255, 255},
+                        {0, 255, 0}, {255, 0, 255}, {255, 0, 0},
+                        {0, 0, 255}, {0, 0, 0}};
+                memcpy(p, bars[x * 8 / w], 3);
+            } else if (!strcmp(name, "checker")) {
+                UINT8 v = ((x / 5 + y / 5) & 1) ? 230 : 20;
+                p[0] = p[1] = p[2] = v;
+            } else {            /* noise */
+                seed = seed * 1103515245 + 12345;
+                p[0] = (UINT8) (seed >> 16);
+                p[1] = (UINT8) (seed >> 8);
+                p[2] = (UINT8) (seed >> 24);
+            }
+        }
+}
+
+
+/*
+ * quality metrics.
+ */
+
+static double
+compute_psnr(const eval_image *ref, const decoded_image *dec) {
+    size_t i, n = (size_t) ref->width * ref->height * 3;
+    double mse = 0;
+    for (i = 0; i < n; i++) {
+        double d = (double) ref->rgb[i] - dec->pixels[i];
+        mse += d * d;
+    }
+    mse /= (double) n;
+    if (mse == 0)
+        return 99.0;
+    return 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+static double
+luma(const UINT8 *p) {
+    return 0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2];
+}
+
+/* mean SSIM of the luma over 8x8 windows with a step of 4 */
+static double
+compute_ssim(const eval_image *ref, const decoded_image *dec) {
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    double total = 0;
+    int windows = 0, wx, wy, x, y;
+
+    if (ref->width < 8 || ref->height < 8)
+        return 1.0;
+    for (wy = 0; wy + 8 <= ref->height; wy += 4)
+        for (wx = 0; wx + 8 <= ref->width; wx += 4) {
+            double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+            double ma, mb, va, vb, cov;
+            for (y = wy; y < wy + 8; y++)
+                for (x = wx; x < wx + 8; x++) {
+                    size_t i = ((size_t) y * ref->width + x) * 3;
+                    double a = luma(ref->rgb + i), b = luma(dec->pixels + i);
+                    sa += a;
+                    sb += b;
+                    saa += a * a;
+                    sbb += b * b;
+                    sab += a * b;
+                }
+            ma = sa / 64;
+            mb = sb / 64;
+            va = saa / 64 - ma * ma;
+            vb = sbb / 64 - mb * mb;
+            cov = sab / 64 - ma * mb;
+            total += ((2 * ma * mb + c1) * (2 * cov + c2)) /
+                     ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            windows++;
+        }
+    return total / windows;
+}
+
+
+/*
+ * baseline CSV from an earlier run, compared against with -b.
+ */
+
+static eval_point *base_points;
+static int base_num;
+
+static void
+load_baseline(const char *path) {
+    char line[512];
+    FILE *fp = fopen(path, "r");
+    int cap = 0;
+    if (!fp)
+        err_exit(FILE_OPEN_ERR);
+    while (fgets(line, sizeof(line), fp)) {
+        eval_point pt;
+        unsigned long bytes;
+        if (sscanf(line, "%63[^,],%31[^,],%u,%*d,%*d,%*f,%*f,%lu,%*f,%lf,%lf",
+                   pt.image, pt.mode, &pt.scale, &bytes, &pt.psnr,
+                   &pt.ssim) != 6)
+            continue;               /* header or failed point */
+        pt.bytes = bytes;
+        if (base_num == cap) {
+            cap = cap ? cap * 2 : 64;
+            base_points = (eval_point *) realloc(base_points,
+                                                 cap * sizeof(eval_point));
+            if (!base_points)
+                err_exit(BUFFER_ALLOC_ERR);
+        }
+        base_points[base_num++] = pt;
+    }
+    fclose(fp);
+}
+
+static const eval_point *
+find_baseline(const eval_point *pt) {
+    int i;
+    for (i = 0; i < base_num; i++)
+        if (!strcmp(base_points[i].image, pt->image) &&
+            !strcmp(base_points[i].mode, pt->mode) &&
+            base_points[i].scale == pt->scale)
+            return &base_points[i];
+    return NULL;
+}
+
+
+/*
+ * run one image through every mode and scale.  returns the number of
+ * failed points.
+ */
+static int
+eval_one(const eval_image *img, FILE *csv, int repeats) {
+    eval_point ref[SCALE_NUM];
+    compress_io cio;
+    FILE *bmp_fp;
+    int m, s, r, failures = 0;
+
+    bmp_fp = img->path ? fopen(img->path, "rb") : tmpfile();
+    if (!bmp_fp)
+        err_exit(FILE_OPEN_ERR);
+    if (!img->path)
+        write_bmp(bmp_fp, img);
+    init_mem(&cio, NULL, 0, NULL, MEM_OUT_SIZE);
+
+    for (m = 0; m < MODE_NUM; m++)
+        for (s = 0; s < SCALE_NUM; s++) {
+            const eval_mode *mode = &MODES[m];
+            encode_options opts;
+            mem_dest dest;
+            decoded_image dec;
+            eval_point pt;
+            const eval_point *base;
+            const char *err;
+            double best = 1e30, t;
+            char why[128] = "";
+
+            init_encode_options(&opts);
+            opts.scale = SCALES[s];
+            mode->setup(&opts);
+
+            memset(&dest, 0, sizeof(dest));
+            for (r = 0; r < repeats; r++) {
+                dest.len = 0;
+                rewind(bmp_fp);
+                t = now_seconds();
+                if (!is_bmp(bmp_fp))
+                    err_exit(FILE_TYPE_ERR);
+                bmp_to_jpeg(&cio, bmp_fp, NULL, &dest, &opts);
+                t = now_seconds() - t;
+                if (t < best)
+                    best = t;
+            }
+
+            strcpy(pt.image, img->name);
+            strcpy(pt.mode, mode->name);
+            pt.scale = SCALES[s];
+            pt.bytes = dest.len;
+            pt.psnr = pt.ssim = 0;
+
+            err = jpeg_decode(dest.data, dest.len, &dec);
+            if (!err && (dec.width != img->width ||
+                         dec.height != img->height || dec.ncomp != 3))
+                err = "decoded size mismatch";
+            if (!err) {
+                pt.psnr = compute_psnr(img, &dec);
+                pt.ssim = compute_ssim(img, &dec);
+                free_decoded_image(&dec);
+            }
+            free_mem_dest(&dest);
+
+            if (err)
+                snprintf(why, sizeof(why), "decode: %s", err);
+            else if (m == 0 && pt.psnr < REF_MIN_PSNR[s])
+                snprintf(why, sizeof(why), "psnr %.2f below %.2f",
+                         pt.psnr, REF_MIN_PSNR[s]);
+            else if (pt.psnr < mode->min_psnr)
+                snprintf(why, sizeof(why), "psnr %.2f below %.2f",
+                         pt.psnr, mode->min_psnr);
+            else if (pt.ssim < mode->min_ssim)
+                snprintf(why, sizeof(why), "ssim %.4f below %.4f",
+                         pt.ssim, mode->min_ssim);
+            else if (m > 0 && pt.psnr < ref[s].psnr - mode->max_psnr_loss)
+                snprintf(why, sizeof(why), "psnr %.2f, reference %.2f",
+                         pt.psnr, ref[s].psnr);
+            else if (m > 0 && pt.ssim < ref[s].ssim - mode->max_ssim_loss)
+                snprintf(why, sizeof(why), "ssim %.4f, reference %.4f",
+                         pt.ssim, ref[s].ssim);
+            else if (m > 0 && pt.bytes > ref[s].bytes * mode->max_size_ratio)
+                snprintf(why, sizeof(why), "size %lu, reference %lu",
+                         (unsigned long) pt.bytes,
+                         (unsigned long) ref[s].bytes);
+            else if ((base = find_baseline(&pt)) != NULL) {
+                if (pt.psnr < base->psnr - BASE_PSNR_LOSS)
+                    snprintf(why, sizeof(why), "psnr %.2f, baseline %.2f",
+                             pt.psnr, base->psnr);
+                else if (pt.ssim < base->ssim - BASE_SSIM_LOSS)
+                    snprintf(why, sizeof(why), "ssim %.4f, baseline %.4f",
+                             pt.ssim, base->ssim);
+                else if (pt.bytes > base->bytes * BASE_SIZE_GROW)
+                    snprintf(why, sizeof(why), "size %lu, baseline %lu",
+                             (unsigned long) pt.bytes,
+                             (unsigned long) base->bytes);
+            }
+            if (m == 0)
+                ref[s] = pt;
+
+            fprintf(csv, "%s,%s,%u,%d,%d,%.3f,%.2f,%lu,%.4f,%.3f,%.5f,%s\n",
+                    pt.image, pt.mode, pt.scale, img->width, img->height,
+                    best * 1e3,
+                    (double) img->width * img->height / best / 1e6,
+                    (unsigned long) pt.bytes,
+                    pt.bytes * 8.0 / ((double) img->width * img->height),
+                    pt.psnr, pt.ssim, why[0] ? "FAIL" : "ok");
+            if (why[0]) {
+                fprintf(stderr, "FAIL %s %s scale %u: %s\n",
+                        pt.image, pt.mode, pt.scale, why);
+                failures++;
+            }
+        }
+
+    free_mem(&cio);
+    fclose(bmp_fp);
+    return failures;
+}
+
+
+static void
+print_help() {
+    printf("evaluate encoder speed, size and quality.\n");
+    printf("Usage:\n");
+    printf("    jpeg_eval [-o CSV] [-b BASELINE_CSV] [-r REPEATS] [BMP...]\n");
+}
+
+int
+main(int argc, char *argv[]) {
+    static const char *SYNTHETIC[] = {"gradient", "bars", "checker", "noise"};
+    FILE *csv = stdout;
+    int repeats = 3, failures = 0, points = 0;
+    int argi, i;
+
+    for (argi = 1; argi < argc && argv[argi][0] == '-'; argi += 2) {
+        if (argi + 1 >= argc) {
+            print_help();
+            return 2;
+        }
+        if (!strcmp(argv[argi], "-o")) {
+            csv = fopen(argv[argi + 1], "w");
+            if (!csv)
+                err_exit(FILE_OPEN_ERR);
+        } else if (!strcmp(argv[argi], "-b"))
+            load_baseline(argv[argi + 1]);
+        else if (!strcmp(argv[argi], "-r"))
+            repeats = atoi(argv[argi + 1]) > 0 ? atoi(argv[argi + 1]) : 1;
+        else {
+            print_help();
+            return 2;
+        }
+    }
+
+    fprintf(csv, "image,mode,scale,width,height,encode_ms,mpix_per_s,"
+                 "bytes,bpp,psnr,ssim,status\n");
+
+    for (i = argi; i < argc; i++) {
+        eval_image img;
+        const char *base = strrchr(argv[i], '/');
+        memset(&img, 0, sizeof(img));
+        strncpy(img.name, base ? base + 1 : argv[i], sizeof(img.name) - 1);
+        img.path = argv[i];
+        if (!load_bmp(argv[i], &img)) {
+            fprintf(stderr, "FAIL %s: not a readable 24 bit BMP\n", argv[i]);
+            failures++;
+            continue;
+        }
+        failures += eval_one(&img, csv, repeats);
+        points += MODE_NUM * SCALE_NUM;
+        free(img.rgb);
+    }
+
+    for (i = 0; i < (int) (sizeof(SYNTHETIC) / sizeof(SYNTHETIC[0])); i++) {
+        eval_image img;
+        memset(&img, 0, sizeof(img));
+        make_synthetic(&img, SYNTHETIC[i], 333, 211);
+        failures += eval_one(&img, csv, repeats);
+        points += MODE_NUM * SCALE_NUM;
+        free(img.rgb);
+    }
+
+    if (csv != stdout)
+        fclose(csv);
+    fprintf(stderr, "%d of %d points failed\n", failures, points);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+/**
+ * @file jpeg_push_check.c
+ * @brief check of the push encoder against the file path.
+ *
+ * Every BMP given on the command line is encoded with bmp_to_jpeg(), then
+ * its rows are pushed through jpeg_push_begin() / jpeg_push_rows() /
+ * jpeg_push_finish() a few at a time, in several patterns of row counts
+ * and options.  The bytes must be the same; the exit status is the number
+ * of cases that differ.
+ */
+
+#include <string.h>
+#include "../cjpeg.h"
+#include "../rdbmp.h"
+#include "../rdimg.h"
+
+
+/* BMP pixels as they are in the file (BGR, rows padded), but top-down */
+typedef struct {
+    UINT32 width;
+    UINT32 height;
+    size_t stride;
+    UINT8 *bgr;
+} check_image;
+
+static UINT32
+le32(const UINT8 *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32) p[3] << 24);
+}
+
+static bool
+load_bmp(FILE *fp, check_image *img) {
+    UINT8 head[BMP_HEAD_LEN];
+    INT32 h;
+    UINT32 y;
+
+    if (fread(head, 1, BMP_HEAD_LEN, fp) != BMP_HEAD_LEN ||
+        head[0] != 'B' || head[1] != 'M' || head[28] != 24)
+        return false;
+    img->width = le32(head + 18);
+    h = (INT32) le32(head + 22);
+    img->height = h < 0 ? -h : h;
+    img->stride = (img->width * 3 + 3) / 4 * 4;
+    img->bgr = (UINT8 *) malloc(img->stride * img->height);
+    if (!img->bgr)
+        err_exit(BUFFER_ALLOC_ERR);
+    fseek(fp, le32(head + 10), SEEK_SET);
+    for (y = 0; y < img->height; y++) {
+        UINT8 *dst = img->bgr + (h < 0 ? y : img->height - 1 - y) * img->stride;
+        if (fread(dst, 1, img->stride, fp) != img->stride)
+            return false;
+    }
+    return true;
+}
+
+/* the sink of the push encoder: append to a mem_dest */
+static bool
+sink_write(void *ctx, const UINT8 *data, size_t len) {
+    mem_dest *dest = (mem_dest *) ctx;
+    if (dest->len + len > dest->cap) {
+        size_t cap = dest->cap ? dest->cap : 1 << 16;
+        while (cap < dest->len + len)
+            cap *= 2;
+        UINT8 *p = (UINT8 *) realloc(dest->data, cap);
+        if (!p)
+            return false;
+        dest->data = p;
+        dest->cap = cap;
+    }
+    memcpy(dest->data + dest->len, data, len);
+    dest->len += len;
+    return true;
+}
+
+/*
+ * row counts of the calls to jpeg_push_rows(), in turn until the image is
+ * done; 0 pushes all the rows left at once
+ */
+typedef struct {
+    const char *name;
+    UINT32 counts[4];
+    int n;
+} push_pattern;
+
+static const push_pattern PATTERNS[] = {
+        {"1", {1}, 1},
+        {"7", {7}, 1},
+        {"9", {9}, 1},
+        {"all", {0}, 1},
+        {"3,16,1,5", {3, 16, 1, 5}, 4},
+};
+
+#define PATTERN_NUM (int) (sizeof(PATTERNS) / sizeof(PATTERNS[0]))
+
+static void
+push_image(const check_image *img, const push_pattern *pat,
+           const encode_options *opts, mem_dest *dest) {
+    out_sink sink = {sink_write, dest};
+    jpeg_push *p = jpeg_push_begin(img->width, img->height, RAW_BGR, opts, &sink);
+    UINT32 y = 0;
+    int i = 0;
+    while (y < img->height) {
+        UINT32 n = pat->counts[i++ % pat->n];
+        if (n == 0 || n > img->height - y)
+            n = img->height - y;
+        jpeg_push_rows(p, img->bgr + y * img->stride, img->stride, n);
+        y += n;
+    }
+    jpeg_push_finish(p);
+}
+
+/* options of the cases: the default, restart intervals, another scale */
+static void
+setup_case(encode_options *opts, int c) {
+    init_encode_options(opts);
+    if (c == 1)
+        opts->restart = 7;
+    else if (c == 2)
+        opts->scale = quality_to_scale(95);
+}
+
+#define CASE_NUM    3
+
+int
+main(int argc, char *argv[]) {
+    static const char *CASE_NAMES[CASE_NUM] = {"default", "restart 7", "q 95"};
+    compress_io cio;
+    int i, c, m, failures = 0;
+
+    if (argc < 2) {
+        printf("check the push encoder against the file path.\n");
+        printf("Usage:\n");
+        printf("    jpeg_push_check {BMP} ...\n");
+        return 2;
+    }
+    init_mem(&cio, NULL, 0, NULL, MEM_OUT_SIZE);
+    for (i = 1; i < argc; i++) {
+        check_image img;
+        FILE *fp = fopen(argv[i], "rb");
+        memset(&img, 0, sizeof(img));
+        if (!fp || !load_bmp(fp, &img)) {
+            fprintf(stderr, "FAIL %s: not a readable 24 bit BMP\n", argv[i]);
+            failures++;
+            if (fp)
+                fclose(fp);
+            free(img.bgr);
+            continue;
+        }
+        for (c = 0; c < CASE_NUM; c++) {
+            encode_options opts;
+            mem_dest file, pushed;
+            setup_case(&opts, c);
+            memset(&file, 0, sizeof(file));
+            rewind(fp);
+            if (!is_bmp(fp))
+                err_exit(FILE_TYPE_ERR);
+            bmp_to_jpeg(&cio, fp, NULL, &file, &opts);
+
+            for (m = 0; m < PATTERN_NUM; m++) {
+                memset(&pushed, 0, sizeof(pushed));
+                push_image(&img, &PATTERNS[m], &opts, &pushed);
+                bool same = pushed.len == file.len &&
+                            !memcmp(pushed.data, file.data, file.len);
+                printf("%s %s, rows %s: %s\n", argv[i], CASE_NAMES[c],
+                       PATTERNS[m].name, same ? "ok" : "FAIL");
+                failures += !same;
+                free_mem_dest(&pushed);
+            }
+            free_mem_dest(&file);
+        }
+        fclose(fp);
+        free(img.bgr);
+    }
+    free_mem(&cio);
+    return failures;
+}